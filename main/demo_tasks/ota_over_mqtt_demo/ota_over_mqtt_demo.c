@@ -50,10 +50,13 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
 
 /* ESP-IDF includes. */
 #include "esp_log.h"
 #include "esp_event.h"
+#include "esp_timer.h"
 #include "sdkconfig.h"
 
 /* OTA library configuration include. */
@@ -65,11 +68,49 @@
 /* Subscription manager header include. */
 #include "subscription_manager.h"
 
+/* Reserved topics dispatch table include. */
+#include "reserved_topics.h"
+
 /* File downloader includes. */
 #include "MQTTFileDownloader.h"
 #include "MQTTFileDownloader_base64.h"
 #include "MQTTFileDownloader_cbor.h"
 
+#if ( otademoconfigENABLE_CBOR_DATA_TYPE == 1 )
+    /* CBOR parser include. */
+    #include "cbor.h"
+#endif
+
+#if ( otademoconfigENABLE_RESUME == 1 )
+    /* Download checkpoint includes. */
+    #include "nvs.h"
+    #include "esp_ota_ops.h"
+    #include "esp_rom_crc.h"
+#endif
+
+#if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+    /* Free heap include. */
+    #include "esp_system.h"
+#endif
+
+#if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+    /* Image hash and signature includes. */
+    #include "esp_ota_ops.h"
+    #include "mbedtls/sha256.h"
+    #include "mbedtls/x509_crt.h"
+#endif
+
+#if ( otademoconfigENABLE_DELTA_UPDATES == 1 )
+    /* Delta update includes. */
+    #include "esp_ota_ops.h"
+    #include "esp_delta_ota.h"
+#endif
+
+#if ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+    /* ROM inflate include. */
+    #include "rom/miniz.h"
+#endif
+
 /* Jobs and parser includes. */
 #include "jobs.h"
 #include "job_parser.h"
@@ -117,7 +158,8 @@
 
 /**
  * @brief Job update response topics filter for OTA.
- * This is used to route all the packets for OTA reserved topics which OTA agent has not subscribed for.
+ * This is registered with the local subscription manager only, to route the
+ * responses to job updates which OTA agent has not subscribed for.
  */
 #define OTA_JOB_UPDATE_RESPONSE_TOPIC_FILTER             OTA_TOPIC_PREFIX "jobs/+/update/+"
 
@@ -162,17 +204,168 @@
 #define OTA_MAX_SIGNATURE_SIZE                           ( 384U )
 
 
-#define NUM_OF_BLOCKS_REQUESTED                          ( 1U )
+/**
+ * @brief The received blocks of the download window are tracked with one bit
+ * each in a 32-bit bitmap.
+ */
+#if ( otademoconfigBLOCK_WINDOW_SIZE > 32U )
+    #error "otademoconfigBLOCK_WINDOW_SIZE must not exceed 32."
+#endif
+
+/**
+ * @brief The free OTA data buffers are tracked in a 32-bit bitmap.
+ */
+#if ( otademoconfigMAX_NUM_OTA_DATA_BUFFERS > 32U )
+    #error "otademoconfigMAX_NUM_OTA_DATA_BUFFERS must not exceed 32."
+#endif
+
+/**
+ * @brief Value of freeDataBuffersBitmap when all the buffers are free.
+ */
+#define OTA_DATA_BUFFERS_ALL_FREE    ( ( uint32_t ) ( ( 1ULL << otademoconfigMAX_NUM_OTA_DATA_BUFFERS ) - 1ULL ) )
+
+/**
+ * @brief The blocks of a patch or of a compressed image are decoded in file
+ * order, and the image they produce is written as it is produced.
+ */
+#if ( otademoconfigENABLE_DELTA_UPDATES == 1 ) || ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+    #define OTA_DECODE_FILE_IN_ORDER    ( 1 )
+#else
+    #define OTA_DECODE_FILE_IN_ORDER    ( 0 )
+#endif
+
+/**
+ * @brief A file decoded in order can neither be written out of order by the
+ * flash writer task nor resumed after a restart, and is either a patch or a
+ * compressed image.
+ */
+#if ( OTA_DECODE_FILE_IN_ORDER == 1 ) && ( ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 ) || ( otademoconfigENABLE_RESUME == 1 ) )
+    #error "Delta updates and compressed images cannot be used with the flash writer task or with resumed downloads."
+#endif
+
+#if ( otademoconfigENABLE_DELTA_UPDATES == 1 ) && ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+    #error "otademoconfigENABLE_DELTA_UPDATES and otademoconfigENABLE_COMPRESSED_IMAGES cannot both be set."
+#endif
+
+#if ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+
+/**
+ * @brief Size of the inflate window, which bounds the distance of the matches
+ * in the compressed image.
+ */
+    #define OTA_DECOMPRESSION_WINDOW_SIZE    ( 1UL << otademoconfigDECOMPRESSION_WINDOW_BITS )
+#endif
+
+/**
+ * @brief The flash writer task writes the blocks from the OTA data buffers they
+ * were received in, so the blocks must not be decoded into a shared buffer.
+ */
+#if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 ) && ( otademoconfigENABLE_ZERO_COPY_BLOCKS == 0 ) && ( otademoconfigENABLE_CBOR_DATA_TYPE == 0 )
+    #error "otademoconfigENABLE_FLASH_WRITER_TASK needs otademoconfigENABLE_ZERO_COPY_BLOCKS or otademoconfigENABLE_CBOR_DATA_TYPE."
+#endif
+
+/**
+ * @brief otaPal_WriteBlock returns the number of bytes written as an int16_t,
+ * so a block must be written in a single call which it can report.
+ */
+#if ( mqttFileDownloader_CONFIG_BLOCK_SIZE > INT16_MAX )
+    #error "mqttFileDownloader_CONFIG_BLOCK_SIZE must not be larger than INT16_MAX."
+#endif
+
+/**
+ * @brief The round trip time of the block requests is measured for the
+ * adaptive block window and for the retransmission timer.
+ */
+#if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 ) || ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+    #define OTA_MEASURE_BLOCK_RTT    ( 1 )
+#else
+    #define OTA_MEASURE_BLOCK_RTT    ( 0 )
+#endif
+
+#if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+
+/**
+ * @brief Retransmission timeout used until the first round trip time sample,
+ * as in RFC 6298.
+ */
+    #define OTA_RETRANSMIT_INITIAL_TIMEOUT_US    ( 1000000LL )
+#endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 1 */
+
+/**
+ * @brief The data type of the file blocks sent by the streams service.
+ */
+#if ( otademoconfigENABLE_CBOR_DATA_TYPE == 1 )
+    #define OTA_DATA_TYPE                                DATA_TYPE_CBOR
+#else
+    #define OTA_DATA_TYPE                                DATA_TYPE_JSON
+#endif
+
 #define START_JOB_MSG_LENGTH                             147U
 #define MAX_THING_NAME_SIZE                              128U
 
 #define MAX_JOB_ID_LENGTH                                ( 64U )
 
+#if ( otademoconfigENABLE_RESUME == 1 )
+
+/**
+ * @brief NVS namespace and key of the download checkpoint.
+ */
+    #define OTA_CHECKPOINT_NVS_NAMESPACE    "ota_demo"
+    #define OTA_CHECKPOINT_NVS_KEY          "checkpoint"
+
+/**
+ * @brief Version of the layout of OtaDownloadCheckpoint_t. Checkpoints of
+ * another version are discarded.
+ */
+    #define OTA_CHECKPOINT_VERSION          ( 1U )
+
+/**
+ * @brief Size of the buffer used to read back the written blocks from flash.
+ */
+    #define OTA_CHECKPOINT_READ_SIZE        ( 256U )
+#endif /* otademoconfigENABLE_RESUME == 1 */
+
+#if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+
+/**
+ * @brief Size of the buffer used to read back from flash the blocks which were
+ * written ahead of the blocks hashed in order.
+ */
+    #define OTA_IMAGE_HASH_READ_SIZE    ( 256U )
+#endif /* otademoconfigENABLE_IMAGE_HASH == 1 */
+
 /**
  * @brief Used to clear bits in a task's notification value.
  */
 #define MAX_UINT32                                       ( 0xffffffff )
 
+/**
+ * @brief Bit of networkEventGroup set while coreMQTT-Agent is connected.
+ */
+#define CORE_MQTT_AGENT_CONNECTED_BIT                    ( 1 << 0 )
+
+/**
+ * @brief Bit of otaStateEventGroup set while the OTA agent is in a state.
+ * Only valid for the states accepted by OTA_STATE_HAS_BIT().
+ */
+#define OTA_STATE_BIT( state )                           ( ( EventBits_t ) 1U << ( state ) )
+
+/**
+ * @brief Number of bits of an event group available to the application, the
+ * top 8 bits of its EventBits_t being reserved by FreeRTOS.
+ */
+#if ( configUSE_16_BIT_TICKS == 1 )
+    #define OTA_STATE_EVENT_BITS                         ( 8 )
+#else
+    #define OTA_STATE_EVENT_BITS                         ( 24 )
+#endif
+
+/**
+ * @brief Whether a state has a bit of otaStateEventGroup. This excludes
+ * OtaAgentStateNoTransition and OtaAgentStateAll.
+ */
+#define OTA_STATE_HAS_BIT( state )                       ( ( ( int ) ( state ) >= 0 ) && ( ( int ) ( state ) < OTA_STATE_EVENT_BITS ) && ( ( state ) != OtaAgentStateAll ) )
+
 /* Struct definitions *********************************************************/
 
 /**
@@ -183,9 +376,64 @@ struct MQTTAgentCommandContext
 {
     MQTTStatus_t xReturnStatus;
     TaskHandle_t xTaskToNotify;
+    IncomingPubCallback_t pxIncomingPublishCallback;
     void * pArgs;
 };
 
+#if ( otademoconfigENABLE_RESUME == 1 )
+
+/**
+ * @brief Download progress persisted in NVS, so that a download of the same
+ * job continues after a restart.
+ */
+    typedef struct OtaDownloadCheckpoint
+    {
+        uint32_t version;
+        char jobId[ MAX_JOB_ID_LENGTH ];
+        char streamName[ otademoconfigMAX_STREAM_NAME_SIZE ];
+        uint32_t fileId;
+        uint32_t fileSize;
+        uint32_t blocksWritten;   /*!< @brief Number of blocks written in order from the start of the file. */
+        uint32_t prefixCrc;       /*!< @brief CRC32 of these blocks as read back from flash. */
+        uint32_t windowBitmap;    /*!< @brief Blocks written after them, bit n for block blocksWritten + n. */
+        uint32_t windowCrc;       /*!< @brief CRC32 of the blocks of windowBitmap as read back from flash. */
+    } OtaDownloadCheckpoint_t;
+#endif /* otademoconfigENABLE_RESUME == 1 */
+
+#if ( otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 )
+
+/**
+ * @brief Result of extracting the file block held by an OTA data buffer.
+ */
+    typedef struct OtaDecodedBlock
+    {
+        MQTTFileDownloaderStatus_t status;
+        int32_t fileId;
+        int32_t blockId;
+        int32_t blockSize;
+        int64_t decodeTimeUs; /*!< @brief Time taken to extract the block, added to blockDecodeTimeUs by the OTA task. */
+    } OtaDecodedBlock_t;
+#endif /* otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 */
+
+#if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+
+/**
+ * @brief File block queued to the flash writer task, and the result of
+ * writing it sent back to the OTA demo task.
+ */
+    typedef struct OtaFlashWrite
+    {
+        OtaDataEvent_t * buffer; /*!< @brief Buffer holding the block, freed once the block is written. */
+        uint8_t * data;
+        size_t dataLength;
+        uint32_t blockId;
+        int16_t result;          /*!< @brief Result of otaPal_WriteBlock. */
+        int64_t queuedTimeUs;
+        int64_t stallTimeUs;     /*!< @brief Time the block waited in the queue. */
+        int64_t writeTimeUs;     /*!< @brief Time taken to write the block. */
+    } OtaFlashWrite_t;
+#endif /* otademoconfigENABLE_FLASH_WRITER_TASK == 1 */
+
 /**
  * @ingroup ota_enum_types
  * @brief The OTA MQTT interface return status.
@@ -206,9 +454,18 @@ typedef enum OtaMqttStatus
 static const char * TAG = "ota_over_mqtt_demo";
 
 /**
- * @brief Mutex used to manage thread safe access of OTA event buffers.
+ * @brief Bit n is set while dataBuffers[ n ] is free. The buffers are taken in
+ * the coreMQTT-Agent task and freed in the OTA tasks with atomic operations on
+ * the bitmap, without a lock.
+ */
+static uint32_t freeDataBuffersBitmap = 0;
+
+/**
+ * @brief Highest number of OTA data buffers in use at once, and number of file
+ * blocks dropped because no buffer was free, since the download started.
  */
-static SemaphoreHandle_t bufferSemaphore;
+static uint32_t dataBuffersHighWatermark = 0;
+static uint32_t dataBuffersExhaustedCount = 0;
 
 /**
  * @brief Static handle used for MQTT agent context.
@@ -216,25 +473,234 @@ static SemaphoreHandle_t bufferSemaphore;
 extern MQTTAgentContext_t xGlobalMqttAgentContext;
 
 /**
- * @brief This boolean is set by the coreMQTT-Agent event handler and signals
- * the OTA demo task to suspend the OTA Agent.
+ * @brief Event group of the coreMQTT-Agent connection, set by the
+ * coreMQTT-Agent event handler.
+ */
+static EventGroupHandle_t networkEventGroup = NULL;
+
+/**
+ * @brief Event group with the bit of the current state of the OTA agent set,
+ * so that tasks can block until the OTA agent reaches a state.
  */
-BaseType_t xSuspendOta = pdTRUE;
+static EventGroupHandle_t otaStateEventGroup = NULL;
 
 static MqttFileDownloaderContext_t mqttFileDownloaderContext = { 0 };
+
+/**
+ * @brief Downloader context of a new stream. Blocks may be decoded with
+ * mqttFileDownloaderContext from the coreMQTT-Agent task, so the new context is
+ * prepared here and copied over it from that task.
+ */
+static MqttFileDownloaderContext_t nextDownloaderContext = { 0 };
 static uint32_t numOfBlocksRemaining = 0;
+static uint32_t numOfBlocks = 0;
+
+/**
+ * @brief First block of the file not written yet, which starts the download
+ * window.
+ */
 static uint32_t currentBlockOffset = 0;
+
+/**
+ * @brief First block of the file not requested yet.
+ */
+static uint32_t nextBlockToRequest = 0;
+
+/**
+ * @brief Bit n is set once block currentBlockOffset + n has been written.
+ */
+static uint32_t receivedBlocksBitmap = 0;
+
+/**
+ * @brief Number of blocks requested ahead of currentBlockOffset, at most
+ * otademoconfigBLOCK_WINDOW_SIZE.
+ */
+static uint32_t blockWindowSize = otademoconfigBLOCK_WINDOW_SIZE;
+
+#if ( OTA_MEASURE_BLOCK_RTT == 1 )
+
+/**
+ * @brief Time each block of the window was requested at, or 0 when it was
+ * requested again and gives no round trip time sample.
+ */
+    static int64_t blockRequestTimeUs[ otademoconfigBLOCK_WINDOW_SIZE ] = { 0 };
+
+/**
+ * @brief Smoothed round trip time of the block requests of the stream, its
+ * mean deviation, and the minimum round trip time.
+ */
+    static int64_t smoothedRttUs = 0;
+    static int64_t rttVarianceUs = 0;
+    static int64_t minRttUs = 0;
+#endif /* OTA_MEASURE_BLOCK_RTT == 1 */
+
+#if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+
+/**
+ * @brief Timer requesting again the missing blocks when no block arrived for
+ * the retransmission timeout, which is doubled each time the timer expires
+ * without a new round trip time sample.
+ */
+    static esp_timer_handle_t retransmitTimer = NULL;
+    static int64_t retransmitTimeoutUs = OTA_RETRANSMIT_INITIAL_TIMEOUT_US;
+
+/**
+ * @brief Set by the timer when it expires, and cleared by the OTA demo task
+ * when it requests the missing blocks.
+ */
+    static volatile bool retransmitTimerExpired = false;
+#endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 1 */
+
+#if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+
+/**
+ * @brief The window grows by one block for each block received until the
+ * first loss, and by one block for each window of blocks received after it.
+ */
+    static bool windowSlowStart = true;
+    static uint32_t blocksSinceWindowGrowth = 0;
+
+/**
+ * @brief Time and number of bytes received when the window was last logged,
+ * to log the throughput obtained with each window size.
+ */
+    static int64_t windowLogTimeUs = 0;
+    static uint32_t windowLogBytes = 0;
+#endif /* otademoconfigENABLE_ADAPTIVE_WINDOW == 1 */
+
+#if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+
+/**
+ * @brief Bit n is set while block currentBlockOffset + n is queued to the
+ * flash writer task.
+ */
+    static uint32_t queuedBlocksBitmap = 0;
+
+/**
+ * @brief Queues of the blocks to write, and of the written blocks, between the
+ * OTA demo task and the flash writer task. Each queued block holds an OTA data
+ * buffer, so the queues never hold more than otademoconfigMAX_NUM_OTA_DATA_BUFFERS
+ * blocks.
+ */
+    static QueueHandle_t flashWriteQueue = NULL;
+    static QueueHandle_t flashWriteDoneQueue = NULL;
+
+/**
+ * @brief Number of blocks queued to the flash writer task whose result was not
+ * collected yet.
+ */
+    static uint32_t flashWritesPending = 0;
+
+/**
+ * @brief Depth of the flash write queue after each block was queued, and time
+ * the blocks waited in the queue for the previous writes to complete.
+ */
+    static uint32_t flashWriteCount = 0;
+    static uint32_t flashWriteMaxQueueDepth = 0;
+    static uint32_t flashWriteQueueDepthSum = 0;
+    static int64_t flashWriteStallTimeUs = 0;
+    static int64_t flashWriteMaxStallTimeUs = 0;
+#endif /* otademoconfigENABLE_FLASH_WRITER_TASK == 1 */
 static uint8_t currentFileId = 0;
 static uint32_t totalBytesReceived = 0;
+
+/**
+ * @brief Start time of the download, and time spent extracting the file blocks
+ * from the streams service messages and writing them to flash, to compare the
+ * data types and block paths.
+ */
+static int64_t downloadStartTimeUs = 0;
+static int64_t blockDecodeTimeUs = 0;
+static int64_t blockWriteTimeUs = 0;
+
+/**
+ * @brief Time the file was closed at, to measure the time taken to check the
+ * image before it is activated.
+ */
+static int64_t closeFileStartTimeUs = 0;
+
+#if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+
+/**
+ * @brief SHA-256 context of the image, fed with the blocks in file order, and
+ * number of blocks hashed so far.
+ */
+    static mbedtls_sha256_context imageHashContext;
+    static uint32_t imageHashedBlocks = 0;
+
+/**
+ * @brief The AWS code signing certificate, also set in the OTA PAL by main.c.
+ */
+    extern const char pcAwsCodeSigningCertPem[] asm ( "_binary_aws_codesign_crt_start" );
+#endif /* otademoconfigENABLE_IMAGE_HASH == 1 */
+
+#if ( OTA_DECODE_FILE_IN_ORDER == 1 )
+
+/**
+ * @brief Size of the image decoded from the file so far, and time spent
+ * writing it.
+ */
+    static uint32_t imageDataSize = 0;
+    static int64_t imageWriteTimeUs = 0;
+#endif /* OTA_DECODE_FILE_IN_ORDER == 1 */
+
+#if ( otademoconfigENABLE_DELTA_UPDATES == 1 )
+
+/**
+ * @brief Patch applied to the running partition.
+ */
+    static esp_delta_ota_handle_t deltaHandle = NULL;
+    static const esp_partition_t * deltaSourcePartition = NULL;
+    static int64_t deltaApplyTimeUs = 0;
+#endif /* otademoconfigENABLE_DELTA_UPDATES == 1 */
+
+#if ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+
+/**
+ * @brief Inflate state of the compressed image, its window of decompressed
+ * data, and the offset the next data is decompressed to.
+ */
+    static tinfl_decompressor decompressor;
+    static uint8_t decompressionWindow[ OTA_DECOMPRESSION_WINDOW_SIZE ];
+    static size_t decompressionWindowOffset = 0;
+    static tinfl_status decompressionStatus = TINFL_STATUS_NEEDS_MORE_INPUT;
+    static int64_t decompressionTimeUs = 0;
+#endif /* otademoconfigENABLE_COMPRESSED_IMAGES == 1 */
+
+#if ( otademoconfigENABLE_RESUME == 1 )
+
+/**
+ * @brief Last checkpoint of the current download.
+ */
+    static OtaDownloadCheckpoint_t downloadCheckpoint = { 0 };
+#endif
 char globalJobId[ MAX_JOB_ID_LENGTH ] = { 0 };
 
 static OtaDataEvent_t dataBuffers[ otademoconfigMAX_NUM_OTA_DATA_BUFFERS ] = { 0 };
+
+#if ( otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 )
+
+/**
+ * @brief IDs of the file block extracted into each of dataBuffers.
+ */
+    static OtaDecodedBlock_t decodedBlocks[ otademoconfigMAX_NUM_OTA_DATA_BUFFERS ] = { 0 };
+#endif
 static OtaJobEventData_t jobDocBuffer = { 0 };
 static AfrOtaJobDocumentFields_t jobFields = { 0 };
 static uint8_t OtaImageSignatureDecoded[ OTA_MAX_SIGNATURE_SIZE ] = { 0 };
 
+/**
+ * @brief State of the OTA agent. Only set by the OTA demo task, through
+ * setOTAState, and read from the coreMQTT-Agent event handler too.
+ */
 static OtaState_t otaAgentState = OtaAgentStateInit;
 
+/**
+ * @brief Whether a file is being downloaded, as posted to the coreMQTT-Agent
+ * manager with the OTA started and stopped events.
+ */
+static bool otaDownloadInProgress = false;
+
 /**
  * @brief Structure used for encoding firmware version.
  */
@@ -283,32 +749,148 @@ static OtaMqttStatus_t prvMQTTPublish( const char * const pacTopic,
  * @param[in] pTopicFilter The topic filter used to subscribe for packets.
  * @param[in] topicFilterLength Length of the topic filter string.
  * @param[in] ucQoS Intended qos value for the messages received on this topic.
+ * @param[in] pxIncomingPublishCallback Callback added to the subscription
+ * manager for the topic filter, or NULL if the topic is routed otherwise.
  * @return OtaMqttSuccess if successful. Appropriate error code otherwise.
  */
 static OtaMqttStatus_t prvMQTTSubscribe( const char * pTopicFilter,
                                          uint16_t topicFilterLength,
-                                         uint8_t ucQoS );
+                                         uint8_t ucQoS,
+                                         IncomingPubCallback_t pxIncomingPublishCallback );
+
+/**
+ * @brief Add or remove a subscription of the OTA demo in the local
+ * subscription manager only, without sending anything to the broker.
+ *
+ * The subscription list is only updated from the coreMQTT-Agent task, so the
+ * update is done by pxCommandCallback, run from a process loop command.
+ *
+ * @param[in] pTopicFilter The topic filter of the subscription.
+ * @param[in] topicFilterLength Length of the topic filter string.
+ * @param[in] pxIncomingPublishCallback Callback of the subscription.
+ * @param[in] pxCommandCallback prvAddLocalSubscriptionCallback or
+ * prvSwitchStreamCallback.
+ * @return OtaMqttSuccess if successful. Appropriate error code otherwise.
+ */
+static OtaMqttStatus_t prvUpdateLocalSubscription( const char * pTopicFilter,
+                                                   uint16_t topicFilterLength,
+                                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                                   MQTTAgentCommandCallback_t pxCommandCallback );
+
+/**
+ * @brief Passed into MQTTAgent_Subscribe() as the callback to execute when the
+ * broker ACKs the SUBSCRIBE message. Adds the subscription to the subscription
+ * manager if it succeeded.
+ *
+ * @param[in] pCommandContext Context of the initial command.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pCommandContext,
+                                         MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Passed into MQTTAgent_ProcessLoop() to add a subscription to the
+ * subscription manager from the coreMQTT-Agent task.
+ *
+ * @param[in] pCommandContext Context of the initial command.
+ * @param[in] pxReturnInfo The result of the command. Not used.
+ */
+static void prvAddLocalSubscriptionCallback( MQTTAgentCommandContext_t * pCommandContext,
+                                             MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Passed into MQTTAgent_ProcessLoop() to stop routing the blocks of the
+ * previous stream and install nextDownloaderContext from the coreMQTT-Agent
+ * task.
+ *
+ * @param[in] pCommandContext Context of the initial command.
+ * @param[in] pxReturnInfo The result of the command. Not used.
+ */
+static void prvSwitchStreamCallback( MQTTAgentCommandContext_t * pCommandContext,
+                                     MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Subscription callback for the data topic of the current MQTT stream.
+ * Hands the file block over to the OTA task.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Not used.
+ * @param[in] pxPublishInfo The incoming publish carrying the file block.
+ */
+static void prvDataBlockCallback( void * pvIncomingPublishCallbackContext,
+                                  MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Reserved topic callback for the notify-next and start-next accepted
+ * jobs topics. Hands the job document over to the OTA task.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Not used.
+ * @param[in] pxPublishInfo The incoming publish carrying the job document.
+ */
+static void prvJobDocumentCallback( void * pvIncomingPublishCallbackContext,
+                                    MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Reserved topic callback for the start-next rejected jobs topic, which
+ * is only logged.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Not used.
+ * @param[in] pxPublishInfo The incoming publish of the rejection.
+ */
+static void prvJobRejectedCallback( void * pvIncomingPublishCallbackContext,
+                                    MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Subscription callback for the responses to job updates, which are
+ * only logged.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Not used.
+ * @param[in] pxPublishInfo The incoming publish of the job update response.
+ */
+static void prvJobUpdateResponseCallback( void * pvIncomingPublishCallbackContext,
+                                          MQTTPublishInfo_t * pxPublishInfo );
 
 /**
  * @brief The function which runs the OTA demo task.
  *
- * The demo task initializes the OTA agent an loops until OTA agent is shutdown.
- * It reports OTA update statistics (which includes number of blocks received, processed and dropped),
- * at regular intervals.
+ * The demo task initializes the OTA agent and processes its events until the
+ * OTA agent is stopped. It blocks on the event queue of the OTA agent and on the
+ * coreMQTT-Agent connection instead of polling them.
  *
  * @param[in] pvParam Any parameters to be passed to OTA demo task.
  */
 static void prvOTADemoTask( void * pvParam );
 
 /**
- * @brief Suspends the OTA agent.
+ * @brief Sets the state of the OTA agent and wakes up the tasks waiting for it.
+ *
+ * @param[in] state New state of the OTA agent.
+ */
+static void setOTAState( OtaState_t state );
+
+/**
+ * @brief Gets the state of the OTA agent from any task.
+ *
+ * @return The state of the OTA agent.
+ */
+static OtaState_t getOTAState( void );
+
+/**
+ * @brief Posts the OTA started or stopped event when a download starts or
+ * ends, so that other traffic only shares the link during a download.
+ *
+ * @param[in] inProgress true if a file is being downloaded.
+ */
+static void setDownloadInProgress( bool inProgress );
+
+/**
+ * @brief Queues an event suspending the OTA agent.
  */
-static void prvSuspendOTACodeSigningDemo( void );
+static void prvSuspendOTA( void );
 
 /**
- * @brief Resumes the OTA agent.
+ * @brief Queues an event resuming the OTA agent.
  */
-static void prvResumeOTACodeSigningDemo( void );
+static void prvResumeOTA( void );
 
 /**
  * @brief ESP Event Loop library handler for coreMQTT-Agent events.
@@ -333,39 +915,162 @@ static void prvCommandCallback( MQTTAgentCommandContext_t * pCommandContext,
     }
 }
 
-static OtaMqttStatus_t prvMQTTSubscribe( const char * pTopicFilter,
-                                         uint16_t topicFilterLength,
-                                         uint8_t ucQoS )
+static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pCommandContext,
+                                         MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    MQTTAgentSubscribeArgs_t * pxSubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) pCommandContext->pArgs;
+
+    if( ( pxReturnInfo->returnCode == MQTTSuccess ) &&
+        ( pCommandContext->pxIncomingPublishCallback != NULL ) &&
+        ( addSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                           pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                           pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                           pCommandContext->pxIncomingPublishCallback,
+                           NULL ) == false ) )
+    {
+        ESP_LOGE( TAG, "Failed to register subscription to %.*s.",
+                  pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                  pxSubscribeArgs->pSubscribeInfo->pTopicFilter );
+        pxReturnInfo->returnCode = MQTTNoMemory;
+    }
+
+    prvCommandCallback( pCommandContext, pxReturnInfo );
+}
+
+static void prvAddLocalSubscriptionCallback( MQTTAgentCommandContext_t * pCommandContext,
+                                             MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    MQTTSubscribeInfo_t * pxSubscribeInfo = ( MQTTSubscribeInfo_t * ) pCommandContext->pArgs;
+
+    pxReturnInfo->returnCode = MQTTSuccess;
+
+    if( addSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                         pxSubscribeInfo->pTopicFilter,
+                         pxSubscribeInfo->topicFilterLength,
+                         pCommandContext->pxIncomingPublishCallback,
+                         NULL ) == false )
+    {
+        pxReturnInfo->returnCode = MQTTNoMemory;
+    }
+
+    prvCommandCallback( pCommandContext, pxReturnInfo );
+}
+
+static void prvSwitchStreamCallback( MQTTAgentCommandContext_t * pCommandContext,
+                                     MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    MQTTSubscribeInfo_t * pxSubscribeInfo = ( MQTTSubscribeInfo_t * ) pCommandContext->pArgs;
+
+    /* Stop routing the blocks of a previous stream. */
+    if( pxSubscribeInfo->topicFilterLength > 0U )
+    {
+        removeSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                            pxSubscribeInfo->pTopicFilter,
+                            pxSubscribeInfo->topicFilterLength );
+    }
+
+    /* No block is being decoded while this task runs the command. */
+    memcpy( &mqttFileDownloaderContext, &nextDownloaderContext, sizeof( mqttFileDownloaderContext ) );
+
+    pxReturnInfo->returnCode = MQTTSuccess;
+    prvCommandCallback( pCommandContext, pxReturnInfo );
+}
+
+static OtaMqttStatus_t prvUpdateLocalSubscription( const char * pTopicFilter,
+                                                   uint16_t topicFilterLength,
+                                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                                   MQTTAgentCommandCallback_t pxCommandCallback )
 {
     MQTTStatus_t mqttStatus;
-    uint32_t ulNotifiedValue;
-    MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
-    MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
     BaseType_t result;
+    MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
     MQTTAgentCommandInfo_t xCommandParams = { 0 };
     MQTTAgentCommandContext_t xApplicationDefinedContext = { 0 };
     OtaMqttStatus_t otaRet = OtaMqttSuccess;
 
-    configASSERT( pTopicFilter != NULL );
-    configASSERT( topicFilterLength > 0 );
-
     xSubscribeInfo.pTopicFilter = pTopicFilter;
     xSubscribeInfo.topicFilterLength = topicFilterLength;
-    xSubscribeInfo.qos = ucQoS;
-    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
-    xSubscribeArgs.numSubscriptions = 1;
 
     xApplicationDefinedContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
+    xApplicationDefinedContext.pxIncomingPublishCallback = pxIncomingPublishCallback;
+    xApplicationDefinedContext.pArgs = ( void * ) &xSubscribeInfo;
 
     xCommandParams.blockTimeMs = otademoconfigMQTT_TIMEOUT_MS;
-    xCommandParams.cmdCompleteCallback = prvCommandCallback;
+    xCommandParams.cmdCompleteCallback = pxCommandCallback;
     xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xApplicationDefinedContext;
 
     xTaskNotifyStateClear( NULL );
 
-    mqttStatus = MQTTAgent_Subscribe( &xGlobalMqttAgentContext,
-                                      &xSubscribeArgs,
-                                      &xCommandParams );
+    /* A process loop command sends nothing to the broker. It is only used to
+     * run the callback from the coreMQTT-Agent task. */
+    mqttStatus = MQTTAgent_ProcessLoop( &xGlobalMqttAgentContext,
+                                        &xCommandParams );
+
+    /* Wait for command to complete so MQTTSubscribeInfo_t remains in scope for the
+     * duration of the command. */
+    if( mqttStatus == MQTTSuccess )
+    {
+        result = xTaskNotifyWait( 0, MAX_UINT32, NULL, portMAX_DELAY );
+
+        if( result == pdTRUE )
+        {
+            mqttStatus = xApplicationDefinedContext.xReturnStatus;
+        }
+        else
+        {
+            mqttStatus = MQTTRecvFailed;
+        }
+    }
+
+    if( mqttStatus != MQTTSuccess )
+    {
+        ESP_LOGE( TAG, "Failed to update local subscription to topic %.*s with error = %u.",
+                  topicFilterLength,
+                  pTopicFilter,
+                  mqttStatus );
+
+        otaRet = OtaMqttSubscribeFailed;
+    }
+
+    return otaRet;
+}
+
+static OtaMqttStatus_t prvMQTTSubscribe( const char * pTopicFilter,
+                                         uint16_t topicFilterLength,
+                                         uint8_t ucQoS,
+                                         IncomingPubCallback_t pxIncomingPublishCallback )
+{
+    MQTTStatus_t mqttStatus;
+    uint32_t ulNotifiedValue;
+    MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
+    MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
+    BaseType_t result;
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+    MQTTAgentCommandContext_t xApplicationDefinedContext = { 0 };
+    OtaMqttStatus_t otaRet = OtaMqttSuccess;
+
+    configASSERT( pTopicFilter != NULL );
+    configASSERT( topicFilterLength > 0 );
+
+    xSubscribeInfo.pTopicFilter = pTopicFilter;
+    xSubscribeInfo.topicFilterLength = topicFilterLength;
+    xSubscribeInfo.qos = ucQoS;
+    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
+    xSubscribeArgs.numSubscriptions = 1;
+
+    xApplicationDefinedContext.xTaskToNotify = xTaskGetCurrentTaskHandle();
+    xApplicationDefinedContext.pxIncomingPublishCallback = pxIncomingPublishCallback;
+    xApplicationDefinedContext.pArgs = ( void * ) &xSubscribeArgs;
+
+    xCommandParams.blockTimeMs = otademoconfigMQTT_TIMEOUT_MS;
+    xCommandParams.cmdCompleteCallback = prvSubscribeCommandCallback;
+    xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xApplicationDefinedContext;
+
+    xTaskNotifyStateClear( NULL );
+
+    mqttStatus = MQTTAgent_Subscribe( &xGlobalMqttAgentContext,
+                                      &xSubscribeArgs,
+                                      &xCommandParams );
 
     /* Wait for command to complete so MQTTSubscribeInfo_t remains in scope for the
      * duration of the command. */
@@ -520,15 +1225,394 @@ static void requestJobDocumentHandler( void )
 
 /*-----------------------------------------------------------*/
 
-static void initMqttDownloader( AfrOtaJobDocumentFields_t * jobFields )
+#if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+
+    static void startImageHash( void )
+    {
+        mbedtls_sha256_free( &imageHashContext );
+        mbedtls_sha256_init( &imageHashContext );
+        ( void ) mbedtls_sha256_starts( &imageHashContext, 0 );
+        imageHashedBlocks = 0;
+    }
+
+/*-----------------------------------------------------------*/
+
+    /* A patch or a compressed image is not hashed, the image it decodes to is
+     * hashed as it is written instead. */
+    #if ( OTA_DECODE_FILE_IN_ORDER == 0 )
+        static void hashImageBlock( uint32_t blockId,
+                                    const uint8_t * data,
+                                    size_t dataLength )
+        {
+            /* Only the next block in file order can be hashed from memory, the
+             * blocks written ahead of it are read back once the gap is filled. */
+            if( blockId == imageHashedBlocks )
+            {
+                ( void ) mbedtls_sha256_update( &imageHashContext, data, dataLength );
+                imageHashedBlocks++;
+            }
+        }
+    #endif /* OTA_DECODE_FILE_IN_ORDER == 0 */
+
+/*-----------------------------------------------------------*/
+
+    static bool hashWrittenBlocks( void )
+    {
+        static uint8_t readBuffer[ OTA_IMAGE_HASH_READ_SIZE ];
+        const esp_partition_t * partition = esp_ota_get_next_update_partition( NULL );
+        size_t offset = ( size_t ) imageHashedBlocks * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        size_t endOffset = ( size_t ) currentBlockOffset * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        size_t readLength = 0;
+        bool result = ( partition != NULL );
+
+        /* The last block of the file may be shorter. */
+        if( endOffset > jobFields.fileSize )
+        {
+            endOffset = jobFields.fileSize;
+        }
+
+        while( ( offset < endOffset ) && ( result == true ) )
+        {
+            readLength = endOffset - offset;
+
+            if( readLength > sizeof( readBuffer ) )
+            {
+                readLength = sizeof( readBuffer );
+            }
+
+            if( esp_partition_read( partition, offset, readBuffer, readLength ) == ESP_OK )
+            {
+                ( void ) mbedtls_sha256_update( &imageHashContext, readBuffer, readLength );
+                offset += readLength;
+            }
+            else
+            {
+                result = false;
+            }
+        }
+
+        /* A partial read leaves the hash out of step with the blocks, the
+         * check at close is then left to the PAL. */
+        if( ( result == true ) && ( imageHashedBlocks < currentBlockOffset ) )
+        {
+            imageHashedBlocks = currentBlockOffset;
+        }
+        else if( result == false )
+        {
+            imageHashedBlocks = UINT32_MAX;
+        }
+
+        return result;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool checkImageSignature( void )
+    {
+        uint8_t digest[ 32 ];
+        mbedtls_x509_crt certificate;
+        int64_t checkStartTimeUs = esp_timer_get_time();
+        bool result = true;
+
+        if( imageHashedBlocks < numOfBlocks )
+        {
+            ( void ) hashWrittenBlocks();
+        }
+
+        if( imageHashedBlocks != numOfBlocks )
+        {
+            ESP_LOGW( TAG, "The image hash is incomplete, the signature is only checked by the PAL.\n" );
+        }
+        else
+        {
+            mbedtls_x509_crt_init( &certificate );
+
+            if( ( mbedtls_sha256_finish( &imageHashContext, digest ) != 0 ) ||
+                ( mbedtls_x509_crt_parse( &certificate,
+                                          ( const unsigned char * ) pcAwsCodeSigningCertPem,
+                                          strlen( pcAwsCodeSigningCertPem ) + 1U ) != 0 ) )
+            {
+                ESP_LOGW( TAG, "Failed to check the image signature, the signature is only checked by the PAL.\n" );
+            }
+            else if( mbedtls_pk_verify( &certificate.pk,
+                                        MBEDTLS_MD_SHA256,
+                                        digest,
+                                        sizeof( digest ),
+                                        ( const unsigned char * ) jobFields.signature,
+                                        jobFields.signatureLen ) != 0 )
+            {
+                result = false;
+            }
+            else
+            {
+                ESP_LOGI( TAG, "Image signature checked against the download hash in %lld us.\n",
+                          esp_timer_get_time() - checkStartTimeUs );
+            }
+
+            mbedtls_x509_crt_free( &certificate );
+        }
+
+        return result;
+    }
+
+#endif /* otademoconfigENABLE_IMAGE_HASH == 1 */
+
+/*-----------------------------------------------------------*/
+
+#if ( OTA_DECODE_FILE_IN_ORDER == 1 )
+
+    static esp_err_t writeImageData( const uint8_t * buffer,
+                                     size_t size )
+    {
+        esp_err_t result = ESP_OK;
+        size_t writeSize;
+        int64_t writeStartTimeUs = esp_timer_get_time();
+
+        /* The image is decoded in order, it is written through the PAL so that
+         * the PAL checks its signature when the file is closed. The PAL returns
+         * the number of bytes written as an int16_t, so larger data is written
+         * in several calls. */
+        while( ( result == ESP_OK ) && ( size > 0U ) )
+        {
+            writeSize = ( size > ( size_t ) INT16_MAX ) ? ( size_t ) INT16_MAX : size;
+
+            if( otaPal_WriteBlock( &jobFields, imageDataSize, ( uint8_t * ) buffer, ( uint32_t ) writeSize ) == ( int16_t ) writeSize )
+            {
+                #if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+                    ( void ) mbedtls_sha256_update( &imageHashContext, buffer, writeSize );
+                #endif
+
+                imageDataSize += writeSize;
+                buffer += writeSize;
+                size -= writeSize;
+            }
+            else
+            {
+                result = ESP_FAIL;
+            }
+        }
+
+        imageWriteTimeUs += esp_timer_get_time() - writeStartTimeUs;
+
+        return result;
+    }
+
+#endif /* OTA_DECODE_FILE_IN_ORDER == 1 */
+
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_DELTA_UPDATES == 1 )
+
+    static esp_err_t readDeltaSource( uint8_t * buffer,
+                                      size_t size,
+                                      int offset )
+    {
+        return esp_partition_read( deltaSourcePartition, ( size_t ) offset, buffer, size );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool startDeltaUpdate( void )
+    {
+        esp_delta_ota_cfg_t deltaConfig =
+        {
+            .user_data = NULL,
+            .read_cb   = readDeltaSource,
+            .write_cb  = writeImageData,
+        };
+
+        if( deltaHandle != NULL )
+        {
+            ( void ) esp_delta_ota_deinit( deltaHandle );
+        }
+
+        deltaSourcePartition = esp_ota_get_running_partition();
+        imageDataSize = 0;
+        imageWriteTimeUs = 0;
+        deltaApplyTimeUs = 0;
+        deltaHandle = esp_delta_ota_init( &deltaConfig );
+
+        return( ( deltaSourcePartition != NULL ) && ( deltaHandle != NULL ) );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool finishDeltaUpdate( void )
+    {
+        int64_t finishStartTimeUs = esp_timer_get_time();
+        bool result = ( esp_delta_ota_finalize( deltaHandle ) == ESP_OK );
+
+        deltaApplyTimeUs += esp_timer_get_time() - finishStartTimeUs;
+
+        ( void ) esp_delta_ota_deinit( deltaHandle );
+        deltaHandle = NULL;
+
+        if( result == true )
+        {
+            #if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+                /* The reconstructed image was hashed as it was written. */
+                imageHashedBlocks = numOfBlocks;
+            #endif
+
+            ESP_LOGI( TAG, "A patch of %lu bytes was applied into an image of %lu bytes in %lld ms.\n",
+                      jobFields.fileSize,
+                      imageDataSize,
+                      deltaApplyTimeUs / 1000 );
+        }
+
+        return result;
+    }
+
+#endif /* otademoconfigENABLE_DELTA_UPDATES == 1 */
+
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+
+    static void startDecompression( void )
+    {
+        tinfl_init( &decompressor );
+        decompressionWindowOffset = 0;
+        decompressionStatus = TINFL_STATUS_NEEDS_MORE_INPUT;
+        decompressionTimeUs = 0;
+        imageDataSize = 0;
+        imageWriteTimeUs = 0;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool decompressBlock( const uint8_t * data,
+                                 size_t dataLength )
+    {
+        size_t inputLength = 0;
+        size_t outputLength = 0;
+        int64_t decompressStartTimeUs = 0;
+        bool result = true;
+
+        /* The window wraps around, the data decompressed into it is written
+         * each time the end of the input or of the window is reached. */
+        do
+        {
+            inputLength = dataLength;
+            outputLength = OTA_DECOMPRESSION_WINDOW_SIZE - decompressionWindowOffset;
+            decompressStartTimeUs = esp_timer_get_time();
+
+            decompressionStatus = tinfl_decompress( &decompressor,
+                                                    data,
+                                                    &inputLength,
+                                                    decompressionWindow,
+                                                    &decompressionWindow[ decompressionWindowOffset ],
+                                                    &outputLength,
+                                                    TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT );
+
+            decompressionTimeUs += esp_timer_get_time() - decompressStartTimeUs;
+            data += inputLength;
+            dataLength -= inputLength;
+
+            if( decompressionStatus < TINFL_STATUS_DONE )
+            {
+                ESP_LOGE( TAG, "Failed to decompress the image, status %d.\n", ( int ) decompressionStatus );
+                result = false;
+            }
+            else if( ( outputLength > 0U ) &&
+                     ( writeImageData( &decompressionWindow[ decompressionWindowOffset ], outputLength ) != ESP_OK ) )
+            {
+                result = false;
+            }
+            else
+            {
+                decompressionWindowOffset = ( decompressionWindowOffset + outputLength ) & ( OTA_DECOMPRESSION_WINDOW_SIZE - 1U );
+            }
+        } while( ( result == true ) &&
+                 ( ( decompressionStatus == TINFL_STATUS_HAS_MORE_OUTPUT ) ||
+                   ( ( decompressionStatus == TINFL_STATUS_NEEDS_MORE_INPUT ) && ( dataLength > 0U ) ) ) );
+
+        /* Nothing may follow the end of the compressed image. */
+        if( ( decompressionStatus == TINFL_STATUS_DONE ) && ( dataLength > 0U ) )
+        {
+            result = false;
+        }
+
+        return result;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool finishDecompression( void )
+    {
+        bool result = ( decompressionStatus == TINFL_STATUS_DONE );
+
+        if( result == true )
+        {
+            #if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+                /* The decompressed image was hashed as it was written. */
+                imageHashedBlocks = numOfBlocks;
+            #endif
+
+            ESP_LOGI( TAG, "A compressed image of %lu bytes was decompressed into %lu bytes in %lld ms, %lld KB/s, and written in %lld ms.\n",
+                      jobFields.fileSize,
+                      imageDataSize,
+                      decompressionTimeUs / 1000,
+                      ( decompressionTimeUs > 0 ) ? ( ( ( int64_t ) imageDataSize * 1000000 ) / ( decompressionTimeUs * 1024 ) ) : 0,
+                      imageWriteTimeUs / 1000 );
+        }
+
+        return result;
+    }
+
+#endif /* otademoconfigENABLE_COMPRESSED_IMAGES == 1 */
+
+/*-----------------------------------------------------------*/
+
+static bool initMqttDownloader( AfrOtaJobDocumentFields_t * jobFields )
 {
     numOfBlocksRemaining = jobFields->fileSize /
                            mqttFileDownloader_CONFIG_BLOCK_SIZE;
     numOfBlocksRemaining += ( jobFields->fileSize %
                               mqttFileDownloader_CONFIG_BLOCK_SIZE > 0 ) ? 1 : 0;
+    numOfBlocks = numOfBlocksRemaining;
     currentFileId = ( uint8_t ) jobFields->fileId;
     currentBlockOffset = 0;
+    nextBlockToRequest = 0;
+    receivedBlocksBitmap = 0;
     totalBytesReceived = 0;
+    downloadStartTimeUs = esp_timer_get_time();
+    blockDecodeTimeUs = 0;
+    blockWriteTimeUs = 0;
+    __atomic_store_n( &dataBuffersHighWatermark, 0U, __ATOMIC_RELAXED );
+    __atomic_store_n( &dataBuffersExhaustedCount, 0U, __ATOMIC_RELAXED );
+
+    #if ( OTA_MEASURE_BLOCK_RTT == 1 )
+        memset( blockRequestTimeUs, 0x00, sizeof( blockRequestTimeUs ) );
+        smoothedRttUs = 0;
+        rttVarianceUs = 0;
+        minRttUs = 0;
+    #endif
+
+    #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+        retransmitTimeoutUs = OTA_RETRANSMIT_INITIAL_TIMEOUT_US;
+    #endif
+
+    #if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+        blockWindowSize = 1U;
+        windowSlowStart = true;
+        blocksSinceWindowGrowth = 0;
+        windowLogTimeUs = downloadStartTimeUs;
+        windowLogBytes = 0;
+    #endif
+
+    #if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+        startImageHash();
+    #endif
+
+    #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+        queuedBlocksBitmap = 0;
+        flashWriteCount = 0;
+        flashWriteMaxQueueDepth = 0;
+        flashWriteQueueDepthSum = 0;
+        flashWriteStallTimeUs = 0;
+        flashWriteMaxStallTimeUs = 0;
+    #endif
 
     /*
      * MQTT streams Library:
@@ -536,16 +1620,32 @@ static void initMqttDownloader( AfrOtaJobDocumentFields_t * jobFields )
      * parameters extracted from the AWS IoT OTA jobs document
      * using OTA jobs parser.
      */
-    mqttDownloader_init( &mqttFileDownloaderContext,
+    mqttDownloader_init( &nextDownloaderContext,
                          jobFields->imageRef,
                          jobFields->imageRefLen,
                          otademoconfigCLIENT_IDENTIFIER,
                          strlen( otademoconfigCLIENT_IDENTIFIER ),
-                         DATA_TYPE_JSON );
+                         OTA_DATA_TYPE );
+
+    /* The context is only written from this task, so it is read here without
+     * waiting for the coreMQTT-Agent task. */
+    if( prvUpdateLocalSubscription( mqttFileDownloaderContext.topicStreamData,
+                                    mqttFileDownloaderContext.topicStreamDataLength,
+                                    prvDataBlockCallback,
+                                    prvSwitchStreamCallback ) != OtaMqttSuccess )
+    {
+        ESP_LOGE( TAG, "Failed to switch to the stream %.*s.",
+                  nextDownloaderContext.topicStreamDataLength,
+                  nextDownloaderContext.topicStreamData );
+        return false;
+    }
 
     prvMQTTSubscribe( mqttFileDownloaderContext.topicStreamData,
                       mqttFileDownloaderContext.topicStreamDataLength,
-                      0 );
+                      0,
+                      prvDataBlockCallback );
+
+    return true;
 }
 
 /*-----------------------------------------------------------*/
@@ -577,32 +1677,181 @@ static bool convertSignatureToDER( AfrOtaJobDocumentFields_t * jobFields )
 
 /*-----------------------------------------------------------*/
 
-static int16_t handleMqttStreamsBlockArrived( uint8_t * data,
-                                              size_t dataLength )
+static int16_t handleMqttStreamsBlockArrived( uint32_t blockId,
+                                              uint8_t * data,
+                                              size_t dataLength,
+                                              int64_t * writeTimeUs )
 {
     int16_t writeblockRes = -1;
+    int64_t writeStartTimeUs = esp_timer_get_time();
+
+    ESP_LOGI( TAG, "Downloaded block %lu of %lu. \n", blockId, numOfBlocks );
 
-    ESP_LOGI( TAG, "Downloaded block %lu of %lu. \n", currentBlockOffset, ( currentBlockOffset + numOfBlocksRemaining ) );
+    #if ( otademoconfigENABLE_DELTA_UPDATES == 1 )
+        /* The blocks of a patch are applied in file order, the image they
+         * reconstruct is written as it is produced. */
+        if( esp_delta_ota_feed_patch( deltaHandle, data, ( int ) dataLength ) == ESP_OK )
+        {
+            writeblockRes = ( int16_t ) dataLength;
+        }
+
+        deltaApplyTimeUs += esp_timer_get_time() - writeStartTimeUs;
+    #elif ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+        /* The blocks of a compressed image are decompressed in file order,
+         * the image is written as it is decompressed. */
+        if( decompressBlock( data, dataLength ) == true )
+        {
+            writeblockRes = ( int16_t ) dataLength;
+        }
+    #else
+        /* Blocks of the window may arrive out of order, each one is written at
+         * its own offset in the file. */
+        writeblockRes = otaPal_WriteBlock( &jobFields,
+                                           blockId * mqttFileDownloader_CONFIG_BLOCK_SIZE,
+                                           data,
+                                           dataLength );
+    #endif /* otademoconfigENABLE_DELTA_UPDATES == 1 */
+
+    /* Blocks may be written from the flash writer task, so the time is
+     * returned for the OTA task to account with accountBlockWrite. */
+    *writeTimeUs = esp_timer_get_time() - writeStartTimeUs;
+
+    return writeblockRes;
+}
 
-    writeblockRes = otaPal_WriteBlock( &jobFields,
-                                       totalBytesReceived,
-                                       data,
-                                       dataLength );
+/*-----------------------------------------------------------*/
+
+static void accountBlockWrite( int16_t writeblockRes,
+                               int64_t writeTimeUs )
+{
+    blockWriteTimeUs += writeTimeUs;
 
     if( writeblockRes > 0 )
     {
         totalBytesReceived += writeblockRes;
     }
+}
 
-    return writeblockRes;
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_CBOR_DATA_TYPE == 1 )
+
+    static bool getCborIntValue( const CborValue * map,
+                                 const char * key,
+                                 int32_t * pValue )
+    {
+        CborValue value;
+        int intValue = 0;
+        bool result = false;
+
+        if( ( cbor_value_map_find_value( map, key, &value ) == CborNoError ) &&
+            ( cbor_value_is_integer( &value ) == true ) &&
+            ( cbor_value_get_int( &value, &intValue ) == CborNoError ) )
+        {
+            *pValue = ( int32_t ) intValue;
+            result = true;
+        }
+
+        return result;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static MQTTFileDownloaderStatus_t decodeCborDataBlock( uint8_t * message,
+                                                           size_t messageLength,
+                                                           int32_t * fileId,
+                                                           int32_t * blockId,
+                                                           int32_t * blockSize,
+                                                           uint8_t ** blockData,
+                                                           size_t * blockDataLength )
+    {
+        MQTTFileDownloaderStatus_t xStatus = MQTTFileDownloaderDataDecodingFailed;
+        CborParser parser;
+        CborValue map;
+        CborValue payload;
+        CborValue next;
+        const uint8_t * payloadData = NULL;
+
+        /* The payload is a definite length byte string, so it is left in the
+         * message and written to flash from there, without a copy. */
+        if( ( cbor_parser_init( message, messageLength, 0, &parser, &map ) == CborNoError ) &&
+            ( cbor_value_is_map( &map ) == true ) &&
+            ( getCborIntValue( &map, "f", fileId ) == true ) &&
+            ( getCborIntValue( &map, "i", blockId ) == true ) &&
+            ( getCborIntValue( &map, "l", blockSize ) == true ) &&
+            ( cbor_value_map_find_value( &map, "p", &payload ) == CborNoError ) &&
+            ( cbor_value_is_byte_string( &payload ) == true ) &&
+            ( cbor_value_is_length_known( &payload ) == true ) &&
+            ( cbor_value_get_byte_string_chunk( &payload, &payloadData, blockDataLength, &next ) == CborNoError ) &&
+            ( payloadData != NULL ) )
+        {
+            *blockData = ( uint8_t * ) payloadData;
+            xStatus = MQTTFileDownloaderSuccess;
+        }
+
+        return xStatus;
+    }
+
+#endif /* otademoconfigENABLE_CBOR_DATA_TYPE == 1 */
+
+/*-----------------------------------------------------------*/
+
+static MQTTFileDownloaderStatus_t extractDataBlock( uint8_t * message,
+                                                    size_t messageLength,
+                                                    uint8_t * blockBuffer,
+                                                    int32_t * fileId,
+                                                    int32_t * blockId,
+                                                    int32_t * blockSize,
+                                                    uint8_t ** blockData,
+                                                    size_t * blockDataLength,
+                                                    int64_t * decodeTimeUs )
+{
+    MQTTFileDownloaderStatus_t xStatus;
+    int64_t decodeStartTimeUs = esp_timer_get_time();
+
+    #if ( otademoconfigENABLE_CBOR_DATA_TYPE == 1 )
+        /* The block is left in the message. */
+        ( void ) blockBuffer;
+
+        xStatus = decodeCborDataBlock( message,
+                                       messageLength,
+                                       fileId,
+                                       blockId,
+                                       blockSize,
+                                       blockData,
+                                       blockDataLength );
+    #else
+        *blockData = blockBuffer;
+
+        /*
+         * MQTT streams Library:
+         * Extracting and decoding the received data block from the incoming MQTT message.
+         */
+        xStatus = mqttDownloader_processReceivedDataBlock( &mqttFileDownloaderContext,
+                                                           message,
+                                                           messageLength,
+                                                           fileId,
+                                                           blockId,
+                                                           blockSize,
+                                                           blockBuffer,
+                                                           blockDataLength );
+    #endif /* otademoconfigENABLE_CBOR_DATA_TYPE == 1 */
+
+    /* Blocks may be extracted from the coreMQTT-Agent task, so the time is
+     * returned for the OTA task to add to blockDecodeTimeUs. */
+    *decodeTimeUs = esp_timer_get_time() - decodeStartTimeUs;
+
+    return xStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-static OtaMqttStatus_t requestDataBlock( void )
+static OtaMqttStatus_t requestDataBlock( uint32_t blockOffset,
+                                         uint32_t numOfBlocksRequested )
 {
     char getStreamRequest[ GET_STREAM_REQUEST_BUFFER_SIZE ];
     size_t getStreamRequestLength = 0U;
+    BaseType_t xBandwidthTaken;
 
     /*
      * MQTT streams Library:
@@ -613,30 +1862,556 @@ static OtaMqttStatus_t requestDataBlock( void )
     getStreamRequestLength = mqttDownloader_createGetDataBlockRequest( mqttFileDownloaderContext.dataType,
                                                                        currentFileId,
                                                                        mqttFileDownloader_CONFIG_BLOCK_SIZE,
-                                                                       ( uint16_t ) currentBlockOffset,
-                                                                       NUM_OF_BLOCKS_REQUESTED,
+                                                                       ( uint16_t ) blockOffset,
+                                                                       numOfBlocksRequested,
                                                                        getStreamRequest,
                                                                        GET_STREAM_REQUEST_BUFFER_SIZE );
 
+    /* The blocks requested take the OTA share of the link while other
+     * traffic is sent alongside the download. */
+    xBandwidthTaken = xCoreMqttAgentManagerWaitForBandwidth( CORE_MQTT_AGENT_TRAFFIC_OTA,
+                                                             numOfBlocksRequested * mqttFileDownloader_CONFIG_BLOCK_SIZE,
+                                                             portMAX_DELAY );
+
     OtaMqttStatus_t xStatus = prvMQTTPublish( mqttFileDownloaderContext.topicGetStream,
                                               mqttFileDownloaderContext.topicGetStreamLength,
                                               getStreamRequest,
                                               getStreamRequestLength,
                                               0 /* QoS0 */ );
 
+    if( xBandwidthTaken == pdPASS )
+    {
+        vCoreMqttAgentManagerReleaseBandwidth( CORE_MQTT_AGENT_TRAFFIC_OTA );
+    }
+
     return xStatus;
 }
 
 /*-----------------------------------------------------------*/
 
-static bool closeFileHandler( void )
+static bool isBlockReceived( uint32_t blockId )
 {
-    return( OtaPalSuccess == otaPal_CloseFile( &jobFields ) );
+    uint32_t blocksBitmap = receivedBlocksBitmap;
+
+    #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+        /* Blocks waiting for the flash writer are not requested again. */
+        blocksBitmap |= queuedBlocksBitmap;
+    #endif
+
+    return( ( blockId < currentBlockOffset ) ||
+            ( ( ( blockId - currentBlockOffset ) < otademoconfigBLOCK_WINDOW_SIZE ) &&
+              ( ( blocksBitmap & ( 1UL << ( blockId - currentBlockOffset ) ) ) != 0UL ) ) );
 }
 
 /*-----------------------------------------------------------*/
 
-static bool imageActivationHandler( void )
+#if ( OTA_MEASURE_BLOCK_RTT == 1 )
+
+    static void recordBlockRequests( uint32_t firstBlock,
+                                     uint32_t numBlocksRequested,
+                                     bool retransmit )
+    {
+        int64_t requestTimeUs = ( retransmit == true ) ? 0 : esp_timer_get_time();
+        uint32_t blockId = 0;
+
+        /* The response to a block requested again cannot be matched to one of
+         * its requests, so it gives no round trip time sample. */
+        for( blockId = firstBlock; blockId < ( firstBlock + numBlocksRequested ); blockId++ )
+        {
+            blockRequestTimeUs[ blockId % otademoconfigBLOCK_WINDOW_SIZE ] = requestTimeUs;
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void sampleBlockRtt( uint32_t blockId )
+    {
+        int64_t requestTimeUs = blockRequestTimeUs[ blockId % otademoconfigBLOCK_WINDOW_SIZE ];
+        int64_t rttUs = 0;
+        int64_t rttErrorUs = 0;
+
+        if( requestTimeUs != 0 )
+        {
+            rttUs = esp_timer_get_time() - requestTimeUs;
+            blockRequestTimeUs[ blockId % otademoconfigBLOCK_WINDOW_SIZE ] = 0;
+
+            /* Smoothed as in RFC 6298. */
+            if( smoothedRttUs == 0 )
+            {
+                smoothedRttUs = rttUs;
+                rttVarianceUs = rttUs / 2;
+            }
+            else
+            {
+                rttErrorUs = ( smoothedRttUs > rttUs ) ? ( smoothedRttUs - rttUs ) : ( rttUs - smoothedRttUs );
+                rttVarianceUs = ( ( 3 * rttVarianceUs ) + rttErrorUs ) / 4;
+                smoothedRttUs = ( ( 7 * smoothedRttUs ) + rttUs ) / 8;
+            }
+
+            if( ( minRttUs == 0 ) || ( rttUs < minRttUs ) )
+            {
+                minRttUs = rttUs;
+            }
+
+            #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+                /* A new sample also ends the backoff. */
+                retransmitTimeoutUs = smoothedRttUs + ( 4 * rttVarianceUs );
+
+                if( retransmitTimeoutUs < ( otademoconfigRETRANSMIT_MIN_TIMEOUT_MS * 1000LL ) )
+                {
+                    retransmitTimeoutUs = otademoconfigRETRANSMIT_MIN_TIMEOUT_MS * 1000LL;
+                }
+                else if( retransmitTimeoutUs > ( otademoconfigRETRANSMIT_MAX_TIMEOUT_MS * 1000LL ) )
+                {
+                    retransmitTimeoutUs = otademoconfigRETRANSMIT_MAX_TIMEOUT_MS * 1000LL;
+                }
+            #endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 1 */
+        }
+    }
+
+#endif /* OTA_MEASURE_BLOCK_RTT == 1 */
+
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+
+    static void retransmitTimerCallback( void * arg )
+    {
+        OtaEventMsg_t nextEvent = { 0 };
+
+        ( void ) arg;
+
+        /* The blocks in flight are requested again on resume after a
+         * disconnection. */
+        if( ( xEventGroupGetBits( networkEventGroup ) & CORE_MQTT_AGENT_CONNECTED_BIT ) != 0U )
+        {
+            retransmitTimerExpired = true;
+            nextEvent.eventId = OtaAgentEventRequestFileBlock;
+            OtaSendEvent_FreeRTOS( &nextEvent );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void startRetransmitTimer( void )
+    {
+        /* Restarted by each request and each block received, so that it only
+         * expires when no block arrived for the retransmission timeout. */
+        ( void ) esp_timer_stop( retransmitTimer );
+        ( void ) esp_timer_start_once( retransmitTimer, ( uint64_t ) retransmitTimeoutUs );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void backoffRetransmitTimer( void )
+    {
+        retransmitTimeoutUs *= 2;
+
+        if( retransmitTimeoutUs > ( otademoconfigRETRANSMIT_MAX_TIMEOUT_MS * 1000LL ) )
+        {
+            retransmitTimeoutUs = otademoconfigRETRANSMIT_MAX_TIMEOUT_MS * 1000LL;
+        }
+
+        ESP_LOGI( TAG, "No block received for the retransmission timeout, now %lld ms.\n",
+                  retransmitTimeoutUs / 1000 );
+    }
+
+#endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 1 */
+
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+
+    static void logBlockWindow( const char * reason )
+    {
+        int64_t nowUs = esp_timer_get_time();
+        int64_t elapsedUs = nowUs - windowLogTimeUs;
+
+        ESP_LOGI( TAG, "Block window %lu (%s): RTT %lld ms, %lld bytes/s, free heap %lu bytes.\n",
+                  blockWindowSize,
+                  reason,
+                  smoothedRttUs / 1000,
+                  ( elapsedUs > 0 ) ? ( ( ( int64_t ) ( totalBytesReceived - windowLogBytes ) * 1000000 ) / elapsedUs ) : 0,
+                  esp_get_free_heap_size() );
+
+        windowLogTimeUs = nowUs;
+        windowLogBytes = totalBytesReceived;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void adaptBlockWindowOnBlock( void )
+    {
+        if( esp_get_free_heap_size() < otademoconfigADAPTIVE_WINDOW_MIN_FREE_HEAP )
+        {
+            /* The blocks in flight are held in network buffers allocated from
+             * the heap until they are read. */
+            if( blockWindowSize > 1U )
+            {
+                blockWindowSize /= 2U;
+                windowSlowStart = false;
+                blocksSinceWindowGrowth = 0;
+                logBlockWindow( "low heap" );
+            }
+        }
+        else if( ( minRttUs > 0 ) && ( smoothedRttUs > ( 2 * minRttUs ) ) )
+        {
+            /* The blocks are queued on the way, more blocks in flight would
+             * only add to the round trip time. */
+            windowSlowStart = false;
+        }
+        else if( blockWindowSize < otademoconfigBLOCK_WINDOW_SIZE )
+        {
+            blocksSinceWindowGrowth++;
+
+            if( ( windowSlowStart == true ) || ( blocksSinceWindowGrowth >= blockWindowSize ) )
+            {
+                blockWindowSize++;
+                blocksSinceWindowGrowth = 0;
+                logBlockWindow( "grow" );
+            }
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void adaptBlockWindowOnLoss( void )
+    {
+        windowSlowStart = false;
+        blocksSinceWindowGrowth = 0;
+
+        if( blockWindowSize > 1U )
+        {
+            blockWindowSize /= 2U;
+        }
+
+        logBlockWindow( "loss" );
+    }
+
+#endif /* otademoconfigENABLE_ADAPTIVE_WINDOW == 1 */
+
+/*-----------------------------------------------------------*/
+
+static OtaMqttStatus_t requestDataBlockWindow( bool retransmit )
+{
+    OtaMqttStatus_t xStatus = OtaMqttSuccess;
+    uint32_t windowEnd = currentBlockOffset + blockWindowSize;
+    uint32_t blockId = currentBlockOffset;
+    uint32_t runStart = 0;
+
+    if( windowEnd > numOfBlocks )
+    {
+        windowEnd = numOfBlocks;
+    }
+
+    if( retransmit == true )
+    {
+        /* Request again each run of requested blocks which did not arrive,
+         * without the blocks of the window already written. */
+        while( ( blockId < nextBlockToRequest ) && ( xStatus == OtaMqttSuccess ) )
+        {
+            if( isBlockReceived( blockId ) == true )
+            {
+                blockId++;
+            }
+            else
+            {
+                runStart = blockId;
+
+                while( ( blockId < nextBlockToRequest ) && ( isBlockReceived( blockId ) == false ) )
+                {
+                    blockId++;
+                }
+
+                ESP_LOGI( TAG, "Requesting again blocks %lu to %lu.\n", runStart, blockId - 1U );
+                xStatus = requestDataBlock( runStart, blockId - runStart );
+
+                #if ( OTA_MEASURE_BLOCK_RTT == 1 )
+                    recordBlockRequests( runStart, blockId - runStart, true );
+                #endif
+            }
+        }
+    }
+
+    /* Keep the window full. */
+    if( ( xStatus == OtaMqttSuccess ) && ( nextBlockToRequest < windowEnd ) )
+    {
+        xStatus = requestDataBlock( nextBlockToRequest, windowEnd - nextBlockToRequest );
+
+        if( xStatus == OtaMqttSuccess )
+        {
+            #if ( OTA_MEASURE_BLOCK_RTT == 1 )
+                recordBlockRequests( nextBlockToRequest, windowEnd - nextBlockToRequest, false );
+            #endif
+
+            nextBlockToRequest = windowEnd;
+        }
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_RESUME == 1 )
+
+    static bool crcPartitionBlocks( const esp_partition_t * partition,
+                                    uint32_t firstBlock,
+                                    uint32_t numBlocksToRead,
+                                    uint32_t * crc )
+    {
+        static uint8_t readBuffer[ OTA_CHECKPOINT_READ_SIZE ];
+        size_t offset = ( size_t ) firstBlock * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        size_t endOffset = ( size_t ) ( firstBlock + numBlocksToRead ) * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+        size_t readLength = 0;
+        bool result = true;
+
+        /* The last block of the file may be shorter. */
+        if( endOffset > jobFields.fileSize )
+        {
+            endOffset = jobFields.fileSize;
+        }
+
+        while( ( offset < endOffset ) && ( result == true ) )
+        {
+            readLength = endOffset - offset;
+
+            if( readLength > sizeof( readBuffer ) )
+            {
+                readLength = sizeof( readBuffer );
+            }
+
+            if( esp_partition_read( partition, offset, readBuffer, readLength ) == ESP_OK )
+            {
+                *crc = esp_rom_crc32_le( *crc, readBuffer, readLength );
+                offset += readLength;
+            }
+            else
+            {
+                result = false;
+            }
+        }
+
+        return result;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool crcWindowBlocks( const esp_partition_t * partition,
+                                 uint32_t windowStart,
+                                 uint32_t windowBitmap,
+                                 uint32_t * crc )
+    {
+        uint32_t bit = 0;
+        bool result = true;
+
+        for( bit = 0; ( bit < otademoconfigBLOCK_WINDOW_SIZE ) && ( result == true ); bit++ )
+        {
+            if( ( windowBitmap & ( 1UL << bit ) ) != 0UL )
+            {
+                result = crcPartitionBlocks( partition, windowStart + bit, 1U, crc );
+            }
+        }
+
+        return result;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void saveDownloadCheckpoint( void )
+    {
+        const esp_partition_t * partition = esp_ota_get_next_update_partition( NULL );
+        uint32_t prefixCrc = downloadCheckpoint.prefixCrc;
+        uint32_t windowCrc = 0;
+        nvs_handle_t handle;
+        esp_err_t err = ESP_FAIL;
+
+        /* Extend the CRC of the blocks written in order with the blocks which
+         * joined them since the last checkpoint, and compute the CRC of the
+         * blocks written ahead of them. Both are read back from flash, so that
+         * they check what was actually programmed. */
+        if( ( partition != NULL ) &&
+            ( crcPartitionBlocks( partition,
+                                  downloadCheckpoint.blocksWritten,
+                                  currentBlockOffset - downloadCheckpoint.blocksWritten,
+                                  &prefixCrc ) == true ) &&
+            ( crcWindowBlocks( partition, currentBlockOffset, receivedBlocksBitmap, &windowCrc ) == true ) )
+        {
+            downloadCheckpoint.blocksWritten = currentBlockOffset;
+            downloadCheckpoint.prefixCrc = prefixCrc;
+            downloadCheckpoint.windowBitmap = receivedBlocksBitmap;
+            downloadCheckpoint.windowCrc = windowCrc;
+
+            err = nvs_open( OTA_CHECKPOINT_NVS_NAMESPACE, NVS_READWRITE, &handle );
+
+            if( err == ESP_OK )
+            {
+                err = nvs_set_blob( handle, OTA_CHECKPOINT_NVS_KEY, &downloadCheckpoint, sizeof( downloadCheckpoint ) );
+
+                if( err == ESP_OK )
+                {
+                    err = nvs_commit( handle );
+                }
+
+                nvs_close( handle );
+            }
+        }
+
+        if( err != ESP_OK )
+        {
+            ESP_LOGW( TAG, "Failed to save the download checkpoint at block %lu.", currentBlockOffset );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void clearDownloadCheckpoint( void )
+    {
+        nvs_handle_t handle;
+
+        memset( &downloadCheckpoint, 0x00, sizeof( downloadCheckpoint ) );
+
+        if( nvs_open( OTA_CHECKPOINT_NVS_NAMESPACE, NVS_READWRITE, &handle ) == ESP_OK )
+        {
+            ( void ) nvs_erase_key( handle, OTA_CHECKPOINT_NVS_KEY );
+            ( void ) nvs_commit( handle );
+            nvs_close( handle );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool resumeDownload( void )
+    {
+        const esp_partition_t * partition = esp_ota_get_next_update_partition( NULL );
+        OtaDownloadCheckpoint_t checkpoint = { 0 };
+        size_t checkpointLength = sizeof( checkpoint );
+        uint32_t prefixCrc = 0;
+        uint32_t windowCrc = 0;
+        uint32_t blockId = 0;
+        nvs_handle_t handle;
+        bool resumed = false;
+
+        if( nvs_open( OTA_CHECKPOINT_NVS_NAMESPACE, NVS_READONLY, &handle ) == ESP_OK )
+        {
+            if( nvs_get_blob( handle, OTA_CHECKPOINT_NVS_KEY, &checkpoint, &checkpointLength ) != ESP_OK )
+            {
+                checkpointLength = 0;
+            }
+
+            nvs_close( handle );
+        }
+
+        /* Only trust a checkpoint of the same job and file, whose blocks are
+         * still in the update partition. They are not if the partition was
+         * erased or written by another download since. */
+        if( ( checkpointLength == sizeof( checkpoint ) ) &&
+            ( checkpoint.version == OTA_CHECKPOINT_VERSION ) &&
+            ( memcmp( checkpoint.jobId, globalJobId, sizeof( globalJobId ) ) == 0 ) &&
+            ( strnlen( checkpoint.streamName, sizeof( checkpoint.streamName ) ) == jobFields.imageRefLen ) &&
+            ( memcmp( checkpoint.streamName, jobFields.imageRef, jobFields.imageRefLen ) == 0 ) &&
+            ( checkpoint.fileId == jobFields.fileId ) &&
+            ( checkpoint.fileSize == jobFields.fileSize ) &&
+            ( checkpoint.blocksWritten < numOfBlocks ) &&
+            ( partition != NULL ) &&
+            ( crcPartitionBlocks( partition, 0U, checkpoint.blocksWritten, &prefixCrc ) == true ) &&
+            ( prefixCrc == checkpoint.prefixCrc ) &&
+            ( crcWindowBlocks( partition, checkpoint.blocksWritten, checkpoint.windowBitmap, &windowCrc ) == true ) &&
+            ( windowCrc == checkpoint.windowCrc ) )
+        {
+            downloadCheckpoint = checkpoint;
+            currentBlockOffset = checkpoint.blocksWritten;
+            nextBlockToRequest = checkpoint.blocksWritten;
+            receivedBlocksBitmap = checkpoint.windowBitmap;
+            numOfBlocksRemaining = numOfBlocks - checkpoint.blocksWritten;
+            totalBytesReceived = checkpoint.blocksWritten * mqttFileDownloader_CONFIG_BLOCK_SIZE;
+
+            for( blockId = 0; blockId < otademoconfigBLOCK_WINDOW_SIZE; blockId++ )
+            {
+                if( ( checkpoint.windowBitmap & ( 1UL << blockId ) ) != 0UL )
+                {
+                    numOfBlocksRemaining--;
+                }
+            }
+
+            ESP_LOGI( TAG, "Resuming the download of job %s at block %lu of %lu.",
+                      globalJobId,
+                      currentBlockOffset,
+                      numOfBlocks );
+            resumed = true;
+        }
+        else
+        {
+            if( checkpointLength > 0U )
+            {
+                ESP_LOGI( TAG, "Download checkpoint does not match the job or the update partition, starting from block 0." );
+            }
+
+            /* Start the checkpoints of this download. */
+            memset( &downloadCheckpoint, 0x00, sizeof( downloadCheckpoint ) );
+            downloadCheckpoint.version = OTA_CHECKPOINT_VERSION;
+            memcpy( downloadCheckpoint.jobId, globalJobId, sizeof( downloadCheckpoint.jobId ) );
+
+            if( jobFields.imageRefLen < sizeof( downloadCheckpoint.streamName ) )
+            {
+                memcpy( downloadCheckpoint.streamName, jobFields.imageRef, jobFields.imageRefLen );
+            }
+
+            downloadCheckpoint.fileId = jobFields.fileId;
+            downloadCheckpoint.fileSize = jobFields.fileSize;
+        }
+
+        return resumed;
+    }
+
+#endif /* otademoconfigENABLE_RESUME == 1 */
+
+/*-----------------------------------------------------------*/
+
+static bool closeFileHandler( void )
+{
+    bool result = true;
+
+    #if ( otademoconfigENABLE_DELTA_UPDATES == 1 )
+        if( finishDeltaUpdate() == false )
+        {
+            ESP_LOGE( TAG, "Failed to apply the patch to the running image, aborting the download.\n" );
+            ( void ) otaPal_Abort( &jobFields );
+            result = false;
+        }
+    #endif
+
+    #if ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+        if( finishDecompression() == false )
+        {
+            ESP_LOGE( TAG, "The compressed image is incomplete or corrupt, aborting the download.\n" );
+            ( void ) otaPal_Abort( &jobFields );
+            result = false;
+        }
+    #endif
+
+    #if ( otademoconfigENABLE_IMAGE_HASH == 1 )
+        /* An image which does not match its signature is rejected before the
+         * PAL reads it back from flash. */
+        if( ( result == true ) && ( checkImageSignature() == false ) )
+        {
+            ESP_LOGE( TAG, "The image does not match its signature, aborting the download.\n" );
+            ( void ) otaPal_Abort( &jobFields );
+            result = false;
+        }
+    #endif
+
+    if( result == true )
+    {
+        result = ( OtaPalSuccess == otaPal_CloseFile( &jobFields ) );
+    }
+
+    return result;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool imageActivationHandler( void )
 {
     return( OtaPalSuccess == otaPal_ActivateNewImage( &jobFields ) );
 }
@@ -717,8 +2492,11 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler( OtaJobEventDat
 
         if( handled )
         {
-            initMqttDownloader( &jobFields );
+            handled = initMqttDownloader( &jobFields );
+        }
 
+        if( handled )
+        {
             /* AWS IoT core returns the signature in a PEM format. We need to
              * convert it to DER format for image signature verification. */
 
@@ -730,7 +2508,26 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler( OtaJobEventDat
 
                 if( palStatus == OtaPalSuccess )
                 {
+                    #if ( otademoconfigENABLE_RESUME == 1 )
+                        /* Checked after the file is created, as creating it
+                         * may erase the blocks of an earlier attempt. */
+                        ( void ) resumeDownload();
+                    #endif
+
                     xResult = OtaPalJobDocFileCreated;
+
+                    #if ( otademoconfigENABLE_DELTA_UPDATES == 1 )
+                        if( startDeltaUpdate() == false )
+                        {
+                            ESP_LOGE( TAG, "Failed to start applying the patch to the running image." );
+                            ( void ) otaPal_Abort( &jobFields );
+                            xResult = OtaPalJobDocFileCreateFailed;
+                        }
+                    #endif
+
+                    #if ( otademoconfigENABLE_COMPRESSED_IMAGES == 1 )
+                        startDecompression();
+                    #endif
                 }
                 else
                 {
@@ -751,121 +2548,267 @@ static OtaPalJobDocProcessingResult_t receivedJobDocumentHandler( OtaJobEventDat
 
 static uint16_t getFreeOTABuffers( void )
 {
+    return ( uint16_t ) __builtin_popcount( __atomic_load_n( &freeDataBuffersBitmap, __ATOMIC_RELAXED ) );
+}
+
+/*-----------------------------------------------------------*/
+
+static void freeOtaDataEventBuffer( OtaDataEvent_t * const pxBuffer )
+{
+    uint32_t ulIndex = ( uint32_t ) ( pxBuffer - dataBuffers );
+
+    ( void ) __atomic_fetch_or( &freeDataBuffersBitmap, 1UL << ulIndex, __ATOMIC_RELEASE );
+}
+
+/*-----------------------------------------------------------*/
+
+static OtaDataEvent_t * getOtaDataEventBuffer( void )
+{
+    uint32_t freeBuffers = __atomic_load_n( &freeDataBuffersBitmap, __ATOMIC_RELAXED );
     uint32_t ulIndex = 0;
-    uint16_t freeBuffers = 0;
+    uint32_t usedBuffers = 0;
+    uint32_t highWatermark = 0;
+    OtaDataEvent_t * freeBuffer = NULL;
+
+    /* Take the lowest free buffer. The compare and swap fails, and reloads the
+     * bitmap, when another task took or freed a buffer meanwhile. */
+    while( ( freeBuffer == NULL ) && ( freeBuffers != 0U ) )
+    {
+        ulIndex = ( uint32_t ) __builtin_ctz( freeBuffers );
+
+        if( __atomic_compare_exchange_n( &freeDataBuffersBitmap, &freeBuffers, freeBuffers & ~( 1UL << ulIndex ),
+                                         false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) )
+        {
+            freeBuffer = &dataBuffers[ ulIndex ];
+            usedBuffers = otademoconfigMAX_NUM_OTA_DATA_BUFFERS - ( uint32_t ) __builtin_popcount( freeBuffers ) + 1U;
+        }
+    }
+
+    if( freeBuffer == NULL )
+    {
+        ( void ) __atomic_fetch_add( &dataBuffersExhaustedCount, 1U, __ATOMIC_RELAXED );
+    }
+    else
+    {
+        highWatermark = __atomic_load_n( &dataBuffersHighWatermark, __ATOMIC_RELAXED );
+
+        while( ( usedBuffers > highWatermark ) &&
+               ( __atomic_compare_exchange_n( &dataBuffersHighWatermark, &highWatermark, usedBuffers,
+                                              false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) == false ) )
+        {
+        }
+    }
+
+    return freeBuffer;
+}
+
+/*-----------------------------------------------------------*/
+
+static void blockWritten( uint32_t blockId )
+{
+    receivedBlocksBitmap |= 1UL << ( blockId - currentBlockOffset );
+    numOfBlocksRemaining--;
+
+    /* Slide the window past the blocks written in order. */
+    while( ( receivedBlocksBitmap & 1UL ) != 0UL )
+    {
+        receivedBlocksBitmap >>= 1;
+        #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+            queuedBlocksBitmap >>= 1;
+        #endif
+        currentBlockOffset++;
+    }
+
+    #if ( otademoconfigENABLE_IMAGE_HASH == 1 ) && ( OTA_DECODE_FILE_IN_ORDER == 0 )
+        if( imageHashedBlocks < currentBlockOffset )
+        {
+            ( void ) hashWrittenBlocks();
+        }
+    #endif
+
+    #if ( otademoconfigENABLE_RESUME == 1 )
+        if( ( numOfBlocksRemaining > 0U ) &&
+            ( ( currentBlockOffset - downloadCheckpoint.blocksWritten ) >= otademoconfigCHECKPOINT_INTERVAL_BLOCKS ) )
+        {
+            saveDownloadCheckpoint();
+        }
+    #endif
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+
+    static void flashWriterTask( void * pvParam )
+    {
+        OtaFlashWrite_t flashWrite;
+        OtaEventMsg_t nextEvent = { 0 };
+
+        ( void ) pvParam;
+
+        for( ; ; )
+        {
+            if( xQueueReceive( flashWriteQueue, &flashWrite, portMAX_DELAY ) == pdTRUE )
+            {
+                /* The statistics are only updated by the OTA demo task, the
+                 * times are sent back to it with the result. */
+                flashWrite.stallTimeUs = esp_timer_get_time() - flashWrite.queuedTimeUs;
+                flashWrite.result = handleMqttStreamsBlockArrived( flashWrite.blockId,
+                                                                   flashWrite.data,
+                                                                   flashWrite.dataLength,
+                                                                   &flashWrite.writeTimeUs );
+                freeOtaDataEventBuffer( flashWrite.buffer );
+
+                /* Wake up the OTA demo task to slide the window and request
+                 * the next blocks. */
+                ( void ) xQueueSend( flashWriteDoneQueue, &flashWrite, portMAX_DELAY );
+                nextEvent.eventId = OtaAgentEventRequestFileBlock;
+                OtaSendEvent_FreeRTOS( &nextEvent );
+            }
+        }
+    }
+
+/*-----------------------------------------------------------*/
 
-    if( xSemaphoreTake( bufferSemaphore, portMAX_DELAY ) == pdTRUE )
+    static bool queueFlashWrite( OtaDataEvent_t * buffer,
+                                 uint32_t blockId,
+                                 uint8_t * data,
+                                 size_t dataLength )
     {
-        for( ulIndex = 0; ulIndex < otademoconfigMAX_NUM_OTA_DATA_BUFFERS; ulIndex++ )
+        OtaFlashWrite_t flashWrite = { 0 };
+        uint32_t queueDepth = 0;
+        bool queued = false;
+
+        flashWrite.buffer = buffer;
+        flashWrite.data = data;
+        flashWrite.dataLength = dataLength;
+        flashWrite.blockId = blockId;
+        flashWrite.queuedTimeUs = esp_timer_get_time();
+
+        if( xQueueSend( flashWriteQueue, &flashWrite, 0 ) == pdTRUE )
         {
-            if( dataBuffers[ ulIndex ].bufferUsed == false )
+            queuedBlocksBitmap |= 1UL << ( blockId - currentBlockOffset );
+            flashWritesPending++;
+
+            queueDepth = ( uint32_t ) uxQueueMessagesWaiting( flashWriteQueue );
+            flashWriteCount++;
+            flashWriteQueueDepthSum += queueDepth;
+
+            if( queueDepth > flashWriteMaxQueueDepth )
             {
-                freeBuffers++;
+                flashWriteMaxQueueDepth = queueDepth;
             }
+
+            queued = true;
         }
 
-        ( void ) xSemaphoreGive( bufferSemaphore );
+        return queued;
     }
-    else
-    {
-        ESP_LOGI( TAG, "Failed to get buffer semaphore. \n" );
-    }
-
-    return freeBuffers;
-}
 
 /*-----------------------------------------------------------*/
 
-static void freeOtaDataEventBuffer( OtaDataEvent_t * const pxBuffer )
-{
-    if( xSemaphoreTake( bufferSemaphore, portMAX_DELAY ) == pdTRUE )
-    {
-        pxBuffer->bufferUsed = false;
-        ( void ) xSemaphoreGive( bufferSemaphore );
-    }
-    else
+    static void collectFlashWrites( bool waitForAll )
     {
-        ESP_LOGI( TAG, "Failed to get buffer semaphore.\n" );
-    }
-}
+        OtaFlashWrite_t flashWrite;
 
-/*-----------------------------------------------------------*/
+        while( ( flashWritesPending > 0U ) &&
+               ( xQueueReceive( flashWriteDoneQueue,
+                                &flashWrite,
+                                ( waitForAll == true ) ? portMAX_DELAY : 0 ) == pdTRUE ) )
+        {
+            flashWritesPending--;
+            queuedBlocksBitmap &= ~( 1UL << ( flashWrite.blockId - currentBlockOffset ) );
+            accountBlockWrite( flashWrite.result, flashWrite.writeTimeUs );
+            flashWriteStallTimeUs += flashWrite.stallTimeUs;
 
-static OtaDataEvent_t * getOtaDataEventBuffer( void )
-{
-    uint32_t ulIndex = 0;
-    OtaDataEvent_t * freeBuffer = NULL;
+            if( flashWrite.stallTimeUs > flashWriteMaxStallTimeUs )
+            {
+                flashWriteMaxStallTimeUs = flashWrite.stallTimeUs;
+            }
 
-    if( xSemaphoreTake( bufferSemaphore, portMAX_DELAY ) == pdTRUE )
-    {
-        for( ulIndex = 0; ulIndex < otademoconfigMAX_NUM_OTA_DATA_BUFFERS; ulIndex++ )
-        {
-            if( dataBuffers[ ulIndex ].bufferUsed == false )
+            /* A block which failed to be written is requested again on
+             * timeout, as its bit is left clear. */
+            if( flashWrite.result > 0 )
             {
-                dataBuffers[ ulIndex ].bufferUsed = true;
-                freeBuffer = &dataBuffers[ ulIndex ];
-                break;
+                blockWritten( flashWrite.blockId );
             }
         }
-
-        ( void ) xSemaphoreGive( bufferSemaphore );
-    }
-    else
-    {
-        ESP_LOGI( TAG, "Failed to get buffer semaphore. \n" );
     }
 
-    return freeBuffer;
-}
+#endif /* otademoconfigENABLE_FLASH_WRITER_TASK == 1 */
 
 /*-----------------------------------------------------------*/
 
-/* Implemented for use by the MQTT library */
-bool otaDemo_handleIncomingMQTTMessage( char * topic,
-                                        size_t topicLength,
-                                        uint8_t * message,
-                                        size_t messageLength )
+static void sendDataBlockEvent( const uint8_t * message,
+                                size_t messageLength )
 {
     OtaEventMsg_t nextEvent = { 0 };
+    OtaDataEvent_t * dataBuf = NULL;
+    bool messageFits = true;
 
-    /*
-     * MQTT streams Library:
-     * Checks if the incoming message contains the requested data block. It is performed by
-     * comparing the incoming MQTT message topic with MQTT streams topics.
-     */
-    bool handled = mqttDownloader_isDataBlockReceived( &mqttFileDownloaderContext, topic, topicLength );
+    #if ( otademoconfigENABLE_ZERO_COPY_BLOCKS == 0 )
+        /* The whole message is copied for the OTA task to decode. */
+        messageFits = ( messageLength <= sizeof( dataBuf->data ) );
+    #endif
 
-    if( handled )
+    /* A block which cannot be handed over to the OTA task is dropped. Its bit
+     * stays clear in the window, so it is requested again on timeout. */
+    if( messageFits == false )
     {
-        nextEvent.eventId = OtaAgentEventReceivedFileBlock;
-        OtaDataEvent_t * dataBuf = getOtaDataEventBuffer();
-        memcpy( dataBuf->data, message, messageLength );
-        nextEvent.dataEvent = dataBuf;
-        dataBuf->dataLength = messageLength;
-        OtaSendEvent_FreeRTOS( &nextEvent );
+        ESP_LOGW( TAG, "Dropping a file block message of %u bytes, larger than the OTA buffers.", ( unsigned ) messageLength );
+    }
+    else if( ( dataBuf = getOtaDataEventBuffer() ) == NULL )
+    {
+        ESP_LOGW( TAG, "No free OTA buffer available, dropping the file block." );
     }
     else
     {
-        /*
-         * AWS IoT Jobs library:
-         * Checks if a message comes from the start-next/accepted reserved topic.
-         */
-        handled = Jobs_IsStartNextAccepted( topic,
-                                            topicLength,
-                                            otademoconfigCLIENT_IDENTIFIER,
-                                            strlen( otademoconfigCLIENT_IDENTIFIER ) );
+        #if ( otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 )
+            OtaDecodedBlock_t * decodedBlock = &decodedBlocks[ dataBuf - dataBuffers ];
+            uint8_t * blockData = NULL;
+            size_t blockDataLength = 0;
+
+            /* The receive buffer is reused once the publish callback returns,
+             * so the block is extracted from it into the OTA data buffer here,
+             * in a single pass, instead of copying the whole message for the
+             * OTA task to decode. */
+            decodedBlock->status = extractDataBlock( ( uint8_t * ) message,
+                                                     messageLength,
+                                                     dataBuf->data,
+                                                     &decodedBlock->fileId,
+                                                     &decodedBlock->blockId,
+                                                     &decodedBlock->blockSize,
+                                                     &blockData,
+                                                     &blockDataLength,
+                                                     &decodedBlock->decodeTimeUs );
+
+            if( ( decodedBlock->status == MQTTFileDownloaderSuccess ) &&
+                ( blockDataLength > mqttFileDownloader_CONFIG_BLOCK_SIZE ) )
+            {
+                decodedBlock->status = MQTTFileDownloaderDataDecodingFailed;
+            }
+            else if( ( decodedBlock->status == MQTTFileDownloaderSuccess ) &&
+                     ( blockData != dataBuf->data ) )
+            {
+                /* CBOR blocks are left in the message by the parser. */
+                memcpy( dataBuf->data, blockData, blockDataLength );
+            }
 
-        if( handled )
+            dataBuf->dataLength = blockDataLength;
+        #else
+            memcpy( dataBuf->data, message, messageLength );
+            dataBuf->dataLength = messageLength;
+        #endif /* otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 */
+
+        nextEvent.dataEvent = dataBuf;
+        nextEvent.eventId = OtaAgentEventReceivedFileBlock;
+
+        if( OtaSendEvent_FreeRTOS( &nextEvent ) != OtaOsSuccess )
         {
-            memcpy( jobDocBuffer.jobData, message, messageLength );
-            nextEvent.jobEvent = &jobDocBuffer;
-            jobDocBuffer.jobDataLength = messageLength;
-            nextEvent.eventId = OtaAgentEventReceivedJobDocument;
-            OtaSendEvent_FreeRTOS( &nextEvent );
+            freeOtaDataEventBuffer( dataBuf );
+            ESP_LOGI( TAG, "Failed to send message to OTA task." );
         }
     }
-
-    return handled;
 }
 
 /*-----------------------------------------------------------*/
@@ -929,73 +2872,116 @@ static void processOTAEvents( void )
 {
     OtaEventMsg_t recvEvent = { 0 };
     OtaEvent_t recvEventId = 0;
-    static OtaEvent_t lastRecvEventId = OtaAgentEventStart;
+    #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 0 )
+        static OtaEvent_t lastRecvEventId = OtaAgentEventStart;
+    #endif
     static OtaEvent_t lastRecvEventIdBeforeSuspend = OtaAgentEventStart;
+    static bool retransmitFileBlocks = false;
     OtaEventMsg_t nextEvent = { 0 };
 
     OtaReceiveEvent_FreeRTOS( &recvEvent );
     recvEventId = recvEvent.eventId;
 
-    if( ( recvEventId != OtaAgentEventSuspend ) && ( recvEventId != OtaAgentEventResume ) )
+    /* The events deferred while suspended, and the queue timeouts, do not
+     * change what is resumed. */
+    if( ( recvEventId != OtaAgentEventSuspend ) &&
+        ( recvEventId != OtaAgentEventResume ) &&
+        ( recvEventId != OtaAgentEventStart ) &&
+        ( getOTAState() != OtaAgentStateSuspended ) )
     {
         lastRecvEventIdBeforeSuspend = recvEventId;
     }
 
-    if( recvEventId != OtaAgentEventStart )
-    {
-        lastRecvEventId = recvEventId;
-    }
-    else
-    {
-        if( lastRecvEventId == OtaAgentEventRequestFileBlock )
+    /* With the retransmission timer, the missing blocks are only requested
+     * again when it expires, so that requests are not doubled on queue
+     * timeouts and its backoff holds. */
+    #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 0 )
+        if( recvEventId != OtaAgentEventStart )
         {
-            /* No current event and we have not received the new block
-             * since last timeout, try sending the request for block again. */
-            recvEventId = lastRecvEventId;
-
-            /* It is likely that the network was disconnected and reconnected,
-             * we should wait for the MQTT connection to go up. */
-            while( xSuspendOta == pdTRUE )
+            lastRecvEventId = recvEventId;
+        }
+        else
+        {
+            if( lastRecvEventId == OtaAgentEventRequestFileBlock )
             {
-                vTaskDelay( pdMS_TO_TICKS( 100 ) );
+                /* No current event and we have not received the new block
+                 * since last timeout, try sending the request for the missing
+                 * blocks again. */
+                recvEventId = lastRecvEventId;
+                retransmitFileBlocks = true;
+
+                #if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+                    adaptBlockWindowOnLoss();
+                #endif
+
+                /* It is likely that the network was disconnected and reconnected,
+                 * we should wait for the MQTT connection to go up. */
+                ( void ) xEventGroupWaitBits( networkEventGroup,
+                                              CORE_MQTT_AGENT_CONNECTED_BIT,
+                                              pdFALSE,
+                                              pdTRUE,
+                                              portMAX_DELAY );
             }
         }
-    }
+    #endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 0 */
 
     switch( recvEventId )
     {
         case OtaAgentEventRequestJobDocument:
             ESP_LOGI( TAG, "Request Job Document event Received \n" );
 
+            if( getOTAState() == OtaAgentStateSuspended )
+            {
+                /* The job is requested on resume, once connected. */
+                break;
+            }
+
+            /* No file is downloaded while a job is requested, as when the
+             * download in progress was abandoned on resume. */
+            setDownloadInProgress( false );
             requestJobDocumentHandler();
-            otaAgentState = OtaAgentStateRequestingJob;
+            setOTAState( OtaAgentStateRequestingJob );
             break;
 
         case OtaAgentEventReceivedJobDocument:
             ESP_LOGI( TAG, "Received Job Document event Received \n" );
 
-            if( otaAgentState == OtaAgentStateSuspended )
+            if( getOTAState() == OtaAgentStateSuspended )
             {
                 ESP_LOGI( TAG, "OTA-Agent is in Suspend State. Hence dropping Job Document. \n" );
             }
             else
             {
+                #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+                    /* The blocks still queued belong to the current download,
+                     * which the job document may replace. */
+                    collectFlashWrites( true );
+                #endif
+
                 switch( receivedJobDocumentHandler( recvEvent.jobEvent ) )
                 {
                     case OtaPalJobDocFileCreated:
                         ESP_LOGI( TAG, "Received OTA Job. \n" );
+                        setDownloadInProgress( true );
                         nextEvent.eventId = OtaAgentEventRequestFileBlock;
                         OtaSendEvent_FreeRTOS( &nextEvent );
-                        otaAgentState = OtaAgentStateCreatingFile;
+                        setOTAState( OtaAgentStateCreatingFile );
                         break;
 
                     case OtaPalJobDocFileCreateFailed:
                     case OtaPalNewImageBootFailed:
                     case OtaPalJobDocProcessingStateInvalid:
+                        /* The job fields of a download in progress were
+                         * replaced by the document, or its file was aborted. */
                         ESP_LOGI( TAG, "This is not an OTA job \n" );
+                        setDownloadInProgress( false );
+
+                        /* The next job arrives on the notify-next topic. */
+                        setOTAState( OtaAgentStateWaitingForJob );
                         break;
 
                     case OtaPalNewImageBooted:
+                        setDownloadInProgress( false );
                         ( void ) sendSuccessMessage();
 
                         /* Short delay before restarting the loop. This allows IoT core
@@ -1012,7 +2998,43 @@ static void processOTAEvents( void )
             break;
 
         case OtaAgentEventRequestFileBlock:
-            otaAgentState = OtaAgentStateRequestingFileBlock;
+            #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+                /* Slide the window past the blocks written since the last
+                 * request. */
+                collectFlashWrites( false );
+            #endif
+
+            if( getOTAState() == OtaAgentStateSuspended )
+            {
+                /* The blocks are requested again on resume, once connected. */
+                break;
+            }
+
+            #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+                if( numOfBlocksRemaining == 0U )
+                {
+                    nextEvent.eventId = OtaAgentEventCloseFile;
+                    OtaSendEvent_FreeRTOS( &nextEvent );
+                    break;
+                }
+            #endif /* otademoconfigENABLE_FLASH_WRITER_TASK == 1 */
+
+            #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+                if( retransmitTimerExpired == true )
+                {
+                    /* Only the blocks of the window which did not arrive are
+                     * requested again. */
+                    retransmitTimerExpired = false;
+                    retransmitFileBlocks = true;
+                    backoffRetransmitTimer();
+
+                    #if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+                        adaptBlockWindowOnLoss();
+                    #endif
+                }
+            #endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 1 */
+
+            setOTAState( OtaAgentStateRequestingFileBlock );
             ESP_LOGI( TAG, "Request File Block event Received.\n" );
 
             if( currentBlockOffset == 0 )
@@ -1020,9 +3042,16 @@ static void processOTAEvents( void )
                 ESP_LOGI( TAG, "Starting The Download.\n" );
             }
 
-            if( requestDataBlock() == OtaMqttSuccess )
+            if( requestDataBlockWindow( retransmitFileBlocks ) == OtaMqttSuccess )
             {
-                ESP_LOGI( TAG, "Data block request sent.\n" );
+                ESP_LOGI( TAG, "Data block requests sent, blocks %lu to %lu requested.\n",
+                          currentBlockOffset,
+                          nextBlockToRequest );
+                retransmitFileBlocks = false;
+
+                #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+                    startRetransmitTimer();
+                #endif
             }
             else
             {
@@ -1037,34 +3066,50 @@ static void processOTAEvents( void )
         case OtaAgentEventReceivedFileBlock:
             ESP_LOGI( TAG, "Received File Block event Received.\n" );
 
-            if( otaAgentState == OtaAgentStateSuspended )
+            if( getOTAState() == OtaAgentStateSuspended )
             {
                 ESP_LOGI( TAG, "OTA-Agent is in Suspend State. Dropping File Block. \n" );
                 freeOtaDataEventBuffer( recvEvent.dataEvent );
             }
             else
             {
-                static uint8_t decodedData[ mqttFileDownloader_CONFIG_BLOCK_SIZE ];
+                uint8_t * decodedData = NULL;
                 size_t decodedDataLength = 0;
                 MQTTFileDownloaderStatus_t xReturnStatus;
                 int16_t result = -1;
+                bool queued = false;
                 int32_t fileId;
                 int32_t blockId;
                 int32_t blockSize;
-                static int32_t lastReceivedblockId = -1;
-
-                /*
-                 * MQTT streams Library:
-                 * Extracting and decoding the received data block from the incoming MQTT message.
-                 */
-                xReturnStatus = mqttDownloader_processReceivedDataBlock( &mqttFileDownloaderContext,
-                                                                         recvEvent.dataEvent->data,
-                                                                         recvEvent.dataEvent->dataLength,
-                                                                         &fileId,
-                                                                         &blockId,
-                                                                         &blockSize,
-                                                                         decodedData,
-                                                                         &decodedDataLength );
+
+                #if ( otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 )
+                    const OtaDecodedBlock_t * decodedBlock = &decodedBlocks[ recvEvent.dataEvent - dataBuffers ];
+
+                    /* The block was extracted into the buffer when the
+                     * message was received, it is written to flash from
+                     * there. */
+                    xReturnStatus = decodedBlock->status;
+                    fileId = decodedBlock->fileId;
+                    blockId = decodedBlock->blockId;
+                    blockSize = decodedBlock->blockSize;
+                    decodedData = recvEvent.dataEvent->data;
+                    decodedDataLength = recvEvent.dataEvent->dataLength;
+                    blockDecodeTimeUs += decodedBlock->decodeTimeUs;
+                #else
+                    static uint8_t decodedBlock[ mqttFileDownloader_CONFIG_BLOCK_SIZE ];
+                    int64_t decodeTimeUs = 0;
+
+                    xReturnStatus = extractDataBlock( recvEvent.dataEvent->data,
+                                                      recvEvent.dataEvent->dataLength,
+                                                      decodedBlock,
+                                                      &fileId,
+                                                      &blockId,
+                                                      &blockSize,
+                                                      &decodedData,
+                                                      &decodedDataLength,
+                                                      &decodeTimeUs );
+                    blockDecodeTimeUs += decodeTimeUs;
+                #endif /* otademoconfigENABLE_ZERO_COPY_BLOCKS == 1 */
 
                 if( xReturnStatus != MQTTFileDownloaderSuccess )
                 {
@@ -1074,27 +3119,61 @@ static void processOTAEvents( void )
                 {
                     /* Error - the file ID doesn't match with the one we received in the job document. */
                 }
-                else if( blockSize > mqttFileDownloader_CONFIG_BLOCK_SIZE )
+                else if( ( blockSize > mqttFileDownloader_CONFIG_BLOCK_SIZE ) ||
+                         ( decodedDataLength > mqttFileDownloader_CONFIG_BLOCK_SIZE ) )
                 {
                     /* Error - the block size doesn't match with what we requested. It can be smaller as
                      * the last block may or may not be of exact size. */
                 }
-                else if( blockId <= lastReceivedblockId )
+                else if( ( ( uint32_t ) blockId >= nextBlockToRequest ) ||
+                         ( isBlockReceived( ( uint32_t ) blockId ) == true ) )
                 {
-                    /* Ignore this block. */
+                    /* Ignore this block, it was not requested or is a
+                     * duplicate of a retransmitted block. */
                 }
+                #if ( OTA_DECODE_FILE_IN_ORDER == 1 )
+                    else if( ( uint32_t ) blockId != currentBlockOffset )
+                    {
+                        /* The file is decoded in order. A block received ahead
+                         * of a missing one is requested again with it. */
+                    }
+                #endif
                 else
                 {
-                    result = handleMqttStreamsBlockArrived( decodedData, decodedDataLength );
-                    lastReceivedblockId = blockId;
+                    #if ( OTA_MEASURE_BLOCK_RTT == 1 )
+                        sampleBlockRtt( ( uint32_t ) blockId );
+                    #endif
+
+                    #if ( otademoconfigENABLE_ADAPTIVE_WINDOW == 1 )
+                        adaptBlockWindowOnBlock();
+                    #endif
+
+                    #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+                        startRetransmitTimer();
+                    #endif
+
+                    #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+                        queued = queueFlashWrite( recvEvent.dataEvent, ( uint32_t ) blockId, decodedData, decodedDataLength );
+                    #else
+                        int64_t writeTimeUs = 0;
+
+                        result = handleMqttStreamsBlockArrived( ( uint32_t ) blockId, decodedData, decodedDataLength, &writeTimeUs );
+                        accountBlockWrite( result, writeTimeUs );
+                    #endif
                 }
 
-                freeOtaDataEventBuffer( recvEvent.dataEvent );
+                if( queued == false )
+                {
+                    freeOtaDataEventBuffer( recvEvent.dataEvent );
+                }
 
                 if( result > 0 )
                 {
-                    numOfBlocksRemaining--;
-                    currentBlockOffset++;
+                    #if ( otademoconfigENABLE_IMAGE_HASH == 1 ) && ( OTA_DECODE_FILE_IN_ORDER == 0 )
+                        hashImageBlock( ( uint32_t ) blockId, decodedData, decodedDataLength );
+                    #endif
+
+                    blockWritten( ( uint32_t ) blockId );
                 }
 
                 if( ( numOfBlocksRemaining % 10 ) == 0 )
@@ -1107,8 +3186,10 @@ static void processOTAEvents( void )
                     nextEvent.eventId = OtaAgentEventCloseFile;
                     OtaSendEvent_FreeRTOS( &nextEvent );
                 }
-                else
+                else if( queued == false )
                 {
+                    /* A queued block requests the next blocks once it has
+                     * been written. */
                     nextEvent.eventId = OtaAgentEventRequestFileBlock;
                     OtaSendEvent_FreeRTOS( &nextEvent );
                 }
@@ -1119,59 +3200,109 @@ static void processOTAEvents( void )
         case OtaAgentEventCloseFile:
             ESP_LOGI( TAG, "Close file event Received \n" );
 
+            closeFileStartTimeUs = esp_timer_get_time();
+
+            #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+                ( void ) esp_timer_stop( retransmitTimer );
+            #endif
+
+            ESP_LOGI( TAG, "Downloaded %lu bytes in %lld ms, extracting the blocks took %lld us and writing them %lld us per block.\n",
+                      totalBytesReceived,
+                      ( esp_timer_get_time() - downloadStartTimeUs ) / 1000,
+                      ( numOfBlocks > 0U ) ? ( blockDecodeTimeUs / numOfBlocks ) : 0,
+                      ( numOfBlocks > 0U ) ? ( blockWriteTimeUs / numOfBlocks ) : 0 );
+
+            ESP_LOGI( TAG, "At most %lu of the %u OTA buffers were in use, %lu file blocks were dropped for lack of a free buffer.\n",
+                      __atomic_load_n( &dataBuffersHighWatermark, __ATOMIC_RELAXED ),
+                      otademoconfigMAX_NUM_OTA_DATA_BUFFERS,
+                      __atomic_load_n( &dataBuffersExhaustedCount, __ATOMIC_RELAXED ) );
+
+            #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+                ESP_LOGI( TAG, "Flash writer queue depth %lu.%02lu on average, %lu at most. Blocks waited %lld us on average, %lld us at most, for the previous writes.\n",
+                          ( flashWriteCount > 0U ) ? ( flashWriteQueueDepthSum / flashWriteCount ) : 0U,
+                          ( flashWriteCount > 0U ) ? ( ( ( flashWriteQueueDepthSum % flashWriteCount ) * 100U ) / flashWriteCount ) : 0U,
+                          flashWriteMaxQueueDepth,
+                          ( flashWriteCount > 0U ) ? ( flashWriteStallTimeUs / flashWriteCount ) : 0,
+                          flashWriteMaxStallTimeUs );
+            #endif
+
+            #if ( otademoconfigENABLE_RESUME == 1 )
+                /* The file is complete, or failed its signature check and
+                 * has to be downloaded again. */
+                clearDownloadCheckpoint();
+            #endif
+
             if( closeFileHandler() == true )
             {
                 nextEvent.eventId = OtaAgentEventActivateImage;
                 OtaSendEvent_FreeRTOS( &nextEvent );
             }
 
+            /* The download is over, whether or not the image is valid. */
+            setDownloadInProgress( false );
             break;
 
         case OtaAgentEventActivateImage:
             ESP_LOGI( TAG, "Activate Image event Received \n" );
 
+            ESP_LOGI( TAG, "Closing and checking the file took %lld ms.\n",
+                      ( esp_timer_get_time() - closeFileStartTimeUs ) / 1000 );
+
             if( imageActivationHandler() == true )
             {
                 nextEvent.eventId = OtaAgentEventActivateImage;
                 OtaSendEvent_FreeRTOS( &nextEvent );
             }
 
-            otaAgentState = OtaAgentStateStopped;
+            setOTAState( OtaAgentStateStopped );
             break;
 
 
         case OtaAgentEventSuspend:
             ESP_LOGI( TAG, "Suspend Event Received \n" );
 
-            otaAgentState = OtaAgentStateSuspended;
+            if( getOTAState() != OtaAgentStateStopped )
+            {
+                setOTAState( OtaAgentStateSuspended );
+            }
+
             break;
 
         case OtaAgentEventResume:
             ESP_LOGI( TAG, "Resume Event Received \n" );
 
-            switch( lastRecvEventIdBeforeSuspend )
+            /* Only a suspended OTA agent is resumed, as the connection may
+             * have been lost before the OTA agent started. */
+            if( getOTAState() == OtaAgentStateSuspended )
             {
-                case OtaAgentEventStart:
-                case OtaAgentEventRequestJobDocument:
-                case OtaAgentEventReceivedJobDocument:
-                default:
-                    nextEvent.eventId = OtaAgentEventRequestJobDocument;
-                    break;
+                switch( lastRecvEventIdBeforeSuspend )
+                {
+                    case OtaAgentEventStart:
+                    case OtaAgentEventRequestJobDocument:
+                    case OtaAgentEventReceivedJobDocument:
+                    default:
+                        nextEvent.eventId = OtaAgentEventRequestJobDocument;
+                        break;
 
-                case OtaAgentEventCreateFile:
-                case OtaAgentEventRequestFileBlock:
-                case OtaAgentEventReceivedFileBlock:
-                    nextEvent.eventId = OtaAgentEventRequestFileBlock;
-                    break;
+                    case OtaAgentEventCreateFile:
+                    case OtaAgentEventRequestFileBlock:
+                    case OtaAgentEventReceivedFileBlock:
+                        /* The blocks in flight were lost with the connection. */
+                        nextEvent.eventId = OtaAgentEventRequestFileBlock;
+                        retransmitFileBlocks = true;
+                        break;
 
-                case OtaAgentEventCloseFile:
-                    nextEvent.eventId = OtaAgentEventActivateImage;
-                    break;
-            }
+                    case OtaAgentEventCloseFile:
+                        nextEvent.eventId = OtaAgentEventActivateImage;
+                        break;
+                }
 
-            otaAgentState = OtaAgentStateResumed;
+                setOTAState( OtaAgentStateResumed );
 
-            OtaSendEvent_FreeRTOS( &nextEvent );
+                OtaSendEvent_FreeRTOS( &nextEvent );
+            }
+
+            break;
 
         default:
             break;
@@ -1180,9 +3311,34 @@ static void processOTAEvents( void )
 
 /*-----------------------------------------------------------*/
 
-static OtaState_t prvGetOTAState( void )
+static void setOTAState( OtaState_t state )
+{
+    OtaState_t previousState = getOTAState();
+
+    /* Every state the agent can enter has a bit of otaStateEventGroup. */
+    configASSERT( OtaAgentStateAll <= OTA_STATE_EVENT_BITS );
+    configASSERT( OTA_STATE_HAS_BIT( state ) );
+
+    if( state != previousState )
+    {
+        ( void ) xEventGroupClearBits( otaStateEventGroup, OTA_STATE_BIT( previousState ) );
+        __atomic_store_n( &otaAgentState, state, __ATOMIC_RELEASE );
+        ( void ) xEventGroupSetBits( otaStateEventGroup, OTA_STATE_BIT( state ) );
+    }
+}
+
+static OtaState_t getOTAState( void )
+{
+    return __atomic_load_n( &otaAgentState, __ATOMIC_ACQUIRE );
+}
+
+static void setDownloadInProgress( bool inProgress )
 {
-    return otaAgentState;
+    if( inProgress != otaDownloadInProgress )
+    {
+        otaDownloadInProgress = inProgress;
+        ( void ) xCoreMqttAgentManagerPost( ( inProgress == true ) ? CORE_MQTT_AGENT_OTA_STARTED_EVENT : CORE_MQTT_AGENT_OTA_STOPPED_EVENT );
+    }
 }
 
 /*-----------------------------------------------------------*/
@@ -1214,12 +3370,9 @@ static void prvOTADemoTask( void * pvParam )
     /* OTA event message used for triggering the OTA process.*/
     OtaEventMsg_t initEvent = { 0 };
 
-    /* OTA Agent state returned from calling OTA_GetAgentState.*/
-    OtaState_t state = OtaAgentStateStopped;
-
-    /* Buffer to hold the notify-next topic. */
-    char jobNotifyTopic[ JOBS_API_MAX_LENGTH( strlen( otademoconfigCLIENT_IDENTIFIER ) ) ];
-    size_t jobNotifyTopicLen = 0;
+    /* The notify-next topic. */
+    const char * jobNotifyTopic = NULL;
+    uint16_t jobNotifyTopicLen = 0;
 
     ESP_LOGI( TAG, "OTA over MQTT demo, Application version %u.%u.%u",
               appFirmwareVersion.u.x.major,
@@ -1228,16 +3381,46 @@ static void prvOTADemoTask( void * pvParam )
 
     /****************************** Init OTA Library. ******************************/
 
-    bufferSemaphore = xSemaphoreCreateMutex();
+    memset( dataBuffers, 0x00, sizeof( dataBuffers ) );
+    __atomic_store_n( &freeDataBuffersBitmap, OTA_DATA_BUFFERS_ALL_FREE, __ATOMIC_RELEASE );
 
-    if( bufferSemaphore == NULL )
-    {
-        xResult = pdFAIL;
-    }
-    else
-    {
-        memset( dataBuffers, 0x00, sizeof( dataBuffers ) );
-    }
+    #if ( otademoconfigENABLE_RETRANSMIT_TIMER == 1 )
+        if( xResult == pdPASS )
+        {
+            const esp_timer_create_args_t retransmitTimerArgs =
+            {
+                .callback = retransmitTimerCallback,
+                .name     = "ota_retransmit"
+            };
+
+            if( esp_timer_create( &retransmitTimerArgs, &retransmitTimer ) != ESP_OK )
+            {
+                xResult = pdFAIL;
+            }
+        }
+    #endif /* otademoconfigENABLE_RETRANSMIT_TIMER == 1 */
+
+    #if ( otademoconfigENABLE_FLASH_WRITER_TASK == 1 )
+        if( xResult == pdPASS )
+        {
+            flashWriteQueue = xQueueCreate( otademoconfigMAX_NUM_OTA_DATA_BUFFERS, sizeof( OtaFlashWrite_t ) );
+            flashWriteDoneQueue = xQueueCreate( otademoconfigMAX_NUM_OTA_DATA_BUFFERS, sizeof( OtaFlashWrite_t ) );
+
+            if( ( flashWriteQueue == NULL ) || ( flashWriteDoneQueue == NULL ) )
+            {
+                xResult = pdFAIL;
+            }
+            else
+            {
+                xResult = xTaskCreate( flashWriterTask,
+                                       "OTAFlashWriter",
+                                       otademoconfigFLASH_WRITER_TASK_STACK_SIZE,
+                                       NULL,
+                                       otademoconfigFLASH_WRITER_TASK_PRIORITY,
+                                       NULL );
+            }
+        }
+    #endif /* otademoconfigENABLE_FLASH_WRITER_TASK == 1 */
 
     /***************************Start OTA demo loop. ******************************/
 
@@ -1250,39 +3433,36 @@ static void prvOTADemoTask( void * pvParam )
         OtaSendEvent_FreeRTOS( &initEvent );
 
         /* Wait for the MQTT Connection to go up. */
-        while( xSuspendOta == pdTRUE )
-        {
-            vTaskDelay( pdMS_TO_TICKS( 100 ) );
-        }
+        ( void ) xEventGroupWaitBits( networkEventGroup,
+                                      CORE_MQTT_AGENT_CONNECTED_BIT,
+                                      pdFALSE,
+                                      pdTRUE,
+                                      portMAX_DELAY );
+
+        /* The jobs topics with a fixed name are routed by the reserved topics
+         * table. The responses to jobs requests are delivered without a broker
+         * subscription. */
+        setReservedTopicCallback( ReservedTopicJobsNotifyNext, prvJobDocumentCallback, NULL, true );
+        setReservedTopicCallback( ReservedTopicJobsStartNextAccepted, prvJobDocumentCallback, NULL, false );
+        setReservedTopicCallback( ReservedTopicJobsStartNextRejected, prvJobRejectedCallback, NULL, false );
 
         /* Subscribe to notify-next */
-        JobsStatus_t status = Jobs_GetTopic( jobNotifyTopic,
-                                             sizeof( jobNotifyTopic ),
-                                             otademoconfigCLIENT_IDENTIFIER,
-                                             strlen( otademoconfigCLIENT_IDENTIFIER ),
-                                             JobsNextJobChanged,
-                                             &jobNotifyTopicLen );
-
-        prvMQTTSubscribe( jobNotifyTopic, ( uint16_t ) jobNotifyTopicLen, 1 );
-
-        while( otaAgentState != OtaAgentStateStopped )
+        jobNotifyTopic = getReservedTopicName( ReservedTopicJobsNotifyNext, &jobNotifyTopicLen );
+        prvMQTTSubscribe( jobNotifyTopic, jobNotifyTopicLen, 1, NULL );
+
+        /* Job IDs are only known at run time, so the update responses are
+         * routed by the subscription manager. */
+        prvUpdateLocalSubscription( OTA_JOB_UPDATE_RESPONSE_TOPIC_FILTER,
+                                    OTA_JOB_UPDATE_RESPONSE_TOPIC_FILTER_LENGTH,
+                                    prvJobUpdateResponseCallback,
+                                    prvAddLocalSubscriptionCallback );
+
+        /* The coreMQTT-Agent event handler suspends and resumes the OTA
+         * agent through its event queue. */
+        while( getOTAState() != OtaAgentStateStopped )
         {
             processOTAEvents();
         }
-
-        while( ( state = prvGetOTAState() ) != OtaAgentStateStopped )
-        {
-            if( ( state != OtaAgentStateSuspended ) && ( xSuspendOta == pdTRUE ) )
-            {
-                prvSuspendOTACodeSigningDemo();
-            }
-            else if( ( state == OtaAgentStateSuspended ) && ( xSuspendOta == pdFALSE ) )
-            {
-                prvResumeOTACodeSigningDemo();
-            }
-
-            vTaskDelay( pdMS_TO_TICKS( otademoconfigTASK_DELAY_MS ) );
-        }
     }
 
     ESP_LOGI( TAG, "OTA agent task stopped. Exiting OTA demo." );
@@ -1290,38 +3470,13 @@ static void prvOTADemoTask( void * pvParam )
     vTaskDelete( NULL );
 }
 
-static void prvSuspendOTACodeSigningDemo( void )
-{
-    if( ( prvGetOTAState() != OtaAgentStateSuspended ) && ( prvGetOTAState() != OtaAgentStateStopped ) )
-    {
-        prvSuspendOTA();
-
-        while( ( prvGetOTAState() != OtaAgentStateSuspended ) &&
-               ( prvGetOTAState() != OtaAgentStateStopped ) )
-        {
-            vTaskDelay( pdMS_TO_TICKS( otademoconfigTASK_DELAY_MS ) );
-        }
-    }
-}
-
-static void prvResumeOTACodeSigningDemo( void )
-{
-    if( prvGetOTAState() == OtaAgentStateSuspended )
-    {
-        prvResumeOTA();
-
-        while( prvGetOTAState() == OtaAgentStateSuspended )
-        {
-            vTaskDelay( pdMS_TO_TICKS( otademoconfigTASK_DELAY_MS ) );
-        }
-    }
-}
-
 static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
                                           esp_event_base_t xEventBase,
                                           int32_t lEventId,
                                           void * pvEventData )
 {
+    OtaState_t state = getOTAState();
+
     ( void ) pvHandlerArg;
     ( void ) xEventBase;
     ( void ) pvEventData;
@@ -1330,12 +3485,26 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
     {
         case CORE_MQTT_AGENT_CONNECTED_EVENT:
             ESP_LOGI( TAG, "coreMQTT-Agent connected. Resuming OTA agent." );
-            xSuspendOta = pdFALSE;
+            ( void ) xEventGroupSetBits( networkEventGroup, CORE_MQTT_AGENT_CONNECTED_BIT );
+
+            /* The event queue of the OTA agent exists once it has requested
+             * a job, and is no longer read once it has stopped. */
+            if( ( state != OtaAgentStateInit ) && ( state != OtaAgentStateStopped ) )
+            {
+                prvResumeOTA();
+            }
+
             break;
 
         case CORE_MQTT_AGENT_DISCONNECTED_EVENT:
             ESP_LOGI( TAG, "coreMQTT-Agent disconnected. Suspending OTA agent." );
-            xSuspendOta = pdTRUE;
+            ( void ) xEventGroupClearBits( networkEventGroup, CORE_MQTT_AGENT_CONNECTED_BIT );
+
+            if( ( state != OtaAgentStateInit ) && ( state != OtaAgentStateStopped ) )
+            {
+                prvSuspendOTA();
+            }
+
             break;
 
         case CORE_MQTT_AGENT_OTA_STARTED_EVENT:
@@ -1351,12 +3520,75 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
     }
 }
 
+static void prvDataBlockCallback( void * pvIncomingPublishCallbackContext,
+                                  MQTTPublishInfo_t * pxPublishInfo )
+{
+    ( void ) pvIncomingPublishCallbackContext;
+
+    sendDataBlockEvent( ( const uint8_t * ) pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+}
+
+static void prvJobDocumentCallback( void * pvIncomingPublishCallbackContext,
+                                    MQTTPublishInfo_t * pxPublishInfo )
+{
+    OtaEventMsg_t nextEvent = { 0 };
+
+    ( void ) pvIncomingPublishCallbackContext;
+
+    /* A document larger than the buffer would overrun it. Room is kept for a
+     * terminating NUL. */
+    if( pxPublishInfo->payloadLength >= sizeof( jobDocBuffer.jobData ) )
+    {
+        ESP_LOGE( TAG, "Dropping a job document of %u bytes, larger than the %u byte buffer.",
+                  ( unsigned ) pxPublishInfo->payloadLength,
+                  ( unsigned ) ( sizeof( jobDocBuffer.jobData ) - 1U ) );
+    }
+    else
+    {
+        memcpy( jobDocBuffer.jobData, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+        nextEvent.jobEvent = &jobDocBuffer;
+        nextEvent.eventId = OtaAgentEventReceivedJobDocument;
+
+        jobDocBuffer.jobDataLength = pxPublishInfo->payloadLength;
+
+        if( OtaSendEvent_FreeRTOS( &nextEvent ) != OtaOsSuccess )
+        {
+            ESP_LOGI( TAG, "Failed to send message to OTA task." );
+        }
+    }
+}
+
+static void prvJobRejectedCallback( void * pvIncomingPublishCallbackContext,
+                                    MQTTPublishInfo_t * pxPublishInfo )
+{
+    ( void ) pvIncomingPublishCallbackContext;
+
+    ESP_LOGW( TAG, "Job request rejected: %.*s",
+              ( int ) pxPublishInfo->payloadLength,
+              ( const char * ) pxPublishInfo->pPayload );
+}
+
+static void prvJobUpdateResponseCallback( void * pvIncomingPublishCallbackContext,
+                                          MQTTPublishInfo_t * pxPublishInfo )
+{
+    ( void ) pvIncomingPublishCallbackContext;
+
+    ESP_LOGI( TAG, "Received update response: %.*s.",
+              pxPublishInfo->topicNameLength,
+              pxPublishInfo->pTopicName );
+}
+
 /* Public function definitions ************************************************/
 
 void vStartOTACodeSigningDemo( void )
 {
     BaseType_t xResult;
 
+    networkEventGroup = xEventGroupCreate();
+    otaStateEventGroup = xEventGroupCreate();
+    configASSERT( ( networkEventGroup != NULL ) && ( otaStateEventGroup != NULL ) );
+    ( void ) xEventGroupSetBits( otaStateEventGroup, OTA_STATE_BIT( getOTAState() ) );
+
     xCoreMqttAgentManagerRegisterHandler( prvCoreMqttAgentEventHandler );
 
     if( ( xResult = xTaskCreate( prvOTADemoTask,
@@ -1372,112 +3604,30 @@ void vStartOTACodeSigningDemo( void )
     configASSERT( xResult == pdPASS );
 }
 
-bool vOTAProcessMessage( void * pvIncomingPublishCallbackContext,
-                         MQTTPublishInfo_t * pxPublishInfo )
+BaseType_t xWaitForOTACodeSigningDemoState( OtaState_t xState,
+                                            TickType_t xTicksToWait )
 {
-    bool isMatch = false;
-    MQTTFileDownloaderStatus_t handled;
-    OtaEventMsg_t nextEvent = { 0 };
-
-    /*
-     * MQTT streams Library:
-     * Checks if the incoming message contains the requested data block. It is performed by
-     * comparing the incoming MQTT message topic with MQTT streams topics.
-     */
-    handled = mqttDownloader_isDataBlockReceived( &mqttFileDownloaderContext,
-                                                  pxPublishInfo->pTopicName,
-                                                  pxPublishInfo->topicNameLength );
-
-    if( handled == MQTTFileDownloaderSuccess )
-    {
-        OtaDataEvent_t * dataBuf = getOtaDataEventBuffer();
-
-        if( dataBuf != NULL )
-        {
-            memcpy( dataBuf->data, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
-            nextEvent.dataEvent = dataBuf;
-            nextEvent.eventId = OtaAgentEventReceivedFileBlock;
-
-            dataBuf->dataLength = pxPublishInfo->payloadLength;
+    EventBits_t uxBits = 0;
+    BaseType_t xResult = pdFAIL;
 
-            if( OtaSendEvent_FreeRTOS( &nextEvent ) != OtaOsSuccess )
-            {
-                freeOtaDataEventBuffer( dataBuf );
-                ESP_LOGI( TAG, "Failed to send message to OTA task." );
-            }
-
-            isMatch = true;
-        }
-        else
-        {
-            ESP_LOGI( TAG, "No free OTA buffer available" );
-        }
-    }
-
-    if( isMatch == false )
+    if( OTA_STATE_HAS_BIT( xState ) == false )
     {
-        /*
-         * AWS IoT Jobs library:
-         * Checks if a message comes from the start-next/accepted reserved topic.
-         */
-        isMatch = Jobs_IsStartNextAccepted( pxPublishInfo->pTopicName,
-                                            pxPublishInfo->topicNameLength,
-                                            otademoconfigCLIENT_IDENTIFIER,
-                                            strlen( otademoconfigCLIENT_IDENTIFIER ) );
-
-        if( isMatch )
-        {
-            memcpy( jobDocBuffer.jobData, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
-            nextEvent.jobEvent = &jobDocBuffer;
-            nextEvent.eventId = OtaAgentEventReceivedJobDocument;
-
-            jobDocBuffer.jobDataLength = pxPublishInfo->payloadLength;
-
-            if( OtaSendEvent_FreeRTOS( &nextEvent ) != OtaOsSuccess )
-            {
-                ESP_LOGI( TAG, "Failed to send message to OTA task." );
-            }
-        }
+        ESP_LOGE( TAG, "Cannot wait for OTA agent state %d.", ( int ) xState );
     }
-
-    if( isMatch == false )
+    else if( otaStateEventGroup != NULL )
     {
-        ( void ) MQTT_MatchTopic( pxPublishInfo->pTopicName,
-                                  pxPublishInfo->topicNameLength,
-                                  OTA_JOB_NOTIFY_TOPIC_FILTER,
-                                  OTA_JOB_NOTIFY_TOPIC_FILTER_LENGTH,
-                                  &isMatch );
+        uxBits = xEventGroupWaitBits( otaStateEventGroup,
+                                      OTA_STATE_BIT( xState ),
+                                      pdFALSE,
+                                      pdTRUE,
+                                      xTicksToWait );
 
-        if( isMatch == true )
-        {
-            memcpy( jobDocBuffer.jobData, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
-            nextEvent.jobEvent = &jobDocBuffer;
-            nextEvent.eventId = OtaAgentEventReceivedJobDocument;
-
-            jobDocBuffer.jobDataLength = pxPublishInfo->payloadLength;
-
-            if( OtaSendEvent_FreeRTOS( &nextEvent ) != OtaOsSuccess )
-            {
-                ESP_LOGI( TAG, "Failed to send message to OTA task." );
-            }
-        }
+        xResult = ( ( uxBits & OTA_STATE_BIT( xState ) ) != 0U ) ? pdPASS : pdFAIL;
     }
-
-    if( isMatch == false )
+    else
     {
-        ( void ) MQTT_MatchTopic( pxPublishInfo->pTopicName,
-                                  pxPublishInfo->topicNameLength,
-                                  OTA_JOB_UPDATE_RESPONSE_TOPIC_FILTER,
-                                  OTA_JOB_UPDATE_RESPONSE_TOPIC_FILTER_LENGTH,
-                                  &isMatch );
-
-        /* Return true if receiving update/accepted or update/rejected to get rid of warning
-         * message "WARN:  Received an unsolicited publish from topic $aws/things/+/jobs/+/update/+". */
-        if( isMatch == true )
-        {
-            ESP_LOGI( TAG, "Received update response: %s.", pxPublishInfo->pTopicName );
-        }
+        /* The demo is not started. */
     }
 
-    return isMatch;
+    return xResult;
 }
@@ -30,6 +30,7 @@
 #include "freertos/FreeRTOS.h"
 #include "core_mqtt_agent.h"
 #include "ota_config.h"
+#include "ota_os_freertos.h"
 
 /* *INDENT-OFF* */
     #ifdef __cplusplus
@@ -43,20 +44,16 @@
 void vStartOTACodeSigningDemo( void );
 
 /**
- * @brief Default callback used to receive default messages for OTA.
+ * @brief Waits for the OTA agent of the codesigning demo to enter a state.
  *
- * The callback is not subscribed with MQTT broker, but only with local subscription manager.
- * A wildcard OTA job topic is used for subscription so that all unsolicited messages related to OTA is
- * forwarded to this callback for filtration. Right now the callback is used to filter responses to job requests
- * from the OTA service.
+ * @param[in] xState State to wait for.
+ * @param[in] xTicksToWait Maximum time to wait.
  *
- * @param[in] pvIncomingPublishCallbackContext MQTT context which stores the connection.
- * @param[in] pPublishInfo MQTT packet that stores the information of the file block.
- *
- * @return true if the message is processed by OTA.
+ * @return pdPASS if the OTA agent is in the state, pdFAIL if the wait timed
+ * out, the demo is not started, or xState is not a state the agent enters.
  */
-bool vOTAProcessMessage( void * pvIncomingPublishCallbackContext,
-                         MQTTPublishInfo_t * pxPublishInfo );
+BaseType_t xWaitForOTACodeSigningDemoState( OtaState_t xState,
+                                            TickType_t xTicksToWait );
 
 /* *INDENT-OFF* */
     #ifdef __cplusplus
@@ -56,12 +56,6 @@
  */
 #define otademoconfigMAX_STREAM_NAME_SIZE        ( CONFIG_GRI_OTA_DEMO_MAX_STREAM_NAME_SIZE )
 
-/**
- * @brief The delay used in the OTA demo task to periodically output the OTA
- * statistics like number of packets received, dropped, processed and queued per connection.
- */
-#define otademoconfigTASK_DELAY_MS               ( CONFIG_GRI_OTA_DEMO_TASK_DELAY_MS )
-
 /**
  * @brief The maximum time for which OTA demo waits for an MQTT operation to be complete.
  * This involves receiving an acknowledgment for broker for SUBSCRIBE, UNSUBSCRIBE and non
@@ -94,6 +88,120 @@
  */
 #define otademoconfigMAX_NUM_OTA_DATA_BUFFERS    ( CONFIG_GRI_OTA_MAX_NUM_DATA_BUFFERS )
 
+/**
+ * @brief Set to 1 to receive the file blocks as CBOR, written to flash from
+ * the received message, instead of base64 encoded in JSON.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_CBOR_DATA_TYPE
+    #define otademoconfigENABLE_CBOR_DATA_TYPE    ( 1 )
+#else
+    #define otademoconfigENABLE_CBOR_DATA_TYPE    ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_CBOR_DATA_TYPE */
+
+/**
+ * @brief Set to 1 to extract the file blocks from the MQTT receive buffer into
+ * the OTA data buffers, which are then written to flash, instead of copying the
+ * messages for the OTA task to decode.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_ZERO_COPY_BLOCKS
+    #define otademoconfigENABLE_ZERO_COPY_BLOCKS    ( 1 )
+#else
+    #define otademoconfigENABLE_ZERO_COPY_BLOCKS    ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_ZERO_COPY_BLOCKS */
+
+/**
+ * @brief The number of file blocks requested ahead of the last block written
+ * in order. Each block in flight needs an OTA data buffer, so the window is
+ * bounded by the number of buffers as well as by the number of blocks the
+ * streams service accepts in one request.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_BLOCK_WINDOW
+    #define otademoconfigBLOCK_WINDOW_SIZE    ( ( CONFIG_MAX_NUM_BLOCKS_REQUEST < otademoconfigMAX_NUM_OTA_DATA_BUFFERS ) ? CONFIG_MAX_NUM_BLOCKS_REQUEST : otademoconfigMAX_NUM_OTA_DATA_BUFFERS )
+#else
+    #define otademoconfigBLOCK_WINDOW_SIZE    ( 1U )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_BLOCK_WINDOW */
+
+/**
+ * @brief Set to 1 to request the missing blocks again after a retransmission
+ * timeout estimated from the round trip time of the block requests, with
+ * exponential backoff, instead of after the OTA event queue timeout.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_RETRANSMIT_TIMER
+    #define otademoconfigENABLE_RETRANSMIT_TIMER      ( 1 )
+    #define otademoconfigRETRANSMIT_MIN_TIMEOUT_MS    ( CONFIG_GRI_OTA_DEMO_RETRANSMIT_MIN_TIMEOUT_MS )
+    #define otademoconfigRETRANSMIT_MAX_TIMEOUT_MS    ( CONFIG_GRI_OTA_DEMO_RETRANSMIT_MAX_TIMEOUT_MS )
+#else
+    #define otademoconfigENABLE_RETRANSMIT_TIMER      ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_RETRANSMIT_TIMER */
+
+/**
+ * @brief Set to 1 to adapt the number of blocks in flight, up to
+ * otademoconfigBLOCK_WINDOW_SIZE, to the losses and round trip time of the
+ * block requests and to the free heap.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_ADAPTIVE_WINDOW
+    #define otademoconfigENABLE_ADAPTIVE_WINDOW           ( 1 )
+    #define otademoconfigADAPTIVE_WINDOW_MIN_FREE_HEAP    ( CONFIG_GRI_OTA_DEMO_ADAPTIVE_WINDOW_MIN_FREE_HEAP )
+#else
+    #define otademoconfigENABLE_ADAPTIVE_WINDOW           ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_ADAPTIVE_WINDOW */
+
+/**
+ * @brief Set to 1 to write the file blocks to flash from a separate task, fed
+ * through a queue of the OTA data buffers holding the blocks.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_FLASH_WRITER_TASK
+    #define otademoconfigENABLE_FLASH_WRITER_TASK        ( 1 )
+    #define otademoconfigFLASH_WRITER_TASK_PRIORITY      ( CONFIG_GRI_OTA_DEMO_FLASH_WRITER_TASK_PRIORITY )
+    #define otademoconfigFLASH_WRITER_TASK_STACK_SIZE    ( CONFIG_GRI_OTA_DEMO_FLASH_WRITER_TASK_STACK_SIZE )
+#else
+    #define otademoconfigENABLE_FLASH_WRITER_TASK        ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_FLASH_WRITER_TASK */
+
+/**
+ * @brief Set to 1 to hash the image as it is downloaded, and check the image
+ * signature against that hash before the file is closed.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_IMAGE_HASH
+    #define otademoconfigENABLE_IMAGE_HASH    ( 1 )
+#else
+    #define otademoconfigENABLE_IMAGE_HASH    ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_IMAGE_HASH */
+
+/**
+ * @brief Set to 1 to apply the downloaded file as a patch of the running image,
+ * writing the reconstructed image to the passive partition.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_DELTA_UPDATES
+    #define otademoconfigENABLE_DELTA_UPDATES    ( 1 )
+#else
+    #define otademoconfigENABLE_DELTA_UPDATES    ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_DELTA_UPDATES */
+
+/**
+ * @brief Set to 1 to decompress the downloaded file, a zlib stream, into the
+ * passive partition, with a window of 2^otademoconfigDECOMPRESSION_WINDOW_BITS
+ * bytes.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_COMPRESSED_IMAGES
+    #define otademoconfigENABLE_COMPRESSED_IMAGES     ( 1 )
+    #define otademoconfigDECOMPRESSION_WINDOW_BITS    ( CONFIG_GRI_OTA_DEMO_DECOMPRESSION_WINDOW_BITS )
+#else
+    #define otademoconfigENABLE_COMPRESSED_IMAGES     ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_COMPRESSED_IMAGES */
+
+/**
+ * @brief Set to 1 to persist the progress of a download in NVS every
+ * otademoconfigCHECKPOINT_INTERVAL_BLOCKS blocks, so that a download of the
+ * same job continues after a restart.
+ */
+#if CONFIG_GRI_OTA_DEMO_ENABLE_RESUME
+    #define otademoconfigENABLE_RESUME                 ( 1 )
+    #define otademoconfigCHECKPOINT_INTERVAL_BLOCKS    ( CONFIG_GRI_OTA_DEMO_CHECKPOINT_INTERVAL_BLOCKS )
+#else
+    #define otademoconfigENABLE_RESUME                 ( 0 )
+#endif /* CONFIG_GRI_OTA_DEMO_ENABLE_RESUME */
+
 /**
  * @brief The version for the firmware which is running. OTA agent uses this
  * version number to perform anti-rollback validation. The firmware version for the
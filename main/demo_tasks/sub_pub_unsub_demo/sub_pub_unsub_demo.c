@@ -26,8 +26,9 @@
 
 /*
  * This file demonstrates numerous tasks all of which use the core-MQTT Agent API
- * to send unique MQTT payloads to unique topics over the same MQTT connection
- * to the same coreMQTT-Agent.
+ * to send unique MQTT payloads over the same MQTT connection to the same
+ * coreMQTT-Agent. Groups of subpubunsubconfigTASKS_PER_TOPIC_FILTER tasks use
+ * the same topic, and share its broker subscription.
  *
  * Each created task is a unique instance of the task implemented by
  * prvSubscribePublishUnsubscribeTask().  prvSubscribePublishUnsubscribeTask()
@@ -78,17 +79,33 @@
 /* Demo task configurations include. */
 #include "sub_pub_unsub_demo_config.h"
 
+#if CONFIG_GRI_ENABLE_OTA_DEMO
+    /* OTA demo include. */
+    #include "ota_over_mqtt_demo.h"
+#endif /* CONFIG_GRI_ENABLE_OTA_DEMO */
+
 /* Preprocessor definitions ***************************************************/
 
 /* coreMQTT-Agent event group bit definitions */
-#define CORE_MQTT_AGENT_CONNECTED_BIT              ( 1 << 0 )
-#define CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT    ( 1 << 1 )
+#define CORE_MQTT_AGENT_CONNECTED_BIT    ( 1 << 0 )
 
 /* MQTT event group bit definitions. */
 #define MQTT_INCOMING_PUBLISH_RECEIVED_BIT         ( 1 << 0 )
 #define MQTT_PUBLISH_COMMAND_COMPLETED_BIT         ( 1 << 1 )
 #define MQTT_SUBSCRIBE_COMMAND_COMPLETED_BIT       ( 1 << 2 )
 #define MQTT_UNSUBSCRIBE_COMMAND_COMPLETED_BIT     ( 1 << 3 )
+#define MQTT_SHARED_SUBSCRIPTION_COMPLETED_BIT     ( 1 << 4 )
+
+/* Delay before adding a subscription again to a topic filter the broker is
+ * unsubscribing from. */
+#define SHARED_SUBSCRIPTION_RETRY_DELAY_MS         ( 100U )
+
+/* Format of the start of the payload published by a task, from its task
+ * number. */
+#define PAYLOAD_TASK_NUMBER_FORMAT                 "%u:"
+
+/* Buffer length for PAYLOAD_TASK_NUMBER_FORMAT. */
+#define PAYLOAD_TASK_NUMBER_LENGTH                 ( 12U )
 
 /* Struct definitions *********************************************************/
 
@@ -99,6 +116,7 @@
 typedef struct IncomingPublishCallbackContext
 {
     EventGroupHandle_t xMqttEventGroup;
+    uint32_t ulTaskNumber;
     char pcIncomingPublish[ subpubunsubconfigSTRING_BUFFER_LENGTH ];
 } IncomingPublishCallbackContext_t;
 
@@ -112,6 +130,10 @@ struct MQTTAgentCommandContext
     EventGroupHandle_t xMqttEventGroup;
     IncomingPublishCallbackContext_t * pxIncomingPublishCallbackContext;
     void * pArgs;
+    bool xSharedSubscription;
+    bool xUnsubscribePending;
+    char * pcBrokerTopicFilter;
+    char * pcLocalTopicFilter;
 };
 
 /**
@@ -190,6 +212,47 @@ static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandCo
 static void prvUnsubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
                                            MQTTAgentReturnInfo_t * pxReturnInfo );
 
+/**
+ * @brief Passed into MQTTAgent_ProcessLoop() to add a subscription to a topic
+ * filter the broker is already subscribed to, from the coreMQTT-Agent task.
+ * Sets xSharedSubscription of the command context if it was added, in which
+ * case no SUBSCRIBE needs to be sent, and xUnsubscribePending if the broker is
+ * still unsubscribing from the topic filter.
+ *
+ * @param[in] pxCommandContext Context of the initial command.
+ * @param[in].xReturnStatus The result of the command.
+ */
+static void prvAddSharedSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                     MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Passed into MQTTAgent_ProcessLoop() to remove the subscription of the
+ * task from the coreMQTT-Agent task. Sets xSharedSubscription of the command
+ * context if other subscriptions to the topic filter remain, in which case no
+ * UNSUBSCRIBE needs to be sent.
+ *
+ * @param[in] pxCommandContext Context of the initial command.
+ * @param[in].xReturnStatus The result of the command.
+ */
+static void prvRemoveSharedSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                        MQTTAgentReturnInfo_t * pxReturnInfo );
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+
+/**
+ * @brief Passed into MQTTAgent_ProcessLoop() to move a topic filter with a
+ * broker subscription of its own under the covering filter the task just
+ * subscribed to. Sets xSharedSubscription of the command context if a topic
+ * filter was moved, in which case its own broker subscription is left unused
+ * and the task unsubscribes from it.
+ *
+ * @param[in] pxCommandContext Context of the initial command.
+ * @param[in].xReturnStatus The result of the command.
+ */
+    static void prvAbsorbAggregatedFilterCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                          MQTTAgentReturnInfo_t * pxReturnInfo );
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
 /**
  * @brief Passed into MQTTAgent_Publish() as the callback to execute when the
  * broker ACKs the PUBLISH message.  Its implementation sends a notification
@@ -226,7 +289,8 @@ static EventBits_t prvWaitForEvent( EventGroupHandle_t xMqttEventGroup,
  * @brief Passed into MQTTAgent_Subscribe() as the callback to execute when
  * there is an incoming publish on the topic being subscribed to.  Its
  * implementation just logs information about the incoming publish including
- * the publish messages source topic and payload.
+ * the publish messages source topic and payload. Publishes from the other
+ * tasks sharing the topic are ignored.
  *
  * See https://freertos.org/mqtt/mqtt-agent-demo.html#example_mqtt_api_call
  *
@@ -247,13 +311,44 @@ static void prvIncomingPublishCallback( void * pvIncomingPublishCallbackContext,
  * for all MQTT brokers.  Can also be QoS2 if supported by the broker.  AWS IoT
  * does not support QoS2.
  * @param[in] pcTopicFilter Topic filter to subscribe to.
+ * @param[in] pcLocalTopicFilter Topic filter of the task when pcTopicFilter is
+ * a covering filter chosen by getAggregateFilter(), NULL otherwise.
  * @param[in] xMqttEventGroup Event group used for MQTT events.
  */
 static void prvSubscribeToTopic( IncomingPublishCallbackContext_t * pxIncomingPublishCallbackContext,
                                  MQTTQoS_t xQoS,
                                  char * pcTopicFilter,
+                                 char * pcLocalTopicFilter,
                                  EventGroupHandle_t xMqttEventGroup );
 
+/**
+ * @brief Add or remove the subscription of the task to a topic filter shared
+ * with other local subscribers, without a broker round trip.
+ *
+ * The update runs in pxCommandCallback, from the coreMQTT-Agent task like the
+ * other updates to the subscription list. It is retried while the broker
+ * unsubscribes from the topic filter, as a SUBSCRIBE sent before the UNSUBACK
+ * could be undone.
+ *
+ * @param[in] pxIncomingPublishCallbackContext The callback context used when
+ * data is received from pcTopicFilter.
+ * @param[in] pcTopicFilter Topic filter of the subscription.
+ * @param[in] xMqttEventGroup Event group used for MQTT events.
+ * @param[in] pxCommandCallback prvAddSharedSubscriptionCommandCallback or
+ * prvRemoveSharedSubscriptionCommandCallback.
+ * @param[out] pcBrokerTopicFilter Buffer of subpubunsubconfigSTRING_BUFFER_LENGTH
+ * bytes receiving the topic filter to send a SUBSCRIBE or an UNSUBSCRIBE for.
+ * This is pcTopicFilter, unless a covering filter is used instead.
+ *
+ * @return `true` if the broker subscription is shared, so the task does not
+ * need to send a SUBSCRIBE or an UNSUBSCRIBE.
+ */
+static bool prvUpdateSharedSubscription( IncomingPublishCallbackContext_t * pxIncomingPublishCallbackContext,
+                                         char * pcTopicFilter,
+                                         EventGroupHandle_t xMqttEventGroup,
+                                         MQTTAgentCommandCallback_t pxCommandCallback,
+                                         char * pcBrokerTopicFilter );
+
 /**
  * @brief Unsubscribe to the topic the demo task will also publish to.
  *
@@ -302,18 +397,13 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
 
         case CORE_MQTT_AGENT_OTA_STARTED_EVENT:
             ESP_LOGI( TAG,
-                      "OTA started. Preventing coreMQTT-Agent commands from "
-                      "being enqueued." );
-            xEventGroupClearBits( xNetworkEventGroup,
-                                  CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT );
+                      "OTA started. Sharing the link with the OTA download." );
             break;
 
         case CORE_MQTT_AGENT_OTA_STOPPED_EVENT:
             ESP_LOGI( TAG,
-                      "OTA stopped. No longer preventing coreMQTT-Agent "
-                      "commands from being enqueued." );
-            xEventGroupSetBits( xNetworkEventGroup,
-                                CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT );
+                      "OTA stopped. No longer sharing the link with the OTA "
+                      "download." );
             break;
 
         default:
@@ -351,13 +441,31 @@ static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandCo
     /* Check if the subscribe operation is a success. */
     if( pxReturnInfo->returnCode == MQTTSuccess )
     {
-        /* Add subscription so that incoming publishes are routed to the application
-         * callback. */
-        xSubscriptionAdded = addSubscription( ( SubscriptionElement_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
-                                              pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
-                                              pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
-                                              prvIncomingPublishCallback,
-                                              ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ) );
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+            if( pxCommandContext->pcLocalTopicFilter != NULL )
+            {
+                /* The broker subscribed to a covering filter, the task
+                 * receives its own topic through it. */
+                xSubscriptionAdded = addAggregate( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                                   pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                                   pxSubscribeArgs->pSubscribeInfo->topicFilterLength ) &&
+                                     addAggregatedSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                                                pxCommandContext->pcLocalTopicFilter,
+                                                                ( uint16_t ) strlen( pxCommandContext->pcLocalTopicFilter ),
+                                                                prvIncomingPublishCallback,
+                                                                ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ) );
+            }
+            else
+        #endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+        {
+            /* Add subscription so that incoming publishes are routed to the application
+             * callback. */
+            xSubscriptionAdded = addSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                                  pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                                  pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                                  prvIncomingPublishCallback,
+                                                  ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ) );
+        }
 
         if( xSubscriptionAdded == false )
         {
@@ -384,13 +492,13 @@ static void prvUnsubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommand
      * initiated the subscribe can check the operation's status. */
     pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
 
-    /* Check if the unsubscribe operation is a success. */
+    /* prvRemoveSharedSubscriptionCommandCallback kept the subscription of the
+     * last subscriber to this topic filter until the broker unsubscribed. */
     if( pxReturnInfo->returnCode == MQTTSuccess )
     {
-        /* Remove subscription from subscription manager. */
-        removeSubscription( ( SubscriptionElement_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
-                            pxUnsubscribeArgs->pSubscribeInfo->pTopicFilter,
-                            pxUnsubscribeArgs->pSubscribeInfo->topicFilterLength );
+        completeSharedUnsubscribe( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                   pxUnsubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                   pxUnsubscribeArgs->pSubscribeInfo->topicFilterLength );
     }
 
     if( pxCommandContext->xMqttEventGroup != NULL )
@@ -400,6 +508,166 @@ static void prvUnsubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommand
     }
 }
 
+static void prvAddSharedSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                     MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    MQTTAgentSubscribeArgs_t * pxSubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) pxCommandContext->pArgs;
+    SubscriptionManagerStats_t xStats = { 0 };
+    SharedSubscriptionStatus_t xStatus;
+
+    pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
+
+    xStatus = addSharedSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                     pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                     pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                     prvIncomingPublishCallback,
+                                     ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ) );
+
+    pxCommandContext->xSharedSubscription = ( xStatus == SharedSubscriptionAdded );
+    pxCommandContext->xUnsubscribePending = ( xStatus == SharedSubscriptionUnsubscribing );
+
+    if( pxCommandContext->xSharedSubscription == true )
+    {
+        getSubscriptionManagerStats( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                     &xStats );
+        ESP_LOGI( TAG,
+                  "Sharing the broker subscription to %.*s. SUBSCRIBE round trips avoided: %" PRIu32 ".",
+                  pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                  pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                  xStats.ulBrokerSubscribesAvoided );
+    }
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+        else if( pxCommandContext->xUnsubscribePending == false )
+        {
+            uint16_t usLength = 0U;
+
+            pxCommandContext->xSharedSubscription = addAggregatedSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                                                               pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                                                               pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                                                               prvIncomingPublishCallback,
+                                                                               ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ) );
+
+            if( pxCommandContext->xSharedSubscription == true )
+            {
+                getSubscriptionManagerStats( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                             &xStats );
+                ESP_LOGI( TAG,
+                          "Receiving %.*s through a covering filter. Broker subscriptions saved: %u, publishes matching no subscription: %" PRIu32 ".",
+                          pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                          pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                          ( unsigned int ) xStats.xBrokerSubscriptionsSaved,
+                          xStats.ulAggregateOvermatches );
+            }
+            else
+            {
+                /* Leave room for the terminating NUL. */
+                usLength = getAggregateFilter( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                               pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                               pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                               pxCommandContext->pcBrokerTopicFilter,
+                                               subpubunsubconfigSTRING_BUFFER_LENGTH - 1U );
+
+                if( usLength > 0U )
+                {
+                    pxCommandContext->pcBrokerTopicFilter[ usLength ] = '\0';
+                }
+            }
+        }
+    #endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
+    xEventGroupSetBits( pxCommandContext->xMqttEventGroup,
+                        MQTT_SHARED_SUBSCRIPTION_COMPLETED_BIT );
+}
+
+static void prvRemoveSharedSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                        MQTTAgentReturnInfo_t * pxReturnInfo )
+{
+    MQTTAgentSubscribeArgs_t * pxUnsubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) pxCommandContext->pArgs;
+    SubscriptionManagerStats_t xStats = { 0 };
+
+    pxCommandContext->xReturnStatus = pxReturnInfo->returnCode;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+    {
+        /* Leave room for the terminating NUL. */
+        uint16_t usLength = removeAggregatedSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                                          pxUnsubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                                          pxUnsubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                                          prvIncomingPublishCallback,
+                                                          ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ),
+                                                          pxCommandContext->pcBrokerTopicFilter,
+                                                          subpubunsubconfigSTRING_BUFFER_LENGTH - 1U );
+
+        pxCommandContext->xSharedSubscription = ( usLength == 0U );
+        pxCommandContext->pcBrokerTopicFilter[ usLength ] = '\0';
+    }
+    #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 ) */
+        pxCommandContext->xSharedSubscription = removeSharedSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                                                          pxUnsubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                                                          pxUnsubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                                                          prvIncomingPublishCallback,
+                                                                          ( void * ) ( pxCommandContext->pxIncomingPublishCallbackContext ) );
+    #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 ) */
+
+    if( pxCommandContext->xSharedSubscription == true )
+    {
+        getSubscriptionManagerStats( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                     &xStats );
+        ESP_LOGI( TAG,
+                  "Other subscribers remain for %.*s. UNSUBSCRIBE round trips avoided: %" PRIu32 ".",
+                  pxUnsubscribeArgs->pSubscribeInfo->topicFilterLength,
+                  pxUnsubscribeArgs->pSubscribeInfo->pTopicFilter,
+                  xStats.ulBrokerUnsubscribesAvoided );
+    }
+
+    xEventGroupSetBits( pxCommandContext->xMqttEventGroup,
+                        MQTT_SHARED_SUBSCRIPTION_COMPLETED_BIT );
+}
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+
+    static void prvAbsorbAggregatedFilterCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                          MQTTAgentReturnInfo_t * pxReturnInfo )
+    {
+        MQTTAgentSubscribeArgs_t * pxSubscribeArgs = ( MQTTAgentSubscribeArgs_t * ) pxCommandContext->pArgs;
+        SubscriptionManagerStats_t xStats;
+        uint16_t usLength;
+
+        ( void ) pxReturnInfo;
+
+        /* Leave room for the terminating NUL. */
+        usLength = absorbAggregatedFilter( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                           pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                                           pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                                           pxCommandContext->pcBrokerTopicFilter,
+                                           subpubunsubconfigSTRING_BUFFER_LENGTH - 1U );
+
+        pxCommandContext->xSharedSubscription = ( usLength > 0U );
+        pxCommandContext->pcBrokerTopicFilter[ usLength ] = '\0';
+
+        if( pxCommandContext->xSharedSubscription == true )
+        {
+            getSubscriptionManagerStats( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+                                         &xStats );
+            ESP_LOGI( TAG,
+                      "Receiving %s through %.*s. Broker subscriptions saved: %u, publishes matching no subscription: %" PRIu32 ".",
+                      pxCommandContext->pcBrokerTopicFilter,
+                      pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
+                      pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
+                      ( unsigned int ) xStats.xBrokerSubscriptionsSaved,
+                      xStats.ulAggregateOvermatches );
+        }
+
+        if( pxCommandContext->xMqttEventGroup != NULL )
+        {
+            xEventGroupSetBits( pxCommandContext->xMqttEventGroup,
+                                MQTT_SHARED_SUBSCRIPTION_COMPLETED_BIT );
+        }
+    }
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
 static EventBits_t prvWaitForEvent( EventGroupHandle_t xMqttEventGroup,
                                     EventBits_t uxBitsToWaitFor )
 {
@@ -417,28 +685,39 @@ static void prvIncomingPublishCallback( void * pvIncomingPublishCallbackContext,
                                         MQTTPublishInfo_t * pxPublishInfo )
 {
     IncomingPublishCallbackContext_t * pxIncomingPublishCallbackContext = ( IncomingPublishCallbackContext_t * ) pvIncomingPublishCallbackContext;
-
-    /* Create a message that contains the incoming MQTT payload to the logger,
-     * terminating the string first. */
-    if( pxPublishInfo->payloadLength < subpubunsubconfigSTRING_BUFFER_LENGTH )
+    char cTaskNumber[ PAYLOAD_TASK_NUMBER_LENGTH ];
+    int lTaskNumberLength = snprintf( cTaskNumber,
+                                      sizeof( cTaskNumber ),
+                                      PAYLOAD_TASK_NUMBER_FORMAT,
+                                      ( unsigned int ) pxIncomingPublishCallbackContext->ulTaskNumber );
+
+    /* The tasks of a group share their topic, so each ignores the publishes
+     * of the others. */
+    if( ( pxPublishInfo->payloadLength >= ( size_t ) lTaskNumberLength ) &&
+        ( memcmp( pxPublishInfo->pPayload, cTaskNumber, ( size_t ) lTaskNumberLength ) == 0 ) )
     {
-        memcpy( ( void * ) ( pxIncomingPublishCallbackContext->pcIncomingPublish ),
-                pxPublishInfo->pPayload,
-                pxPublishInfo->payloadLength );
+        /* Create a message that contains the incoming MQTT payload to the logger,
+         * terminating the string first. */
+        if( pxPublishInfo->payloadLength < subpubunsubconfigSTRING_BUFFER_LENGTH )
+        {
+            memcpy( ( void * ) ( pxIncomingPublishCallbackContext->pcIncomingPublish ),
+                    pxPublishInfo->pPayload,
+                    pxPublishInfo->payloadLength );
 
-        ( pxIncomingPublishCallbackContext->pcIncomingPublish )[ pxPublishInfo->payloadLength ] = 0x00;
-    }
-    else
-    {
-        memcpy( ( void * ) ( pxIncomingPublishCallbackContext->pcIncomingPublish ),
-                pxPublishInfo->pPayload,
-                subpubunsubconfigSTRING_BUFFER_LENGTH );
+            ( pxIncomingPublishCallbackContext->pcIncomingPublish )[ pxPublishInfo->payloadLength ] = 0x00;
+        }
+        else
+        {
+            memcpy( ( void * ) ( pxIncomingPublishCallbackContext->pcIncomingPublish ),
+                    pxPublishInfo->pPayload,
+                    subpubunsubconfigSTRING_BUFFER_LENGTH );
 
-        ( pxIncomingPublishCallbackContext->pcIncomingPublish )[ subpubunsubconfigSTRING_BUFFER_LENGTH - 1 ] = 0x00;
-    }
+            ( pxIncomingPublishCallbackContext->pcIncomingPublish )[ subpubunsubconfigSTRING_BUFFER_LENGTH - 1 ] = 0x00;
+        }
 
-    xEventGroupSetBits( pxIncomingPublishCallbackContext->xMqttEventGroup,
-                        MQTT_INCOMING_PUBLISH_RECEIVED_BIT );
+        xEventGroupSetBits( pxIncomingPublishCallbackContext->xMqttEventGroup,
+                            MQTT_INCOMING_PUBLISH_RECEIVED_BIT );
+    }
 }
 
 static void prvPublishToTopic( MQTTQoS_t xQoS,
@@ -450,6 +729,7 @@ static void prvPublishToTopic( MQTTQoS_t xQoS,
 
     MQTTStatus_t xCommandAdded;
     EventBits_t xReceivedEvent = 0;
+    BaseType_t xBandwidthTaken;
 
     MQTTPublishInfo_t xPublishInfo = { 0 };
 
@@ -491,14 +771,18 @@ static void prvPublishToTopic( MQTTQoS_t xQoS,
 
     do
     {
-        /* Wait for coreMQTT-Agent task to have working network connection and
-         * not be performing an OTA update. */
+        /* Wait for coreMQTT-Agent task to have working network connection, and
+         * for this traffic's share of the link during an OTA update. */
         xEventGroupWaitBits( xNetworkEventGroup,
-                             CORE_MQTT_AGENT_CONNECTED_BIT | CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT,
+                             CORE_MQTT_AGENT_CONNECTED_BIT,
                              pdFALSE,
                              pdTRUE,
                              portMAX_DELAY );
 
+        xBandwidthTaken = xCoreMqttAgentManagerWaitForBandwidth( CORE_MQTT_AGENT_TRAFFIC_TELEMETRY,
+                                                                 xPublishInfo.topicNameLength + xPublishInfo.payloadLength,
+                                                                 portMAX_DELAY );
+
         ESP_LOGI( TAG,
                   "Task \"%s\" sending publish request to coreMQTT-Agent with message \"%s\" on topic \"%s\" with ID %" PRIu32 ".",
                   pcTaskGetName( NULL ),
@@ -529,6 +813,11 @@ static void prvPublishToTopic( MQTTQoS_t xQoS,
                       MQTT_Status_strerror( xCommandAdded ) );
         }
 
+        if( xBandwidthTaken == pdPASS )
+        {
+            vCoreMqttAgentManagerReleaseBandwidth( CORE_MQTT_AGENT_TRAFFIC_TELEMETRY );
+        }
+
         /* Check all ways the status was passed back just for demonstration
          * purposes. */
         if( ( ( xReceivedEvent & MQTT_PUBLISH_COMMAND_COMPLETED_BIT ) == 0 ) ||
@@ -552,12 +841,14 @@ static void prvPublishToTopic( MQTTQoS_t xQoS,
 static void prvSubscribeToTopic( IncomingPublishCallbackContext_t * pxIncomingPublishCallbackContext,
                                  MQTTQoS_t xQoS,
                                  char * pcTopicFilter,
+                                 char * pcLocalTopicFilter,
                                  EventGroupHandle_t xMqttEventGroup )
 {
     uint32_t ulSubscribeMessageId;
 
     MQTTStatus_t xCommandAdded;
     EventBits_t xReceivedEvent = 0;
+    BaseType_t xBandwidthTaken;
 
     MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
     MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
@@ -596,6 +887,7 @@ static void prvSubscribeToTopic( IncomingPublishCallbackContext_t * pxIncomingPu
     xCommandContext.xMqttEventGroup = xMqttEventGroup;
     xCommandContext.pxIncomingPublishCallbackContext = pxIncomingPublishCallbackContext;
     xCommandContext.pArgs = ( void * ) &xSubscribeArgs;
+    xCommandContext.pcLocalTopicFilter = pcLocalTopicFilter;
 
     xCommandParams.blockTimeMs = subpubunsubconfigMAX_COMMAND_SEND_BLOCK_TIME_MS;
     xCommandParams.cmdCompleteCallback = prvSubscribeCommandCallback;
@@ -603,14 +895,18 @@ static void prvSubscribeToTopic( IncomingPublishCallbackContext_t * pxIncomingPu
 
     do
     {
-        /* Wait for coreMQTT-Agent task to have working network connection and
-         * not be performing an OTA update. */
+        /* Wait for coreMQTT-Agent task to have working network connection, and
+         * for this traffic's share of the link during an OTA update. */
         xEventGroupWaitBits( xNetworkEventGroup,
-                             CORE_MQTT_AGENT_CONNECTED_BIT | CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT,
+                             CORE_MQTT_AGENT_CONNECTED_BIT,
                              pdFALSE,
                              pdTRUE,
                              portMAX_DELAY );
 
+        xBandwidthTaken = xCoreMqttAgentManagerWaitForBandwidth( CORE_MQTT_AGENT_TRAFFIC_CONTROL,
+                                                                 xSubscribeInfo.topicFilterLength,
+                                                                 portMAX_DELAY );
+
         ESP_LOGI( TAG,
                   "Task \"%s\" sending subscribe request to coreMQTT-Agent for topic filter: %s with id %" PRIu32 "",
                   pcTaskGetName( NULL ),
@@ -635,6 +931,11 @@ static void prvSubscribeToTopic( IncomingPublishCallbackContext_t * pxIncomingPu
                       MQTT_Status_strerror( xCommandAdded ) );
         }
 
+        if( xBandwidthTaken == pdPASS )
+        {
+            vCoreMqttAgentManagerReleaseBandwidth( CORE_MQTT_AGENT_TRAFFIC_CONTROL );
+        }
+
         /* Check all ways the status was passed back just for demonstration
          * purposes. */
         if( ( ( xReceivedEvent & MQTT_SUBSCRIBE_COMMAND_COMPLETED_BIT ) == 0 ) ||
@@ -656,6 +957,79 @@ static void prvSubscribeToTopic( IncomingPublishCallbackContext_t * pxIncomingPu
              ( xCommandContext.xReturnStatus != MQTTSuccess ) );
 }
 
+static bool prvUpdateSharedSubscription( IncomingPublishCallbackContext_t * pxIncomingPublishCallbackContext,
+                                         char * pcTopicFilter,
+                                         EventGroupHandle_t xMqttEventGroup,
+                                         MQTTAgentCommandCallback_t pxCommandCallback,
+                                         char * pcBrokerTopicFilter )
+{
+    MQTTStatus_t xCommandAdded;
+
+    MQTTAgentSubscribeArgs_t xSubscribeArgs = { 0 };
+    MQTTSubscribeInfo_t xSubscribeInfo = { 0 };
+
+    MQTTAgentCommandContext_t xCommandContext = { 0 };
+    MQTTAgentCommandInfo_t xCommandParams = { 0 };
+
+    xSubscribeInfo.pTopicFilter = pcTopicFilter;
+    xSubscribeInfo.topicFilterLength = ( uint16_t ) strlen( pcTopicFilter );
+
+    xSubscribeArgs.pSubscribeInfo = &xSubscribeInfo;
+    xSubscribeArgs.numSubscriptions = 1;
+
+    xCommandContext.xMqttEventGroup = xMqttEventGroup;
+    xCommandContext.pxIncomingPublishCallbackContext = pxIncomingPublishCallbackContext;
+    xCommandContext.pArgs = ( void * ) &xSubscribeArgs;
+    xCommandContext.pcBrokerTopicFilter = pcBrokerTopicFilter;
+
+    /* The broker subscription is to the topic filter itself unless the
+     * callback picks a covering filter. */
+    strncpy( pcBrokerTopicFilter, pcTopicFilter, subpubunsubconfigSTRING_BUFFER_LENGTH - 1U );
+    pcBrokerTopicFilter[ subpubunsubconfigSTRING_BUFFER_LENGTH - 1U ] = '\0';
+
+    xCommandParams.blockTimeMs = subpubunsubconfigMAX_COMMAND_SEND_BLOCK_TIME_MS;
+    xCommandParams.cmdCompleteCallback = pxCommandCallback;
+    xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xCommandContext;
+
+    do
+    {
+        if( xCommandContext.xUnsubscribePending == true )
+        {
+            ESP_LOGI( TAG,
+                      "Waiting for the broker to unsubscribe from %s before subscribing again.",
+                      pcTopicFilter );
+            xCommandContext.xUnsubscribePending = false;
+            vTaskDelay( pdMS_TO_TICKS( SHARED_SUBSCRIPTION_RETRY_DELAY_MS ) );
+        }
+
+        /* Wait for coreMQTT-Agent task to have working network connection. */
+        xEventGroupWaitBits( xNetworkEventGroup,
+                             CORE_MQTT_AGENT_CONNECTED_BIT,
+                             pdFALSE,
+                             pdTRUE,
+                             portMAX_DELAY );
+
+        /* A process loop command sends nothing to the broker. It is only used to
+         * run the callback from the coreMQTT-Agent task. */
+        xCommandAdded = MQTTAgent_ProcessLoop( &xGlobalMqttAgentContext,
+                                               &xCommandParams );
+
+        if( xCommandAdded == MQTTSuccess )
+        {
+            prvWaitForEvent( xMqttEventGroup,
+                             MQTT_SHARED_SUBSCRIPTION_COMPLETED_BIT );
+        }
+        else
+        {
+            ESP_LOGE( TAG,
+                      "Failed to enqueue process loop command. Error code=%s",
+                      MQTT_Status_strerror( xCommandAdded ) );
+        }
+    } while( xCommandContext.xUnsubscribePending == true );
+
+    return xCommandContext.xSharedSubscription;
+}
+
 static void prvUnsubscribeToTopic( MQTTQoS_t xQoS,
                                    char * pcTopicFilter,
                                    EventGroupHandle_t xMqttEventGroup )
@@ -664,6 +1038,7 @@ static void prvUnsubscribeToTopic( MQTTQoS_t xQoS,
 
     MQTTStatus_t xCommandAdded;
     EventBits_t xReceivedEvent = 0;
+    BaseType_t xBandwidthTaken;
 
     MQTTAgentSubscribeArgs_t xUnsubscribeArgs = { 0 };
     MQTTSubscribeInfo_t xUnsubscribeInfo = { 0 };
@@ -708,13 +1083,18 @@ static void prvUnsubscribeToTopic( MQTTQoS_t xQoS,
 
     do
     {
-        /* Wait for coreMQTT-Agent task to have working network connection and
-         * not be performing an OTA update. */
+        /* Wait for coreMQTT-Agent task to have working network connection, and
+         * for this traffic's share of the link during an OTA update. */
         xEventGroupWaitBits( xNetworkEventGroup,
-                             CORE_MQTT_AGENT_CONNECTED_BIT | CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT,
+                             CORE_MQTT_AGENT_CONNECTED_BIT,
                              pdFALSE,
                              pdTRUE,
                              portMAX_DELAY );
+
+        xBandwidthTaken = xCoreMqttAgentManagerWaitForBandwidth( CORE_MQTT_AGENT_TRAFFIC_CONTROL,
+                                                                 xUnsubscribeInfo.topicFilterLength,
+                                                                 portMAX_DELAY );
+
         ESP_LOGI( TAG,
                   "Task \"%s\" sending unsubscribe request to coreMQTT-Agent for topic filter: %s with id %" PRIu32 "",
                   pcTaskGetName( NULL ),
@@ -739,6 +1119,11 @@ static void prvUnsubscribeToTopic( MQTTQoS_t xQoS,
                       MQTT_Status_strerror( xCommandAdded ) );
         }
 
+        if( xBandwidthTaken == pdPASS )
+        {
+            vCoreMqttAgentManagerReleaseBandwidth( CORE_MQTT_AGENT_TRAFFIC_CONTROL );
+        }
+
         /* Check all ways the status was passed back just for demonstration
          * purposes. */
         if( ( ( xReceivedEvent & MQTT_UNSUBSCRIBE_COMMAND_COMPLETED_BIT ) == 0 ) ||
@@ -771,31 +1156,84 @@ static void prvSubscribePublishUnsubscribeTask( void * pvParameters )
     MQTTQoS_t xQoS;
     char * pcTopicBuffer = topicBuf[ ulTaskNumber ];
     char pcPayload[ subpubunsubconfigSTRING_BUFFER_LENGTH ];
+    char cBrokerTopicFilter[ subpubunsubconfigSTRING_BUFFER_LENGTH ];
 
     xMqttEventGroup = xEventGroupCreate();
     xIncomingPublishCallbackContext.xMqttEventGroup = xMqttEventGroup;
+    xIncomingPublishCallbackContext.ulTaskNumber = ulTaskNumber;
 
     xQoS = ( MQTTQoS_t ) subpubunsubconfigQOS_LEVEL;
 
-    /* Create a topic name for this task to publish to. */
+    /* Create a topic name for this task to publish to, shared with the other
+     * tasks of its group. */
     snprintf( pcTopicBuffer,
               subpubunsubconfigSTRING_BUFFER_LENGTH,
-              "/filter/%s",
-              pcTaskGetName( NULL ) );
+              "/filter/SubPubGroup%u",
+              ( unsigned int ) ( ulTaskNumber / subpubunsubconfigTASKS_PER_TOPIC_FILTER ) );
+
+    #if CONFIG_GRI_ENABLE_OTA_DEMO
+        /* Let the OTA demo check for a pending job before loading the link,
+         * but do not wait for a job which is found to be downloaded. */
+        if( xWaitForOTACodeSigningDemoState( OtaAgentStateWaitingForJob,
+                                             pdMS_TO_TICKS( subpubunsubconfigOTA_JOB_CHECK_WAIT_MS ) ) != pdPASS )
+        {
+            ESP_LOGI( TAG, "OTA job check not done for task \"%s\", starting anyway.",
+                      pcTaskGetName( NULL ) );
+        }
+    #endif /* CONFIG_GRI_ENABLE_OTA_DEMO */
 
     while( 1 )
     {
         /* Subscribe to the same topic to which this task will publish.  That will
          * result in each published message being published from the server back to
-         * the target. */
-        prvSubscribeToTopic( &xIncomingPublishCallbackContext,
-                             xQoS,
-                             pcTopicBuffer,
-                             xMqttEventGroup );
+         * the target. Only subscribe at the broker if no other local subscriber
+         * already did. */
+        if( prvUpdateSharedSubscription( &xIncomingPublishCallbackContext,
+                                         pcTopicBuffer,
+                                         xMqttEventGroup,
+                                         prvAddSharedSubscriptionCommandCallback,
+                                         cBrokerTopicFilter ) == false )
+        {
+            if( strcmp( cBrokerTopicFilter, pcTopicBuffer ) == 0 )
+            {
+                prvSubscribeToTopic( &xIncomingPublishCallbackContext,
+                                     xQoS,
+                                     pcTopicBuffer,
+                                     NULL,
+                                     xMqttEventGroup );
+            }
+
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+                else
+                {
+                    char cAbsorbedTopicFilter[ subpubunsubconfigSTRING_BUFFER_LENGTH ];
+
+                    /* Subscribe to the covering filter instead, then drop the
+                     * broker subscriptions of the sibling topic filters it
+                     * now receives. Until they are dropped, their publishes
+                     * arrive twice. */
+                    prvSubscribeToTopic( &xIncomingPublishCallbackContext,
+                                         xQoS,
+                                         cBrokerTopicFilter,
+                                         pcTopicBuffer,
+                                         xMqttEventGroup );
+
+                    while( prvUpdateSharedSubscription( &xIncomingPublishCallbackContext,
+                                                        cBrokerTopicFilter,
+                                                        xMqttEventGroup,
+                                                        prvAbsorbAggregatedFilterCommandCallback,
+                                                        cAbsorbedTopicFilter ) == true )
+                    {
+                        prvUnsubscribeToTopic( xQoS, cAbsorbedTopicFilter, xMqttEventGroup );
+                    }
+                }
+            #endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+        }
 
         snprintf( pcPayload,
                   subpubunsubconfigSTRING_BUFFER_LENGTH,
-                  "%s",
+                  PAYLOAD_TASK_NUMBER_FORMAT "%s",
+                  ( unsigned int ) ulTaskNumber,
                   pcTaskGetName( NULL ) );
 
         prvPublishToTopic( xQoS,
@@ -810,7 +1248,16 @@ static void prvSubscribePublishUnsubscribeTask( void * pvParameters )
                   pcTaskGetName( NULL ),
                   xIncomingPublishCallbackContext.pcIncomingPublish );
 
-        prvUnsubscribeToTopic( xQoS, pcTopicBuffer, xMqttEventGroup );
+        /* Only unsubscribe at the broker if this task was the last local
+         * subscriber. */
+        if( prvUpdateSharedSubscription( &xIncomingPublishCallbackContext,
+                                         pcTopicBuffer,
+                                         xMqttEventGroup,
+                                         prvRemoveSharedSubscriptionCommandCallback,
+                                         cBrokerTopicFilter ) == false )
+        {
+            prvUnsubscribeToTopic( xQoS, cBrokerTopicFilter, xMqttEventGroup );
+        }
 
         ESP_LOGI( TAG,
                   "Task \"%s\" completed a loop. Delaying before next loop.",
@@ -835,13 +1282,9 @@ void vStartSubscribePublishUnsubscribeDemo( void )
     xNetworkEventGroup = xEventGroupCreate();
     xCoreMqttAgentManagerRegisterHandler( prvCoreMqttAgentEventHandler );
 
-    /* Initialize the coreMQTT-Agent event group. */
-    xEventGroupSetBits( xNetworkEventGroup,
-                        CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT );
-
     /* Each instance of prvSubscribePublishUnsubscribeTask() generates a unique
-     * name and topic filter for itself from the number passed in as the task
-     * parameter. */
+     * name, and the topic filter of its group, from the number passed in as the
+     * task parameter. */
     /* Create a few instances of prvSubscribePublishUnsubscribeTask(). */
     for( ulTaskNumber = 0; ulTaskNumber < subpubunsubconfigNUM_TASKS_TO_CREATE; ulTaskNumber++ )
     {
@@ -71,6 +71,12 @@
  */
 #define subpubunsubconfigNUM_TASKS_TO_CREATE                     ( ( unsigned long ) ( CONFIG_GRI_SUB_PUB_UNSUB_DEMO_NUM_TASKS_TO_CREATE ) )
 
+/**
+ * @brief The number of consecutive SubPubUnsub tasks subscribing to the same
+ * topic filter.
+ */
+#define subpubunsubconfigTASKS_PER_TOPIC_FILTER                  ( ( unsigned long ) ( CONFIG_GRI_SUB_PUB_UNSUB_DEMO_TASKS_PER_TOPIC_FILTER ) )
+
 /**
  * @brief The task priority of each of the SubPubUnsub tasks.
  */
@@ -81,6 +87,15 @@
  */
 #define subpubunsubconfigTASK_STACK_SIZE                         ( ( unsigned int ) ( CONFIG_GRI_SUB_PUB_UNSUB_DEMO_TASK_STACK_SIZE ) )
 
+#if CONFIG_GRI_ENABLE_OTA_DEMO
+
+/**
+ * @brief The maximum amount of time in milliseconds each SubPubUnsub task
+ * waits at startup for the OTA demo to find no pending job.
+ */
+    #define subpubunsubconfigOTA_JOB_CHECK_WAIT_MS               ( ( unsigned int ) ( CONFIG_GRI_SUB_PUB_UNSUB_DEMO_OTA_JOB_CHECK_WAIT_MS ) )
+#endif /* CONFIG_GRI_ENABLE_OTA_DEMO */
+
 /* *INDENT-OFF* */
     #ifdef __cplusplus
         } /* extern "C" */
@@ -0,0 +1,581 @@
+/*
+ * ESP32-C3 Featured FreeRTOS IoT Integration V202204.00
+ * Copyright (C) 2022 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * https://www.FreeRTOS.org
+ * https://github.com/FreeRTOS
+ *
+ */
+
+/*
+ * This file measures the time the subscription manager takes to dispatch
+ * incoming publishes to their subscriptions, against the linear scan calling
+ * MQTT_MatchTopic() on every subscription which it replaces.
+ *
+ * prvSubscriptionManagerBenchmarkTask() fills a subscription list of its own
+ * with topic filters shaped like those of a device using AWS IoT shadows, jobs,
+ * OTA streams and per-sensor commands, then dispatches a mix of incoming
+ * publishes through handleIncomingPublishes() and through the linear scan, and
+ * logs the time each took. The list takes its blocks from the subscription pool
+ * shared with the coreMQTT-Agent manager, so vRunSubscriptionManagerBenchmark()
+ * only returns once the benchmark has emptied the list, and must be called
+ * before the manager is started.
+ *
+ * With precompiled topic filters, it then times matchSubscriptionFilter()
+ * against MQTT_MatchTopic() on one topic filter of each shape, for a topic
+ * matching it and a topic that does not.
+ */
+
+/* Includes *******************************************************************/
+
+/* Standard includes. */
+#include <string.h>
+#include <stdio.h>
+
+/* FreeRTOS includes. */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* ESP-IDF includes. */
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+/* coreMQTT library include. */
+#include "core_mqtt.h"
+
+/* Subscription manager include. */
+#include "subscription_manager.h"
+
+/* Public functions include. */
+#include "subscription_manager_benchmark.h"
+
+/* Benchmark configurations include. */
+#include "subscription_manager_benchmark_config.h"
+
+/* Preprocessor definitions ***************************************************/
+
+/**
+ * @brief Length of the buffer holding a generated topic filter.
+ */
+#define submgrbenchFILTER_BUFFER_LENGTH    ( 64U )
+
+/**
+ * @brief Number of elements of an array.
+ */
+#define submgrbenchARRAY_LENGTH( x )       ( sizeof( x ) / sizeof( ( x )[ 0 ] ) )
+
+/* Struct definitions *********************************************************/
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+/**
+ * @brief A topic filter shape timed by the matcher microbenchmark.
+ */
+    typedef struct BenchmarkShape
+    {
+        const char * pcName;
+        const char * pcFilter;
+        const char * pcMatchingTopic;
+        const char * pcOtherTopic;
+    } BenchmarkShape_t;
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+/* Global variables ***********************************************************/
+
+/**
+ * @brief Logging tag for ESP-IDF logging functions.
+ */
+static const char * TAG = "sub_mgr_benchmark";
+
+/**
+ * @brief Topic filters subscribed to by the benchmark, before the per-sensor
+ * command topic filters which fill the rest of the list.
+ */
+static const char * const pcBenchmarkFilters[] =
+{
+    "$aws/things/bench/shadow/update/accepted",
+    "$aws/things/bench/shadow/update/rejected",
+    "$aws/things/bench/shadow/update/delta",
+    "$aws/things/bench/shadow/get/accepted",
+    "$aws/things/bench/shadow/get/rejected",
+    "$aws/things/bench/shadow/name/+/update/delta",
+    "$aws/things/bench/jobs/notify-next",
+    "$aws/things/bench/jobs/+/get/accepted",
+    "$aws/things/bench/jobs/+/update/accepted",
+    "$aws/things/bench/streams/+/data/cbor",
+    "$aws/things/bench/streams/+/rejected/cbor",
+    "bench/config/#"
+};
+
+/**
+ * @brief Topics of the incoming publishes dispatched by the benchmark.
+ */
+static const char * const pcBenchmarkTopics[] =
+{
+    "$aws/things/bench/shadow/update/delta",
+    "$aws/things/bench/shadow/name/lights/update/delta",
+    "$aws/things/bench/jobs/notify-next",
+    "$aws/things/bench/jobs/AFR_OTA-1/get/accepted",
+    "$aws/things/bench/streams/AFR_OTA-1/data/cbor",
+    "bench/sensor/3/cmd",
+    "bench/config/telemetry/period",
+    "other/device/telemetry"
+};
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+/**
+ * @brief Topic filter shapes timed by the matcher microbenchmark. The other
+ * topic shares the longest prefix with the filter the shape allows.
+ */
+    static const BenchmarkShape_t xBenchmarkShapes[] =
+    {
+        {
+            "literal shadow topic",
+            "$aws/things/bench/shadow/update/delta",
+            "$aws/things/bench/shadow/update/delta",
+            "$aws/things/bench/shadow/update/documents"
+        },
+        {
+            "named shadow, '+' mid-filter",
+            "$aws/things/bench/shadow/name/+/update/delta",
+            "$aws/things/bench/shadow/name/lights/update/delta",
+            "$aws/things/bench/shadow/name/lights/update/accepted"
+        },
+        {
+            "job ID, '+' mid-filter",
+            "$aws/things/bench/jobs/+/get/accepted",
+            "$aws/things/bench/jobs/AFR_OTA-1/get/accepted",
+            "$aws/things/bench/jobs/AFR_OTA-1/get/rejected"
+        },
+        {
+            "OTA stream, '+' mid-filter",
+            "$aws/things/bench/streams/+/data/cbor",
+            "$aws/things/bench/streams/AFR_OTA-1/data/cbor",
+            "$aws/things/other/streams/AFR_OTA-1/data/cbor"
+        },
+        {
+            "trailing '#'",
+            "bench/config/#",
+            "bench/config/telemetry/period",
+            "bench/sensor/3/cmd"
+        },
+        {
+            "leading '+'",
+            "+/sensor/3/cmd",
+            "bench/sensor/3/cmd",
+            "bench/sensor/4/cmd"
+        },
+        {
+            "first level differs",
+            "bench/sensor/3/cmd",
+            "bench/sensor/3/cmd",
+            "other/sensor/3/cmd"
+        }
+    };
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+/**
+ * @brief The subscription list the benchmark dispatches to.
+ */
+static SubscriptionList_t xBenchmarkSubscriptionList;
+
+/**
+ * @brief Number of times a subscription callback was invoked.
+ */
+static uint32_t ulCallbackInvocations = 0U;
+
+/**
+ * @brief Handle of the task waiting for the benchmark to end.
+ */
+static TaskHandle_t xCallerTask = NULL;
+
+/* Static function declarations ***********************************************/
+
+/**
+ * @brief The subscription callback of every benchmark subscription.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Unused.
+ * @param[in] pxPublishInfo Unused.
+ */
+static void prvBenchmarkCallback( void * pvIncomingPublishCallbackContext,
+                                  MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Fill the benchmark subscription list, until it holds
+ * SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS subscriptions or the pool or filter
+ * arena runs out.
+ *
+ * @return The number of subscriptions added.
+ */
+static size_t prvAddBenchmarkSubscriptions( void );
+
+/**
+ * @brief Remove every subscription from the benchmark subscription list.
+ */
+static void prvRemoveBenchmarkSubscriptions( void );
+
+/**
+ * @brief Dispatch an incoming publish by calling MQTT_MatchTopic() on every
+ * subscription, as the subscription manager did before it was indexed.
+ *
+ * @param[in] pxPublishInfo The incoming publish.
+ */
+static void prvLinearScanDispatch( MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Dispatch every benchmark topic submgrbenchconfigITERATIONS times.
+ *
+ * @param[in] xLinearScan Dispatch with prvLinearScanDispatch() instead of
+ * handleIncomingPublishes().
+ * @param[out] pulInvocations Subscription callbacks invoked.
+ *
+ * @return The time taken in microseconds.
+ */
+static int64_t prvTimeDispatch( bool xLinearScan,
+                                uint32_t * pulInvocations );
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+/**
+ * @brief Time matchSubscriptionFilter() and MQTT_MatchTopic() on every shape
+ * of xBenchmarkShapes, and log the time per match. The benchmark subscription
+ * list must be empty.
+ */
+    static void prvTimeMatchers( void );
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+/**
+ * @brief The task which runs the benchmark once, notifies xCallerTask and
+ * deletes itself.
+ *
+ * @param[in] pvParameters Unused.
+ */
+static void prvSubscriptionManagerBenchmarkTask( void * pvParameters );
+
+/* Static function definitions ************************************************/
+
+static void prvBenchmarkCallback( void * pvIncomingPublishCallbackContext,
+                                  MQTTPublishInfo_t * pxPublishInfo )
+{
+    ( void ) pvIncomingPublishCallbackContext;
+    ( void ) pxPublishInfo;
+
+    ulCallbackInvocations++;
+}
+
+static size_t prvAddBenchmarkSubscriptions( void )
+{
+    char cFilter[ submgrbenchFILTER_BUFFER_LENGTH ];
+    const char * pcFilter = NULL;
+    size_t xAdded = 0U;
+    bool xListFull = false;
+    int lLength = 0;
+
+    while( ( xListFull == false ) && ( xAdded < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) )
+    {
+        if( xAdded < submgrbenchARRAY_LENGTH( pcBenchmarkFilters ) )
+        {
+            pcFilter = pcBenchmarkFilters[ xAdded ];
+            lLength = ( int ) strlen( pcFilter );
+        }
+        else
+        {
+            lLength = snprintf( cFilter,
+                                sizeof( cFilter ),
+                                "bench/sensor/%u/cmd",
+                                ( unsigned int ) ( xAdded - submgrbenchARRAY_LENGTH( pcBenchmarkFilters ) ) );
+            pcFilter = cFilter;
+        }
+
+        if( addSubscription( &xBenchmarkSubscriptionList,
+                             pcFilter,
+                             ( uint16_t ) lLength,
+                             prvBenchmarkCallback,
+                             NULL ) == true )
+        {
+            xAdded++;
+        }
+        else
+        {
+            xListFull = true;
+        }
+    }
+
+    return xAdded;
+}
+
+static void prvRemoveBenchmarkSubscriptions( void )
+{
+    size_t xIndex = 0U;
+
+    for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+    {
+        removeSubscriptionAtIndex( &xBenchmarkSubscriptionList, xIndex );
+    }
+}
+
+static void prvLinearScanDispatch( MQTTPublishInfo_t * pxPublishInfo )
+{
+    SubscriptionElement_t * pxSubscription = NULL;
+    bool xIsMatch = false;
+    size_t xIndex = 0U;
+
+    for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+    {
+        pxSubscription = getSubscription( &xBenchmarkSubscriptionList, xIndex );
+
+        if( pxSubscription != NULL )
+        {
+            xIsMatch = false;
+            ( void ) MQTT_MatchTopic( pxPublishInfo->pTopicName,
+                                      pxPublishInfo->topicNameLength,
+                                      pxSubscription->pcSubscriptionFilterString,
+                                      pxSubscription->usFilterStringLength,
+                                      &xIsMatch );
+
+            if( xIsMatch == true )
+            {
+                pxSubscription->pxIncomingPublishCallback( pxSubscription->pvIncomingPublishCallbackContext,
+                                                           pxPublishInfo );
+            }
+        }
+    }
+}
+
+static int64_t prvTimeDispatch( bool xLinearScan,
+                                uint32_t * pulInvocations )
+{
+    MQTTPublishInfo_t xPublishInfo[ submgrbenchARRAY_LENGTH( pcBenchmarkTopics ) ];
+    int64_t llStartTimeUs = 0;
+    int64_t llElapsedUs = 0;
+    uint32_t ulIteration = 0U;
+    size_t xTopic = 0U;
+
+    memset( xPublishInfo, 0x00, sizeof( xPublishInfo ) );
+
+    for( xTopic = 0U; xTopic < submgrbenchARRAY_LENGTH( pcBenchmarkTopics ); xTopic++ )
+    {
+        xPublishInfo[ xTopic ].pTopicName = pcBenchmarkTopics[ xTopic ];
+        xPublishInfo[ xTopic ].topicNameLength = ( uint16_t ) strlen( pcBenchmarkTopics[ xTopic ] );
+    }
+
+    ulCallbackInvocations = 0U;
+    llStartTimeUs = esp_timer_get_time();
+
+    for( ulIteration = 0U; ulIteration < submgrbenchconfigITERATIONS; ulIteration++ )
+    {
+        for( xTopic = 0U; xTopic < submgrbenchARRAY_LENGTH( pcBenchmarkTopics ); xTopic++ )
+        {
+            if( xLinearScan == true )
+            {
+                prvLinearScanDispatch( &( xPublishInfo[ xTopic ] ) );
+            }
+            else
+            {
+                ( void ) handleIncomingPublishes( &xBenchmarkSubscriptionList,
+                                                  &( xPublishInfo[ xTopic ] ) );
+            }
+        }
+    }
+
+    llElapsedUs = esp_timer_get_time() - llStartTimeUs;
+    *pulInvocations = ulCallbackInvocations;
+
+    return llElapsedUs;
+}
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+    static void prvTimeMatchers( void )
+    {
+        const BenchmarkShape_t * pxShape = NULL;
+        const SubscriptionElement_t * pxSubscription = NULL;
+        const char * pcTopics[ 2 ];
+        uint16_t usTopicLengths[ 2 ];
+        int64_t llStartTimeUs = 0;
+        int64_t llMatchTopicUs = 0;
+        int64_t llPrecompiledUs = 0;
+        uint32_t ulIteration = 0U;
+        uint32_t ulMatchTopicHits = 0U;
+        uint32_t ulPrecompiledHits = 0U;
+        size_t xShape = 0U, xTopic = 0U;
+        bool xIsMatch = false;
+
+        for( xShape = 0U; xShape < submgrbenchARRAY_LENGTH( xBenchmarkShapes ); xShape++ )
+        {
+            pxShape = &( xBenchmarkShapes[ xShape ] );
+            pcTopics[ 0 ] = pxShape->pcMatchingTopic;
+            pcTopics[ 1 ] = pxShape->pcOtherTopic;
+            usTopicLengths[ 0 ] = ( uint16_t ) strlen( pxShape->pcMatchingTopic );
+            usTopicLengths[ 1 ] = ( uint16_t ) strlen( pxShape->pcOtherTopic );
+
+            ( void ) addSubscription( &xBenchmarkSubscriptionList,
+                                      pxShape->pcFilter,
+                                      ( uint16_t ) strlen( pxShape->pcFilter ),
+                                      prvBenchmarkCallback,
+                                      NULL );
+            pxSubscription = getSubscription( &xBenchmarkSubscriptionList, 0U );
+
+            if( pxSubscription == NULL )
+            {
+                ESP_LOGE( TAG, "Failed to add topic filter %s.", pxShape->pcFilter );
+            }
+            else
+            {
+                ulMatchTopicHits = 0U;
+                llStartTimeUs = esp_timer_get_time();
+
+                for( ulIteration = 0U; ulIteration < submgrbenchconfigITERATIONS; ulIteration++ )
+                {
+                    for( xTopic = 0U; xTopic < 2U; xTopic++ )
+                    {
+                        xIsMatch = false;
+                        ( void ) MQTT_MatchTopic( pcTopics[ xTopic ],
+                                                  usTopicLengths[ xTopic ],
+                                                  pxSubscription->pcSubscriptionFilterString,
+                                                  pxSubscription->usFilterStringLength,
+                                                  &xIsMatch );
+                        ulMatchTopicHits += ( xIsMatch == true ) ? 1U : 0U;
+                    }
+                }
+
+                llMatchTopicUs = esp_timer_get_time() - llStartTimeUs;
+
+                ulPrecompiledHits = 0U;
+                llStartTimeUs = esp_timer_get_time();
+
+                for( ulIteration = 0U; ulIteration < submgrbenchconfigITERATIONS; ulIteration++ )
+                {
+                    for( xTopic = 0U; xTopic < 2U; xTopic++ )
+                    {
+                        ulPrecompiledHits += ( matchSubscriptionFilter( pxSubscription,
+                                                                        pcTopics[ xTopic ],
+                                                                        usTopicLengths[ xTopic ] ) == true ) ? 1U : 0U;
+                    }
+                }
+
+                llPrecompiledUs = esp_timer_get_time() - llStartTimeUs;
+
+                ESP_LOGI( TAG,
+                          "%s (%s): MQTT_MatchTopic %lld ns, precompiled filter %lld ns per match.",
+                          pxShape->pcName,
+                          pxShape->pcFilter,
+                          ( llMatchTopicUs * 1000 ) / ( int64_t ) ( 2U * submgrbenchconfigITERATIONS ),
+                          ( llPrecompiledUs * 1000 ) / ( int64_t ) ( 2U * submgrbenchconfigITERATIONS ) );
+
+                if( ( ulMatchTopicHits != submgrbenchconfigITERATIONS ) ||
+                    ( ulPrecompiledHits != submgrbenchconfigITERATIONS ) )
+                {
+                    ESP_LOGE( TAG,
+                              "Matchers disagree on %s: MQTT_MatchTopic matched %lu topics, precompiled filter %lu, expected %lu.",
+                              pxShape->pcFilter,
+                              ( unsigned long ) ulMatchTopicHits,
+                              ( unsigned long ) ulPrecompiledHits,
+                              ( unsigned long ) submgrbenchconfigITERATIONS );
+                }
+            }
+
+            prvRemoveBenchmarkSubscriptions();
+        }
+    }
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+static void prvSubscriptionManagerBenchmarkTask( void * pvParameters )
+{
+    const uint32_t ulPublishes = submgrbenchconfigITERATIONS * submgrbenchARRAY_LENGTH( pcBenchmarkTopics );
+    const char * pcMatcher = NULL;
+    int64_t llLinearScanUs = 0;
+    int64_t llManagerUs = 0;
+    uint32_t ulLinearScanInvocations = 0U;
+    uint32_t ulManagerInvocations = 0U;
+    size_t xSubscriptions = 0U;
+
+    ( void ) pvParameters;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+        pcMatcher = "topic trie";
+    #elif ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+        pcMatcher = "precompiled filters";
+    #else
+        pcMatcher = "MQTT_MatchTopic";
+    #endif
+
+    xSubscriptions = prvAddBenchmarkSubscriptions();
+
+    /* Warm the caches for both matchers before timing them. */
+    ( void ) prvTimeDispatch( true, &ulLinearScanInvocations );
+    ( void ) prvTimeDispatch( false, &ulManagerInvocations );
+
+    llLinearScanUs = prvTimeDispatch( true, &ulLinearScanInvocations );
+    llManagerUs = prvTimeDispatch( false, &ulManagerInvocations );
+
+    ESP_LOGI( TAG,
+              "Dispatched %lu publishes to %u subscriptions. Linear scan: %lld us, %lld ns per publish. "
+              "Subscription manager (%s%s): %lld us, %lld ns per publish.",
+              ( unsigned long ) ulPublishes,
+              ( unsigned int ) xSubscriptions,
+              llLinearScanUs,
+              ( llLinearScanUs * 1000 ) / ( int64_t ) ulPublishes,
+              pcMatcher,
+              ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 ) ? ", exact match hash" : "",
+              llManagerUs,
+              ( llManagerUs * 1000 ) / ( int64_t ) ulPublishes );
+
+    if( ulLinearScanInvocations != ulManagerInvocations )
+    {
+        ESP_LOGE( TAG,
+                  "Matchers disagree: linear scan invoked %lu callbacks, subscription manager %lu.",
+                  ( unsigned long ) ulLinearScanInvocations,
+                  ( unsigned long ) ulManagerInvocations );
+    }
+
+    prvRemoveBenchmarkSubscriptions();
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+        prvTimeMatchers();
+    #endif
+
+    xTaskNotifyGive( xCallerTask );
+    vTaskDelete( NULL );
+}
+
+/* Public function definitions ************************************************/
+
+void vRunSubscriptionManagerBenchmark( void )
+{
+    xCallerTask = xTaskGetCurrentTaskHandle();
+
+    if( xTaskCreate( prvSubscriptionManagerBenchmarkTask,
+                     "SubMgrBench",
+                     submgrbenchconfigTASK_STACK_SIZE,
+                     NULL,
+                     submgrbenchconfigTASK_PRIORITY,
+                     NULL ) != pdPASS )
+    {
+        ESP_LOGE( TAG, "Failed to create the subscription manager benchmark task." );
+    }
+    else
+    {
+        ( void ) ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+    }
+}
@@ -0,0 +1,371 @@
+/*
+ * ESP32-C3 Featured FreeRTOS IoT Integration V202204.00
+ * Copyright (C) 2022 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * https://www.FreeRTOS.org
+ * https://github.com/FreeRTOS
+ *
+ */
+
+/*
+ * This file checks that incoming publishes can be dispatched without locks
+ * while the subscription list changes, when the subscription manager keeps two
+ * copies of the subscription table (SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS).
+ *
+ * prvStressWriterTask() adds and removes topic filters at random on a
+ * subscription list of its own, while prvStressReaderTask() dispatches incoming
+ * publishes with random topics to it. Every subscription is registered with its
+ * topic filter as callback context, so the callback checks that the topic of the
+ * publish matches the filter of the subscription which was invoked. The
+ * callback also tries to change the list from time to time, which the
+ * subscription manager must refuse as the writer would wait for the callback.
+ * The test logs its results once prvStressWriterTask() is done, and both tasks
+ * delete themselves. The list takes its blocks from the subscription pool
+ * shared with the coreMQTT-Agent manager, so vRunSubscriptionManagerStressTest()
+ * only returns once the writer task has removed every subscription, and must
+ * be called before the manager is started.
+ */
+
+/* Includes *******************************************************************/
+
+/* Standard includes. */
+#include <string.h>
+#include <stdlib.h>
+
+/* FreeRTOS includes. */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* ESP-IDF includes. */
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+/* coreMQTT library include. */
+#include "core_mqtt.h"
+
+/* Subscription manager include. */
+#include "subscription_manager.h"
+
+/* Public functions include. */
+#include "subscription_manager_stress_test.h"
+
+/* Stress test configurations include. */
+#include "subscription_manager_stress_test_config.h"
+
+/* Preprocessor definitions ***************************************************/
+
+/**
+ * @brief Number of elements of an array.
+ */
+#define submgrstressARRAY_LENGTH( x )          ( sizeof( x ) / sizeof( ( x )[ 0 ] ) )
+
+/**
+ * @brief The reader and writer tasks block for a tick after this many
+ * dispatches or changes, to let the lower priority tasks run.
+ */
+#define submgrstressYIELD_PERIOD               ( 64U )
+
+/**
+ * @brief The subscription callback tries to change the list once every this
+ * many invocations.
+ */
+#define submgrstressCALLBACK_WRITE_PERIOD      ( 1024U )
+
+/**
+ * @brief The topic filter the subscription callback tries to subscribe to.
+ */
+#define submgrstressCALLBACK_FILTER            "stress/callback"
+
+/* Global variables ***********************************************************/
+
+/**
+ * @brief Logging tag for ESP-IDF logging functions.
+ */
+static const char * TAG = "sub_mgr_stress_test";
+
+/**
+ * @brief Topic filters added and removed by the writer task.
+ */
+static const char * const pcStressFilters[] =
+{
+    "stress/a/1",
+    "stress/a/2",
+    "stress/b/1",
+    "stress/+/1",
+    "stress/a/+",
+    "stress/b/#",
+    "stress/#",
+    "+/a/1"
+};
+
+/**
+ * @brief Topics of the incoming publishes dispatched by the reader task.
+ */
+static const char * const pcStressTopics[] =
+{
+    "stress/a/1",
+    "stress/a/2",
+    "stress/b/1",
+    "stress/b/2",
+    "stress/c",
+    "other/a/1"
+};
+
+/**
+ * @brief The subscription list the stress test changes and dispatches to.
+ */
+static SubscriptionList_t xStressSubscriptionList;
+
+/**
+ * @brief Handles of the reader and writer tasks, which notify each other when
+ * the test ends, and of the task waiting for the test to end.
+ */
+static TaskHandle_t xReaderTask = NULL;
+static TaskHandle_t xWriterTask = NULL;
+static TaskHandle_t xCallerTask = NULL;
+
+/**
+ * @brief Counters updated by the subscription callback, on the reader task.
+ */
+static uint32_t ulCallbackInvocations = 0U;
+static uint32_t ulMismatches = 0U;
+static uint32_t ulRefusedWrites = 0U;
+static uint32_t ulAcceptedWrites = 0U;
+
+/* Static function declarations ***********************************************/
+
+/**
+ * @brief The subscription callback of every stress test subscription.
+ *
+ * @param[in] pvIncomingPublishCallbackContext Topic filter of the subscription.
+ * @param[in] pxPublishInfo The incoming publish.
+ */
+static void prvStressCallback( void * pvIncomingPublishCallbackContext,
+                               MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Add or remove a random topic filter.
+ *
+ * @param[in,out] pxSubscribed Which topic filters are subscribed to.
+ * @param[in,out] pxIndices Index of each subscribed topic filter in the list.
+ */
+static void prvChangeSubscriptions( bool * pxSubscribed,
+                                    size_t * pxIndices );
+
+/**
+ * @brief The task which dispatches incoming publishes until the writer task
+ * notifies it.
+ *
+ * @param[in] pvParameters Unused.
+ */
+static void prvStressReaderTask( void * pvParameters );
+
+/**
+ * @brief The task which changes the subscription list for
+ * submgrstressconfigDURATION_MS, then stops the reader task, logs the results
+ * and empties the list.
+ *
+ * @param[in] pvParameters Unused.
+ */
+static void prvStressWriterTask( void * pvParameters );
+
+/* Static function definitions ************************************************/
+
+static void prvStressCallback( void * pvIncomingPublishCallbackContext,
+                               MQTTPublishInfo_t * pxPublishInfo )
+{
+    const char * pcFilter = ( const char * ) pvIncomingPublishCallbackContext;
+    bool xIsMatch = false;
+
+    ulCallbackInvocations++;
+
+    ( void ) MQTT_MatchTopic( pxPublishInfo->pTopicName,
+                              pxPublishInfo->topicNameLength,
+                              pcFilter,
+                              ( uint16_t ) strlen( pcFilter ),
+                              &xIsMatch );
+
+    if( xIsMatch == false )
+    {
+        ulMismatches++;
+    }
+
+    if( ( ulCallbackInvocations % submgrstressCALLBACK_WRITE_PERIOD ) == 0U )
+    {
+        if( addSubscription( &xStressSubscriptionList,
+                             submgrstressCALLBACK_FILTER,
+                             ( uint16_t ) strlen( submgrstressCALLBACK_FILTER ),
+                             prvStressCallback,
+                             ( void * ) submgrstressCALLBACK_FILTER ) == true )
+        {
+            ulAcceptedWrites++;
+        }
+        else
+        {
+            ulRefusedWrites++;
+        }
+    }
+}
+
+static void prvChangeSubscriptions( bool * pxSubscribed,
+                                    size_t * pxIndices )
+{
+    size_t xFilter = ( size_t ) rand() % submgrstressARRAY_LENGTH( pcStressFilters );
+    const char * pcFilter = pcStressFilters[ xFilter ];
+
+    if( pxSubscribed[ xFilter ] == false )
+    {
+        pxSubscribed[ xFilter ] = addSubscriptionWithIndex( &xStressSubscriptionList,
+                                                            pcFilter,
+                                                            ( uint16_t ) strlen( pcFilter ),
+                                                            prvStressCallback,
+                                                            ( void * ) pcFilter,
+                                                            &( pxIndices[ xFilter ] ) );
+    }
+    else
+    {
+        if( ( rand() & 1 ) == 0 )
+        {
+            removeSubscriptionAtIndex( &xStressSubscriptionList, pxIndices[ xFilter ] );
+        }
+        else
+        {
+            removeSubscription( &xStressSubscriptionList,
+                                pcFilter,
+                                ( uint16_t ) strlen( pcFilter ) );
+        }
+
+        pxSubscribed[ xFilter ] = false;
+    }
+}
+
+static void prvStressReaderTask( void * pvParameters )
+{
+    MQTTPublishInfo_t xPublishInfo;
+    uint32_t ulDispatches = 0U;
+    size_t xTopic = 0U;
+
+    ( void ) pvParameters;
+
+    memset( &xPublishInfo, 0x00, sizeof( xPublishInfo ) );
+
+    while( ulTaskNotifyTake( pdTRUE, 0U ) == 0U )
+    {
+        xTopic = ( size_t ) rand() % submgrstressARRAY_LENGTH( pcStressTopics );
+        xPublishInfo.pTopicName = pcStressTopics[ xTopic ];
+        xPublishInfo.topicNameLength = ( uint16_t ) strlen( pcStressTopics[ xTopic ] );
+
+        ( void ) handleIncomingPublishes( &xStressSubscriptionList, &xPublishInfo );
+
+        ulDispatches++;
+
+        if( ( ulDispatches % submgrstressYIELD_PERIOD ) == 0U )
+        {
+            vTaskDelay( 1U );
+        }
+    }
+
+    ESP_LOGI( TAG, "Reader task dispatched %lu publishes.", ( unsigned long ) ulDispatches );
+
+    xTaskNotifyGive( xWriterTask );
+    vTaskDelete( NULL );
+}
+
+static void prvStressWriterTask( void * pvParameters )
+{
+    bool xSubscribed[ submgrstressARRAY_LENGTH( pcStressFilters ) ] = { false };
+    size_t xIndices[ submgrstressARRAY_LENGTH( pcStressFilters ) ] = { 0U };
+    TickType_t xStartTicks = xTaskGetTickCount();
+    uint32_t ulChanges = 0U;
+    size_t xIndex = 0U;
+
+    ( void ) pvParameters;
+
+    while( ( xTaskGetTickCount() - xStartTicks ) < pdMS_TO_TICKS( submgrstressconfigDURATION_MS ) )
+    {
+        prvChangeSubscriptions( xSubscribed, xIndices );
+
+        ulChanges++;
+
+        if( ( ulChanges % submgrstressYIELD_PERIOD ) == 0U )
+        {
+            vTaskDelay( 1U );
+        }
+    }
+
+    /* Stop the reader task, and wait for it to be done with the list. */
+    xTaskNotifyGive( xReaderTask );
+    ( void ) ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+
+    ESP_LOGI( TAG,
+              "Made %lu changes to the subscription list. Callbacks: %lu, mismatched: %lu. "
+              "Changes from callbacks refused: %lu, accepted: %lu.",
+              ( unsigned long ) ulChanges,
+              ( unsigned long ) ulCallbackInvocations,
+              ( unsigned long ) ulMismatches,
+              ( unsigned long ) ulRefusedWrites,
+              ( unsigned long ) ulAcceptedWrites );
+
+    if( ( ulMismatches != 0U ) || ( ulAcceptedWrites != 0U ) )
+    {
+        ESP_LOGE( TAG, "Subscription manager stress test failed." );
+    }
+
+    for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+    {
+        removeSubscriptionAtIndex( &xStressSubscriptionList, xIndex );
+    }
+
+    /* The pool blocks of the list are back in the pool. */
+    xTaskNotifyGive( xCallerTask );
+    vTaskDelete( NULL );
+}
+
+/* Public function definitions ************************************************/
+
+void vRunSubscriptionManagerStressTest( void )
+{
+    xCallerTask = xTaskGetCurrentTaskHandle();
+
+    if( xTaskCreate( prvStressReaderTask,
+                     "SubMgrStressRd",
+                     submgrstressconfigTASK_STACK_SIZE,
+                     NULL,
+                     submgrstressconfigTASK_PRIORITY,
+                     &xReaderTask ) != pdPASS )
+    {
+        ESP_LOGE( TAG, "Failed to create the stress test reader task." );
+    }
+    else if( xTaskCreate( prvStressWriterTask,
+                          "SubMgrStressWr",
+                          submgrstressconfigTASK_STACK_SIZE,
+                          NULL,
+                          submgrstressconfigTASK_PRIORITY,
+                          &xWriterTask ) != pdPASS )
+    {
+        ESP_LOGE( TAG, "Failed to create the stress test writer task." );
+
+        vTaskDelete( xReaderTask );
+    }
+    else
+    {
+        ( void ) ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * ESP32-C3 Featured FreeRTOS IoT Integration V202204.00
+ * Copyright (C) 2022 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * https://www.FreeRTOS.org
+ * https://github.com/FreeRTOS
+ *
+ */
+
+#ifndef SUBSCRIPTION_MANAGER_STRESS_TEST_CONFIG_H
+#define SUBSCRIPTION_MANAGER_STRESS_TEST_CONFIG_H
+
+/* ESP-IDF sdkconfig include. */
+#include <sdkconfig.h>
+
+/* *INDENT-OFF* */
+    #ifdef __cplusplus
+        extern "C" {
+    #endif
+/* *INDENT-ON* */
+
+/**
+ * @brief How long the writer task changes the subscription list while the
+ * reader task dispatches incoming publishes, in milliseconds.
+ */
+#define submgrstressconfigDURATION_MS        ( ( uint32_t ) ( CONFIG_GRI_SUBSCRIPTION_MANAGER_STRESS_TEST_DURATION_MS ) )
+
+/**
+ * @brief The task priority of the reader and writer tasks.
+ */
+#define submgrstressconfigTASK_PRIORITY      ( ( unsigned int ) ( CONFIG_GRI_SUBSCRIPTION_MANAGER_STRESS_TEST_TASK_PRIORITY ) )
+
+/**
+ * @brief The task stack size of the reader and writer tasks.
+ */
+#define submgrstressconfigTASK_STACK_SIZE    ( ( unsigned int ) ( CONFIG_GRI_SUBSCRIPTION_MANAGER_STRESS_TEST_TASK_STACK_SIZE ) )
+
+/* *INDENT-OFF* */
+    #ifdef __cplusplus
+        } /* extern "C" */
+    #endif
+/* *INDENT-ON* */
+
+#endif /* SUBSCRIPTION_MANAGER_STRESS_TEST_CONFIG_H */
@@ -89,8 +89,7 @@
 /* Preprocessor definitions ***************************************************/
 
 /* coreMQTT-Agent event group bit definitions */
-#define CORE_MQTT_AGENT_CONNECTED_BIT              ( 1 << 0 )
-#define CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT    ( 1 << 1 )
+#define CORE_MQTT_AGENT_CONNECTED_BIT    ( 1 << 0 )
 
 /* Struct definitions *********************************************************/
 
@@ -262,7 +261,7 @@ static void prvSubscribeCommandCallback( MQTTAgentCommandContext_t * pxCommandCo
     {
         /* Add subscription so that incoming publishes are routed to the application
          * callback. */
-        xSubscriptionAdded = addSubscription( ( SubscriptionElement_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
+        xSubscriptionAdded = addSubscription( ( SubscriptionList_t * ) xGlobalMqttAgentContext.pIncomingCallbackContext,
                                               pxSubscribeArgs->pSubscribeInfo->pTopicFilter,
                                               pxSubscribeArgs->pSubscribeInfo->topicFilterLength,
                                               prvIncomingPublishCallback,
@@ -373,6 +372,7 @@ static bool prvSubscribeToTopic( MQTTQoS_t xQoS,
 {
     MQTTStatus_t xCommandAdded;
     BaseType_t xCommandAcknowledged = pdFALSE;
+    BaseType_t xBandwidthTaken;
     MQTTAgentSubscribeArgs_t xSubscribeArgs;
     MQTTSubscribeInfo_t xSubscribeInfo;
     static int32_t ulNextSubscribeMessageID = 0;
@@ -406,6 +406,11 @@ static bool prvSubscribeToTopic( MQTTQoS_t xQoS,
     xCommandParams.cmdCompleteCallback = prvSubscribeCommandCallback;
     xCommandParams.pCmdCompleteCallbackContext = ( void * ) &xApplicationDefinedContext;
 
+    /* Wait for this traffic's share of the link during an OTA update. */
+    xBandwidthTaken = xCoreMqttAgentManagerWaitForBandwidth( CORE_MQTT_AGENT_TRAFFIC_CONTROL,
+                                                             xSubscribeInfo.topicFilterLength,
+                                                             portMAX_DELAY );
+
     /* Loop in case the queue used to communicate with the MQTT agent is full and
      * attempts to post to it time out.  The queue will not become full if the
      * priority of the MQTT agent task is higher than the priority of the task
@@ -427,6 +432,11 @@ static bool prvSubscribeToTopic( MQTTQoS_t xQoS,
      * the ulNextSubscribeMessageID value set in the context above. */
     xCommandAcknowledged = prvWaitForCommandAcknowledgment( NULL );
 
+    if( xBandwidthTaken == pdPASS )
+    {
+        vCoreMqttAgentManagerReleaseBandwidth( CORE_MQTT_AGENT_TRAFFIC_CONTROL );
+    }
+
     /* Check both ways the status was passed back just for demonstration
      * purposes. */
     if( ( xCommandAcknowledged != pdTRUE ) ||
@@ -454,6 +464,7 @@ static void prvTempSubPubAndLEDControlTask( void * pvParameters )
     MQTTAgentCommandContext_t xCommandContext;
     uint32_t ulNotification = 0U, ulValueToNotify = 0UL;
     MQTTStatus_t xCommandAdded;
+    BaseType_t xBandwidthTaken;
     MQTTQoS_t xQoS;
     TickType_t xTicksToDelay;
     float temperatureValue;
@@ -470,8 +481,6 @@ static void prvTempSubPubAndLEDControlTask( void * pvParameters )
 
     /* Initialize the coreMQTT-Agent event group. */
     xNetworkEventGroup = xEventGroupCreate();
-    xEventGroupSetBits( xNetworkEventGroup,
-                        CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT );
 
     /* Register coreMQTT-Agent event handler. */
     xCoreMqttAgentManagerRegisterHandler( prvCoreMqttAgentEventHandler );
@@ -538,14 +547,18 @@ static void prvTempSubPubAndLEDControlTask( void * pvParameters )
          * is acknowledged. */
         xCommandContext.ulNotificationValue = ulValueToNotify;
 
-        /* Wait for coreMQTT-Agent task to have working network connection and
-         * not be performing an OTA update. */
+        /* Wait for coreMQTT-Agent task to have working network connection, and
+         * for this traffic's share of the link during an OTA update. */
         xEventGroupWaitBits( xNetworkEventGroup,
-                             CORE_MQTT_AGENT_CONNECTED_BIT | CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT,
+                             CORE_MQTT_AGENT_CONNECTED_BIT,
                              pdFALSE,
                              pdTRUE,
                              portMAX_DELAY );
 
+        xBandwidthTaken = xCoreMqttAgentManagerWaitForBandwidth( CORE_MQTT_AGENT_TRAFFIC_TELEMETRY,
+                                                                 xPublishInfo.topicNameLength + xPublishInfo.payloadLength,
+                                                                 portMAX_DELAY );
+
         ESP_LOGI( TAG,
                   "Sending publish request to agent with message \"%s\" on topic \"%s\"",
                   payloadBuf,
@@ -569,6 +582,11 @@ static void prvTempSubPubAndLEDControlTask( void * pvParameters )
 
         prvWaitForCommandAcknowledgment( &ulNotification );
 
+        if( xBandwidthTaken == pdPASS )
+        {
+            vCoreMqttAgentManagerReleaseBandwidth( CORE_MQTT_AGENT_TRAFFIC_TELEMETRY );
+        }
+
         /* The value received by the callback that executed when the publish was
          * acked came from the context passed into MQTTAgent_Publish() above, so
          * should match the value set in the context above. */
@@ -634,18 +652,13 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
 
         case CORE_MQTT_AGENT_OTA_STARTED_EVENT:
             ESP_LOGI( TAG,
-                      "OTA started. Preventing coreMQTT-Agent commands from "
-                      "being enqueued." );
-            xEventGroupClearBits( xNetworkEventGroup,
-                                  CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT );
+                      "OTA started. Sharing the link with the OTA download." );
             break;
 
         case CORE_MQTT_AGENT_OTA_STOPPED_EVENT:
             ESP_LOGI( TAG,
-                      "OTA stopped. No longer preventing coreMQTT-Agent "
-                      "commands from being enqueued." );
-            xEventGroupSetBits( xNetworkEventGroup,
-                                CORE_MQTT_AGENT_OTA_NOT_IN_PROGRESS_BIT );
+                      "OTA stopped. No longer sharing the link with the OTA "
+                      "download." );
             break;
 
         default:
@@ -69,6 +69,14 @@
     #include "ota_over_mqtt_demo.h"
 #endif /* CONFIG_GRI_ENABLE_OTA_DEMO */
 
+#if CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_BENCHMARK
+    #include "subscription_manager_benchmark.h"
+#endif /* CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_BENCHMARK */
+
+#if CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_STRESS_TEST
+    #include "subscription_manager_stress_test.h"
+#endif /* CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_STRESS_TEST */
+
 #if CONFIG_GRI_RUN_QUALIFICATION_TEST
     #include "qualification_wrapper_config.h"
 #endif /* CONFIG_GRI_RUN_QUALIFICATION_TEST */
@@ -253,6 +261,18 @@ static void prvStartEnabledDemos( void )
     BaseType_t xResult;
 
     #if ( CONFIG_GRI_RUN_QUALIFICATION_TEST == 0 )
+        #if CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_BENCHMARK
+            /* Runs to completion, so its subscription list is empty before the
+             * coreMQTT-Agent manager takes blocks from the subscription pool. */
+            vRunSubscriptionManagerBenchmark();
+        #endif /* CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_BENCHMARK */
+
+        #if CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_STRESS_TEST
+            /* Runs to completion, so its subscription list is empty before the
+             * coreMQTT-Agent manager takes blocks from the subscription pool. */
+            vRunSubscriptionManagerStressTest();
+        #endif /* CONFIG_GRI_ENABLE_SUBSCRIPTION_MANAGER_STRESS_TEST */
+
         #if CONFIG_GRI_ENABLE_SUB_PUB_UNSUB_DEMO
             vStartSubscribePublishUnsubscribeDemo();
         #endif /* CONFIG_GRI_ENABLE_SIMPLE_PUB_SUB_DEMO */
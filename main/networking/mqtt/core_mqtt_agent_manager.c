@@ -63,6 +63,9 @@
 /* Subscription manager include. */
 #include "subscription_manager.h"
 
+/* Reserved topics dispatch table include. */
+#include "reserved_topics.h"
+
 /* Network transport include. */
 #include "network_transport.h"
 
@@ -72,11 +75,6 @@
 /* Configurations include. */
 #include "core_mqtt_agent_manager_config.h"
 
-/* OTA demo include. */
-#if CONFIG_GRI_ENABLE_OTA_DEMO
-    #include "ota_over_mqtt_demo.h"
-#endif /* CONFIG_GRI_ENABLE_OTA_DEMO */
-
 /* Preprocessor definitions ***************************************************/
 
 /* Network event group bit definitions */
@@ -93,6 +91,27 @@
 
 #define MUTEX_IS_OWNED( xHandle )    ( xTaskGetCurrentTaskHandle() == xSemaphoreGetMutexHolder( xHandle ) )
 
+/* Bandwidth sharing definitions */
+#if ( ( configBANDWIDTH_OTA_PERCENT + configBANDWIDTH_CONTROL_PERCENT ) >= 100 )
+    #error "The OTA and control bandwidth percentages must leave a share for telemetry."
+#endif
+
+/**
+ * @brief Bytes charged for every command on top of its payload, for the MQTT
+ * and TLS headers, so that the rate of small commands is bounded too.
+ */
+#define BANDWIDTH_COMMAND_OVERHEAD_BYTES    ( 64 )
+
+/**
+ * @brief Ticks a command waiting for a command slot sleeps before checking
+ * again whether one was released.
+ */
+#define BANDWIDTH_SLOT_POLL_TICKS           ( ( pdMS_TO_TICKS( 10 ) > 0U ) ? pdMS_TO_TICKS( 10 ) : 1U )
+
+/* Subscription diagnostics definitions */
+#define SUBSCRIPTION_DIAGNOSTICS_TOPIC          CONFIG_GRI_THING_NAME "/diagnostics/subscriptions"
+#define SUBSCRIPTION_DIAGNOSTICS_BUFFER_SIZE    ( 512U )
+
 /* Global variables ***********************************************************/
 
 /**
@@ -124,15 +143,15 @@ static MQTTAgentMessageContext_t xCommandQueue;
 MQTTAgentContext_t xGlobalMqttAgentContext;
 
 /**
- * @brief The global array of subscription elements.
+ * @brief The global list of subscription elements.
  *
- * @note No thread safety is required to this array, since updates to the array
+ * @note No thread safety is required to this list, since updates to the list
  * elements are done only from the MQTT agent task. The subscription manager
- * implementation expects that the array of the subscription elements used for
- * storing subscriptions to be initialized to 0. As this is a global array, it
- * will be initialized to 0 by default.
+ * implementation expects that the list used for storing subscriptions to be
+ * initialized to 0. As this is a global variable, it will be initialized to 0
+ * by default.
  */
-SubscriptionElement_t xGlobalSubscriptionList[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+SubscriptionList_t xGlobalSubscriptionList;
 
 /**
  * @brief Lock to handle multi-tasks accessing xSubInfo in prvHandleResubscribe.
@@ -149,6 +168,55 @@ static NetworkContext_t * pxNetworkContext;
  */
 static EventGroupHandle_t xNetworkEventGroup;
 
+/**
+ * @brief Token bucket and command slots of a traffic class. Tokens are counted
+ * in bytes times ticks per second, so that a tick of refill adds the rate in
+ * bytes per second. The tokens go below zero when a command larger than the
+ * bucket is sent.
+ */
+typedef struct BandwidthBucket
+{
+    int64_t llTokens;
+    int64_t llCapacity;
+    int64_t llRate;
+    uint32_t ulSlots;            /*!< @brief Share of the agent command queue. */
+    uint32_t ulSlotsInUse;       /*!< @brief Commands sent and not released yet. */
+    uint32_t ulWaiting;          /*!< @brief Tasks waiting to send a command. */
+    uint32_t ulCommands;         /*!< @brief Commands sent during the OTA update. */
+    uint32_t ulDelayedCommands;  /*!< @brief Commands which waited for their share. */
+    uint32_t ulBorrowedCommands; /*!< @brief Commands sent beyond the share while the other classes were idle. */
+    uint64_t ullBytes;           /*!< @brief Bytes of the commands sent. */
+    TickType_t xDelayedTicks;    /*!< @brief Time the delayed commands waited in total. */
+} BandwidthBucket_t;
+
+/**
+ * @brief Token buckets of the traffic classes, the tick they were last refilled
+ * at, and whether they are in use because an OTA update is in progress.
+ */
+static BandwidthBucket_t xBandwidthBuckets[ CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT ];
+static TickType_t xBandwidthRefillTick;
+static bool xBandwidthSharingEnabled = false;
+
+/**
+ * @brief Lock of the bandwidth sharing state.
+ */
+static SemaphoreHandle_t xBandwidthMutex;
+
+#if ( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 )
+
+/**
+ * @brief Payload of the subscription diagnostics publish. It must stay in scope
+ * until the publish completes.
+ */
+    static char cDiagnosticsPayload[ SUBSCRIPTION_DIAGNOSTICS_BUFFER_SIZE ];
+
+/**
+ * @brief Set while a subscription diagnostics publish is in progress. Only used
+ * from the coreMQTT-Agent task.
+ */
+    static bool xDiagnosticsPublishInProgress = false;
+#endif /* configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 */
+
 /* Static function declarations ***********************************************/
 
 /**
@@ -199,6 +267,37 @@ static void prvSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxComman
  */
 static MQTTStatus_t prvHandleResubscribe( void );
 
+#if ( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 )
+
+/**
+ * @brief Ask the coreMQTT-Agent task to publish the dispatch statistics of the
+ * subscriptions, with a process loop command which sends nothing to the broker.
+ */
+    static void prvRequestSubscriptionDiagnostics( void );
+
+/**
+ * @brief Passed into MQTTAgent_ProcessLoop() to serialize the dispatch
+ * statistics of the subscriptions as JSON and publish them to
+ * SUBSCRIPTION_DIAGNOSTICS_TOPIC, from the coreMQTT-Agent task which owns the
+ * subscription list.
+ *
+ * @param[in] pxCommandContext Context of the initial command. Not used.
+ * @param[in] pxReturnInfo The result of the command. Not used.
+ */
+    static void prvPublishSubscriptionDiagnostics( MQTTAgentCommandContext_t * pxCommandContext,
+                                                   MQTTAgentReturnInfo_t * pxReturnInfo );
+
+/**
+ * @brief Passed into MQTTAgent_Publish() as the callback to execute when the
+ * subscription diagnostics have been sent.
+ *
+ * @param[in] pxCommandContext Context of the initial command. Not used.
+ * @param[in] pxReturnInfo The result of the command.
+ */
+    static void prvSubscriptionDiagnosticsCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                           MQTTAgentReturnInfo_t * pxReturnInfo );
+#endif /* configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 */
+
 /**
  * @brief Task used to run the MQTT agent.
  *
@@ -278,6 +377,38 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
                                           int32_t lEventId,
                                           void * pvEventData );
 
+/**
+ * @brief Start or stop sharing the link capacity between the traffic classes.
+ *
+ * @param[in] xEnable true when an OTA update starts, false when it stops.
+ */
+static void prvSetBandwidthSharing( bool xEnable );
+
+/**
+ * @brief Add the tokens earned since the last refill to every bucket.
+ */
+static void prvRefillBandwidthBuckets( void );
+
+/**
+ * @brief Take the tokens and a command slot for a command of a class. A class
+ * which has used its share may go on while no other class has a command
+ * waiting, so that the link is not left idle.
+ *
+ * @param[in] xClass Traffic class of the command.
+ * @param[in] xBytes Number of bytes of the command.
+ *
+ * @return 0 if the command may be sent, else the number of ticks to wait
+ * before trying again.
+ */
+static TickType_t prvTakeBandwidth( CoreMqttAgentTrafficClass_t xClass,
+                                    size_t xBytes );
+
+/**
+ * @brief Log what each traffic class sent during the OTA update, and how long
+ * its commands waited for their share.
+ */
+static void prvLogBandwidthStats( void );
+
 /* Static function definitions ************************************************/
 
 static inline BaseType_t xLockSubList( void )
@@ -359,21 +490,17 @@ static void prvIncomingPublishCallback( MQTTAgentContext_t * pMqttAgentContext,
 
     ( void ) packetId;
 
+    /* Reserved topics known at build time are routed through a static table,
+     * without subscription manager entries. */
+    xPublishHandled = handleReservedTopicPublish( pxPublishInfo );
+
     /* Fan out the incoming publishes to the callbacks registered using
      * subscription manager. */
-    xPublishHandled = handleIncomingPublishes( ( SubscriptionElement_t * ) pMqttAgentContext->pIncomingCallbackContext,
-                                               pxPublishInfo );
-
-    #if CONFIG_GRI_ENABLE_OTA_DEMO
-
-        /*
-         * Check if the incoming publish is for OTA agent.
-         */
-        if( xPublishHandled != true )
-        {
-            xPublishHandled = vOTAProcessMessage( pMqttAgentContext->pIncomingCallbackContext, pxPublishInfo );
-        }
-    #endif /* CONFIG_GRI_ENABLE_OTA_DEMO */
+    if( xPublishHandled != true )
+    {
+        xPublishHandled = handleIncomingPublishes( ( SubscriptionList_t * ) pMqttAgentContext->pIncomingCallbackContext,
+                                                   pxPublishInfo );
+    }
 
     /* If there are no callbacks to handle the incoming publishes,
      * handle it as an unsolicited publish. */
@@ -414,7 +541,7 @@ static void prvSubscriptionCommandCallback( MQTTAgentCommandContext_t * pxComman
                           pxSubscribeArgs->pSubscribeInfo[ lIndex ].topicFilterLength,
                           pxSubscribeArgs->pSubscribeInfo[ lIndex ].pTopicFilter );
                 /* Remove subscription callback for unsubscribe. */
-                removeSubscription( xGlobalSubscriptionList,
+                removeSubscription( &xGlobalSubscriptionList,
                                     pxSubscribeArgs->pSubscribeInfo[ lIndex ].pTopicFilter,
                                     pxSubscribeArgs->pSubscribeInfo[ lIndex ].topicFilterLength );
             }
@@ -433,15 +560,21 @@ static MQTTStatus_t prvHandleResubscribe( void )
     MQTTStatus_t xResult = MQTTBadParameter;
     uint32_t ulIndex = 0U;
     uint16_t usNumSubscriptions = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+    ReservedTopic_t eTopic = ReservedTopicNone;
 
     /* These variables need to stay in scope until command completes. */
     static MQTTAgentSubscribeArgs_t xSubArgs = { 0 };
-    static MQTTSubscribeInfo_t xSubInfo[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+        static MQTTSubscribeInfo_t xSubInfo[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS + SUBSCRIPTION_MANAGER_MAX_AGGREGATES + ReservedTopicCount ];
+    #else
+        static MQTTSubscribeInfo_t xSubInfo[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS + ReservedTopicCount ];
+    #endif
     static MQTTAgentCommandInfo_t xCommandParams = { 0 };
 
     xLockSubList();
 
-    memset( &( xSubInfo[ 0 ] ), 0, SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS * sizeof( MQTTSubscribeInfo_t ) );
+    memset( &( xSubInfo[ 0 ] ), 0, sizeof( xSubInfo ) );
 
     /* Loop through each subscription in the subscription list and add a subscribe
      * command to the command queue. */
@@ -449,10 +582,26 @@ static MQTTStatus_t prvHandleResubscribe( void )
     {
         /* Check if there is a subscription in the subscription list. This demo
          * doesn't check for duplicate subscriptions. */
-        if( xGlobalSubscriptionList[ ulIndex ].usFilterStringLength != 0 )
+        pxSubscription = getSubscription( &xGlobalSubscriptionList, ulIndex );
+
+        if( ( pxSubscription != NULL ) && ( pxSubscription->xUnsubscribing == true ) )
         {
-            xSubInfo[ usNumSubscriptions ].pTopicFilter = xGlobalSubscriptionList[ ulIndex ].pcSubscriptionFilterString;
-            xSubInfo[ usNumSubscriptions ].topicFilterLength = xGlobalSubscriptionList[ ulIndex ].usFilterStringLength;
+            /* The last subscriber left the topic filter. */
+            pxSubscription = NULL;
+        }
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+            if( ( pxSubscription != NULL ) && ( pxSubscription->xAggregated == true ) )
+            {
+                /* Received through the covering filter resubscribed below. */
+                pxSubscription = NULL;
+            }
+        #endif
+
+        if( pxSubscription != NULL )
+        {
+            xSubInfo[ usNumSubscriptions ].pTopicFilter = pxSubscription->pcSubscriptionFilterString;
+            xSubInfo[ usNumSubscriptions ].topicFilterLength = pxSubscription->usFilterStringLength;
 
             /* QoS1 is used for all the subscriptions in this demo. */
             xSubInfo[ usNumSubscriptions ].qos = MQTTQoS1;
@@ -466,6 +615,46 @@ static MQTTStatus_t prvHandleResubscribe( void )
         }
     }
 
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+        for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES; ulIndex++ )
+        {
+            xSubInfo[ usNumSubscriptions ].pTopicFilter = getAggregate( &xGlobalSubscriptionList,
+                                                                        ulIndex,
+                                                                        &( xSubInfo[ usNumSubscriptions ].topicFilterLength ) );
+
+            if( xSubInfo[ usNumSubscriptions ].pTopicFilter != NULL )
+            {
+                xSubInfo[ usNumSubscriptions ].qos = MQTTQoS1;
+
+                ESP_LOGI( TAG,
+                          "Resubscribe to the covering filter %.*s will be attempted.",
+                          xSubInfo[ usNumSubscriptions ].topicFilterLength,
+                          xSubInfo[ usNumSubscriptions ].pTopicFilter );
+
+                usNumSubscriptions++;
+            }
+        }
+    #endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
+    /* Reserved topics subscribed at the broker have no entry in the
+     * subscription list. */
+    for( eTopic = ( ReservedTopic_t ) 0; eTopic < ReservedTopicCount; eTopic++ )
+    {
+        if( reservedTopicNeedsResubscribe( eTopic ) == true )
+        {
+            xSubInfo[ usNumSubscriptions ].pTopicFilter = getReservedTopicName( eTopic,
+                                                                                &( xSubInfo[ usNumSubscriptions ].topicFilterLength ) );
+            xSubInfo[ usNumSubscriptions ].qos = MQTTQoS1;
+
+            ESP_LOGI( TAG,
+                      "Resubscribe to the topic %.*s will be attempted.",
+                      xSubInfo[ usNumSubscriptions ].topicFilterLength,
+                      xSubInfo[ usNumSubscriptions ].pTopicFilter );
+
+            usNumSubscriptions++;
+        }
+    }
+
     if( usNumSubscriptions > 0U )
     {
         xSubArgs.pSubscribeInfo = xSubInfo;
@@ -498,6 +687,136 @@ static MQTTStatus_t prvHandleResubscribe( void )
     return xResult;
 }
 
+#if ( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 )
+
+    static void prvRequestSubscriptionDiagnostics( void )
+    {
+        MQTTStatus_t xCommandAdded;
+        MQTTAgentCommandInfo_t xCommandInfo =
+        {
+            .blockTimeMs                 = 0,
+            .cmdCompleteCallback         = prvPublishSubscriptionDiagnostics,
+            .pCmdCompleteCallbackContext = NULL,
+        };
+
+        xCommandAdded = MQTTAgent_ProcessLoop( &xGlobalMqttAgentContext, &xCommandInfo );
+
+        if( xCommandAdded != MQTTSuccess )
+        {
+            ESP_LOGW( TAG,
+                      "Skipped subscription diagnostics as the command queue is full. xResult=%s.",
+                      MQTT_Status_strerror( xCommandAdded ) );
+        }
+    }
+
+    static void prvPublishSubscriptionDiagnostics( MQTTAgentCommandContext_t * pxCommandContext,
+                                                   MQTTAgentReturnInfo_t * pxReturnInfo )
+    {
+        static MQTTPublishInfo_t xPublishInfo = { 0 };
+        MQTTAgentCommandInfo_t xCommandInfo = { 0 };
+        SubscriptionManagerStats_t xStats = { 0 };
+        SubscriptionDispatchStats_t xDispatchStats = { 0 };
+        SubscriptionElement_t * pxSubscription = NULL;
+        MQTTStatus_t xCommandAdded;
+        size_t xIndex = 0U;
+        size_t xLength = 0U;
+        size_t xReported = 0U;
+        int lWritten = 0;
+
+        ( void ) pxCommandContext;
+        ( void ) pxReturnInfo;
+
+        if( xDiagnosticsPublishInProgress == false )
+        {
+            getSubscriptionManagerStats( &xGlobalSubscriptionList, &xStats );
+
+            lWritten = snprintf( cDiagnosticsPayload,
+                                 sizeof( cDiagnosticsPayload ),
+                                 "{\"unmatched\":%" PRIu32 ",\"subscriptions\":[",
+                                 xStats.ulUnmatchedPublishes );
+            xLength = ( size_t ) lWritten;
+
+            for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+            {
+                pxSubscription = getSubscription( &xGlobalSubscriptionList, xIndex );
+
+                if( ( pxSubscription != NULL ) &&
+                    ( getSubscriptionDispatchStats( &xGlobalSubscriptionList, xIndex, &xDispatchStats ) == true ) )
+                {
+                    lWritten = snprintf( &( cDiagnosticsPayload[ xLength ] ),
+                                         sizeof( cDiagnosticsPayload ) - xLength,
+                                         "%s{\"filter\":\"%.*s\",\"matches\":%" PRIu32 ",\"bytes\":%" PRIu32
+                                         ",\"callbackUs\":%" PRIu32 ",\"maxCallbackUs\":%" PRIu32 ",\"slow\":%" PRIu32 "}",
+                                         ( xReported > 0U ) ? "," : "",
+                                         pxSubscription->usFilterStringLength,
+                                         pxSubscription->pcSubscriptionFilterString,
+                                         xDispatchStats.ulMatches,
+                                         xDispatchStats.ulBytesDelivered,
+                                         xDispatchStats.ulCallbackTimeUs,
+                                         xDispatchStats.ulMaxCallbackTimeUs,
+                                         xDispatchStats.ulSlowCallbacks );
+
+                    /* Keep room for closing the JSON document. */
+                    if( ( lWritten < 0 ) ||
+                        ( ( xLength + ( size_t ) lWritten + sizeof( "]}" ) ) > sizeof( cDiagnosticsPayload ) ) )
+                    {
+                        ESP_LOGW( TAG,
+                                  "Subscription diagnostics truncated to %u subscriptions.",
+                                  ( unsigned int ) xReported );
+                        break;
+                    }
+
+                    xLength += ( size_t ) lWritten;
+                    xReported++;
+                }
+            }
+
+            memcpy( &( cDiagnosticsPayload[ xLength ] ), "]}", sizeof( "]}" ) - 1U );
+            xLength += sizeof( "]}" ) - 1U;
+
+            xPublishInfo.qos = MQTTQoS0;
+            xPublishInfo.pTopicName = SUBSCRIPTION_DIAGNOSTICS_TOPIC;
+            xPublishInfo.topicNameLength = ( uint16_t ) ( sizeof( SUBSCRIPTION_DIAGNOSTICS_TOPIC ) - 1U );
+            xPublishInfo.pPayload = cDiagnosticsPayload;
+            xPublishInfo.payloadLength = xLength;
+
+            /* The block time must be 0 as this runs in the coreMQTT-Agent task. */
+            xCommandInfo.blockTimeMs = 0U;
+            xCommandInfo.cmdCompleteCallback = prvSubscriptionDiagnosticsCommandCallback;
+            xCommandInfo.pCmdCompleteCallbackContext = NULL;
+
+            xCommandAdded = MQTTAgent_Publish( &xGlobalMqttAgentContext, &xPublishInfo, &xCommandInfo );
+
+            if( xCommandAdded == MQTTSuccess )
+            {
+                xDiagnosticsPublishInProgress = true;
+            }
+            else
+            {
+                ESP_LOGW( TAG,
+                          "Failed to enqueue the subscription diagnostics publish. xResult=%s.",
+                          MQTT_Status_strerror( xCommandAdded ) );
+            }
+        }
+    }
+
+    static void prvSubscriptionDiagnosticsCommandCallback( MQTTAgentCommandContext_t * pxCommandContext,
+                                                           MQTTAgentReturnInfo_t * pxReturnInfo )
+    {
+        ( void ) pxCommandContext;
+
+        if( pxReturnInfo->returnCode != MQTTSuccess )
+        {
+            ESP_LOGW( TAG,
+                      "Failed to publish subscription diagnostics. xResult=%s.",
+                      MQTT_Status_strerror( pxReturnInfo->returnCode ) );
+        }
+
+        xDiagnosticsPublishInProgress = false;
+    }
+
+#endif /* configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 */
+
 static void prvMQTTAgentTask( void * pvParameters )
 {
     MQTTStatus_t xMQTTStatus = MQTTSuccess;
@@ -571,6 +890,10 @@ static MQTTStatus_t prvCoreMqttAgentInit( NetworkContext_t * pxNetworkContext )
 
     ulGlobalEntryTimeMs = prvGetTimeMs();
 
+    /* The reserved topic table is checked at build time. This backs up the
+     * check, as publishes on reserved topics would otherwise be misrouted. */
+    configASSERT( checkReservedTopicTable() == true );
+
     xCommandQueue.queue = xQueueCreateStatic( configMQTT_AGENT_COMMAND_QUEUE_LENGTH,
                                               sizeof( MQTTAgentCommand_t * ),
                                               staticQueueStorageArea,
@@ -596,7 +919,7 @@ static MQTTStatus_t prvCoreMqttAgentInit( NetworkContext_t * pxNetworkContext )
                               &xTransport,
                               prvGetTimeMs,
                               prvIncomingPublishCallback,
-                              xGlobalSubscriptionList );
+                              &xGlobalSubscriptionList );
 
     return xReturn;
 }
@@ -706,6 +1029,10 @@ static void prvCoreMqttAgentConnectionTask( void * pvParameters )
     TlsTransportStatus_t xTlsRet;
     MQTTStatus_t eMqttRet;
 
+    #if ( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 )
+        TickType_t xLastDiagnosticsTick = 0;
+    #endif
+
     while( 1 )
     {
         int lSockFd = -1;
@@ -775,6 +1102,10 @@ static void prvCoreMqttAgentConnectionTask( void * pvParameters )
             xEventGroupSetBits( xNetworkEventGroup,
                                 CORE_MQTT_AGENT_CONNECTED_BIT );
             xCoreMqttAgentManagerPost( CORE_MQTT_AGENT_CONNECTED_EVENT );
+
+            #if ( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 )
+                xLastDiagnosticsTick = xTaskGetTickCount();
+            #endif
         }
 
         if( eMqttRet == MQTTSuccess )
@@ -816,6 +1147,14 @@ static void prvCoreMqttAgentConnectionTask( void * pvParameters )
                     }
                 }
 
+                #if ( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 )
+                    if( ( xTaskGetTickCount() - xLastDiagnosticsTick ) >= pdMS_TO_TICKS( configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS ) )
+                    {
+                        xLastDiagnosticsTick = xTaskGetTickCount();
+                        prvRequestSubscriptionDiagnostics();
+                    }
+                #endif /* configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS > 0 */
+
                 vTaskDelay( pdMS_TO_TICKS( 10 ) );
             }
         }
@@ -897,11 +1236,13 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
             break;
 
         case CORE_MQTT_AGENT_OTA_STARTED_EVENT:
-            ESP_LOGI( TAG, "OTA started." );
+            ESP_LOGI( TAG, "OTA started. Sharing the link between the OTA download, telemetry and control." );
+            prvSetBandwidthSharing( true );
             break;
 
         case CORE_MQTT_AGENT_OTA_STOPPED_EVENT:
             ESP_LOGI( TAG, "OTA stopped." );
+            prvSetBandwidthSharing( false );
             break;
 
         default:
@@ -911,6 +1252,182 @@ static void prvCoreMqttAgentEventHandler( void * pvHandlerArg,
     }
 }
 
+static void prvSetBandwidthSharing( bool xEnable )
+{
+    static const uint32_t ulPercent[ CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT ] =
+    {
+        [ CORE_MQTT_AGENT_TRAFFIC_OTA ]       = configBANDWIDTH_OTA_PERCENT,
+        [ CORE_MQTT_AGENT_TRAFFIC_TELEMETRY ] = 100U - configBANDWIDTH_OTA_PERCENT - configBANDWIDTH_CONTROL_PERCENT,
+        [ CORE_MQTT_AGENT_TRAFFIC_CONTROL ]   = configBANDWIDTH_CONTROL_PERCENT,
+    };
+    BandwidthBucket_t * pxBucket;
+    bool xStopped = false;
+    uint32_t ulClass;
+
+    if( ( xBandwidthMutex != NULL ) &&
+        ( xSemaphoreTake( xBandwidthMutex, portMAX_DELAY ) == pdTRUE ) )
+    {
+        if( ( xEnable == true ) && ( xBandwidthSharingEnabled == false ) )
+        {
+            /* Every class starts with a full bucket, one second of its rate.
+             * The commands in flight keep their slots. */
+            for( ulClass = 0; ulClass < CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT; ulClass++ )
+            {
+                pxBucket = &xBandwidthBuckets[ ulClass ];
+                pxBucket->llRate = ( ( int64_t ) configBANDWIDTH_LINK_CAPACITY_BYTES_PER_SECOND * ulPercent[ ulClass ] ) / 100;
+                pxBucket->llCapacity = pxBucket->llRate * configTICK_RATE_HZ;
+                pxBucket->llTokens = pxBucket->llCapacity;
+                pxBucket->ulSlots = ( configMQTT_AGENT_COMMAND_QUEUE_LENGTH * ulPercent[ ulClass ] ) / 100U;
+                pxBucket->ulSlots = ( pxBucket->ulSlots > 0U ) ? pxBucket->ulSlots : 1U;
+                pxBucket->ulCommands = 0;
+                pxBucket->ulDelayedCommands = 0;
+                pxBucket->ulBorrowedCommands = 0;
+                pxBucket->ullBytes = 0;
+                pxBucket->xDelayedTicks = 0;
+            }
+
+            xBandwidthRefillTick = xTaskGetTickCount();
+        }
+
+        xStopped = ( ( xEnable == false ) && ( xBandwidthSharingEnabled == true ) );
+        xBandwidthSharingEnabled = xEnable;
+
+        ( void ) xSemaphoreGive( xBandwidthMutex );
+    }
+
+    /* The statistics are not changed once sharing stopped. */
+    if( xStopped == true )
+    {
+        prvLogBandwidthStats();
+    }
+}
+
+static void prvRefillBandwidthBuckets( void )
+{
+    TickType_t xNow = xTaskGetTickCount();
+    int64_t llElapsedTicks = ( int64_t ) ( TickType_t ) ( xNow - xBandwidthRefillTick );
+    BandwidthBucket_t * pxBucket;
+    uint32_t ulClass;
+
+    for( ulClass = 0; ulClass < CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT; ulClass++ )
+    {
+        pxBucket = &xBandwidthBuckets[ ulClass ];
+        pxBucket->llTokens += pxBucket->llRate * llElapsedTicks;
+
+        if( pxBucket->llTokens > pxBucket->llCapacity )
+        {
+            pxBucket->llTokens = pxBucket->llCapacity;
+        }
+    }
+
+    xBandwidthRefillTick = xNow;
+}
+
+static TickType_t prvTakeBandwidth( CoreMqttAgentTrafficClass_t xClass,
+                                    size_t xBytes )
+{
+    BandwidthBucket_t * pxBucket = &xBandwidthBuckets[ xClass ];
+    int64_t llCost = ( ( int64_t ) xBytes + BANDWIDTH_COMMAND_OVERHEAD_BYTES ) * configTICK_RATE_HZ;
+    int64_t llNeeded = llCost;
+    uint32_t ulSlotsInUse = 0;
+    bool xOthersWaiting = false;
+    bool xBorrowed = false;
+    TickType_t xWaitTicks = 0;
+    uint32_t ulClass;
+
+    for( ulClass = 0; ulClass < CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT; ulClass++ )
+    {
+        ulSlotsInUse += xBandwidthBuckets[ ulClass ].ulSlotsInUse;
+
+        if( ( ulClass != ( uint32_t ) xClass ) && ( xBandwidthBuckets[ ulClass ].ulWaiting > 0U ) )
+        {
+            xOthersWaiting = true;
+        }
+    }
+
+    /* A command larger than the bucket is sent once the bucket is full, and
+     * the bucket goes into debt for the rest. */
+    if( llNeeded > pxBucket->llCapacity )
+    {
+        llNeeded = pxBucket->llCapacity;
+    }
+
+    if( pxBucket->ulSlotsInUse >= pxBucket->ulSlots )
+    {
+        /* The slots of the other classes may be used while they are idle,
+         * until the command queue is full. */
+        if( ( xOthersWaiting == true ) ||
+            ( ulSlotsInUse >= configMQTT_AGENT_COMMAND_QUEUE_LENGTH ) )
+        {
+            xWaitTicks = BANDWIDTH_SLOT_POLL_TICKS;
+        }
+        else
+        {
+            xBorrowed = true;
+        }
+    }
+
+    if( ( xWaitTicks == 0U ) && ( pxBucket->llTokens < llNeeded ) )
+    {
+        if( xOthersWaiting == true )
+        {
+            xWaitTicks = ( TickType_t ) ( ( llNeeded - pxBucket->llTokens + pxBucket->llRate - 1 ) / pxBucket->llRate );
+        }
+        else
+        {
+            xBorrowed = true;
+        }
+    }
+
+    if( xWaitTicks == 0U )
+    {
+        pxBucket->llTokens -= llCost;
+        pxBucket->ulSlotsInUse++;
+        pxBucket->ulCommands++;
+        pxBucket->ullBytes += xBytes;
+
+        if( xBorrowed == true )
+        {
+            /* The capacity left idle by the other classes is not paid back
+             * once they have commands to send again. */
+            if( pxBucket->llTokens < 0 )
+            {
+                pxBucket->llTokens = 0;
+            }
+
+            pxBucket->ulBorrowedCommands++;
+        }
+    }
+
+    return xWaitTicks;
+}
+
+static void prvLogBandwidthStats( void )
+{
+    static const char * const pcClassNames[ CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT ] =
+    {
+        [ CORE_MQTT_AGENT_TRAFFIC_OTA ]       = "OTA",
+        [ CORE_MQTT_AGENT_TRAFFIC_TELEMETRY ] = "Telemetry",
+        [ CORE_MQTT_AGENT_TRAFFIC_CONTROL ]   = "Control",
+    };
+    const BandwidthBucket_t * pxBucket;
+    uint32_t ulClass;
+
+    for( ulClass = 0; ulClass < CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT; ulClass++ )
+    {
+        pxBucket = &xBandwidthBuckets[ ulClass ];
+
+        ESP_LOGI( TAG,
+                  "%s traffic during OTA: %" PRIu32 " commands, %" PRIu64 " bytes, %" PRIu32 " delayed for %" PRIu32 " ms in total, %" PRIu32 " sent beyond its share.",
+                  pcClassNames[ ulClass ],
+                  pxBucket->ulCommands,
+                  pxBucket->ullBytes,
+                  pxBucket->ulDelayedCommands,
+                  ( uint32_t ) ( pxBucket->xDelayedTicks * MILLISECONDS_PER_TICK ),
+                  pxBucket->ulBorrowedCommands );
+    }
+}
+
 /* Public function definitions ************************************************/
 
 BaseType_t xCoreMqttAgentManagerPost( int32_t lEventId )
@@ -932,6 +1449,103 @@ BaseType_t xCoreMqttAgentManagerPost( int32_t lEventId )
     return xRet;
 }
 
+BaseType_t xCoreMqttAgentManagerWaitForBandwidth( CoreMqttAgentTrafficClass_t xClass,
+                                                  size_t xBytes,
+                                                  TickType_t xTicksToWait )
+{
+    TickType_t xStartTick = xTaskGetTickCount();
+    TickType_t xWaitedTicks = 0;
+    TickType_t xWaitTicks = 0;
+    BaseType_t xRet = pdFAIL;
+    bool xRetry = false;
+    bool xWaiting = false;
+    BandwidthBucket_t * pxBucket;
+
+    do
+    {
+        if( ( xBandwidthMutex == NULL ) || ( xClass >= CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT ) )
+        {
+            /* No slot can be taken before the manager is started. */
+            ESP_LOGE( TAG,
+                      "Cannot take a command slot for traffic class %d: the manager is not started or the class is invalid.",
+                      ( int ) xClass );
+            xRet = pdFAIL;
+        }
+        else if( xSemaphoreTake( xBandwidthMutex, portMAX_DELAY ) == pdTRUE )
+        {
+            pxBucket = &xBandwidthBuckets[ xClass ];
+
+            if( xBandwidthSharingEnabled == false )
+            {
+                /* The slots are counted outside of an OTA update too, so
+                 * that they are right when one starts. */
+                pxBucket->ulSlotsInUse++;
+                xWaitTicks = 0;
+            }
+            else
+            {
+                prvRefillBandwidthBuckets();
+                xWaitTicks = prvTakeBandwidth( xClass, xBytes );
+            }
+
+            xRet = ( xWaitTicks == 0U ) ? pdPASS : pdFAIL;
+            xWaitedTicks = xTaskGetTickCount() - xStartTick;
+            xRetry = ( ( xRet == pdFAIL ) && ( xWaitedTicks < xTicksToWait ) );
+
+            /* A waiting task stops the other classes from going beyond
+             * their share. */
+            if( ( xRetry == true ) && ( xWaiting == false ) )
+            {
+                pxBucket->ulWaiting++;
+                xWaiting = true;
+            }
+            else if( ( xRetry == false ) && ( xWaiting == true ) )
+            {
+                pxBucket->ulWaiting--;
+                xWaiting = false;
+
+                if( ( xRet == pdPASS ) && ( xBandwidthSharingEnabled == true ) )
+                {
+                    pxBucket->ulDelayedCommands++;
+                    pxBucket->xDelayedTicks += xWaitedTicks;
+                }
+            }
+
+            ( void ) xSemaphoreGive( xBandwidthMutex );
+        }
+
+        if( xRetry == true )
+        {
+            /* Sleep until the bucket should hold enough tokens, or a slot may
+             * have been released, then try again, as other tasks may have
+             * taken them meanwhile. */
+            if( xWaitTicks > ( xTicksToWait - xWaitedTicks ) )
+            {
+                xWaitTicks = xTicksToWait - xWaitedTicks;
+            }
+
+            vTaskDelay( xWaitTicks );
+        }
+    } while( xRetry == true );
+
+    return xRet;
+}
+
+void vCoreMqttAgentManagerReleaseBandwidth( CoreMqttAgentTrafficClass_t xClass )
+{
+    /* Only a wait that returned pdPASS took a slot to give back. */
+    configASSERT( xBandwidthMutex );
+    configASSERT( xClass < CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT );
+
+    if( xSemaphoreTake( xBandwidthMutex, portMAX_DELAY ) == pdTRUE )
+    {
+        configASSERT( xBandwidthBuckets[ xClass ].ulSlotsInUse > 0U );
+        xBandwidthBuckets[ xClass ].ulSlotsInUse--;
+
+        ( void ) xSemaphoreGive( xBandwidthMutex );
+    }
+}
+
 BaseType_t xCoreMqttAgentManagerRegisterHandler( esp_event_handler_t xEventHandler )
 {
     esp_err_t xEspErrRet;
@@ -1060,6 +1674,18 @@ BaseType_t xCoreMqttAgentManagerStart( NetworkContext_t * pxNetworkContextIn )
         }
     }
 
+    if( xRet != pdFAIL )
+    {
+        xBandwidthMutex = xSemaphoreCreateMutex();
+
+        if( xBandwidthMutex == NULL )
+        {
+            ESP_LOGE( TAG,
+                      "No memory to allocate the bandwidth sharing mutex." );
+            xRet = pdFAIL;
+        }
+    }
+
     if( xRet != pdFAIL )
     {
         /* Start coreMQTT-Agent. */
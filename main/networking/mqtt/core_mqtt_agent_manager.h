@@ -37,6 +37,18 @@
     #endif
 /* *INDENT-ON* */
 
+/**
+ * @brief Classes of traffic sharing the link while an OTA update is in
+ * progress.
+ */
+typedef enum CoreMqttAgentTrafficClass
+{
+    CORE_MQTT_AGENT_TRAFFIC_OTA = 0,
+    CORE_MQTT_AGENT_TRAFFIC_TELEMETRY,
+    CORE_MQTT_AGENT_TRAFFIC_CONTROL,
+    CORE_MQTT_AGENT_TRAFFIC_CLASS_COUNT
+} CoreMqttAgentTrafficClass_t;
+
 /**
  * @brief Register an event handler with coreMQTT-Agent events.
  *
@@ -68,6 +80,40 @@ BaseType_t xCoreMqttAgentManagerStart( NetworkContext_t * pxNetworkContextIn );
  */
 BaseType_t xCoreMqttAgentManagerPost( int32_t lEventId );
 
+/**
+ * @brief Wait until a traffic class may send a command to the coreMQTT-Agent.
+ *
+ * While an OTA update is in progress, each class of traffic gets its configured
+ * share of the link capacity and of the agent command queue, so telemetry and
+ * control keep a minimum rate during a download. A class goes beyond its share
+ * while the other classes have no command waiting. Otherwise, commands are not
+ * delayed.
+ *
+ * Each call returning pdPASS takes a command slot, which is given back with
+ * vCoreMqttAgentManagerReleaseBandwidth() once the command completed.
+ *
+ * @param[in] xClass Traffic class of the command.
+ * @param[in] xBytes Number of bytes the command sends or, for a request,
+ * causes the broker to send.
+ * @param[in] xTicksToWait Maximum time to wait.
+ *
+ * @return pdPASS if the command may be sent, pdFAIL if the wait timed out,
+ * the manager is not started or the traffic class is invalid.
+ */
+BaseType_t xCoreMqttAgentManagerWaitForBandwidth( CoreMqttAgentTrafficClass_t xClass,
+                                                  size_t xBytes,
+                                                  TickType_t xTicksToWait );
+
+/**
+ * @brief Give back the command slot taken by
+ * xCoreMqttAgentManagerWaitForBandwidth() once the command completed.
+ *
+ * Must only be called after a wait that returned pdPASS.
+ *
+ * @param[in] xClass Traffic class of the command.
+ */
+void vCoreMqttAgentManagerReleaseBandwidth( CoreMqttAgentTrafficClass_t xClass );
+
 /* *INDENT-OFF* */
     #ifdef __cplusplus
         } /* extern "C" */
@@ -106,6 +106,27 @@
  */
 #define configMQTT_AGENT_TASK_PRIORITY                  ( CONFIG_GRI_MQTT_AGENT_TASK_PRIORITY )
 
+/**
+ * @brief Link capacity in bytes per second shared between the traffic classes
+ * while an OTA update is in progress, and the percentage of it and of the agent
+ * command queue given to the OTA download and to control traffic. Telemetry
+ * gets the remainder. The shares only apply while several classes have
+ * commands waiting.
+ */
+#define configBANDWIDTH_LINK_CAPACITY_BYTES_PER_SECOND    ( CONFIG_GRI_MQTT_AGENT_LINK_CAPACITY_BYTES_PER_SECOND )
+#define configBANDWIDTH_OTA_PERCENT                       ( CONFIG_GRI_MQTT_AGENT_OTA_BANDWIDTH_PERCENT )
+#define configBANDWIDTH_CONTROL_PERCENT                   ( CONFIG_GRI_MQTT_AGENT_CONTROL_BANDWIDTH_PERCENT )
+
+/**
+ * @brief Period in milliseconds at which the dispatch statistics of the
+ * subscriptions are published. 0 disables the publish.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS
+    #define configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS    ( CONFIG_GRI_SUBSCRIPTION_MANAGER_DIAGNOSTICS_PERIOD_MS )
+#else
+    #define configSUBSCRIPTION_DIAGNOSTICS_PERIOD_MS    ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS */
+
 /* *INDENT-OFF* */
     #ifdef __cplusplus
         } /* extern "C" */
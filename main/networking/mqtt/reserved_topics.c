@@ -0,0 +1,335 @@
+/*
+ * ESP32-C3 Featured FreeRTOS IoT Integration V202204.00
+ * Copyright (C) 2022 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * https://www.FreeRTOS.org
+ * https://github.com/FreeRTOS
+ *
+ */
+
+/**
+ * @file reserved_topics.c
+ * @brief Static dispatch table for the AWS IoT reserved topics of this thing.
+ */
+
+/* Standard includes. */
+#include <string.h>
+
+/* Reserved topics header include. */
+#include "reserved_topics.h"
+
+/* Logging configuration for the Demo. */
+#ifndef LIBRARY_LOG_NAME
+    #define LIBRARY_LOG_NAME    "ReservedTopics"
+#endif
+
+#ifndef LIBRARY_LOG_LEVEL
+    #define LIBRARY_LOG_LEVEL    LOG_INFO
+#endif
+
+#include "logging_stack.h"
+
+/**
+ * @brief Number of slots of the perfect hash table. Must be a power of 2.
+ */
+#define RESERVED_TOPIC_HASH_SLOTS    ( 32U )
+
+/**
+ * @brief Position, from the end of the topic, of the character added to the
+ * suffix length by the perfect hash.
+ */
+#define RESERVED_TOPIC_HASH_CHAR     ( 4U )
+
+/**
+ * @brief Shortest reserved topic suffix, so that the hashed character is
+ * always within the suffix.
+ */
+#define RESERVED_TOPIC_MIN_SUFFIX    ( sizeof( "jobs/notify" ) - 1U )
+
+/**
+ * @brief Marks an empty slot of the perfect hash table. The other slots hold
+ * their reserved topic plus one.
+ */
+#define RESERVED_TOPIC_EMPTY_SLOT    ( 0U )
+
+/**
+ * @brief The reserved topic suffixes, the part after #RESERVED_TOPIC_PREFIX.
+ *
+ * Each suffix is split around the character the perfect hash adds to its
+ * length, so that the slot of the suffix is computed at build time. The
+ * character is given as a token, which RESERVED_TOPIC_KEY() turns into a
+ * character constant.
+ */
+#define RESERVED_TOPIC_LIST( X )                                                  \
+    X( ReservedTopicJobsNotify, "jobs/no", t, "ify" )                             \
+    X( ReservedTopicJobsNotifyNext, "jobs/notify-", n, "ext" )                    \
+    X( ReservedTopicJobsStartNextAccepted, "jobs/start-next/acce", p, "ted" )     \
+    X( ReservedTopicJobsStartNextRejected, "jobs/start-next/reje", c, "ted" )     \
+    X( ReservedTopicJobsGetNextAccepted, "jobs/$next/get/acce", p, "ted" )        \
+    X( ReservedTopicJobsGetNextRejected, "jobs/$next/get/reje", c, "ted" )        \
+    X( ReservedTopicShadowGetAccepted, "shadow/get/acce", p, "ted" )              \
+    X( ReservedTopicShadowGetRejected, "shadow/get/reje", c, "ted" )              \
+    X( ReservedTopicShadowUpdateAccepted, "shadow/update/acce", p, "ted" )        \
+    X( ReservedTopicShadowUpdateRejected, "shadow/update/reje", c, "ted" )        \
+    X( ReservedTopicShadowUpdateDelta, "shadow/update/d", e, "lta" )              \
+    X( ReservedTopicShadowUpdateDocuments, "shadow/update/docum", e, "nts" )
+
+/**
+ * @brief Character constants of the hashed characters of the suffixes.
+ */
+#define RESERVED_TOPIC_KEY( cKey )    RESERVED_TOPIC_KEY_ ## cKey
+#define RESERVED_TOPIC_KEY_c          'c'
+#define RESERVED_TOPIC_KEY_e          'e'
+#define RESERVED_TOPIC_KEY_n          'n'
+#define RESERVED_TOPIC_KEY_p          'p'
+#define RESERVED_TOPIC_KEY_t          't'
+
+/**
+ * @brief Length of a suffix of RESERVED_TOPIC_LIST().
+ */
+#define RESERVED_TOPIC_SUFFIX_LENGTH( pcHead, pcTail )    ( sizeof( pcHead ) + sizeof( pcTail ) - 1U )
+
+/**
+ * @brief Slot of a suffix of RESERVED_TOPIC_LIST() in the perfect hash table,
+ * computed the same way as getReservedTopic() does.
+ */
+#define RESERVED_TOPIC_SLOT( pcHead, cKey, pcTail )                                  \
+    ( ( RESERVED_TOPIC_SUFFIX_LENGTH( pcHead, pcTail ) + ( uint8_t ) RESERVED_TOPIC_KEY( cKey ) ) & \
+      ( RESERVED_TOPIC_HASH_SLOTS - 1U ) )
+
+/**
+ * @brief Declare a reserved topic as a compile time string and its length.
+ */
+#define RESERVED_TOPIC( pcSuffix )                                     \
+    {                                                                  \
+        RESERVED_TOPIC_PREFIX pcSuffix,                                \
+        ( uint16_t ) ( sizeof( RESERVED_TOPIC_PREFIX pcSuffix ) - 1U ) \
+    }
+
+/**
+ * @brief Expansions of RESERVED_TOPIC_LIST() for the tables and the build time
+ * checks.
+ */
+#define RESERVED_TOPIC_NAME_ENTRY( eTopic, pcHead, cKey, pcTail )    [ eTopic ] = RESERVED_TOPIC( pcHead #cKey pcTail ),
+#define RESERVED_TOPIC_SLOT_ENTRY( eTopic, pcHead, cKey, pcTail )    [ RESERVED_TOPIC_SLOT( pcHead, cKey, pcTail ) ] = ( uint8_t ) ( eTopic + 1 ),
+#define RESERVED_TOPIC_COUNT( eTopic, pcHead, cKey, pcTail )         +1U
+#define RESERVED_TOPIC_SLOT_SUM( eTopic, pcHead, cKey, pcTail )      +( 1ULL << RESERVED_TOPIC_SLOT( pcHead, cKey, pcTail ) )
+#define RESERVED_TOPIC_SLOT_MASK( eTopic, pcHead, cKey, pcTail )     | ( 1ULL << RESERVED_TOPIC_SLOT( pcHead, cKey, pcTail ) )
+#define RESERVED_TOPIC_CHECK( eTopic, pcHead, cKey, pcTail )                                                \
+    _Static_assert( sizeof( pcTail ) == RESERVED_TOPIC_HASH_CHAR,                                            \
+                    "The hashed character of " #eTopic " must be the RESERVED_TOPIC_HASH_CHAR-th from the end." ); \
+    _Static_assert( RESERVED_TOPIC_SUFFIX_LENGTH( pcHead, pcTail ) >= RESERVED_TOPIC_MIN_SUFFIX,             \
+                    "The suffix of " #eTopic " is shorter than RESERVED_TOPIC_MIN_SUFFIX." );
+
+_Static_assert( ( RESERVED_TOPIC_HASH_SLOTS & ( RESERVED_TOPIC_HASH_SLOTS - 1U ) ) == 0U,
+                "RESERVED_TOPIC_HASH_SLOTS must be a power of 2." );
+
+_Static_assert( ( 0U RESERVED_TOPIC_LIST( RESERVED_TOPIC_COUNT ) ) == ReservedTopicCount,
+                "RESERVED_TOPIC_LIST must have one suffix per reserved topic." );
+
+/* The sum of the slot bits only equals their union if no two suffixes share a
+ * slot. */
+_Static_assert( ( 0ULL RESERVED_TOPIC_LIST( RESERVED_TOPIC_SLOT_SUM ) ) == ( 0ULL RESERVED_TOPIC_LIST( RESERVED_TOPIC_SLOT_MASK ) ),
+                "Two reserved topic suffixes share a slot of the perfect hash table." );
+
+RESERVED_TOPIC_LIST( RESERVED_TOPIC_CHECK )
+
+/**
+ * @brief A reserved topic name.
+ */
+typedef struct ReservedTopicName
+{
+    const char * pcName;
+    uint16_t usLength;
+} ReservedTopicName_t;
+
+/**
+ * @brief Names of the reserved topics, in the order of ReservedTopic_t.
+ */
+static const ReservedTopicName_t xReservedTopicNames[ ReservedTopicCount ] =
+{
+    RESERVED_TOPIC_LIST( RESERVED_TOPIC_NAME_ENTRY )
+};
+
+/**
+ * @brief Perfect hash table of the reserved topics.
+ *
+ * A topic suffix hashes to its length plus its RESERVED_TOPIC_HASH_CHAR-th
+ * character from the end, modulo RESERVED_TOPIC_HASH_SLOTS. The table is built
+ * from RESERVED_TOPIC_LIST(), whose suffixes are checked above to have one slot
+ * each. The suffixes do not depend on the thing name, so neither does this
+ * table.
+ */
+static const uint8_t ucReservedTopicSlots[ RESERVED_TOPIC_HASH_SLOTS ] =
+{
+    RESERVED_TOPIC_LIST( RESERVED_TOPIC_SLOT_ENTRY )
+};
+
+/**
+ * @brief Callbacks of the reserved topics, and their contexts.
+ *
+ * They are set from the demo tasks and read from the MQTT agent task. A
+ * callback is stored with release semantics after its context, and loaded
+ * with acquire semantics before it, so the agent task sees the context set
+ * along with the callback.
+ */
+static IncomingPubCallback_t pxReservedTopicCallbacks[ ReservedTopicCount ];
+static void * pvReservedTopicContexts[ ReservedTopicCount ];
+
+/**
+ * @brief Bit mask of the reserved topics to subscribe again at the broker when
+ * the session is not resumed.
+ */
+static uint32_t ulReservedTopicResubscribe = 0U;
+
+/*-----------------------------------------------------------*/
+
+ReservedTopic_t getReservedTopic( const char * pcTopicName,
+                                  uint16_t usTopicNameLength )
+{
+    ReservedTopic_t eTopic = ReservedTopicNone;
+    uint16_t usSuffixLength = 0U;
+    uint8_t ucSlot = 0U;
+
+    if( ( pcTopicName != NULL ) &&
+        ( usTopicNameLength >= ( RESERVED_TOPIC_PREFIX_LENGTH + RESERVED_TOPIC_MIN_SUFFIX ) ) &&
+        ( pcTopicName[ 0 ] == '$' ) )
+    {
+        usSuffixLength = usTopicNameLength - RESERVED_TOPIC_PREFIX_LENGTH;
+        ucSlot = ucReservedTopicSlots[ ( usSuffixLength +
+                                         ( uint8_t ) pcTopicName[ usTopicNameLength - RESERVED_TOPIC_HASH_CHAR ] ) &
+                                       ( RESERVED_TOPIC_HASH_SLOTS - 1U ) ];
+
+        if( ( ucSlot != RESERVED_TOPIC_EMPTY_SLOT ) &&
+            ( xReservedTopicNames[ ucSlot - 1U ].usLength == usTopicNameLength ) &&
+            ( memcmp( xReservedTopicNames[ ucSlot - 1U ].pcName, pcTopicName, usTopicNameLength ) == 0 ) )
+        {
+            eTopic = ( ReservedTopic_t ) ( ucSlot - 1U );
+        }
+    }
+
+    return eTopic;
+}
+
+/*-----------------------------------------------------------*/
+
+bool checkReservedTopicTable( void )
+{
+    bool xValid = true;
+    ReservedTopic_t eTopic = ReservedTopicNone;
+
+    for( eTopic = ( ReservedTopic_t ) 0; eTopic < ReservedTopicCount; eTopic++ )
+    {
+        if( ( xReservedTopicNames[ eTopic ].usLength < ( RESERVED_TOPIC_PREFIX_LENGTH + RESERVED_TOPIC_MIN_SUFFIX ) ) ||
+            ( getReservedTopic( xReservedTopicNames[ eTopic ].pcName,
+                                xReservedTopicNames[ eTopic ].usLength ) != eTopic ) )
+        {
+            LogError( ( "Reserved topic %.*s does not hash to its own slot of the perfect hash table.",
+                        ( int ) xReservedTopicNames[ eTopic ].usLength,
+                        xReservedTopicNames[ eTopic ].pcName ) );
+            xValid = false;
+        }
+    }
+
+    return xValid;
+}
+
+/*-----------------------------------------------------------*/
+
+const char * getReservedTopicName( ReservedTopic_t eTopic,
+                                   uint16_t * pusTopicNameLength )
+{
+    const char * pcName = NULL;
+
+    if( ( eTopic < ReservedTopicCount ) &&
+        ( pusTopicNameLength != NULL ) )
+    {
+        pcName = xReservedTopicNames[ eTopic ].pcName;
+        *pusTopicNameLength = xReservedTopicNames[ eTopic ].usLength;
+    }
+
+    return pcName;
+}
+
+/*-----------------------------------------------------------*/
+
+bool setReservedTopicCallback( ReservedTopic_t eTopic,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext,
+                               bool xResubscribe )
+{
+    bool xReturnStatus = false;
+
+    if( eTopic < ReservedTopicCount )
+    {
+        __atomic_store_n( &( pvReservedTopicContexts[ eTopic ] ), pvIncomingPublishCallbackContext, __ATOMIC_RELAXED );
+        __atomic_store_n( &( pxReservedTopicCallbacks[ eTopic ] ), pxIncomingPublishCallback, __ATOMIC_RELEASE );
+
+        if( ( xResubscribe == true ) && ( pxIncomingPublishCallback != NULL ) )
+        {
+            ( void ) __atomic_fetch_or( &ulReservedTopicResubscribe, ( 1UL << eTopic ), __ATOMIC_RELEASE );
+        }
+        else
+        {
+            ( void ) __atomic_fetch_and( &ulReservedTopicResubscribe, ~( 1UL << eTopic ), __ATOMIC_RELEASE );
+        }
+
+        xReturnStatus = true;
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+bool reservedTopicNeedsResubscribe( ReservedTopic_t eTopic )
+{
+    return ( eTopic < ReservedTopicCount ) &&
+           ( ( __atomic_load_n( &ulReservedTopicResubscribe, __ATOMIC_ACQUIRE ) & ( 1UL << eTopic ) ) != 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+bool handleReservedTopicPublish( MQTTPublishInfo_t * pxPublishInfo )
+{
+    bool xPublishHandled = false;
+    ReservedTopic_t eTopic = ReservedTopicNone;
+    IncomingPubCallback_t pxCallback = NULL;
+
+    if( pxPublishInfo != NULL )
+    {
+        eTopic = getReservedTopic( pxPublishInfo->pTopicName,
+                                   pxPublishInfo->topicNameLength );
+    }
+
+    if( eTopic != ReservedTopicNone )
+    {
+        pxCallback = __atomic_load_n( &( pxReservedTopicCallbacks[ eTopic ] ), __ATOMIC_ACQUIRE );
+    }
+
+    if( pxCallback != NULL )
+    {
+        pxCallback( __atomic_load_n( &( pvReservedTopicContexts[ eTopic ] ), __ATOMIC_RELAXED ),
+                    pxPublishInfo );
+        xPublishHandled = true;
+    }
+
+    return xPublishHandled;
+}
@@ -0,0 +1,162 @@
+/*
+ * ESP32-C3 Featured FreeRTOS IoT Integration V202204.00
+ * Copyright (C) 2022 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * https://www.FreeRTOS.org
+ * https://github.com/FreeRTOS
+ *
+ */
+
+/**
+ * @file reserved_topics.h
+ * @brief Static dispatch table for the AWS IoT reserved topics of this thing.
+ */
+#ifndef RESERVED_TOPICS_H
+#define RESERVED_TOPICS_H
+
+/* ESP-IDF sdkconfig include. */
+#include <sdkconfig.h>
+
+/* Subscription manager include. */
+#include "subscription_manager.h"
+
+/**
+ * @brief Common prefix of the reserved topics of this thing. The thing name is
+ * fixed at build time, so the full topic strings are compile time constants.
+ */
+#define RESERVED_TOPIC_PREFIX           "$aws/things/" CONFIG_GRI_THING_NAME "/"
+
+/**
+ * @brief Length of #RESERVED_TOPIC_PREFIX.
+ */
+#define RESERVED_TOPIC_PREFIX_LENGTH    ( ( uint16_t ) ( sizeof( RESERVED_TOPIC_PREFIX ) - 1U ) )
+
+/* *INDENT-OFF* */
+    #ifdef __cplusplus
+        extern "C" {
+    #endif
+/* *INDENT-ON* */
+
+/**
+ * @brief The reserved topics of this thing whose name is known at build time.
+ *
+ * Topics containing a job ID or a stream name are only known at run time, and
+ * are routed by the subscription manager instead.
+ */
+typedef enum ReservedTopic
+{
+    ReservedTopicJobsNotify = 0,
+    ReservedTopicJobsNotifyNext,
+    ReservedTopicJobsStartNextAccepted,
+    ReservedTopicJobsStartNextRejected,
+    ReservedTopicJobsGetNextAccepted,
+    ReservedTopicJobsGetNextRejected,
+    ReservedTopicShadowGetAccepted,
+    ReservedTopicShadowGetRejected,
+    ReservedTopicShadowUpdateAccepted,
+    ReservedTopicShadowUpdateRejected,
+    ReservedTopicShadowUpdateDelta,
+    ReservedTopicShadowUpdateDocuments,
+    ReservedTopicCount,
+    ReservedTopicNone = ReservedTopicCount
+} ReservedTopic_t;
+
+/**
+ * @brief Find the reserved topic a topic name is, with one hash of the topic
+ * suffix and one compare.
+ *
+ * @param[in] pcTopicName The topic name.
+ * @param[in] usTopicNameLength Length of the topic name.
+ *
+ * @return The reserved topic, or #ReservedTopicNone.
+ */
+ReservedTopic_t getReservedTopic( const char * pcTopicName,
+                                  uint16_t usTopicNameLength );
+
+/**
+ * @brief Check that every reserved topic hashes to its own slot of the perfect
+ * hash table used by getReservedTopic().
+ *
+ * The table is built and checked at build time, so this only backs up these
+ * checks at run time.
+ *
+ * @return `true` if the table is consistent with the topic names, `false`
+ * otherwise, after logging the topics that are not found.
+ */
+bool checkReservedTopicTable( void );
+
+/**
+ * @brief Get the full name of a reserved topic.
+ *
+ * @param[in] eTopic The reserved topic.
+ * @param[out] pusTopicNameLength Length of the topic name.
+ *
+ * @return The topic name, which is not NULL terminated, or NULL if eTopic is
+ * not a reserved topic.
+ */
+const char * getReservedTopicName( ReservedTopic_t eTopic,
+                                   uint16_t * pusTopicNameLength );
+
+/**
+ * @brief Set the callback invoked for the incoming publishes on a reserved
+ * topic, in place of the subscription manager.
+ *
+ * Must be called before subscribing to the topic or requesting the publishes.
+ *
+ * @param[in] eTopic The reserved topic.
+ * @param[in] pxIncomingPublishCallback The callback, or NULL to clear it.
+ * @param[in] pvIncomingPublishCallbackContext Context for the callback.
+ * @param[in] xResubscribe Whether the topic is subscribed at the broker, and
+ * must be subscribed again if the broker does not resume the session.
+ *
+ * @return `true` if the callback was set, `false` if eTopic is not valid.
+ */
+bool setReservedTopicCallback( ReservedTopic_t eTopic,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext,
+                               bool xResubscribe );
+
+/**
+ * @brief Check whether a reserved topic has a callback, and needs to be
+ * subscribed again at the broker when the session is not resumed.
+ *
+ * @param[in] eTopic The reserved topic.
+ *
+ * @return `true` if the topic must be resubscribed.
+ */
+bool reservedTopicNeedsResubscribe( ReservedTopic_t eTopic );
+
+/**
+ * @brief Invoke the callback set for the reserved topic of an incoming
+ * publish, if any.
+ *
+ * @param[in] pxPublishInfo Info of incoming publish.
+ *
+ * @return `true` if a callback was invoked, `false` otherwise.
+ */
+bool handleReservedTopicPublish( MQTTPublishInfo_t * pxPublishInfo );
+
+/* *INDENT-OFF* */
+    #ifdef __cplusplus
+        } /* extern "C" */
+    #endif
+/* *INDENT-ON* */
+
+#endif /* RESERVED_TOPICS_H */
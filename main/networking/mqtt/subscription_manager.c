@@ -46,135 +46,3815 @@
 
 #include "logging_stack.h"
 
-bool addSubscription( SubscriptionElement_t * pxSubscriptionList,
+/**
+ * @brief Bit mask with a bit set for every slot of a block.
+ */
+#define BLOCK_FULL_MASK                                     \
+    ( ( SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS >= 32U ) ? \
+      UINT32_MAX :                                          \
+      ( ( 1UL << SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ) - 1UL ) )
+
+/**
+ * @brief Number of blocks in the pool, enough for every copy of a table.
+ */
+#define POOL_TOTAL_BLOCKS    ( SUBSCRIPTION_MANAGER_POOL_BLOCKS * SUBSCRIPTION_MANAGER_TABLE_COPIES )
+
+/**
+ * @brief Bit mask with a bit set for every block of the pool.
+ */
+#define POOL_FULL_MASK       ( ( uint32_t ) ( ( 1ULL << POOL_TOTAL_BLOCKS ) - 1ULL ) )
+
+#if ( POOL_TOTAL_BLOCKS > 32U )
+    #error "The subscription pool can have at most 32 blocks, or 16 when SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS is 1."
+#endif
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 ) && ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+    #error "SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS is not supported with SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE."
+#endif
+
+#if ( SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS > 32U )
+    #error "SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS can be at most 32."
+#endif
+
+#if ( ( SUBSCRIPTION_MANAGER_HASH_BUCKETS == 0U ) || ( ( SUBSCRIPTION_MANAGER_HASH_BUCKETS & ( SUBSCRIPTION_MANAGER_HASH_BUCKETS - 1U ) ) != 0U ) )
+    #error "SUBSCRIPTION_MANAGER_HASH_BUCKETS must be a power of 2."
+#endif
+
+#if ( SUBSCRIPTION_MANAGER_POOL_FROM_HEAP == 0 )
+
+/**
+ * @brief The pool from which subscription tables take their blocks.
+ */
+    static SubscriptionElement_t xSubscriptionPool[ POOL_TOTAL_BLOCKS ][ SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ];
+#endif
+
+/**
+ * @brief Bit mask of the pool blocks in use. Being 0 initialized, all blocks
+ * start free. Lists written from different tasks share the pool, so the mask
+ * is only accessed atomically.
+ */
+static uint32_t ulUsedPoolBlocks = 0U;
+
+/**
+ * @brief Get the subscription stored at an index of a table.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] xIndex Index of the subscription.
+ *
+ * @return The subscription, or NULL if there is none at this index.
+ */
+static SubscriptionElement_t * prvGetSubscription( SubscriptionTable_t * pxTable,
+                                                   size_t xIndex );
+
+/**
+ * @brief Add a subscription to a table. See addSubscriptionWithIndex().
+ */
+static bool prvAddSubscription( SubscriptionTable_t * pxTable,
+                                const char * pcTopicFilterString,
+                                uint16_t usTopicFilterLength,
+                                IncomingPubCallback_t pxIncomingPublishCallback,
+                                void * pvIncomingPublishCallbackContext,
+                                size_t * pxIndex );
+
+/**
+ * @brief Remove the subscription at an index of a table.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] xIndex Index of the subscription.
+ *
+ * @return `true` if there was a subscription at this index.
+ */
+static bool prvRemoveSubscriptionAtIndex( SubscriptionTable_t * pxTable,
+                                          size_t xIndex );
+
+/**
+ * @brief Remove subscriptions from a table. See removeSubscription() and
+ * removeSharedSubscription().
+ *
+ * @param[in] pxIncomingPublishCallback Callback of the subscription to remove,
+ * or NULL to remove all the subscriptions to the topic filter.
+ * @param[in] pvIncomingPublishCallbackContext Context of the subscription to
+ * remove, if pxIncomingPublishCallback is not NULL.
+ *
+ * @return `true` if a subscription was removed.
+ */
+static bool prvRemoveSubscription( SubscriptionTable_t * pxTable,
+                                   const char * pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                   void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Count the subscriptions of a table to a topic filter.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] pcTopicFilterString Topic filter string.
+ * @param[in] usTopicFilterLength Length of the topic filter string.
+ *
+ * @return Number of subscriptions to the topic filter, not counting one
+ * waiting for its UNSUBACK.
+ */
+static size_t prvCountSubscriptions( SubscriptionTable_t * pxTable,
+                                     const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength );
+
+/**
+ * @brief Add a subscription to a table if the topic filter already has one.
+ * See addSharedSubscription().
+ */
+static SharedSubscriptionStatus_t prvAddSharedSubscription( SubscriptionTable_t * pxTable,
+                                                            const char * pcTopicFilterString,
+                                                            uint16_t usTopicFilterLength,
+                                                            IncomingPubCallback_t pxIncomingPublishCallback,
+                                                            void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Remove a single subscription from a table. See
+ * removeSharedSubscription().
+ */
+static bool prvRemoveSharedSubscription( SubscriptionTable_t * pxTable,
+                                         const char * pcTopicFilterString,
+                                         uint16_t usTopicFilterLength,
+                                         IncomingPubCallback_t pxIncomingPublishCallback,
+                                         void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Remove the subscription to a topic filter kept until its UNSUBACK.
+ * See completeSharedUnsubscribe().
+ */
+static void prvCompleteSharedUnsubscribe( SubscriptionTable_t * pxTable,
+                                          const char * pcTopicFilterString,
+                                          uint16_t usTopicFilterLength );
+
+/**
+ * @brief Invoke the callbacks of a table matching an incoming publish. See
+ * handleIncomingPublishes().
+ */
+static bool prvHandleIncomingPublishes( SubscriptionTable_t * pxTable,
+                                        MQTTPublishInfo_t * pxPublishInfo );
+
+/**
+ * @brief Get the statistics of a table. See getSubscriptionManagerStats().
+ */
+static void prvGetTableStats( const SubscriptionTable_t * pxTable,
+                              SubscriptionManagerStats_t * pxStats );
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+
+/**
+ * @brief Register as a reader of the active copy of the table.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ *
+ * @return Index of the copy to read, to pass to prvEndRead().
+ */
+    static uint32_t prvBeginRead( SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Unregister a reader.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] ulTable Index returned by prvBeginRead().
+ */
+    static void prvEndRead( SubscriptionList_t * pxSubscriptionList,
+                            uint32_t ulTable );
+
+/**
+ * @brief Wait for the readers of a copy of the table to finish. The writer
+ * blocks on pvReadersDone, given by the last of these readers.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] ulTable Index of the copy.
+ */
+    static void prvWaitForReaders( SubscriptionList_t * pxSubscriptionList,
+                                   uint32_t ulTable );
+
+/**
+ * @brief Check if the calling task is dispatching incoming publishes of the
+ * list, in which case a write would wait for itself.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ *
+ * @return `true` if a write from the calling task must be refused.
+ */
+    static bool prvIsDispatchContext( const SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Get the copy of the table a writer updates first, once its readers
+ * are done.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ *
+ * @return Index of the copy.
+ */
+    static uint32_t prvBeginWrite( SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Publish the copy of the table updated first, and get the other copy
+ * once its readers are done. The writer then replays its update on it, which
+ * gives the same result as both copies were identical.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] ulTable Index returned by prvBeginWrite().
+ *
+ * @return Index of the other copy.
+ */
+    static uint32_t prvPublishWrite( SubscriptionList_t * pxSubscriptionList,
+                                     uint32_t ulTable );
+
+/**
+ * @brief Reserve the pool block each copy of the table needs to add a
+ * subscription, before the first copy is written.
+ *
+ * Both copies take their block from the reservation, and neither takes one if
+ * the pool cannot provide a block to each, so that the pool running out
+ * between the two writes cannot make the copies differ.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ */
+    static void prvReserveBlocks( SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Return the blocks reserved by prvReserveBlocks() which the write did
+ * not use to the pool.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ */
+    static void prvReleaseReservedBlocks( SubscriptionList_t * pxSubscriptionList );
+
+/**
+ * @brief Check that an update gave the same result on both copies of the
+ * table.
+ *
+ * @param[in] xMatches Whether the results are the same.
+ *
+ * @return xMatches.
+ */
+    static bool prvReplayMatches( bool xMatches );
+
+/**
+ * @brief Check the result of a subscription added to both copies of the
+ * table, and remove it from the copy which has it if the results differ.
+ *
+ * @param[in] pxSubscriptionList The subscription list.
+ * @param[in] ulTable Index returned by prvPublishWrite().
+ * @param[in] xAdded Result of the addition to the copy published first.
+ * @param[in] xReplayed Result of the addition to the other copy.
+ * @param[in] pcTopicFilterString Topic filter of the subscription.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[in] pxIncomingPublishCallback Callback of the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context of the subscription.
+ *
+ * @return `true` if the subscription was added to both copies.
+ */
+    static bool prvCheckReplayedAdd( SubscriptionList_t * pxSubscriptionList,
+                                     uint32_t ulTable,
+                                     bool xAdded,
+                                     bool xReplayed,
+                                     const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength,
+                                     IncomingPubCallback_t pxIncomingPublishCallback,
+                                     void * pvIncomingPublishCallbackContext );
+#else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+    #define prvIsDispatchContext( pxSubscriptionList )    ( false )
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 */
+
+/**
+ * @brief Take a block from the pool.
+ *
+ * @param[out] pucPoolBlock Number of the pool block taken.
+ *
+ * @return The block, or NULL if the pool is exhausted.
+ */
+static SubscriptionElement_t * prvTakePoolBlock( uint8_t * pucPoolBlock );
+
+/**
+ * @brief Return a block to the pool.
+ *
+ * @param[in] pxBlock The block.
+ * @param[in] ucPoolBlock Number of the pool block, from prvTakePoolBlock().
+ */
+static void prvGivePoolBlock( SubscriptionElement_t * pxBlock,
+                              uint8_t ucPoolBlock );
+
+/**
+ * @brief Take a free slot from the list, growing the list by one block from
+ * the pool if all of its slots are used.
+ *
+ * @param[in] pxTable The subscription table.
+ *
+ * @return Index of the slot, or SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS if the
+ * pool is exhausted.
+ */
+static size_t prvAllocateSlot( SubscriptionTable_t * pxTable );
+
+/**
+ * @brief Release a slot of the list, returning its block to the pool if the
+ * block is left empty.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] xIndex Index of the slot.
+ */
+static void prvFreeSlot( SubscriptionTable_t * pxTable,
+                         size_t xIndex );
+
+/*-----------------------------------------------------------*/
+
+static SubscriptionElement_t * prvTakePoolBlock( uint8_t * pucPoolBlock )
+{
+    SubscriptionElement_t * pxBlock = NULL;
+    uint32_t ulUsed = __atomic_load_n( &ulUsedPoolBlocks, __ATOMIC_RELAXED );
+    uint32_t ulPoolBlock = 0U;
+    bool xTaken = false;
+
+    while( ( xTaken == false ) && ( ulUsed != POOL_FULL_MASK ) )
+    {
+        ulPoolBlock = ( uint32_t ) __builtin_ctz( ~ulUsed );
+        xTaken = __atomic_compare_exchange_n( &ulUsedPoolBlocks,
+                                              &ulUsed,
+                                              ulUsed | ( 1UL << ulPoolBlock ),
+                                              false,
+                                              __ATOMIC_ACQ_REL,
+                                              __ATOMIC_RELAXED );
+    }
+
+    if( xTaken == true )
+    {
+        #if ( SUBSCRIPTION_MANAGER_POOL_FROM_HEAP == 1 )
+            pxBlock = SUBSCRIPTION_MANAGER_MALLOC( sizeof( SubscriptionElement_t ) * SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS );
+
+            if( pxBlock == NULL )
+            {
+                LogError( ( "Failed to allocate a subscription pool block of %u bytes.",
+                            ( unsigned int ) ( sizeof( SubscriptionElement_t ) * SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ) ) );
+
+                ( void ) __atomic_fetch_and( &ulUsedPoolBlocks, ~( 1UL << ulPoolBlock ), __ATOMIC_RELEASE );
+            }
+        #else
+            pxBlock = xSubscriptionPool[ ulPoolBlock ];
+        #endif
+    }
+
+    if( pxBlock != NULL )
+    {
+        memset( pxBlock, 0x00, sizeof( SubscriptionElement_t ) * SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS );
+        *pucPoolBlock = ( uint8_t ) ulPoolBlock;
+    }
+
+    return pxBlock;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvGivePoolBlock( SubscriptionElement_t * pxBlock,
+                              uint8_t ucPoolBlock )
+{
+    #if ( SUBSCRIPTION_MANAGER_POOL_FROM_HEAP == 1 )
+        SUBSCRIPTION_MANAGER_FREE( pxBlock );
+    #else
+        ( void ) pxBlock;
+    #endif
+
+    ( void ) __atomic_fetch_and( &ulUsedPoolBlocks, ~( 1UL << ucPoolBlock ), __ATOMIC_RELEASE );
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t prvAllocateSlot( SubscriptionTable_t * pxTable )
+{
+    size_t xIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+    uint16_t usBlock = 0U;
+    uint16_t usHole = SUBSCRIPTION_MANAGER_POOL_BLOCKS;
+
+    /* Prefer the lowest free slot so that subscriptions gather in the first
+     * blocks, letting the others be released. */
+    for( usBlock = 0U; usBlock < pxTable->usBlockCount; usBlock++ )
+    {
+        if( pxTable->pxBlocks[ usBlock ] == NULL )
+        {
+            if( usHole == SUBSCRIPTION_MANAGER_POOL_BLOCKS )
+            {
+                usHole = usBlock;
+            }
+        }
+        else if( pxTable->ulUsedSlots[ usBlock ] != BLOCK_FULL_MASK )
+        {
+            xIndex = ( ( size_t ) usBlock * SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ) +
+                     ( size_t ) __builtin_ctz( ~( pxTable->ulUsedSlots[ usBlock ] ) );
+            break;
+        }
+        else
+        {
+            /* The block is full. */
+        }
+    }
+
+    if( xIndex == SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+    {
+        /* Fill the hole left by a released block before growing the list. */
+        usBlock = ( usHole < SUBSCRIPTION_MANAGER_POOL_BLOCKS ) ? usHole : pxTable->usBlockCount;
+
+        if( usBlock < SUBSCRIPTION_MANAGER_POOL_BLOCKS )
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                /* The writer reserved the block before writing either copy. */
+                pxTable->pxBlocks[ usBlock ] = pxTable->pxReservedBlock;
+                pxTable->ucPoolBlocks[ usBlock ] = pxTable->ucReservedPoolBlock;
+                pxTable->pxReservedBlock = NULL;
+            #else
+                pxTable->pxBlocks[ usBlock ] = prvTakePoolBlock( &( pxTable->ucPoolBlocks[ usBlock ] ) );
+            #endif
+        }
+
+        if( ( usBlock < SUBSCRIPTION_MANAGER_POOL_BLOCKS ) &&
+            ( pxTable->pxBlocks[ usBlock ] != NULL ) )
+        {
+            pxTable->ulUsedSlots[ usBlock ] = 0U;
+
+            if( usBlock == pxTable->usBlockCount )
+            {
+                pxTable->usBlockCount++;
+            }
+
+            xIndex = ( size_t ) usBlock * SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS;
+        }
+    }
+
+    if( xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+    {
+        pxTable->ulUsedSlots[ xIndex / SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ] |=
+            ( 1UL << ( xIndex % SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ) );
+        pxTable->usSubscriptionCount++;
+
+        if( pxTable->usSubscriptionCount > pxTable->usHighWatermark )
+        {
+            pxTable->usHighWatermark = pxTable->usSubscriptionCount;
+        }
+    }
+
+    return xIndex;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvFreeSlot( SubscriptionTable_t * pxTable,
+                         size_t xIndex )
+{
+    uint16_t usBlock = ( uint16_t ) ( xIndex / SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS );
+
+    memset( prvGetSubscription( pxTable, xIndex ), 0x00, sizeof( SubscriptionElement_t ) );
+    pxTable->ulUsedSlots[ usBlock ] &= ~( 1UL << ( xIndex % SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ) );
+    pxTable->usSubscriptionCount--;
+
+    /* The other blocks keep their position, so that the index of the remaining
+     * subscriptions does not change. */
+    if( pxTable->ulUsedSlots[ usBlock ] == 0U )
+    {
+        prvGivePoolBlock( pxTable->pxBlocks[ usBlock ], pxTable->ucPoolBlocks[ usBlock ] );
+        pxTable->pxBlocks[ usBlock ] = NULL;
+    }
+
+    while( ( pxTable->usBlockCount > 0U ) &&
+           ( pxTable->pxBlocks[ pxTable->usBlockCount - 1U ] == NULL ) )
+    {
+        pxTable->usBlockCount--;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Increment a dispatch counter, which concurrent readers may share when
+ * SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS is 1.
+ */
+#if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+    #define COUNTER_ADD( ulCounter, ulValue )    ( void ) __atomic_fetch_add( &( ulCounter ), ( ulValue ), __ATOMIC_RELAXED )
+#else
+    #define COUNTER_ADD( ulCounter, ulValue )    ( ulCounter ) += ( ulValue )
+#endif
+
+#define COUNTER_INCREMENT( ulCounter )    COUNTER_ADD( ulCounter, 1U )
+
+/**
+ * @brief Check whether a subscription must be matched with wildcard matching,
+ * rather than through the exact match hash table.
+ */
+#if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+    #define SUBSCRIPTION_NEEDS_WILDCARD_MATCH( pxSubscription )    ( ( pxSubscription )->xIsExactMatch == false )
+#else
+    #define SUBSCRIPTION_NEEDS_WILDCARD_MATCH( pxSubscription )    ( true )
+#endif
+
+/**
+ * @brief Invoke the callback of a matching subscription, and record its
+ * dispatch statistics when SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS is 1.
+ *
+ * @param[in] pxSubscription The matching subscription.
+ * @param[in] pxPublishInfo Info of incoming publish.
+ */
+static void prvInvokeCallback( SubscriptionElement_t * pxSubscription,
+                               MQTTPublishInfo_t * pxPublishInfo );
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 )
+
+/**
+ * @brief Record one run of a subscription callback.
+ *
+ * @param[in] pxSubscription The subscription.
+ * @param[in] pxPublishInfo Info of the publish delivered to the callback.
+ * @param[in] ulElapsedUs Time spent in the callback.
+ */
+    static void prvRecordDispatch( SubscriptionElement_t * pxSubscription,
+                                   const MQTTPublishInfo_t * pxPublishInfo,
+                                   uint32_t ulElapsedUs );
+#endif
+
+/*-----------------------------------------------------------*/
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 )
+
+    static void prvRecordDispatch( SubscriptionElement_t * pxSubscription,
+                                   const MQTTPublishInfo_t * pxPublishInfo,
+                                   uint32_t ulElapsedUs )
+    {
+        SubscriptionDispatchStats_t * pxStats = &( pxSubscription->xDispatchStats );
+
+        COUNTER_INCREMENT( pxStats->ulMatches );
+        COUNTER_ADD( pxStats->ulBytesDelivered, ( uint32_t ) pxPublishInfo->payloadLength );
+        COUNTER_ADD( pxStats->ulCallbackTimeUs, ulElapsedUs );
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        {
+            /* Readers of the same copy of the table may race on the maximum. */
+            uint32_t ulMax = __atomic_load_n( &( pxStats->ulMaxCallbackTimeUs ), __ATOMIC_RELAXED );
+
+            while( ( ulElapsedUs > ulMax ) &&
+                   ( __atomic_compare_exchange_n( &( pxStats->ulMaxCallbackTimeUs ), &ulMax, ulElapsedUs,
+                                                  false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) == false ) )
+            {
+            }
+        }
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            if( ulElapsedUs > pxStats->ulMaxCallbackTimeUs )
+            {
+                pxStats->ulMaxCallbackTimeUs = ulElapsedUs;
+            }
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+
+        if( ( SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US > 0U ) &&
+            ( ulElapsedUs > SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US ) )
+        {
+            COUNTER_INCREMENT( pxStats->ulSlowCallbacks );
+
+            LogWarn( ( "Callback for topic filter %.*s took %u us, over the %u us slow callback threshold.",
+                       ( int ) pxSubscription->usFilterStringLength,
+                       pxSubscription->pcSubscriptionFilterString,
+                       ( unsigned int ) ulElapsedUs,
+                       ( unsigned int ) SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US ) );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 */
+
+static void prvInvokeCallback( SubscriptionElement_t * pxSubscription,
+                               MQTTPublishInfo_t * pxPublishInfo )
+{
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 )
+        IncomingPubCallback_t pxCallback = pxSubscription->pxIncomingPublishCallback;
+        void * pvContext = pxSubscription->pvIncomingPublishCallbackContext;
+        uint32_t ulStartUs = ( uint32_t ) SUBSCRIPTION_MANAGER_GET_TIME_US();
+        uint32_t ulElapsedUs = 0U;
+
+        pxCallback( pvContext, pxPublishInfo );
+
+        ulElapsedUs = ( uint32_t ) SUBSCRIPTION_MANAGER_GET_TIME_US() - ulStartUs;
+
+        /* Skip the statistics if the callback removed its own subscription. */
+        if( ( pxSubscription->pxIncomingPublishCallback == pxCallback ) &&
+            ( pxSubscription->pvIncomingPublishCallbackContext == pvContext ) )
+        {
+            prvRecordDispatch( pxSubscription, pxPublishInfo, ulElapsedUs );
+        }
+    #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 ) */
+        pxSubscription->pxIncomingPublishCallback( pxSubscription->pvIncomingPublishCallbackContext,
+                                                   pxPublishInfo );
+    #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 ) */
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 ) || ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+
+/**
+ * @brief Invoke the callbacks of the matched subscriptions.
+ *
+ * When SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS is 1, the entries are taken
+ * before invoking any callback, so every callback runs with the subscriptions
+ * the dispatch started with. Otherwise a callback may remove a subscription,
+ * and the entries are taken again before each callback.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] pusMatches Indices of the matched subscriptions.
+ * @param[in] xMatchCount Number of matched subscriptions.
+ * @param[in] pxPublishInfo Info of incoming publish.
+ *
+ * @return `true` if a callback was invoked.
+ */
+    static bool prvInvokeMatches( SubscriptionTable_t * pxTable,
+                                  const uint16_t * pusMatches,
+                                  size_t xMatchCount,
+                                  MQTTPublishInfo_t * pxPublishInfo );
+
+/*-----------------------------------------------------------*/
+
+    static bool prvInvokeMatches( SubscriptionTable_t * pxTable,
+                                  const uint16_t * pusMatches,
+                                  size_t xMatchCount,
+                                  MQTTPublishInfo_t * pxPublishInfo )
+    {
+        size_t xIndex = 0U;
+        SubscriptionElement_t * pxSubscription = NULL;
+        bool xInvoked = false;
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            SubscriptionElement_t * pxMatched[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+
+            for( xIndex = 0U; xIndex < xMatchCount; xIndex++ )
+            {
+                pxMatched[ xIndex ] = prvGetSubscription( pxTable, pusMatches[ xIndex ] );
+            }
+        #endif
+
+        for( xIndex = 0U; xIndex < xMatchCount; xIndex++ )
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                pxSubscription = pxMatched[ xIndex ];
+            #else
+                /* A previous callback may have removed this subscription. */
+                pxSubscription = prvGetSubscription( pxTable, pusMatches[ xIndex ] );
+            #endif
+
+            if( ( pxSubscription != NULL ) &&
+                ( pxSubscription->xUnsubscribing == false ) )
+            {
+                prvInvokeCallback( pxSubscription, pxPublishInfo );
+                xInvoked = true;
+            }
+        }
+
+        return xInvoked;
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 ) || ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 ) */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 ) || ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+/**
+ * @brief Compute the FNV-1a hash of a topic name or topic filter.
+ *
+ * @param[in] pcString The string to hash.
+ * @param[in] usLength Length of the string.
+ *
+ * @return The hash.
+ */
+    static uint32_t prvHashTopic( const char * pcString,
+                                  uint16_t usLength );
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvHashTopic( const char * pcString,
+                                  uint16_t usLength )
+    {
+        uint32_t ulHash = 2166136261UL;
+        uint16_t usIndex = 0U;
+
+        for( usIndex = 0U; usIndex < usLength; usIndex++ )
+        {
+            ulHash ^= ( uint8_t ) pcString[ usIndex ];
+            ulHash *= 16777619UL;
+        }
+
+        return ulHash;
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 ) || ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 ) */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+
+/**
+ * @brief Add a subscription without wildcards to the hash table.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] xIndex Index of the subscription.
+ */
+    static void prvHashInsert( SubscriptionTable_t * pxTable,
+                               size_t xIndex );
+
+/**
+ * @brief Remove a subscription without wildcards from the hash table.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] xIndex Index of the subscription.
+ */
+    static void prvHashRemove( SubscriptionTable_t * pxTable,
+                               size_t xIndex );
+
+/**
+ * @brief Collect the subscriptions whose topic filter equals the topic name.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] pcTopicName Topic name of the incoming publish.
+ * @param[in] usTopicNameLength Length of the topic name.
+ * @param[out] pusMatches Array receiving the indices of the matches.
+ * @param[in,out] pxMatchCount Number of entries in pusMatches.
+ */
+    static void prvHashMatch( SubscriptionTable_t * pxTable,
+                              const char * pcTopicName,
+                              uint16_t usTopicNameLength,
+                              uint16_t * pusMatches,
+                              size_t * pxMatchCount );
+
+/*-----------------------------------------------------------*/
+
+    static void prvHashInsert( SubscriptionTable_t * pxTable,
+                               size_t xIndex )
+    {
+        SubscriptionElement_t * pxSubscription = prvGetSubscription( pxTable, xIndex );
+        uint16_t * pusBucket = NULL;
+
+        pxSubscription->ulFilterHash = prvHashTopic( pxSubscription->pcSubscriptionFilterString,
+                                                     pxSubscription->usFilterStringLength );
+        pusBucket = &( pxTable->usHashBuckets[ pxSubscription->ulFilterHash & ( SUBSCRIPTION_MANAGER_HASH_BUCKETS - 1U ) ] );
+
+        pxSubscription->usNextInBucket = *pusBucket;
+        *pusBucket = ( uint16_t ) ( xIndex + 1U );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvHashRemove( SubscriptionTable_t * pxTable,
+                               size_t xIndex )
+    {
+        SubscriptionElement_t * pxSubscription = prvGetSubscription( pxTable, xIndex );
+        uint16_t * pusLink = &( pxTable->usHashBuckets[ pxSubscription->ulFilterHash & ( SUBSCRIPTION_MANAGER_HASH_BUCKETS - 1U ) ] );
+
+        while( *pusLink != 0U )
+        {
+            if( *pusLink == ( uint16_t ) ( xIndex + 1U ) )
+            {
+                *pusLink = pxSubscription->usNextInBucket;
+                break;
+            }
+
+            pusLink = &( prvGetSubscription( pxTable, *pusLink - 1U )->usNextInBucket );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvHashMatch( SubscriptionTable_t * pxTable,
+                              const char * pcTopicName,
+                              uint16_t usTopicNameLength,
+                              uint16_t * pusMatches,
+                              size_t * pxMatchCount )
+    {
+        uint32_t ulHash = prvHashTopic( pcTopicName, usTopicNameLength );
+        uint16_t usNext = pxTable->usHashBuckets[ ulHash & ( SUBSCRIPTION_MANAGER_HASH_BUCKETS - 1U ) ];
+        SubscriptionElement_t * pxSubscription = NULL;
+
+        while( usNext != 0U )
+        {
+            pxSubscription = prvGetSubscription( pxTable, usNext - 1U );
+
+            if( ( pxSubscription->ulFilterHash == ulHash ) &&
+                ( pxSubscription->usFilterStringLength == usTopicNameLength ) &&
+                ( memcmp( pxSubscription->pcSubscriptionFilterString, pcTopicName, usTopicNameLength ) == 0 ) )
+            {
+                pusMatches[ *pxMatchCount ] = ( uint16_t ) ( usNext - 1U );
+                ( *pxMatchCount )++;
+            }
+
+            usNext = pxSubscription->usNextInBucket;
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+/**
+ * @brief Compare two strings of the same length one 32 bit word at a time.
+ *
+ * @param[in] pcFirst The first string.
+ * @param[in] pcSecond The second string.
+ * @param[in] xLength Length of the strings.
+ *
+ * @return `true` if the strings are equal.
+ */
+    static bool prvLiteralEqual( const char * pcFirst,
+                                 const char * pcSecond,
+                                 size_t xLength );
+
+/**
+ * @brief Record the levels and wildcards of the topic filter of a
+ * subscription. The filter is left uncompiled, and matched with
+ * MQTT_MatchTopic, if it has more than SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS
+ * levels or is longer than 255 bytes.
+ *
+ * @param[in] pxSubscription The subscription.
+ */
+    static void prvCompileFilter( SubscriptionElement_t * pxSubscription );
+
+/**
+ * @brief Match a topic name against the compiled topic filter of a
+ * subscription.
+ *
+ * @param[in] pxSubscription The subscription, whose filter is compiled.
+ * @param[in] pcTopicName Topic name of the incoming publish.
+ * @param[in] usTopicNameLength Length of the topic name.
+ * @param[in] ulFirstLevelHash Hash of the first level of the topic name.
+ *
+ * @return `true` if the topic name matches the topic filter.
+ */
+    static bool prvMatchCompiledFilter( const SubscriptionElement_t * pxSubscription,
+                                        const char * pcTopicName,
+                                        uint16_t usTopicNameLength,
+                                        uint32_t ulFirstLevelHash );
+
+/*-----------------------------------------------------------*/
+
+    static bool prvLiteralEqual( const char * pcFirst,
+                                 const char * pcSecond,
+                                 size_t xLength )
+    {
+        uint32_t ulFirstWord = 0U, ulSecondWord = 0U;
+        bool xEqual = true;
+
+        /* The filter and topic strings have no alignment guarantee, memcpy lets
+         * the compiler pick the fastest load that is safe on the target. */
+        while( ( xEqual == true ) && ( xLength >= sizeof( uint32_t ) ) )
+        {
+            memcpy( &ulFirstWord, pcFirst, sizeof( uint32_t ) );
+            memcpy( &ulSecondWord, pcSecond, sizeof( uint32_t ) );
+            xEqual = ( ulFirstWord == ulSecondWord );
+            pcFirst += sizeof( uint32_t );
+            pcSecond += sizeof( uint32_t );
+            xLength -= sizeof( uint32_t );
+        }
+
+        while( ( xEqual == true ) && ( xLength > 0U ) )
+        {
+            xEqual = ( *pcFirst == *pcSecond );
+            pcFirst++;
+            pcSecond++;
+            xLength--;
+        }
+
+        return xEqual;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvCompileFilter( SubscriptionElement_t * pxSubscription )
+    {
+        SubscriptionCompiledFilter_t * pxCompiled = &( pxSubscription->xCompiledFilter );
+        const char * pcFilter = pxSubscription->pcSubscriptionFilterString;
+        uint16_t usLength = pxSubscription->usFilterStringLength;
+        uint16_t usIndex = 0U, usLevelStart = 0U;
+        uint8_t ucLevel = 0U;
+        bool xInLiteralPrefix = true, xCompiled = ( usLength <= UINT8_MAX );
+
+        memset( pxCompiled, 0x00, sizeof( SubscriptionCompiledFilter_t ) );
+
+        /* Every level starts at the beginning of the filter or after a '/'. */
+        for( usIndex = 0U; ( xCompiled == true ) && ( usIndex <= usLength ); usIndex++ )
+        {
+            if( ( usIndex == usLength ) || ( pcFilter[ usIndex ] == '/' ) )
+            {
+                if( ucLevel == SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS )
+                {
+                    xCompiled = false;
+                }
+                else
+                {
+                    pxCompiled->ucLevelOffsets[ ucLevel ] = ( uint8_t ) usLevelStart;
+
+                    if( ( ( usIndex - usLevelStart ) == 1U ) && ( pcFilter[ usLevelStart ] == '+' ) )
+                    {
+                        pxCompiled->ulSingleLevelWildcards |= ( 1UL << ucLevel );
+                        xInLiteralPrefix = false;
+                    }
+                    else if( ( ( usIndex - usLevelStart ) == 1U ) && ( pcFilter[ usLevelStart ] == '#' ) )
+                    {
+                        pxCompiled->xEndsWithMultiLevelWildcard = true;
+                        xInLiteralPrefix = false;
+                    }
+                    else if( xInLiteralPrefix == true )
+                    {
+                        pxCompiled->usLiteralPrefixLength = usIndex;
+                        pxCompiled->ucLiteralLevels = ( uint8_t ) ( ucLevel + 1U );
+                    }
+                    else
+                    {
+                        /* A literal level after a wildcard. */
+                    }
+
+                    ucLevel++;
+                    usLevelStart = usIndex + 1U;
+                }
+            }
+        }
+
+        if( xCompiled == true )
+        {
+            pxCompiled->ucLevelCount = ucLevel;
+
+            if( pxCompiled->ucLiteralLevels > 0U )
+            {
+                pxCompiled->ulFirstLevelHash = prvHashTopic( pcFilter,
+                                                             ( pxCompiled->ucLevelCount > 1U ) ?
+                                                             ( uint16_t ) ( pxCompiled->ucLevelOffsets[ 1 ] - 1U ) :
+                                                             usLength );
+            }
+        }
+        else
+        {
+            memset( pxCompiled, 0x00, sizeof( SubscriptionCompiledFilter_t ) );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvMatchCompiledFilter( const SubscriptionElement_t * pxSubscription,
+                                        const char * pcTopicName,
+                                        uint16_t usTopicNameLength,
+                                        uint32_t ulFirstLevelHash )
+    {
+        const SubscriptionCompiledFilter_t * pxCompiled = &( pxSubscription->xCompiledFilter );
+        const char * pcFilter = pxSubscription->pcSubscriptionFilterString;
+        const char * pcSeparator = NULL;
+        uint16_t usPrefixLength = pxCompiled->usLiteralPrefixLength;
+        uint16_t usTopicIndex = 0U, usFilterLevelStart = 0U, usFilterLevelEnd = 0U, usTopicLevelLength = 0U;
+        uint8_t ucLevel = 0U;
+        bool xMatch = false, xRestMatched = false;
+
+        if( pxCompiled->ucLiteralLevels == 0U )
+        {
+            /* Wildcards do not match the first level of topics starting with
+             * '$', such as the AWS reserved topics. */
+            xMatch = ( usTopicNameLength == 0U ) || ( pcTopicName[ 0 ] != '$' );
+        }
+        else
+        {
+            /* Most topics not matching the filter differ on their first level,
+             * and are rejected by comparing its hash. */
+            xMatch = ( pxCompiled->ulFirstLevelHash == ulFirstLevelHash ) &&
+                     ( usTopicNameLength >= usPrefixLength ) &&
+                     ( ( usTopicNameLength == usPrefixLength ) || ( pcTopicName[ usPrefixLength ] == '/' ) ) &&
+                     prvLiteralEqual( pcFilter, pcTopicName, usPrefixLength );
+
+            /* Past the end of the topic if it has no more levels. */
+            usTopicIndex = usPrefixLength + 1U;
+        }
+
+        for( ucLevel = pxCompiled->ucLiteralLevels;
+             ( xMatch == true ) && ( xRestMatched == false ) && ( ucLevel < pxCompiled->ucLevelCount );
+             ucLevel++ )
+        {
+            usFilterLevelStart = pxCompiled->ucLevelOffsets[ ucLevel ];
+            usFilterLevelEnd = ( ( ucLevel + 1U ) < pxCompiled->ucLevelCount ) ?
+                               ( uint16_t ) ( pxCompiled->ucLevelOffsets[ ucLevel + 1U ] - 1U ) :
+                               pxSubscription->usFilterStringLength;
+
+            if( ( pxCompiled->xEndsWithMultiLevelWildcard == true ) &&
+                ( ( ucLevel + 1U ) == pxCompiled->ucLevelCount ) )
+            {
+                /* '#' also matches the parent level, so the topic may have no
+                 * level left. */
+                xRestMatched = true;
+            }
+            else if( usTopicIndex > usTopicNameLength )
+            {
+                xMatch = false;
+            }
+            else
+            {
+                pcSeparator = memchr( &( pcTopicName[ usTopicIndex ] ), '/', ( size_t ) ( usTopicNameLength - usTopicIndex ) );
+                usTopicLevelLength = ( pcSeparator != NULL ) ?
+                                     ( uint16_t ) ( pcSeparator - &( pcTopicName[ usTopicIndex ] ) ) :
+                                     ( uint16_t ) ( usTopicNameLength - usTopicIndex );
+
+                if( ( pxCompiled->ulSingleLevelWildcards & ( 1UL << ucLevel ) ) == 0U )
+                {
+                    xMatch = ( usTopicLevelLength == ( usFilterLevelEnd - usFilterLevelStart ) ) &&
+                             prvLiteralEqual( &( pcFilter[ usFilterLevelStart ] ),
+                                              &( pcTopicName[ usTopicIndex ] ),
+                                              usTopicLevelLength );
+                }
+
+                usTopicIndex += usTopicLevelLength + 1U;
+            }
+        }
+
+        /* Without a trailing '#', the topic must have no level left. */
+        return ( xMatch == true ) &&
+               ( ( xRestMatched == true ) || ( usTopicIndex > usTopicNameLength ) );
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+
+/**
+ * @brief Check whether a trie node holds the given topic level.
+ */
+    #define TRIE_NODE_IS_LEVEL( pxNode, pcLevelString, usLength )                          \
+    ( ( ( pxNode )->usLevelLength == ( usLength ) ) &&                                      \
+      ( memcmp( ( pxNode )->pcLevel, ( pcLevelString ), ( size_t ) ( usLength ) ) == 0 ) )
+
+/**
+ * @brief Find the length of the topic level starting at pcLevel.
+ *
+ * @param[in] pcLevel Start of the level.
+ * @param[in] usRemainingLength Length of the string from pcLevel to its end.
+ * @param[out] pxIsLastLevel Set to true if no '/' follows this level.
+ *
+ * @return Length of the level, excluding the '/' separator.
+ */
+    static uint16_t prvGetLevelLength( const char * pcLevel,
+                                       uint16_t usRemainingLength,
+                                       bool * pxIsLastLevel );
+
+/**
+ * @brief Add a topic filter to the trie, creating the nodes for its levels.
+ *
+ * @param[in] pxTrie The topic trie.
+ * @param[in] pcTopicFilterString Topic filter string. Must stay in scope while
+ * it is in the trie.
+ * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] usSubscriptionIndex Index of the subscription in the list.
+ *
+ * @return `true` if inserted, `false` if there are not enough trie nodes.
+ */
+    static bool prvTrieInsert( SubscriptionTrie_t * pxTrie,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               uint16_t usSubscriptionIndex );
+
+/**
+ * @brief Rebuild the trie from the subscriptions in the list.
+ *
+ * Used after a removal, as the removed filter string may be referenced by
+ * nodes shared with other subscriptions.
+ *
+ * @param[in] pxTable The subscription table.
+ */
+    static void prvTrieRebuild( SubscriptionTable_t * pxTable );
+
+/**
+ * @brief Collect the subscriptions of the children of a node which match the
+ * topic level at pcLevel, descending into the levels that follow it.
+ *
+ * @param[in] pxTrie The topic trie.
+ * @param[in] usNodeIndex Node whose children are matched.
+ * @param[in] pcLevel Start of the topic level to match.
+ * @param[in] usRemainingLength Length of the topic from pcLevel to its end.
+ * @param[in] xWildcardAllowed `false` if wildcards may not match this level,
+ * i.e. the first level of a topic beginning with '$'.
+ * @param[out] pusMatches Indexes of the matching subscriptions.
+ * @param[in,out] pxMatchCount Number of entries in pusMatches.
+ */
+    static void prvTrieMatch( const SubscriptionTrie_t * pxTrie,
+                              uint16_t usNodeIndex,
+                              const char * pcLevel,
+                              uint16_t usRemainingLength,
+                              bool xWildcardAllowed,
+                              uint16_t * pusMatches,
+                              size_t * pxMatchCount );
+
+/**
+ * @brief Append the subscriptions ending at a node to the match list.
+ */
+    static void prvTrieCollect( const SubscriptionTrie_t * pxTrie,
+                                uint16_t usNodeIndex,
+                                uint16_t * pusMatches,
+                                size_t * pxMatchCount );
+
+/*-----------------------------------------------------------*/
+
+    static uint16_t prvGetLevelLength( const char * pcLevel,
+                                       uint16_t usRemainingLength,
+                                       bool * pxIsLastLevel )
+    {
+        const char * pcSeparator = memchr( pcLevel, '/', ( size_t ) usRemainingLength );
+
+        *pxIsLastLevel = ( pcSeparator == NULL );
+
+        return ( pcSeparator == NULL ) ? usRemainingLength : ( uint16_t ) ( pcSeparator - pcLevel );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvTrieInsert( SubscriptionTrie_t * pxTrie,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               uint16_t usSubscriptionIndex )
+    {
+        uint16_t usNodeIndex = 0U, usChild = 0U, usLevelLength = 0U;
+        uint16_t usRemainingLength = usTopicFilterLength;
+        const char * pcLevel = pcTopicFilterString;
+        bool xIsLastLevel = false, xReturnStatus = true;
+
+        /* The root is created with the first subscription. */
+        if( pxTrie->usNodeCount == 0U )
+        {
+            memset( &( pxTrie->xNodes[ 0 ] ), 0x00, sizeof( SubscriptionTrieNode_t ) );
+            pxTrie->usNodeCount = 1U;
+        }
+
+        while( ( xReturnStatus == true ) && ( xIsLastLevel == false ) )
+        {
+            usLevelLength = prvGetLevelLength( pcLevel, usRemainingLength, &xIsLastLevel );
+
+            /* Look for the level amongst the children of the current node. */
+            for( usChild = pxTrie->xNodes[ usNodeIndex ].usFirstChild;
+                 usChild != 0U;
+                 usChild = pxTrie->xNodes[ usChild - 1U ].usNextSibling )
+            {
+                if( TRIE_NODE_IS_LEVEL( &( pxTrie->xNodes[ usChild - 1U ] ), pcLevel, usLevelLength ) )
+                {
+                    break;
+                }
+            }
+
+            if( usChild == 0U )
+            {
+                if( pxTrie->usNodeCount < SUBSCRIPTION_MANAGER_TRIE_MAX_NODES )
+                {
+                    usChild = ++( pxTrie->usNodeCount );
+                    pxTrie->xNodes[ usChild - 1U ].pcLevel = pcLevel;
+                    pxTrie->xNodes[ usChild - 1U ].usLevelLength = usLevelLength;
+                    pxTrie->xNodes[ usChild - 1U ].usFirstChild = 0U;
+                    pxTrie->xNodes[ usChild - 1U ].usFirstSubscription = 0U;
+                    pxTrie->xNodes[ usChild - 1U ].usNextSibling = pxTrie->xNodes[ usNodeIndex ].usFirstChild;
+                    pxTrie->xNodes[ usNodeIndex ].usFirstChild = usChild;
+                }
+                else
+                {
+                    xReturnStatus = false;
+                }
+            }
+
+            if( xReturnStatus == true )
+            {
+                usNodeIndex = usChild - 1U;
+
+                if( xIsLastLevel == false )
+                {
+                    pcLevel = &( pcLevel[ usLevelLength + 1U ] );
+                    usRemainingLength -= ( uint16_t ) ( usLevelLength + 1U );
+                }
+            }
+        }
+
+        if( xReturnStatus == true )
+        {
+            pxTrie->usNextSubscription[ usSubscriptionIndex ] = pxTrie->xNodes[ usNodeIndex ].usFirstSubscription;
+            pxTrie->xNodes[ usNodeIndex ].usFirstSubscription = ( uint16_t ) ( usSubscriptionIndex + 1U );
+        }
+
+        return xReturnStatus;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvTrieRebuild( SubscriptionTable_t * pxTable )
+    {
+        size_t xIndex = 0U;
+        SubscriptionElement_t * pxSubscription = NULL;
+        bool xInserted = false;
+
+        pxTable->xTrie.usNodeCount = 0U;
+
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                SUBSCRIPTION_NEEDS_WILDCARD_MATCH( pxSubscription ) )
+            {
+                xInserted = prvTrieInsert( &( pxTable->xTrie ),
+                                           pxSubscription->pcSubscriptionFilterString,
+                                           pxSubscription->usFilterStringLength,
+                                           ( uint16_t ) xIndex );
+
+                /* The remaining filters fitted in the trie before, so this is
+                 * not expected to fail. */
+                if( xInserted == false )
+                {
+                    LogError( ( "Failed to re-index topic filter %.*s.",
+                                pxSubscription->usFilterStringLength,
+                                pxSubscription->pcSubscriptionFilterString ) );
+                }
+            }
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvTrieCollect( const SubscriptionTrie_t * pxTrie,
+                                uint16_t usNodeIndex,
+                                uint16_t * pusMatches,
+                                size_t * pxMatchCount )
+    {
+        uint16_t usSubscription = pxTrie->xNodes[ usNodeIndex ].usFirstSubscription;
+
+        while( ( usSubscription != 0U ) && ( *pxMatchCount < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) )
+        {
+            pusMatches[ *pxMatchCount ] = usSubscription - 1U;
+            ( *pxMatchCount )++;
+            usSubscription = pxTrie->usNextSubscription[ usSubscription - 1U ];
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvTrieMatch( const SubscriptionTrie_t * pxTrie,
+                              uint16_t usNodeIndex,
+                              const char * pcLevel,
+                              uint16_t usRemainingLength,
+                              bool xWildcardAllowed,
+                              uint16_t * pusMatches,
+                              size_t * pxMatchCount )
+    {
+        const SubscriptionTrieNode_t * pxChild = NULL;
+        uint16_t usChild = 0U, usGrandChild = 0U;
+        bool xIsLastLevel = false, xDescend = false;
+        uint16_t usLevelLength = prvGetLevelLength( pcLevel, usRemainingLength, &xIsLastLevel );
+
+        for( usChild = pxTrie->xNodes[ usNodeIndex ].usFirstChild;
+             usChild != 0U;
+             usChild = pxChild->usNextSibling )
+        {
+            pxChild = &( pxTrie->xNodes[ usChild - 1U ] );
+            xDescend = false;
+
+            if( TRIE_NODE_IS_LEVEL( pxChild, "#", 1U ) )
+            {
+                /* Multi-level wildcard matches this level and everything below. */
+                if( xWildcardAllowed == true )
+                {
+                    prvTrieCollect( pxTrie, usChild - 1U, pusMatches, pxMatchCount );
+                }
+            }
+            else if( TRIE_NODE_IS_LEVEL( pxChild, "+", 1U ) )
+            {
+                xDescend = xWildcardAllowed;
+            }
+            else
+            {
+                xDescend = TRIE_NODE_IS_LEVEL( pxChild, pcLevel, usLevelLength );
+            }
+
+            if( xDescend == false )
+            {
+                /* This child does not match the level. */
+            }
+            else if( xIsLastLevel == true )
+            {
+                /* The topic ends here. Filters ending at this node match, as
+                 * do filters ending in "/#" here since '#' also matches the
+                 * parent level. */
+                prvTrieCollect( pxTrie, usChild - 1U, pusMatches, pxMatchCount );
+
+                for( usGrandChild = pxChild->usFirstChild;
+                     usGrandChild != 0U;
+                     usGrandChild = pxTrie->xNodes[ usGrandChild - 1U ].usNextSibling )
+                {
+                    if( TRIE_NODE_IS_LEVEL( &( pxTrie->xNodes[ usGrandChild - 1U ] ), "#", 1U ) )
+                    {
+                        prvTrieCollect( pxTrie, usGrandChild - 1U, pusMatches, pxMatchCount );
+                    }
+                }
+            }
+            else
+            {
+                prvTrieMatch( pxTrie,
+                              usChild - 1U,
+                              &( pcLevel[ usLevelLength + 1U ] ),
+                              ( uint16_t ) ( usRemainingLength - usLevelLength - 1U ),
+                              true,
+                              pusMatches,
+                              pxMatchCount );
+            }
+        }
+    }
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+
+/**
+ * @brief Check whether a topic name, or a topic filter without wildcards,
+ * falls under a covering filter. Covering filters end with "/+".
+ *
+ * @param[in] pcAggregateFilter The covering filter.
+ * @param[in] usAggregateFilterLength Length of the covering filter.
+ * @param[in] pcTopic The topic name or topic filter.
+ * @param[in] usTopicLength Length of the topic.
+ *
+ * @return `true` if the covering filter matches the topic.
+ */
+    static bool prvAggregateCovers( const char * pcAggregateFilter,
+                                    uint16_t usAggregateFilterLength,
+                                    const char * pcTopic,
+                                    uint16_t usTopicLength );
+
+/**
+ * @brief Check that a topic filter has no wildcards.
+ */
+    static bool prvIsLiteralFilter( const char * pcTopicFilterString,
+                                    uint16_t usTopicFilterLength );
+
+/**
+ * @brief Find the entry of a covering filter, or a free entry if
+ * usAggregateFilterLength is 0.
+ *
+ * @return Index of the entry, or SUBSCRIPTION_MANAGER_MAX_AGGREGATES if there
+ * is none.
+ */
+    static size_t prvFindAggregate( const SubscriptionTable_t * pxTable,
+                                    const char * pcAggregateFilter,
+                                    uint16_t usAggregateFilterLength );
+
+/**
+ * @brief Find the registered covering filter of a topic filter.
+ *
+ * @return Index of the entry, or SUBSCRIPTION_MANAGER_MAX_AGGREGATES if no
+ * registered covering filter receives the publishes of the topic filter.
+ */
+    static size_t prvFindCoveringAggregate( const SubscriptionTable_t * pxTable,
+                                            const char * pcTopicFilterString,
+                                            uint16_t usTopicFilterLength );
+
+/**
+ * @brief Find the subscription of a context-callback pair to a topic filter.
+ *
+ * @return Index of the subscription, or SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS
+ * if there is none.
+ */
+    static size_t prvFindSubscription( SubscriptionTable_t * pxTable,
+                                       const char * pcTopicFilterString,
+                                       uint16_t usTopicFilterLength,
+                                       IncomingPubCallback_t pxIncomingPublishCallback,
+                                       void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Check whether a covering filter exceeds the overmatch budget.
+ */
+    static bool prvAggregateOverBudget( uint32_t ulPublishes,
+                                        uint32_t ulOvermatches );
+
+/**
+ * @brief Choose a covering filter for a topic filter. See getAggregateFilter().
+ */
+    static uint16_t prvGetAggregateFilter( SubscriptionTable_t * pxTable,
+                                           const char * pcTopicFilterString,
+                                           uint16_t usTopicFilterLength,
+                                           char * pcAggregateFilter,
+                                           uint16_t usBufferLength );
+
+/**
+ * @brief Register a covering filter in a table. See addAggregate().
+ */
+    static bool prvAddAggregate( SubscriptionTable_t * pxTable,
+                                 const char * pcAggregateFilter,
+                                 uint16_t usAggregateFilterLength );
+
+/**
+ * @brief Add a subscription under a covering filter. See
+ * addAggregatedSubscription().
+ */
+    static bool prvAddAggregatedSubscription( SubscriptionTable_t * pxTable,
+                                              const char * pcTopicFilterString,
+                                              uint16_t usTopicFilterLength,
+                                              IncomingPubCallback_t pxIncomingPublishCallback,
+                                              void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Move the subscriptions to one topic filter under a covering filter.
+ * See absorbAggregatedFilter().
+ */
+    static uint16_t prvAbsorbAggregatedFilter( SubscriptionTable_t * pxTable,
+                                               const char * pcAggregateFilter,
+                                               uint16_t usAggregateFilterLength,
+                                               char * pcTopicFilter,
+                                               uint16_t usBufferLength );
+
+/**
+ * @brief Remove a subscription from a table. See
+ * removeAggregatedSubscription().
+ *
+ * @param[in] pxOverBudget Whether each covering filter exceeds the overmatch
+ * budget, decided once for both copies of the table.
+ */
+    static uint16_t prvRemoveAggregatedSubscription( SubscriptionTable_t * pxTable,
+                                                     const char * pcTopicFilterString,
+                                                     uint16_t usTopicFilterLength,
+                                                     IncomingPubCallback_t pxIncomingPublishCallback,
+                                                     void * pvIncomingPublishCallbackContext,
+                                                     const bool * pxOverBudget,
+                                                     char * pcUnsubscribeFilter,
+                                                     uint16_t usBufferLength );
+
+/**
+ * @brief Count an incoming publish against the covering filters matching it.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] pxPublishInfo Info of incoming publish.
+ * @param[in] xHandled Whether a subscription matched the publish.
+ */
+    static void prvRecordAggregateMatch( SubscriptionTable_t * pxTable,
+                                         const MQTTPublishInfo_t * pxPublishInfo,
+                                         bool xHandled );
+
+/**
+ * @brief Get the aggregation statistics of a table.
+ */
+    static void prvGetAggregateStats( const SubscriptionTable_t * pxTable,
+                                      SubscriptionManagerStats_t * pxStats );
+
+/*-----------------------------------------------------------*/
+
+    static bool prvAggregateCovers( const char * pcAggregateFilter,
+                                    uint16_t usAggregateFilterLength,
+                                    const char * pcTopic,
+                                    uint16_t usTopicLength )
+    {
+        /* The parent levels, followed by the '/' before the '+'. */
+        uint16_t usPrefixLength = usAggregateFilterLength - 1U;
+
+        return ( usTopicLength >= usPrefixLength ) &&
+               ( memcmp( pcAggregateFilter, pcTopic, usPrefixLength ) == 0 ) &&
+               ( memchr( &( pcTopic[ usPrefixLength ] ), '/', ( size_t ) ( usTopicLength - usPrefixLength ) ) == NULL );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvIsLiteralFilter( const char * pcTopicFilterString,
+                                    uint16_t usTopicFilterLength )
+    {
+        return ( memchr( pcTopicFilterString, '+', usTopicFilterLength ) == NULL ) &&
+               ( memchr( pcTopicFilterString, '#', usTopicFilterLength ) == NULL );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static size_t prvFindAggregate( const SubscriptionTable_t * pxTable,
+                                    const char * pcAggregateFilter,
+                                    uint16_t usAggregateFilterLength )
+    {
+        size_t xIndex = 0U;
+        const SubscriptionAggregate_t * pxAggregate = NULL;
+
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES; xIndex++ )
+        {
+            pxAggregate = &( pxTable->xAggregates[ xIndex ] );
+
+            if( ( pxAggregate->usFilterLength == usAggregateFilterLength ) &&
+                ( ( usAggregateFilterLength == 0U ) ||
+                  ( memcmp( pxAggregate->cFilter, pcAggregateFilter, usAggregateFilterLength ) == 0 ) ) )
+            {
+                break;
+            }
+        }
+
+        return xIndex;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static size_t prvFindCoveringAggregate( const SubscriptionTable_t * pxTable,
+                                            const char * pcTopicFilterString,
+                                            uint16_t usTopicFilterLength )
+    {
+        size_t xIndex = SUBSCRIPTION_MANAGER_MAX_AGGREGATES;
+        const SubscriptionAggregate_t * pxAggregate = NULL;
+
+        if( prvIsLiteralFilter( pcTopicFilterString, usTopicFilterLength ) == true )
+        {
+            for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES; xIndex++ )
+            {
+                pxAggregate = &( pxTable->xAggregates[ xIndex ] );
+
+                if( ( pxAggregate->xActive == true ) &&
+                    ( prvAggregateCovers( pxAggregate->cFilter,
+                                          pxAggregate->usFilterLength,
+                                          pcTopicFilterString,
+                                          usTopicFilterLength ) == true ) )
+                {
+                    break;
+                }
+            }
+        }
+
+        return xIndex;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static size_t prvFindSubscription( SubscriptionTable_t * pxTable,
+                                       const char * pcTopicFilterString,
+                                       uint16_t usTopicFilterLength,
+                                       IncomingPubCallback_t pxIncomingPublishCallback,
+                                       void * pvIncomingPublishCallbackContext )
+    {
+        size_t xIndex = 0U;
+        SubscriptionElement_t * pxSubscription = NULL;
+
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                ( pxSubscription->pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+                ( pxSubscription->pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) &&
+                ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+                ( memcmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+            {
+                break;
+            }
+        }
+
+        return xIndex;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvAggregateOverBudget( uint32_t ulPublishes,
+                                        uint32_t ulOvermatches )
+    {
+        return ( ulPublishes >= SUBSCRIPTION_MANAGER_AGGREGATION_MIN_SAMPLES ) &&
+               ( ( ( uint64_t ) ulOvermatches * 100U ) >
+                 ( ( uint64_t ) ulPublishes * SUBSCRIPTION_MANAGER_AGGREGATION_OVERMATCH_PERCENT ) );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint16_t prvGetAggregateFilter( SubscriptionTable_t * pxTable,
+                                           const char * pcTopicFilterString,
+                                           uint16_t usTopicFilterLength,
+                                           char * pcAggregateFilter,
+                                           uint16_t usBufferLength )
+    {
+        size_t xIndex = 0U, xPrevious = 0U, xSiblings = 0U;
+        SubscriptionElement_t * pxSubscription = NULL;
+        uint16_t usParentLength = usTopicFilterLength, usAggregateFilterLength = 0U;
+        bool xSeen = false;
+
+        /* Find the '/' before the last level. */
+        while( ( usParentLength > 0U ) && ( pcTopicFilterString[ usParentLength - 1U ] != '/' ) )
+        {
+            usParentLength--;
+        }
+
+        if( ( usParentLength > 0U ) &&
+            ( prvFindAggregate( pxTable, pcTopicFilterString, 0U ) < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) &&
+            ( ( usParentLength + 1U ) <= usBufferLength ) &&
+            ( ( usParentLength + 1U ) <= SUBSCRIPTION_MANAGER_AGGREGATE_FILTER_LENGTH ) &&
+            ( prvIsLiteralFilter( pcTopicFilterString, usTopicFilterLength ) == true ) )
+        {
+            memcpy( pcAggregateFilter, pcTopicFilterString, usParentLength );
+            pcAggregateFilter[ usParentLength ] = '+';
+            usAggregateFilterLength = usParentLength + 1U;
+
+            /* Count the other sibling topic filters. Subscriptions to the same
+             * topic filter share its copy in the arena. */
+            for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+            {
+                pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+                if( ( pxSubscription != NULL ) &&
+                    ( pxSubscription->xUnsubscribing == false ) &&
+                    ( ( pxSubscription->usFilterStringLength != usTopicFilterLength ) ||
+                      ( memcmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) != 0 ) ) &&
+                    prvIsLiteralFilter( pxSubscription->pcSubscriptionFilterString, pxSubscription->usFilterStringLength ) &&
+                    prvAggregateCovers( pcAggregateFilter,
+                                        usAggregateFilterLength,
+                                        pxSubscription->pcSubscriptionFilterString,
+                                        pxSubscription->usFilterStringLength ) )
+                {
+                    xSeen = false;
+
+                    for( xPrevious = 0U; ( xPrevious < xIndex ) && ( xSeen == false ); xPrevious++ )
+                    {
+                        xSeen = ( prvGetSubscription( pxTable, xPrevious ) != NULL ) &&
+                                ( prvGetSubscription( pxTable, xPrevious )->pcSubscriptionFilterString == pxSubscription->pcSubscriptionFilterString );
+                    }
+
+                    if( xSeen == false )
+                    {
+                        xSiblings++;
+                    }
+                }
+            }
+
+            /* Refused covering filters keep their entry, and active ones are
+             * joined with addAggregatedSubscription(). */
+            if( ( ( xSiblings + 1U ) < SUBSCRIPTION_MANAGER_AGGREGATION_MIN_FILTERS ) ||
+                ( prvFindAggregate( pxTable, pcAggregateFilter, usAggregateFilterLength ) < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) )
+            {
+                usAggregateFilterLength = 0U;
+            }
+        }
+
+        return usAggregateFilterLength;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvAddAggregate( SubscriptionTable_t * pxTable,
+                                 const char * pcAggregateFilter,
+                                 uint16_t usAggregateFilterLength )
+    {
+        size_t xIndex = prvFindAggregate( pxTable, pcAggregateFilter, usAggregateFilterLength );
+        SubscriptionAggregate_t * pxAggregate = NULL;
+
+        if( xIndex == SUBSCRIPTION_MANAGER_MAX_AGGREGATES )
+        {
+            /* Take a free entry. */
+            xIndex = prvFindAggregate( pxTable, pcAggregateFilter, 0U );
+        }
+
+        if( ( xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) &&
+            ( usAggregateFilterLength > 1U ) &&
+            ( usAggregateFilterLength <= SUBSCRIPTION_MANAGER_AGGREGATE_FILTER_LENGTH ) &&
+            ( pcAggregateFilter[ usAggregateFilterLength - 1U ] == '+' ) &&
+            ( pcAggregateFilter[ usAggregateFilterLength - 2U ] == '/' ) )
+        {
+            pxAggregate = &( pxTable->xAggregates[ xIndex ] );
+            memcpy( pxAggregate->cFilter, pcAggregateFilter, usAggregateFilterLength );
+            pxAggregate->usFilterLength = usAggregateFilterLength;
+            pxAggregate->xActive = true;
+        }
+        else
+        {
+            LogError( ( "Cannot register covering filter %.*s.",
+                        ( int ) usAggregateFilterLength,
+                        pcAggregateFilter ) );
+        }
+
+        return( pxAggregate != NULL );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvAddAggregatedSubscription( SubscriptionTable_t * pxTable,
+                                              const char * pcTopicFilterString,
+                                              uint16_t usTopicFilterLength,
+                                              IncomingPubCallback_t pxIncomingPublishCallback,
+                                              void * pvIncomingPublishCallbackContext )
+    {
+        size_t xIndex = 0U;
+        bool xAdded = false;
+
+        if( ( pcTopicFilterString != NULL ) &&
+            ( prvFindCoveringAggregate( pxTable, pcTopicFilterString, usTopicFilterLength ) < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) )
+        {
+            xAdded = prvAddSubscription( pxTable,
+                                         pcTopicFilterString,
+                                         usTopicFilterLength,
+                                         pxIncomingPublishCallback,
+                                         pvIncomingPublishCallbackContext,
+                                         NULL );
+
+            if( xAdded == true )
+            {
+                xIndex = prvFindSubscription( pxTable,
+                                              pcTopicFilterString,
+                                              usTopicFilterLength,
+                                              pxIncomingPublishCallback,
+                                              pvIncomingPublishCallbackContext );
+
+                if( prvGetSubscription( pxTable, xIndex )->xAggregated == false )
+                {
+                    prvGetSubscription( pxTable, xIndex )->xAggregated = true;
+                    pxTable->ulAggregatedSubscribes++;
+                }
+            }
+        }
+
+        return xAdded;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint16_t prvAbsorbAggregatedFilter( SubscriptionTable_t * pxTable,
+                                               const char * pcAggregateFilter,
+                                               uint16_t usAggregateFilterLength,
+                                               char * pcTopicFilter,
+                                               uint16_t usBufferLength )
+    {
+        size_t xIndex = 0U, xOther = 0U;
+        size_t xAggregate = prvFindAggregate( pxTable, pcAggregateFilter, usAggregateFilterLength );
+        SubscriptionElement_t * pxSubscription = NULL, * pxOther = NULL;
+        uint16_t usLength = 0U;
+
+        for( xIndex = 0U;
+             ( xAggregate < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) &&
+             ( pxTable->xAggregates[ xAggregate ].xActive == true ) &&
+             ( usLength == 0U ) &&
+             ( xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS );
+             xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                ( pxSubscription->xAggregated == false ) &&
+                ( pxSubscription->xUnsubscribing == false ) &&
+                ( pxSubscription->usFilterStringLength <= usBufferLength ) &&
+                prvIsLiteralFilter( pxSubscription->pcSubscriptionFilterString, pxSubscription->usFilterStringLength ) &&
+                prvAggregateCovers( pcAggregateFilter,
+                                    usAggregateFilterLength,
+                                    pxSubscription->pcSubscriptionFilterString,
+                                    pxSubscription->usFilterStringLength ) )
+            {
+                usLength = pxSubscription->usFilterStringLength;
+                memcpy( pcTopicFilter, pxSubscription->pcSubscriptionFilterString, usLength );
+
+                /* Its broker subscription is shared by all the subscriptions
+                 * to the topic filter. */
+                for( xOther = xIndex; xOther < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xOther++ )
+                {
+                    pxOther = prvGetSubscription( pxTable, xOther );
+
+                    if( ( pxOther != NULL ) &&
+                        ( pxOther->xUnsubscribing == false ) &&
+                        ( pxOther->pcSubscriptionFilterString == pxSubscription->pcSubscriptionFilterString ) )
+                    {
+                        pxOther->xAggregated = true;
+                    }
+                }
+            }
+        }
+
+        return usLength;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint16_t prvRemoveAggregatedSubscription( SubscriptionTable_t * pxTable,
+                                                     const char * pcTopicFilterString,
+                                                     uint16_t usTopicFilterLength,
+                                                     IncomingPubCallback_t pxIncomingPublishCallback,
+                                                     void * pvIncomingPublishCallbackContext,
+                                                     const bool * pxOverBudget,
+                                                     char * pcUnsubscribeFilter,
+                                                     uint16_t usBufferLength )
+    {
+        size_t xIndex = 0U, xAggregate = SUBSCRIPTION_MANAGER_MAX_AGGREGATES;
+        SubscriptionElement_t * pxSubscription = NULL;
+        SubscriptionAggregate_t * pxAggregate = NULL;
+        const char * pcFilter = NULL;
+        bool xAggregated = false, xStillNeeded = false;
+        uint16_t usLength = 0U;
+
+        xIndex = prvFindSubscription( pxTable,
+                                      pcTopicFilterString,
+                                      usTopicFilterLength,
+                                      pxIncomingPublishCallback,
+                                      pvIncomingPublishCallbackContext );
+
+        if( ( pxIncomingPublishCallback != NULL ) &&
+            ( xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) )
+        {
+            xAggregated = prvGetSubscription( pxTable, xIndex )->xAggregated;
+
+            if( xAggregated == false )
+            {
+                /* The subscribers of the topic filter share its own broker
+                 * subscription, and the last one is kept until the UNSUBACK. */
+                xStillNeeded = prvRemoveSharedSubscription( pxTable,
+                                                            pcTopicFilterString,
+                                                            usTopicFilterLength,
+                                                            pxIncomingPublishCallback,
+                                                            pvIncomingPublishCallbackContext );
+            }
+            else
+            {
+                xAggregate = prvFindCoveringAggregate( pxTable, pcTopicFilterString, usTopicFilterLength );
+
+                ( void ) prvRemoveSubscription( pxTable,
+                                                pcTopicFilterString,
+                                                usTopicFilterLength,
+                                                pxIncomingPublishCallback,
+                                                pvIncomingPublishCallbackContext );
+
+                /* The broker subscription is still needed by the remaining
+                 * subscriptions under the same covering filter. */
+                for( xIndex = 0U; ( xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) && ( xStillNeeded == false ); xIndex++ )
+                {
+                    pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+                    xStillNeeded = ( pxSubscription != NULL ) &&
+                                   ( pxSubscription->xAggregated == true ) &&
+                                   ( xAggregate < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) &&
+                                   prvAggregateCovers( pxTable->xAggregates[ xAggregate ].cFilter,
+                                                       pxTable->xAggregates[ xAggregate ].usFilterLength,
+                                                       pxSubscription->pcSubscriptionFilterString,
+                                                       pxSubscription->usFilterStringLength );
+                }
+
+                if( xStillNeeded == true )
+                {
+                    pxTable->ulBrokerUnsubscribesAvoided++;
+                }
+            }
+
+            if( xStillNeeded == true )
+            {
+                /* Nothing to unsubscribe from. */
+            }
+            else if( xAggregated == false )
+            {
+                usLength = usTopicFilterLength;
+                pcFilter = pcTopicFilterString;
+            }
+            else if( xAggregate < SUBSCRIPTION_MANAGER_MAX_AGGREGATES )
+            {
+                pxAggregate = &( pxTable->xAggregates[ xAggregate ] );
+                usLength = pxAggregate->usFilterLength;
+                pcFilter = pxAggregate->cFilter;
+            }
+            else
+            {
+                /* The covering filter was not found, there is nothing to
+                 * unsubscribe from. */
+            }
+
+            if( usLength > usBufferLength )
+            {
+                LogError( ( "Buffer of %u bytes too short for the topic filter to unsubscribe from.",
+                            ( unsigned int ) usBufferLength ) );
+                usLength = 0U;
+            }
+            else if( usLength > 0U )
+            {
+                memcpy( pcUnsubscribeFilter, pcFilter, usLength );
+            }
+            else
+            {
+                /* Nothing to unsubscribe from. */
+            }
+
+            /* Release the covering filter once copied. */
+            if( pxAggregate == NULL )
+            {
+                /* No covering filter left without subscriptions. */
+            }
+            else if( pxOverBudget[ xAggregate ] == true )
+            {
+                /* Keep the entry, so that the covering filter is not chosen
+                 * again. */
+                LogWarn( ( "Covering filter %.*s exceeded the overmatch budget of %u%%, it will not be used again.",
+                           ( int ) pxAggregate->usFilterLength,
+                           pxAggregate->cFilter,
+                           ( unsigned int ) SUBSCRIPTION_MANAGER_AGGREGATION_OVERMATCH_PERCENT ) );
+                pxAggregate->xActive = false;
+            }
+            else
+            {
+                memset( pxAggregate, 0x00, sizeof( SubscriptionAggregate_t ) );
+            }
+        }
+
+        return usLength;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvRecordAggregateMatch( SubscriptionTable_t * pxTable,
+                                         const MQTTPublishInfo_t * pxPublishInfo,
+                                         bool xHandled )
+    {
+        size_t xIndex = 0U;
+        SubscriptionAggregate_t * pxAggregate = NULL;
+
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES; xIndex++ )
+        {
+            pxAggregate = &( pxTable->xAggregates[ xIndex ] );
+
+            if( ( pxAggregate->xActive == true ) &&
+                ( prvAggregateCovers( pxAggregate->cFilter,
+                                      pxAggregate->usFilterLength,
+                                      pxPublishInfo->pTopicName,
+                                      pxPublishInfo->topicNameLength ) == true ) )
+            {
+                COUNTER_INCREMENT( pxAggregate->ulPublishes );
+
+                if( xHandled == false )
+                {
+                    COUNTER_INCREMENT( pxAggregate->ulOvermatches );
+                    COUNTER_INCREMENT( pxTable->ulAggregateOvermatches );
+                }
+            }
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvGetAggregateStats( const SubscriptionTable_t * pxTable,
+                                      SubscriptionManagerStats_t * pxStats )
+    {
+        size_t xIndex = 0U, xOther = 0U, xCovered = 0U;
+        const SubscriptionElement_t * pxSubscription = NULL, * pxOther = NULL;
+        bool xCounted = false;
+
+        pxStats->xActiveAggregates = 0U;
+
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES; xIndex++ )
+        {
+            if( pxTable->xAggregates[ xIndex ].xActive == true )
+            {
+                pxStats->xActiveAggregates++;
+            }
+        }
+
+        /* Count the topic filters whose subscriptions all receive their
+         * publishes through a covering filter. */
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( ( SubscriptionTable_t * ) pxTable, xIndex );
+            xCounted = ( pxSubscription == NULL ) || ( pxSubscription->xAggregated == false );
+
+            for( xOther = 0U; ( xOther < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) && ( xCounted == false ); xOther++ )
+            {
+                pxOther = prvGetSubscription( ( SubscriptionTable_t * ) pxTable, xOther );
+
+                /* Counted at its first subscription, unless one of them has a
+                 * broker subscription of its own. */
+                xCounted = ( pxOther != NULL ) &&
+                           ( pxOther->pcSubscriptionFilterString == pxSubscription->pcSubscriptionFilterString ) &&
+                           ( ( xOther < xIndex ) || ( pxOther->xAggregated == false ) );
+            }
+
+            if( xCounted == false )
+            {
+                xCovered++;
+            }
+        }
+
+        pxStats->xBrokerSubscriptionsSaved = ( xCovered > pxStats->xActiveAggregates ) ?
+                                             ( xCovered - pxStats->xActiveAggregates ) : 0U;
+        pxStats->ulAggregatedSubscribes = pxTable->ulAggregatedSubscribes;
+        pxStats->ulAggregateOvermatches = pxTable->ulAggregateOvermatches;
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
+/*-----------------------------------------------------------*/
+
+/**
+ * @brief Get the copy of a topic filter in the filter arena, copying it there
+ * if no subscription of the list uses this topic filter yet. The arena is
+ * compacted if there is not enough space left at its end.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] pcTopicFilterString Topic filter string to copy.
+ * @param[in] usTopicFilterLength Length of the topic filter string.
+ *
+ * @return The copy of the topic filter, or NULL if the arena is full.
+ */
+static const char * prvInternFilter( SubscriptionTable_t * pxTable,
+                                     const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength );
+
+/**
+ * @brief Reclaim the space of a topic filter in the filter arena if no
+ * subscription uses it anymore and it is at the end of the arena.
+ *
+ * @param[in] pxTable The subscription table.
+ * @param[in] pcFilter Topic filter in the arena.
+ * @param[in] usFilterLength Length of the topic filter.
+ */
+static void prvReleaseFilter( SubscriptionTable_t * pxTable,
+                              const char * pcFilter,
+                              uint16_t usFilterLength );
+
+/**
+ * @brief Move the topic filters in use to the start of the filter arena,
+ * dropping the space of removed topic filters.
+ *
+ * @param[in] pxTable The subscription table.
+ */
+static void prvCompactFilterArena( SubscriptionTable_t * pxTable );
+
+/*-----------------------------------------------------------*/
+
+static const char * prvInternFilter( SubscriptionTable_t * pxTable,
+                                     const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength )
+{
+    size_t xIndex = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+    char * pcFilter = NULL;
+
+    /* Share the storage of an identical topic filter. */
+    for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+    {
+        pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+        if( ( pxSubscription != NULL ) &&
+            ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+            ( memcmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+        {
+            pcFilter = ( char * ) pxSubscription->pcSubscriptionFilterString;
+            break;
+        }
+    }
+
+    if( pcFilter == NULL )
+    {
+        if( ( ( size_t ) pxTable->usFilterArenaUsed + usTopicFilterLength ) > SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE )
+        {
+            prvCompactFilterArena( pxTable );
+        }
+
+        if( ( ( size_t ) pxTable->usFilterArenaUsed + usTopicFilterLength ) <= SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE )
+        {
+            pcFilter = &( pxTable->cFilterArena[ pxTable->usFilterArenaUsed ] );
+            memcpy( pcFilter, pcTopicFilterString, usTopicFilterLength );
+            pxTable->usFilterArenaUsed += usTopicFilterLength;
+        }
+    }
+
+    return pcFilter;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvReleaseFilter( SubscriptionTable_t * pxTable,
+                              const char * pcFilter,
+                              uint16_t usFilterLength )
+{
+    size_t xIndex = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+    uint16_t usEnd = 0U, usUsed = 0U;
+    bool xInUse = false;
+
+    /* Space before the end of the arena is only reclaimed by compaction, so
+     * there is nothing to do for other topic filters. */
+    if( &( pcFilter[ usFilterLength ] ) != &( pxTable->cFilterArena[ pxTable->usFilterArenaUsed ] ) )
+    {
+        xInUse = true;
+    }
+
+    /* Find the end of the topic filters still in use, which is the new end of
+     * the arena if this topic filter was the last one. */
+    for( xIndex = 0U; ( xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) && ( xInUse == false ); xIndex++ )
+    {
+        pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+        if( pxSubscription != NULL )
+        {
+            xInUse = ( pxSubscription->pcSubscriptionFilterString == pcFilter );
+            usEnd = ( uint16_t ) ( ( pxSubscription->pcSubscriptionFilterString - pxTable->cFilterArena ) +
+                                   pxSubscription->usFilterStringLength );
+
+            if( usEnd > usUsed )
+            {
+                usUsed = usEnd;
+            }
+        }
+    }
+
+    if( xInUse == false )
+    {
+        pxTable->usFilterArenaUsed = usUsed;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCompactFilterArena( SubscriptionTable_t * pxTable )
+{
+    size_t xIndex = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+    const char * pcLowest = NULL;
+    const char * pcPrevious = NULL;
+    uint16_t usLength = 0U;
+    uint16_t usUsed = 0U;
+
+    /* Move the topic filters in order of address, so that each one is moved
+     * down over space that is either free or already moved. */
+    do
+    {
+        pcLowest = NULL;
+
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                ( ( pcPrevious == NULL ) || ( pxSubscription->pcSubscriptionFilterString > pcPrevious ) ) &&
+                ( ( pcLowest == NULL ) || ( pxSubscription->pcSubscriptionFilterString < pcLowest ) ) )
+            {
+                pcLowest = pxSubscription->pcSubscriptionFilterString;
+                usLength = pxSubscription->usFilterStringLength;
+            }
+        }
+
+        if( pcLowest != NULL )
+        {
+            memmove( &( pxTable->cFilterArena[ usUsed ] ), pcLowest, usLength );
+
+            for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+            {
+                pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+                if( ( pxSubscription != NULL ) &&
+                    ( pxSubscription->pcSubscriptionFilterString == pcLowest ) )
+                {
+                    pxSubscription->pcSubscriptionFilterString = &( pxTable->cFilterArena[ usUsed ] );
+                }
+            }
+
+            usUsed += usLength;
+            pcPrevious = pcLowest;
+        }
+    } while( pcLowest != NULL );
+
+    LogDebug( ( "Compacted the topic filter arena from %u to %u bytes.",
+                ( unsigned int ) pxTable->usFilterArenaUsed,
+                ( unsigned int ) usUsed ) );
+
+    pxTable->usFilterArenaUsed = usUsed;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+        /* The trie nodes point into the moved topic filters. */
+        prvTrieRebuild( pxTable );
+    #endif
+}
+
+/*-----------------------------------------------------------*/
+
+
+static bool prvAddSubscription( SubscriptionTable_t * pxTable,
+                                const char * pcTopicFilterString,
+                                uint16_t usTopicFilterLength,
+                                IncomingPubCallback_t pxIncomingPublishCallback,
+                                void * pvIncomingPublishCallbackContext,
+                                size_t * pxIndex )
+{
+    size_t xIndex = 0U;
+    size_t xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
+    SubscriptionElement_t * pxSubscription = NULL;
+    const char * pcFilter = NULL;
+    bool xReturnStatus = false, xExists = false;
+
+    if( ( pxTable == NULL ) ||
+        ( pcTopicFilterString == NULL ) ||
+        ( usTopicFilterLength == 0U ) ||
+        ( pxIncomingPublishCallback == NULL ) )
+    {
+        LogError( ( "Invalid parameter. pxTable=%p, pcTopicFilterString=%p,"
+                    " usTopicFilterLength=%u, pxIncomingPublishCallback=%p.",
+                    pxTable,
+                    pcTopicFilterString,
+                    ( unsigned int ) usTopicFilterLength,
+                    pxIncomingPublishCallback ) );
+    }
+    else
+    {
+        /* Scan for duplicates. */
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+                ( strncmp( pcTopicFilterString, pxSubscription->pcSubscriptionFilterString, ( size_t ) usTopicFilterLength ) == 0 ) )
+            {
+                /* If a subscription already exists, don't do anything. */
+                if( ( pxSubscription->pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+                    ( pxSubscription->pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
+                {
+                    LogWarn( ( "Subscription already exists.\n" ) );
+                    xExists = true;
+                    xReturnStatus = true;
+
+                    if( pxIndex != NULL )
+                    {
+                        *pxIndex = xIndex;
+                    }
+
+                    break;
+                }
+            }
+        }
+
+        if( xExists == false )
+        {
+            pcFilter = prvInternFilter( pxTable, pcTopicFilterString, usTopicFilterLength );
+
+            if( pcFilter == NULL )
+            {
+                LogError( ( "Topic filter arena exhausted, cannot add topic filter %.*s. "
+                            "%u of %u bytes in use.",
+                            ( int ) usTopicFilterLength,
+                            pcTopicFilterString,
+                            ( unsigned int ) pxTable->usFilterArenaUsed,
+                            ( unsigned int ) SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE ) );
+            }
+            else
+            {
+                xAvailableIndex = prvAllocateSlot( pxTable );
+
+                if( xAvailableIndex == SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+                {
+                    LogError( ( "Subscription pool exhausted, cannot add topic filter %.*s. "
+                                "%u subscriptions in the list, %u pool blocks of %u.",
+                                ( int ) usTopicFilterLength,
+                                pcTopicFilterString,
+                                ( unsigned int ) pxTable->usSubscriptionCount,
+                                ( unsigned int ) SUBSCRIPTION_MANAGER_POOL_BLOCKS,
+                                ( unsigned int ) SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS ) );
+
+                    prvReleaseFilter( pxTable, pcFilter, usTopicFilterLength );
+                }
+            }
+        }
+
+        if( xAvailableIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xAvailableIndex );
+            pxSubscription->pcSubscriptionFilterString = pcFilter;
+            pxSubscription->usFilterStringLength = usTopicFilterLength;
+            pxSubscription->pxIncomingPublishCallback = pxIncomingPublishCallback;
+            pxSubscription->pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
+            xReturnStatus = true;
+
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+                prvCompileFilter( pxSubscription );
+            #endif
+
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+                pxSubscription->xIsExactMatch = ( memchr( pcFilter, '+', usTopicFilterLength ) == NULL ) &&
+                                                ( memchr( pcFilter, '#', usTopicFilterLength ) == NULL );
+
+                if( pxSubscription->xIsExactMatch == true )
+                {
+                    prvHashInsert( pxTable, xAvailableIndex );
+                }
+            #endif /* SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 */
+
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+                if( SUBSCRIPTION_NEEDS_WILDCARD_MATCH( pxSubscription ) &&
+                    ( prvTrieInsert( &( pxTable->xTrie ),
+                                     pcFilter,
+                                     usTopicFilterLength,
+                                     ( uint16_t ) xAvailableIndex ) == false ) )
+                {
+                    LogError( ( "Not enough topic trie nodes to add topic filter %.*s.",
+                                ( int ) usTopicFilterLength,
+                                pcTopicFilterString ) );
+
+                    /* Release the slot, and the nodes created for the partial
+                     * path. */
+                    prvFreeSlot( pxTable, xAvailableIndex );
+                    prvTrieRebuild( pxTable );
+                    prvReleaseFilter( pxTable, pcFilter, usTopicFilterLength );
+                    xReturnStatus = false;
+                }
+            #endif /* SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 */
+
+            if( ( xReturnStatus == true ) && ( pxIndex != NULL ) )
+            {
+                *pxIndex = xAvailableIndex;
+            }
+        }
+
+        if( xReturnStatus == false )
+        {
+            pxTable->ulFailedAdds++;
+        }
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRemoveSubscriptionAtIndex( SubscriptionTable_t * pxTable,
+                                          size_t xIndex )
+{
+    SubscriptionElement_t * pxSubscription = prvGetSubscription( pxTable, xIndex );
+    const char * pcRemovedFilter = NULL;
+    uint16_t usRemovedFilterLength = 0U;
+
+    if( pxSubscription != NULL )
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+            if( pxSubscription->xIsExactMatch == true )
+            {
+                prvHashRemove( pxTable, xIndex );
+            }
+        #endif
+
+        pcRemovedFilter = pxSubscription->pcSubscriptionFilterString;
+        usRemovedFilterLength = pxSubscription->usFilterStringLength;
+        prvFreeSlot( pxTable, xIndex );
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+            prvTrieRebuild( pxTable );
+        #endif
+
+        prvReleaseFilter( pxTable, pcRemovedFilter, usRemovedFilterLength );
+    }
+
+    return( pcRemovedFilter != NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRemoveSubscription( SubscriptionTable_t * pxTable,
+                                   const char * pcTopicFilterString,
+                                   uint16_t usTopicFilterLength,
+                                   IncomingPubCallback_t pxIncomingPublishCallback,
+                                   void * pvIncomingPublishCallbackContext )
+{
+    size_t xIndex = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+    bool xRemoved = false;
+
+    if( ( pxTable == NULL ) ||
+        ( pcTopicFilterString == NULL ) ||
+        ( usTopicFilterLength == 0U ) )
+    {
+        LogError( ( "Invalid parameter. pxTable=%p, pcTopicFilterString=%p,"
+                    " usTopicFilterLength=%u.",
+                    pxTable,
+                    pcTopicFilterString,
+                    ( unsigned int ) usTopicFilterLength ) );
+    }
+    else
+    {
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+                ( ( pxIncomingPublishCallback == NULL ) ||
+                  ( ( pxSubscription->pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+                    ( pxSubscription->pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) ) ) &&
+                ( strncmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+            {
+                xRemoved = prvRemoveSubscriptionAtIndex( pxTable, xIndex );
+            }
+        }
+    }
+
+    return xRemoved;
+}
+
+/*-----------------------------------------------------------*/
+
+static size_t prvCountSubscriptions( SubscriptionTable_t * pxTable,
+                                     const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength )
+{
+    size_t xIndex = 0U, xCount = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+
+    for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+    {
+        pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+        if( ( pxSubscription != NULL ) &&
+            ( pxSubscription->xUnsubscribing == false ) &&
+            ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+            ( strncmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+        {
+            xCount++;
+        }
+    }
+
+    return xCount;
+}
+
+/*-----------------------------------------------------------*/
+
+static SharedSubscriptionStatus_t prvAddSharedSubscription( SubscriptionTable_t * pxTable,
+                                                            const char * pcTopicFilterString,
+                                                            uint16_t usTopicFilterLength,
+                                                            IncomingPubCallback_t pxIncomingPublishCallback,
+                                                            void * pvIncomingPublishCallbackContext )
+{
+    SharedSubscriptionStatus_t xStatus = SharedSubscriptionNotFound;
+    SubscriptionElement_t * pxSubscription = NULL;
+    size_t xIndex = 0U;
+
+    if( pcTopicFilterString != NULL )
+    {
+        for( xIndex = 0U; ( xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) && ( xStatus == SharedSubscriptionNotFound ); xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription != NULL ) &&
+                ( pxSubscription->xUnsubscribing == true ) &&
+                ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+                ( strncmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+            {
+                /* An UNSUBSCRIBE sent to the broker would remove a new
+                 * subscription as well. */
+                xStatus = SharedSubscriptionUnsubscribing;
+            }
+        }
+    }
+
+    if( ( xStatus == SharedSubscriptionNotFound ) &&
+        ( pcTopicFilterString != NULL ) &&
+        ( prvCountSubscriptions( pxTable, pcTopicFilterString, usTopicFilterLength ) > 0U ) &&
+        ( prvAddSubscription( pxTable,
+                              pcTopicFilterString,
+                              usTopicFilterLength,
+                              pxIncomingPublishCallback,
+                              pvIncomingPublishCallbackContext,
+                              NULL ) == true ) )
+    {
+        pxTable->ulBrokerSubscribesAvoided++;
+        xStatus = SharedSubscriptionAdded;
+    }
+
+    return xStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRemoveSharedSubscription( SubscriptionTable_t * pxTable,
+                                         const char * pcTopicFilterString,
+                                         uint16_t usTopicFilterLength,
+                                         IncomingPubCallback_t pxIncomingPublishCallback,
+                                         void * pvIncomingPublishCallbackContext )
+{
+    bool xStillSubscribed = false;
+    size_t xIndex = 0U, xOwnIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS, xOthers = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+
+    if( ( pxIncomingPublishCallback == NULL ) ||
+        ( pcTopicFilterString == NULL ) )
+    {
+        LogError( ( "Invalid parameter. pxIncomingPublishCallback=%p, pcTopicFilterString=%p.",
+                    pxIncomingPublishCallback,
+                    pcTopicFilterString ) );
+    }
+    else
+    {
+        for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+        {
+            pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+            if( ( pxSubscription == NULL ) ||
+                ( pxSubscription->xUnsubscribing == true ) ||
+                ( pxSubscription->usFilterStringLength != usTopicFilterLength ) ||
+                ( strncmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) != 0 ) )
+            {
+                /* Not a subscriber of the topic filter. */
+            }
+            else if( ( xOwnIndex == SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ) &&
+                     ( pxSubscription->pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
+                     ( pxSubscription->pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
+            {
+                xOwnIndex = xIndex;
+            }
+            else
+            {
+                xOthers++;
+            }
+        }
+    }
+
+    if( xOwnIndex == SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+    {
+        /* Not subscribed with this callback and context. */
+    }
+    else if( xOthers > 0U )
+    {
+        ( void ) prvRemoveSubscriptionAtIndex( pxTable, xOwnIndex );
+        pxTable->ulBrokerUnsubscribesAvoided++;
+        xStillSubscribed = true;
+    }
+    else
+    {
+        /* The last subscriber. The entry is kept, so that the topic filter is
+         * not subscribed to again before the broker has unsubscribed. */
+        prvGetSubscription( pxTable, xOwnIndex )->xUnsubscribing = true;
+    }
+
+    return xStillSubscribed;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCompleteSharedUnsubscribe( SubscriptionTable_t * pxTable,
+                                          const char * pcTopicFilterString,
+                                          uint16_t usTopicFilterLength )
+{
+    size_t xIndex = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+
+    for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+    {
+        pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+        if( ( pxSubscription != NULL ) &&
+            ( pxSubscription->xUnsubscribing == true ) &&
+            ( pxSubscription->usFilterStringLength == usTopicFilterLength ) &&
+            ( strncmp( pxSubscription->pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 ) )
+        {
+            ( void ) prvRemoveSubscriptionAtIndex( pxTable, xIndex );
+        }
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvHandleIncomingPublishes( SubscriptionTable_t * pxTable,
+                                        MQTTPublishInfo_t * pxPublishInfo )
+{
+    size_t xIndex = 0U;
+    SubscriptionElement_t * pxSubscription = NULL;
+    bool isMatched = false, publishHandled = false, xWildcardMatched = false;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 ) || ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+        uint16_t usMatches[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+        size_t xMatchCount = 0U;
+    #endif
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+        const char * pcSeparator = NULL;
+        uint32_t ulFirstLevelHash = 0U;
+    #endif
+
+    if( ( pxTable == NULL ) ||
+        ( pxPublishInfo == NULL ) )
+    {
+        LogError( ( "Invalid parameter. pxTable=%p, pxPublishInfo=%p,",
+                    pxTable,
+                    pxPublishInfo ) );
+    }
+    else
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+            prvHashMatch( pxTable,
+                          pxPublishInfo->pTopicName,
+                          pxPublishInfo->topicNameLength,
+                          usMatches,
+                          &xMatchCount );
+
+            COUNTER_INCREMENT( pxTable->ulExactMatchLookups );
+
+            if( xMatchCount > 0U )
+            {
+                COUNTER_INCREMENT( pxTable->ulExactMatchHits );
+            }
+
+            /* Exact matches are collected before invoking any callback, as a
+             * callback may change the subscription list. */
+            publishHandled = prvInvokeMatches( pxTable, usMatches, xMatchCount, pxPublishInfo );
+            xMatchCount = 0U;
+        #endif /* SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 */
+
+        COUNTER_INCREMENT( pxTable->ulWildcardMatchLookups );
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+            if( ( pxTable->xTrie.usNodeCount > 0U ) &&
+                ( pxPublishInfo->topicNameLength > 0U ) )
+            {
+                /* Wildcards do not match the first level of topics starting
+                 * with '$', such as the AWS reserved topics. */
+                prvTrieMatch( &( pxTable->xTrie ),
+                              0U,
+                              pxPublishInfo->pTopicName,
+                              pxPublishInfo->topicNameLength,
+                              ( pxPublishInfo->pTopicName[ 0 ] != '$' ),
+                              usMatches,
+                              &xMatchCount );
+            }
+
+            /* All matches are collected before invoking any callback, as a
+             * callback may change the subscription list. */
+            xWildcardMatched = prvInvokeMatches( pxTable, usMatches, xMatchCount, pxPublishInfo );
+
+            ( void ) xIndex;
+            ( void ) pxSubscription;
+            ( void ) isMatched;
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 ) */
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+                /* Hashed once, and compared with the first level of every
+                 * compiled filter. */
+                pcSeparator = memchr( pxPublishInfo->pTopicName, '/', pxPublishInfo->topicNameLength );
+                ulFirstLevelHash = prvHashTopic( pxPublishInfo->pTopicName,
+                                                 ( pcSeparator != NULL ) ?
+                                                 ( uint16_t ) ( pcSeparator - pxPublishInfo->pTopicName ) :
+                                                 pxPublishInfo->topicNameLength );
+            #endif
+
+            for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; xIndex++ )
+            {
+                pxSubscription = prvGetSubscription( pxTable, xIndex );
+
+                if( ( pxSubscription != NULL ) &&
+                    ( pxSubscription->xUnsubscribing == false ) &&
+                    SUBSCRIPTION_NEEDS_WILDCARD_MATCH( pxSubscription ) )
+                {
+                    #if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+                        if( pxSubscription->xCompiledFilter.ucLevelCount > 0U )
+                        {
+                            isMatched = prvMatchCompiledFilter( pxSubscription,
+                                                                pxPublishInfo->pTopicName,
+                                                                pxPublishInfo->topicNameLength,
+                                                                ulFirstLevelHash );
+                        }
+                        else
+                    #endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+                    {
+                        MQTT_MatchTopic( pxPublishInfo->pTopicName,
+                                         pxPublishInfo->topicNameLength,
+                                         pxSubscription->pcSubscriptionFilterString,
+                                         pxSubscription->usFilterStringLength,
+                                         &isMatched );
+                    }
+
+                    if( isMatched == true )
+                    {
+                        prvInvokeCallback( pxSubscription, pxPublishInfo );
+                        xWildcardMatched = true;
+                    }
+                }
+            }
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 ) */
+
+        if( xWildcardMatched == true )
+        {
+            COUNTER_INCREMENT( pxTable->ulWildcardMatchHits );
+            publishHandled = true;
+        }
+
+        if( publishHandled == false )
+        {
+            COUNTER_INCREMENT( pxTable->ulUnmatchedPublishes );
+        }
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+            prvRecordAggregateMatch( pxTable, pxPublishInfo, publishHandled );
+        #endif
+    }
+
+    return publishHandled;
+}
+
+/*-----------------------------------------------------------*/
+
+static SubscriptionElement_t * prvGetSubscription( SubscriptionTable_t * pxTable,
+                                                   size_t xIndex )
+{
+    SubscriptionElement_t * pxSubscription = NULL;
+    size_t xBlock = xIndex / SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS;
+    size_t xSlot = xIndex % SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS;
+
+    if( ( pxTable != NULL ) &&
+        ( xBlock < pxTable->usBlockCount ) &&
+        ( ( pxTable->ulUsedSlots[ xBlock ] & ( 1UL << xSlot ) ) != 0U ) )
+    {
+        pxSubscription = &( pxTable->pxBlocks[ xBlock ][ xSlot ] );
+    }
+
+    return pxSubscription;
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvGetTableStats( const SubscriptionTable_t * pxTable,
+                              SubscriptionManagerStats_t * pxStats )
+{
+    uint16_t usBlock = 0U;
+
+    if( ( pxTable == NULL ) ||
+        ( pxStats == NULL ) )
+    {
+        LogError( ( "Invalid parameter. pxTable=%p, pxStats=%p.",
+                    pxTable,
+                    pxStats ) );
+    }
+    else
+    {
+        pxStats->xSubscriptionCount = pxTable->usSubscriptionCount;
+        pxStats->xCapacity = 0U;
+
+        for( usBlock = 0U; usBlock < pxTable->usBlockCount; usBlock++ )
+        {
+            if( pxTable->pxBlocks[ usBlock ] != NULL )
+            {
+                pxStats->xCapacity += SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS;
+            }
+        }
+
+        pxStats->xHighWatermark = pxTable->usHighWatermark;
+        pxStats->xTotalPoolBlocks = POOL_TOTAL_BLOCKS;
+        pxStats->xFreePoolBlocks = POOL_TOTAL_BLOCKS - ( size_t ) __builtin_popcount( __atomic_load_n( &ulUsedPoolBlocks, __ATOMIC_RELAXED ) );
+        pxStats->ulFailedAdds = pxTable->ulFailedAdds;
+        pxStats->xFilterArenaUsed = pxTable->usFilterArenaUsed;
+        pxStats->xFilterArenaSize = SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE;
+        pxStats->ulBrokerSubscribesAvoided = pxTable->ulBrokerSubscribesAvoided;
+        pxStats->ulBrokerUnsubscribesAvoided = pxTable->ulBrokerUnsubscribesAvoided;
+        pxStats->ulExactMatchLookups = pxTable->ulExactMatchLookups;
+        pxStats->ulExactMatchHits = pxTable->ulExactMatchHits;
+        pxStats->ulWildcardMatchLookups = pxTable->ulWildcardMatchLookups;
+        pxStats->ulWildcardMatchHits = pxTable->ulWildcardMatchHits;
+        pxStats->ulUnmatchedPublishes = pxTable->ulUnmatchedPublishes;
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+            prvGetAggregateStats( pxTable, pxStats );
+        #else
+            pxStats->xActiveAggregates = 0U;
+            pxStats->xBrokerSubscriptionsSaved = 0U;
+            pxStats->ulAggregatedSubscribes = 0U;
+            pxStats->ulAggregateOvermatches = 0U;
+        #endif
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+
+    static uint32_t prvBeginRead( SubscriptionList_t * pxSubscriptionList )
+    {
+        uint32_t ulTable = 0U;
+        bool xRegistered = false;
+
+        while( xRegistered == false )
+        {
+            ulTable = __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_SEQ_CST );
+            ( void ) __atomic_fetch_add( &( pxSubscriptionList->ulReaders[ ulTable ] ), 1U, __ATOMIC_SEQ_CST );
+
+            /* If a writer published the other copy in the meantime, it may
+             * not have seen this reader, so read the new copy instead. The
+             * writer may also be waiting for this reader to leave. */
+            if( __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_SEQ_CST ) == ulTable )
+            {
+                xRegistered = true;
+            }
+            else
+            {
+                prvEndRead( pxSubscriptionList, ulTable );
+            }
+        }
+
+        return ulTable;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvEndRead( SubscriptionList_t * pxSubscriptionList,
+                            uint32_t ulTable )
+    {
+        void * pvReadersDone = NULL;
+
+        /* Either the writer sees no reader left, or the last reader sees the
+         * writer waiting and wakes it. */
+        if( ( __atomic_sub_fetch( &( pxSubscriptionList->ulReaders[ ulTable ] ), 1U, __ATOMIC_SEQ_CST ) == 0U ) &&
+            ( __atomic_load_n( &( pxSubscriptionList->ulWriterWaiting ), __ATOMIC_SEQ_CST ) == ( ulTable + 1U ) ) )
+        {
+            pvReadersDone = __atomic_load_n( &( pxSubscriptionList->pvReadersDone ), __ATOMIC_ACQUIRE );
+
+            if( pvReadersDone != NULL )
+            {
+                SUBSCRIPTION_MANAGER_SIGNAL_WRITER( pvReadersDone );
+            }
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvWaitForReaders( SubscriptionList_t * pxSubscriptionList,
+                                   uint32_t ulTable )
+    {
+        void * pvReadersDone = NULL;
+
+        if( __atomic_load_n( &( pxSubscriptionList->ulReaders[ ulTable ] ), __ATOMIC_SEQ_CST ) != 0U )
+        {
+            /* Writers are serialized, so only one of them creates the event. */
+            pvReadersDone = __atomic_load_n( &( pxSubscriptionList->pvReadersDone ), __ATOMIC_ACQUIRE );
+
+            if( pvReadersDone == NULL )
+            {
+                pvReadersDone = SUBSCRIPTION_MANAGER_CREATE_READERS_DONE();
+                __atomic_store_n( &( pxSubscriptionList->pvReadersDone ), pvReadersDone, __ATOMIC_RELEASE );
+            }
+
+            __atomic_store_n( &( pxSubscriptionList->ulWriterWaiting ), ulTable + 1U, __ATOMIC_SEQ_CST );
+
+            /* The event may be left signaled by a previous wait, so the
+             * readers are checked again every time it is taken. */
+            while( __atomic_load_n( &( pxSubscriptionList->ulReaders[ ulTable ] ), __ATOMIC_SEQ_CST ) != 0U )
+            {
+                SUBSCRIPTION_MANAGER_WAIT_FOR_READERS( pvReadersDone );
+            }
+
+            __atomic_store_n( &( pxSubscriptionList->ulWriterWaiting ), 0U, __ATOMIC_SEQ_CST );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvIsDispatchContext( const SubscriptionList_t * pxSubscriptionList )
+    {
+        void * pvTask = SUBSCRIPTION_MANAGER_GET_TASK();
+
+        return ( pvTask != NULL ) &&
+               ( __atomic_load_n( &( pxSubscriptionList->pvDispatchTask ), __ATOMIC_ACQUIRE ) == pvTask );
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvBeginWrite( SubscriptionList_t * pxSubscriptionList )
+    {
+        uint32_t ulTable = 1U - __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_ACQUIRE );
+
+        prvWaitForReaders( pxSubscriptionList, ulTable );
+
+        return ulTable;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static uint32_t prvPublishWrite( SubscriptionList_t * pxSubscriptionList,
+                                     uint32_t ulTable )
+    {
+        __atomic_store_n( &( pxSubscriptionList->ulActiveTable ), ulTable, __ATOMIC_SEQ_CST );
+
+        prvWaitForReaders( pxSubscriptionList, 1U - ulTable );
+
+        return 1U - ulTable;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvReserveBlocks( SubscriptionList_t * pxSubscriptionList )
+    {
+        SubscriptionTable_t * pxTable = NULL;
+        uint32_t ulTable = 0U;
+        uint16_t usBlock = 0U;
+        bool xNeedsBlock = false, xReserved = true;
+
+        for( ulTable = 0U; ( ulTable < SUBSCRIPTION_MANAGER_TABLE_COPIES ) && ( xReserved == true ); ulTable++ )
+        {
+            pxTable = &( pxSubscriptionList->xTables[ ulTable ] );
+            xNeedsBlock = true;
+
+            for( usBlock = 0U; ( usBlock < pxTable->usBlockCount ) && ( xNeedsBlock == true ); usBlock++ )
+            {
+                xNeedsBlock = ( pxTable->pxBlocks[ usBlock ] == NULL ) ||
+                              ( pxTable->ulUsedSlots[ usBlock ] == BLOCK_FULL_MASK );
+            }
+
+            if( xNeedsBlock == true )
+            {
+                pxTable->pxReservedBlock = prvTakePoolBlock( &( pxTable->ucReservedPoolBlock ) );
+                xReserved = ( pxTable->pxReservedBlock != NULL );
+            }
+        }
+
+        if( xReserved == false )
+        {
+            /* Neither copy can grow, so an addition fails on both. */
+            prvReleaseReservedBlocks( pxSubscriptionList );
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static void prvReleaseReservedBlocks( SubscriptionList_t * pxSubscriptionList )
+    {
+        SubscriptionTable_t * pxTable = NULL;
+        uint32_t ulTable = 0U;
+
+        for( ulTable = 0U; ulTable < SUBSCRIPTION_MANAGER_TABLE_COPIES; ulTable++ )
+        {
+            pxTable = &( pxSubscriptionList->xTables[ ulTable ] );
+
+            if( pxTable->pxReservedBlock != NULL )
+            {
+                prvGivePoolBlock( pxTable->pxReservedBlock, pxTable->ucReservedPoolBlock );
+                pxTable->pxReservedBlock = NULL;
+            }
+        }
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvReplayMatches( bool xMatches )
+    {
+        if( xMatches == false )
+        {
+            LogError( ( "The copies of the subscription list differ after an update." ) );
+        }
+
+        return xMatches;
+    }
+
+/*-----------------------------------------------------------*/
+
+    static bool prvCheckReplayedAdd( SubscriptionList_t * pxSubscriptionList,
+                                     uint32_t ulTable,
+                                     bool xAdded,
+                                     bool xReplayed,
+                                     const char * pcTopicFilterString,
+                                     uint16_t usTopicFilterLength,
+                                     IncomingPubCallback_t pxIncomingPublishCallback,
+                                     void * pvIncomingPublishCallbackContext )
+    {
+        uint32_t ulCopy = ulTable;
+
+        if( prvReplayMatches( xAdded == xReplayed ) == false )
+        {
+            if( xAdded == true )
+            {
+                /* Readers use the copy published first, so publish the other
+                 * one before removing the subscription from it. */
+                ulCopy = prvPublishWrite( pxSubscriptionList, ulTable );
+            }
+
+            ( void ) prvRemoveSubscription( &( pxSubscriptionList->xTables[ ulCopy ] ),
+                                            pcTopicFilterString,
+                                            usTopicFilterLength,
+                                            pxIncomingPublishCallback,
+                                            pvIncomingPublishCallbackContext );
+        }
+
+        return ( xAdded == true ) && ( xReplayed == true );
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 */
+
+bool addSubscription( SubscriptionList_t * pxSubscriptionList,
                       const char * pcTopicFilterString,
                       uint16_t usTopicFilterLength,
                       IncomingPubCallback_t pxIncomingPublishCallback,
                       void * pvIncomingPublishCallbackContext )
 {
-    int32_t lIndex = 0;
-    size_t xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
-    bool xReturnStatus = false;
+    return addSubscriptionWithIndex( pxSubscriptionList,
+                                     pcTopicFilterString,
+                                     usTopicFilterLength,
+                                     pxIncomingPublishCallback,
+                                     pvIncomingPublishCallbackContext,
+                                     NULL );
+}
+
+/*-----------------------------------------------------------*/
+
+bool addSubscriptionWithIndex( SubscriptionList_t * pxSubscriptionList,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext,
+                               size_t * pxIndex )
+{
+    bool xReturnStatus = false;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulTable = 0U;
+        bool xReplayed = false;
+    #endif
+
+    if( pxSubscriptionList == NULL )
+    {
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
+    }
+    else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+    {
+        LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+    }
+    else
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            /* Both copies get the same updates, so the subscription gets the
+             * same index in both. */
+            ulTable = prvBeginWrite( pxSubscriptionList );
+            prvReserveBlocks( pxSubscriptionList );
+            xReturnStatus = prvAddSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                pcTopicFilterString,
+                                                usTopicFilterLength,
+                                                pxIncomingPublishCallback,
+                                                pvIncomingPublishCallbackContext,
+                                                pxIndex );
+
+            ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+            xReplayed = prvAddSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                            pcTopicFilterString,
+                                            usTopicFilterLength,
+                                            pxIncomingPublishCallback,
+                                            pvIncomingPublishCallbackContext,
+                                            NULL );
+            prvReleaseReservedBlocks( pxSubscriptionList );
+
+            xReturnStatus = prvCheckReplayedAdd( pxSubscriptionList,
+                                                 ulTable,
+                                                 xReturnStatus,
+                                                 xReplayed,
+                                                 pcTopicFilterString,
+                                                 usTopicFilterLength,
+                                                 pxIncomingPublishCallback,
+                                                 pvIncomingPublishCallbackContext );
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            xReturnStatus = prvAddSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                pcTopicFilterString,
+                                                usTopicFilterLength,
+                                                pxIncomingPublishCallback,
+                                                pvIncomingPublishCallbackContext,
+                                                pxIndex );
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+    }
+
+    return xReturnStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+void removeSubscription( SubscriptionList_t * pxSubscriptionList,
+                         const char * pcTopicFilterString,
+                         uint16_t usTopicFilterLength )
+{
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulTable = 0U;
+        bool xRemoved = false;
+    #endif
 
-    if( ( pxSubscriptionList == NULL ) ||
-        ( pcTopicFilterString == NULL ) ||
-        ( usTopicFilterLength == 0U ) ||
-        ( pxIncomingPublishCallback == NULL ) )
+    if( pxSubscriptionList == NULL )
     {
-        LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
-                    " usTopicFilterLength=%u, pxIncomingPublishCallback=%p.",
-                    pxSubscriptionList,
-                    pcTopicFilterString,
-                    ( unsigned int ) usTopicFilterLength,
-                    pxIncomingPublishCallback ) );
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
+    }
+    else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+    {
+        LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
     }
     else
     {
-        /* Start at end of array, so that we will insert at the first available index.
-         * Scans backwards to find duplicates. */
-        for( lIndex = ( int32_t ) SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS - 1; lIndex >= 0; lIndex-- )
-        {
-            if( pxSubscriptionList[ lIndex ].usFilterStringLength == 0 )
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            ulTable = prvBeginWrite( pxSubscriptionList );
+            xRemoved = prvRemoveSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                              pcTopicFilterString,
+                                              usTopicFilterLength,
+                                              NULL,
+                                              NULL );
+
+            ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+            ( void ) prvReplayMatches( prvRemoveSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                              pcTopicFilterString,
+                                                              usTopicFilterLength,
+                                                              NULL,
+                                                              NULL ) == xRemoved );
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            ( void ) prvRemoveSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                            pcTopicFilterString,
+                                            usTopicFilterLength,
+                                            NULL,
+                                            NULL );
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+void removeSubscriptionAtIndex( SubscriptionList_t * pxSubscriptionList,
+                                size_t xIndex )
+{
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulTable = 0U;
+        bool xRemoved = false;
+    #endif
+
+    if( pxSubscriptionList == NULL )
+    {
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
+    }
+    else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+    {
+        LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+    }
+    else
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            ulTable = prvBeginWrite( pxSubscriptionList );
+            xRemoved = prvRemoveSubscriptionAtIndex( &( pxSubscriptionList->xTables[ ulTable ] ), xIndex );
+
+            ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+            ( void ) prvReplayMatches( prvRemoveSubscriptionAtIndex( &( pxSubscriptionList->xTables[ ulTable ] ), xIndex ) == xRemoved );
+        #else
+            ( void ) prvRemoveSubscriptionAtIndex( &( pxSubscriptionList->xTables[ 0 ] ), xIndex );
+        #endif
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+SharedSubscriptionStatus_t addSharedSubscription( SubscriptionList_t * pxSubscriptionList,
+                                                  const char * pcTopicFilterString,
+                                                  uint16_t usTopicFilterLength,
+                                                  IncomingPubCallback_t pxIncomingPublishCallback,
+                                                  void * pvIncomingPublishCallbackContext )
+{
+    SharedSubscriptionStatus_t xAdded = SharedSubscriptionNotFound;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulTable = 0U;
+        SharedSubscriptionStatus_t xReplayed = SharedSubscriptionNotFound;
+    #endif
+
+    if( pxSubscriptionList == NULL )
+    {
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
+    }
+    else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+    {
+        LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+    }
+    else
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            ulTable = prvBeginWrite( pxSubscriptionList );
+            prvReserveBlocks( pxSubscriptionList );
+            xAdded = prvAddSharedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                               pcTopicFilterString,
+                                               usTopicFilterLength,
+                                               pxIncomingPublishCallback,
+                                               pvIncomingPublishCallbackContext );
+
+            ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+            xReplayed = prvAddSharedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                  pcTopicFilterString,
+                                                  usTopicFilterLength,
+                                                  pxIncomingPublishCallback,
+                                                  pvIncomingPublishCallbackContext );
+            prvReleaseReservedBlocks( pxSubscriptionList );
+
+            if( ( prvCheckReplayedAdd( pxSubscriptionList,
+                                       ulTable,
+                                       ( xAdded == SharedSubscriptionAdded ),
+                                       ( xReplayed == SharedSubscriptionAdded ),
+                                       pcTopicFilterString,
+                                       usTopicFilterLength,
+                                       pxIncomingPublishCallback,
+                                       pvIncomingPublishCallbackContext ) == false ) &&
+                ( xAdded == SharedSubscriptionAdded ) )
             {
-                xAvailableIndex = lIndex;
+                /* The caller subscribes with the broker, and adds the
+                 * subscription again. */
+                xAdded = SharedSubscriptionNotFound;
             }
-            else if( ( pxSubscriptionList[ lIndex ].usFilterStringLength == usTopicFilterLength ) &&
-                     ( strncmp( pcTopicFilterString, pxSubscriptionList[ lIndex ].pcSubscriptionFilterString, ( size_t ) usTopicFilterLength ) == 0 ) )
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            xAdded = prvAddSharedSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                               pcTopicFilterString,
+                                               usTopicFilterLength,
+                                               pxIncomingPublishCallback,
+                                               pvIncomingPublishCallbackContext );
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+    }
+
+    return xAdded;
+}
+
+/*-----------------------------------------------------------*/
+
+bool removeSharedSubscription( SubscriptionList_t * pxSubscriptionList,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext )
+{
+    bool xStillSubscribed = false;
+
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulTable = 0U;
+    #endif
+
+    if( pxSubscriptionList == NULL )
+    {
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
+    }
+    else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+    {
+        LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+    }
+    else
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            ulTable = prvBeginWrite( pxSubscriptionList );
+            xStillSubscribed = prvRemoveSharedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                            pcTopicFilterString,
+                                                            usTopicFilterLength,
+                                                            pxIncomingPublishCallback,
+                                                            pvIncomingPublishCallbackContext );
+
+            ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+
+            if( prvReplayMatches( prvRemoveSharedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                               pcTopicFilterString,
+                                                               usTopicFilterLength,
+                                                               pxIncomingPublishCallback,
+                                                               pvIncomingPublishCallbackContext ) == xStillSubscribed ) == false )
             {
-                /* If a subscription already exists, don't do anything. */
-                if( ( pxSubscriptionList[ lIndex ].pxIncomingPublishCallback == pxIncomingPublishCallback ) &&
-                    ( pxSubscriptionList[ lIndex ].pvIncomingPublishCallbackContext == pvIncomingPublishCallbackContext ) )
-                {
-                    LogWarn( ( "Subscription already exists.\n" ) );
-                    xAvailableIndex = SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS;
-                    xReturnStatus = true;
-                    break;
-                }
+                /* Keep the broker subscription, which a copy still uses. */
+                xStillSubscribed = true;
             }
-        }
-
-        if( xAvailableIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
-        {
-            pxSubscriptionList[ xAvailableIndex ].pcSubscriptionFilterString = pcTopicFilterString;
-            pxSubscriptionList[ xAvailableIndex ].usFilterStringLength = usTopicFilterLength;
-            pxSubscriptionList[ xAvailableIndex ].pxIncomingPublishCallback = pxIncomingPublishCallback;
-            pxSubscriptionList[ xAvailableIndex ].pvIncomingPublishCallbackContext = pvIncomingPublishCallbackContext;
-            xReturnStatus = true;
-        }
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            xStillSubscribed = prvRemoveSharedSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                            pcTopicFilterString,
+                                                            usTopicFilterLength,
+                                                            pxIncomingPublishCallback,
+                                                            pvIncomingPublishCallbackContext );
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
     }
 
-    return xReturnStatus;
+    return xStillSubscribed;
 }
 
 /*-----------------------------------------------------------*/
 
-void removeSubscription( SubscriptionElement_t * pxSubscriptionList,
-                         const char * pcTopicFilterString,
-                         uint16_t usTopicFilterLength )
+void completeSharedUnsubscribe( SubscriptionList_t * pxSubscriptionList,
+                                const char * pcTopicFilterString,
+                                uint16_t usTopicFilterLength )
 {
-    uint32_t ulIndex = 0;
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulTable = 0U;
+    #endif
 
     if( ( pxSubscriptionList == NULL ) ||
-        ( pcTopicFilterString == NULL ) ||
-        ( usTopicFilterLength == 0U ) )
+        ( pcTopicFilterString == NULL ) )
     {
-        LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
-                    " usTopicFilterLength=%u.",
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p.",
                     pxSubscriptionList,
-                    pcTopicFilterString,
-                    ( unsigned int ) usTopicFilterLength ) );
+                    pcTopicFilterString ) );
+    }
+    else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+    {
+        LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
     }
     else
     {
-        for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++ )
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            ulTable = prvBeginWrite( pxSubscriptionList );
+            prvCompleteSharedUnsubscribe( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                          pcTopicFilterString,
+                                          usTopicFilterLength );
+
+            ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+            prvCompleteSharedUnsubscribe( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                          pcTopicFilterString,
+                                          usTopicFilterLength );
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            prvCompleteSharedUnsubscribe( &( pxSubscriptionList->xTables[ 0 ] ),
+                                          pcTopicFilterString,
+                                          usTopicFilterLength );
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+
+    uint16_t getAggregateFilter( SubscriptionList_t * pxSubscriptionList,
+                                 const char * pcTopicFilterString,
+                                 uint16_t usTopicFilterLength,
+                                 char * pcAggregateFilter,
+                                 uint16_t usBufferLength )
+    {
+        uint16_t usLength = 0U;
+
+        if( ( pxSubscriptionList == NULL ) ||
+            ( pcTopicFilterString == NULL ) ||
+            ( pcAggregateFilter == NULL ) )
+        {
+            LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p, pcAggregateFilter=%p.",
+                        pxSubscriptionList,
+                        pcTopicFilterString,
+                        pcAggregateFilter ) );
+        }
+        else
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                usLength = prvGetAggregateFilter( &( pxSubscriptionList->xTables[ __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_ACQUIRE ) ] ),
+                                                  pcTopicFilterString,
+                                                  usTopicFilterLength,
+                                                  pcAggregateFilter,
+                                                  usBufferLength );
+            #else
+                usLength = prvGetAggregateFilter( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                  pcTopicFilterString,
+                                                  usTopicFilterLength,
+                                                  pcAggregateFilter,
+                                                  usBufferLength );
+            #endif
+        }
+
+        return usLength;
+    }
+
+/*-----------------------------------------------------------*/
+
+    bool addAggregate( SubscriptionList_t * pxSubscriptionList,
+                       const char * pcAggregateFilter,
+                       uint16_t usAggregateFilterLength )
+    {
+        bool xAdded = false;
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            uint32_t ulTable = 0U;
+        #endif
+
+        if( ( pxSubscriptionList == NULL ) ||
+            ( pcAggregateFilter == NULL ) )
+        {
+            LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcAggregateFilter=%p.",
+                        pxSubscriptionList,
+                        pcAggregateFilter ) );
+        }
+        else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+        {
+            LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+        }
+        else
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                ulTable = prvBeginWrite( pxSubscriptionList );
+                xAdded = prvAddAggregate( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                          pcAggregateFilter,
+                                          usAggregateFilterLength );
+
+                ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+                xAdded = prvReplayMatches( prvAddAggregate( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                            pcAggregateFilter,
+                                                            usAggregateFilterLength ) == xAdded ) && xAdded;
+            #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+                xAdded = prvAddAggregate( &( pxSubscriptionList->xTables[ 0 ] ),
+                                          pcAggregateFilter,
+                                          usAggregateFilterLength );
+            #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+        }
+
+        return xAdded;
+    }
+
+/*-----------------------------------------------------------*/
+
+    bool addAggregatedSubscription( SubscriptionList_t * pxSubscriptionList,
+                                    const char * pcTopicFilterString,
+                                    uint16_t usTopicFilterLength,
+                                    IncomingPubCallback_t pxIncomingPublishCallback,
+                                    void * pvIncomingPublishCallbackContext )
+    {
+        bool xAdded = false;
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            uint32_t ulTable = 0U;
+            bool xReplayed = false;
+        #endif
+
+        if( pxSubscriptionList == NULL )
+        {
+            LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                        pxSubscriptionList ) );
+        }
+        else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+        {
+            LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+        }
+        else
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                ulTable = prvBeginWrite( pxSubscriptionList );
+                prvReserveBlocks( pxSubscriptionList );
+                xAdded = prvAddAggregatedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                       pcTopicFilterString,
+                                                       usTopicFilterLength,
+                                                       pxIncomingPublishCallback,
+                                                       pvIncomingPublishCallbackContext );
+
+                ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+                xReplayed = prvAddAggregatedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                          pcTopicFilterString,
+                                                          usTopicFilterLength,
+                                                          pxIncomingPublishCallback,
+                                                          pvIncomingPublishCallbackContext );
+                prvReleaseReservedBlocks( pxSubscriptionList );
+
+                xAdded = prvCheckReplayedAdd( pxSubscriptionList,
+                                              ulTable,
+                                              xAdded,
+                                              xReplayed,
+                                              pcTopicFilterString,
+                                              usTopicFilterLength,
+                                              pxIncomingPublishCallback,
+                                              pvIncomingPublishCallbackContext );
+            #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+                xAdded = prvAddAggregatedSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                       pcTopicFilterString,
+                                                       usTopicFilterLength,
+                                                       pxIncomingPublishCallback,
+                                                       pvIncomingPublishCallbackContext );
+            #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+        }
+
+        return xAdded;
+    }
+
+/*-----------------------------------------------------------*/
+
+    uint16_t absorbAggregatedFilter( SubscriptionList_t * pxSubscriptionList,
+                                     const char * pcAggregateFilter,
+                                     uint16_t usAggregateFilterLength,
+                                     char * pcTopicFilter,
+                                     uint16_t usBufferLength )
+    {
+        uint16_t usLength = 0U;
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            uint32_t ulTable = 0U;
+        #endif
+
+        if( ( pxSubscriptionList == NULL ) ||
+            ( pcAggregateFilter == NULL ) ||
+            ( usAggregateFilterLength == 0U ) ||
+            ( pcTopicFilter == NULL ) )
+        {
+            LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcAggregateFilter=%p,"
+                        " usAggregateFilterLength=%u, pcTopicFilter=%p.",
+                        pxSubscriptionList,
+                        pcAggregateFilter,
+                        ( unsigned int ) usAggregateFilterLength,
+                        pcTopicFilter ) );
+        }
+        else if( prvIsDispatchContext( pxSubscriptionList ) == true )
+        {
+            LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+        }
+        else
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                ulTable = prvBeginWrite( pxSubscriptionList );
+                usLength = prvAbsorbAggregatedFilter( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                      pcAggregateFilter,
+                                                      usAggregateFilterLength,
+                                                      pcTopicFilter,
+                                                      usBufferLength );
+
+                ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+
+                if( prvReplayMatches( prvAbsorbAggregatedFilter( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                                 pcAggregateFilter,
+                                                                 usAggregateFilterLength,
+                                                                 pcTopicFilter,
+                                                                 usBufferLength ) == usLength ) == false )
+                {
+                    usLength = 0U;
+                }
+            #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+                usLength = prvAbsorbAggregatedFilter( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                      pcAggregateFilter,
+                                                      usAggregateFilterLength,
+                                                      pcTopicFilter,
+                                                      usBufferLength );
+            #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+        }
+
+        return usLength;
+    }
+
+/*-----------------------------------------------------------*/
+
+    uint16_t removeAggregatedSubscription( SubscriptionList_t * pxSubscriptionList,
+                                           const char * pcTopicFilterString,
+                                           uint16_t usTopicFilterLength,
+                                           IncomingPubCallback_t pxIncomingPublishCallback,
+                                           void * pvIncomingPublishCallbackContext,
+                                           char * pcUnsubscribeFilter,
+                                           uint16_t usBufferLength )
+    {
+        uint16_t usLength = 0U;
+        bool xOverBudget[ SUBSCRIPTION_MANAGER_MAX_AGGREGATES ];
+        uint32_t ulPublishes = 0U, ulOvermatches = 0U, ulTable = 0U;
+        size_t xIndex = 0U;
+
+        if( ( pxSubscriptionList == NULL ) ||
+            ( pcTopicFilterString == NULL ) ||
+            ( pxIncomingPublishCallback == NULL ) ||
+            ( pcUnsubscribeFilter == NULL ) )
+        {
+            LogError( ( "Invalid parameter. pxSubscriptionList=%p, pcTopicFilterString=%p,"
+                        " pxIncomingPublishCallback=%p, pcUnsubscribeFilter=%p.",
+                        pxSubscriptionList,
+                        pcTopicFilterString,
+                        pxIncomingPublishCallback,
+                        pcUnsubscribeFilter ) );
+        }
+        else if( prvIsDispatchContext( pxSubscriptionList ) == true )
         {
-            if( pxSubscriptionList[ ulIndex ].usFilterStringLength == usTopicFilterLength )
+            LogError( ( "Subscription list cannot be changed from a subscription callback." ) );
+        }
+        else
+        {
+            /* Readers count publishes in the copy they use, so the budget is
+             * checked once over both copies, and both copies get the same
+             * decision. */
+            for( xIndex = 0U; xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES; xIndex++ )
             {
-                if( strncmp( pxSubscriptionList[ ulIndex ].pcSubscriptionFilterString, pcTopicFilterString, usTopicFilterLength ) == 0 )
+                ulPublishes = 0U;
+                ulOvermatches = 0U;
+
+                for( ulTable = 0U; ulTable < SUBSCRIPTION_MANAGER_TABLE_COPIES; ulTable++ )
                 {
-                    memset( &( pxSubscriptionList[ ulIndex ] ), 0x00, sizeof( SubscriptionElement_t ) );
+                    ulPublishes += pxSubscriptionList->xTables[ ulTable ].xAggregates[ xIndex ].ulPublishes;
+                    ulOvermatches += pxSubscriptionList->xTables[ ulTable ].xAggregates[ xIndex ].ulOvermatches;
                 }
+
+                xOverBudget[ xIndex ] = prvAggregateOverBudget( ulPublishes, ulOvermatches );
             }
+
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                ulTable = prvBeginWrite( pxSubscriptionList );
+                usLength = prvRemoveAggregatedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                            pcTopicFilterString,
+                                                            usTopicFilterLength,
+                                                            pxIncomingPublishCallback,
+                                                            pvIncomingPublishCallbackContext,
+                                                            xOverBudget,
+                                                            pcUnsubscribeFilter,
+                                                            usBufferLength );
+
+                ulTable = prvPublishWrite( pxSubscriptionList, ulTable );
+
+                if( prvReplayMatches( prvRemoveAggregatedSubscription( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                                       pcTopicFilterString,
+                                                                       usTopicFilterLength,
+                                                                       pxIncomingPublishCallback,
+                                                                       pvIncomingPublishCallbackContext,
+                                                                       xOverBudget,
+                                                                       pcUnsubscribeFilter,
+                                                                       usBufferLength ) == usLength ) == false )
+                {
+                    /* Keep the broker subscription, which a copy still uses. */
+                    usLength = 0U;
+                }
+            #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+                usLength = prvRemoveAggregatedSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                            pcTopicFilterString,
+                                                            usTopicFilterLength,
+                                                            pxIncomingPublishCallback,
+                                                            pvIncomingPublishCallbackContext,
+                                                            xOverBudget,
+                                                            pcUnsubscribeFilter,
+                                                            usBufferLength );
+            #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
         }
+
+        return usLength;
+    }
+
+/*-----------------------------------------------------------*/
+
+    const char * getAggregate( SubscriptionList_t * pxSubscriptionList,
+                               size_t xIndex,
+                               uint16_t * pusLength )
+    {
+        const char * pcFilter = NULL;
+        const SubscriptionAggregate_t * pxAggregate = NULL;
+
+        if( ( pxSubscriptionList != NULL ) &&
+            ( pusLength != NULL ) &&
+            ( xIndex < SUBSCRIPTION_MANAGER_MAX_AGGREGATES ) )
+        {
+            #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+                pxAggregate = &( pxSubscriptionList->xTables[ __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_ACQUIRE ) ].xAggregates[ xIndex ] );
+            #else
+                pxAggregate = &( pxSubscriptionList->xTables[ 0 ].xAggregates[ xIndex ] );
+            #endif
+
+            if( pxAggregate->xActive == true )
+            {
+                pcFilter = pxAggregate->cFilter;
+                *pusLength = pxAggregate->usFilterLength;
+            }
+        }
+
+        return pcFilter;
     }
-}
 
 /*-----------------------------------------------------------*/
 
-bool handleIncomingPublishes( SubscriptionElement_t * pxSubscriptionList,
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
+bool handleIncomingPublishes( SubscriptionList_t * pxSubscriptionList,
                               MQTTPublishInfo_t * pxPublishInfo )
 {
-    uint32_t ulIndex = 0;
-    bool isMatched = false, publishHandled = false;
+    bool publishHandled = false;
+    uint32_t ulTable = 0U;
 
-    if( ( pxSubscriptionList == NULL ) ||
-        ( pxPublishInfo == NULL ) )
+    if( pxSubscriptionList == NULL )
     {
-        LogError( ( "Invalid parameter. pxSubscriptionList=%p, pxPublishInfo=%p,",
-                    pxSubscriptionList,
-                    pxPublishInfo ) );
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
     }
     else
     {
-        for( ulIndex = 0U; ulIndex < SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS; ulIndex++ )
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            /* Callbacks run on this task, and must not write to the list. */
+            __atomic_store_n( &( pxSubscriptionList->pvDispatchTask ), SUBSCRIPTION_MANAGER_GET_TASK(), __ATOMIC_RELEASE );
+            ulTable = prvBeginRead( pxSubscriptionList );
+        #endif
+
+        publishHandled = prvHandleIncomingPublishes( &( pxSubscriptionList->xTables[ ulTable ] ),
+                                                     pxPublishInfo );
+
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            prvEndRead( pxSubscriptionList, ulTable );
+            __atomic_store_n( &( pxSubscriptionList->pvDispatchTask ), NULL, __ATOMIC_RELEASE );
+        #endif
+    }
+
+    return publishHandled;
+}
+
+/*-----------------------------------------------------------*/
+
+SubscriptionElement_t * getSubscription( SubscriptionList_t * pxSubscriptionList,
+                                         size_t xIndex )
+{
+    SubscriptionElement_t * pxSubscription = NULL;
+
+    if( pxSubscriptionList != NULL )
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            pxSubscription = prvGetSubscription( &( pxSubscriptionList->xTables[ __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_ACQUIRE ) ] ),
+                                                 xIndex );
+        #else
+            pxSubscription = prvGetSubscription( &( pxSubscriptionList->xTables[ 0 ] ),
+                                                 xIndex );
+        #endif
+    }
+
+    return pxSubscription;
+}
+
+/*-----------------------------------------------------------*/
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+    bool matchSubscriptionFilter( const SubscriptionElement_t * pxSubscription,
+                                  const char * pcTopicName,
+                                  uint16_t usTopicNameLength )
+    {
+        const char * pcSeparator = NULL;
+        bool xIsMatch = false;
+
+        if( ( pxSubscription == NULL ) || ( pcTopicName == NULL ) )
+        {
+            LogError( ( "Invalid parameter. pxSubscription=%p, pcTopicName=%p.",
+                        pxSubscription,
+                        pcTopicName ) );
+        }
+        else if( pxSubscription->xCompiledFilter.ucLevelCount > 0U )
+        {
+            pcSeparator = memchr( pcTopicName, '/', usTopicNameLength );
+            xIsMatch = prvMatchCompiledFilter( pxSubscription,
+                                               pcTopicName,
+                                               usTopicNameLength,
+                                               prvHashTopic( pcTopicName,
+                                                             ( pcSeparator != NULL ) ?
+                                                             ( uint16_t ) ( pcSeparator - pcTopicName ) :
+                                                             usTopicNameLength ) );
+        }
+        else
+        {
+            ( void ) MQTT_MatchTopic( pcTopicName,
+                                      usTopicNameLength,
+                                      pxSubscription->pcSubscriptionFilterString,
+                                      pxSubscription->usFilterStringLength,
+                                      &xIsMatch );
+        }
+
+        return xIsMatch;
+    }
+
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 )
+
+    bool getSubscriptionDispatchStats( SubscriptionList_t * pxSubscriptionList,
+                                       size_t xIndex,
+                                       SubscriptionDispatchStats_t * pxStats )
+    {
+        SubscriptionElement_t * pxSubscription = NULL;
+        bool xFound = false;
+        uint32_t ulTable = 0U;
+
+        if( ( pxSubscriptionList == NULL ) ||
+            ( pxStats == NULL ) )
         {
-            if( pxSubscriptionList[ ulIndex ].usFilterStringLength > 0 )
+            LogError( ( "Invalid parameter. pxSubscriptionList=%p, pxStats=%p.",
+                        pxSubscriptionList,
+                        pxStats ) );
+        }
+        else
+        {
+            memset( pxStats, 0, sizeof( SubscriptionDispatchStats_t ) );
+
+            /* Both copies of the table hold the subscription at the same index,
+             * but readers record their dispatches in either one. */
+            for( ulTable = 0U; ulTable < SUBSCRIPTION_MANAGER_TABLE_COPIES; ulTable++ )
             {
-                MQTT_MatchTopic( pxPublishInfo->pTopicName,
-                                 pxPublishInfo->topicNameLength,
-                                 pxSubscriptionList[ ulIndex ].pcSubscriptionFilterString,
-                                 pxSubscriptionList[ ulIndex ].usFilterStringLength,
-                                 &isMatched );
+                pxSubscription = prvGetSubscription( &( pxSubscriptionList->xTables[ ulTable ] ), xIndex );
 
-                if( isMatched == true )
+                if( pxSubscription != NULL )
                 {
-                    pxSubscriptionList[ ulIndex ].pxIncomingPublishCallback( pxSubscriptionList[ ulIndex ].pvIncomingPublishCallbackContext,
-                                                                             pxPublishInfo );
-                    publishHandled = true;
+                    pxStats->ulMatches += pxSubscription->xDispatchStats.ulMatches;
+                    pxStats->ulBytesDelivered += pxSubscription->xDispatchStats.ulBytesDelivered;
+                    pxStats->ulCallbackTimeUs += pxSubscription->xDispatchStats.ulCallbackTimeUs;
+                    pxStats->ulSlowCallbacks += pxSubscription->xDispatchStats.ulSlowCallbacks;
+
+                    if( pxSubscription->xDispatchStats.ulMaxCallbackTimeUs > pxStats->ulMaxCallbackTimeUs )
+                    {
+                        pxStats->ulMaxCallbackTimeUs = pxSubscription->xDispatchStats.ulMaxCallbackTimeUs;
+                    }
+
+                    xFound = true;
                 }
             }
         }
+
+        return xFound;
     }
 
-    return publishHandled;
+/*-----------------------------------------------------------*/
+
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 */
+
+void getSubscriptionManagerStats( const SubscriptionList_t * pxSubscriptionList,
+                                  SubscriptionManagerStats_t * pxStats )
+{
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        SubscriptionManagerStats_t xOtherStats = { 0 };
+        uint32_t ulTable = 0U;
+    #endif
+
+    if( pxSubscriptionList == NULL )
+    {
+        LogError( ( "Invalid parameter. pxSubscriptionList=%p.",
+                    pxSubscriptionList ) );
+    }
+    else
+    {
+        #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+            ulTable = __atomic_load_n( &( pxSubscriptionList->ulActiveTable ), __ATOMIC_ACQUIRE );
+            prvGetTableStats( &( pxSubscriptionList->xTables[ ulTable ] ), pxStats );
+            prvGetTableStats( &( pxSubscriptionList->xTables[ 1U - ulTable ] ), &xOtherStats );
+
+            if( pxStats != NULL )
+            {
+                /* Both copies get every update, but readers use either one. */
+                pxStats->ulExactMatchLookups += xOtherStats.ulExactMatchLookups;
+                pxStats->ulExactMatchHits += xOtherStats.ulExactMatchHits;
+                pxStats->ulWildcardMatchLookups += xOtherStats.ulWildcardMatchLookups;
+                pxStats->ulWildcardMatchHits += xOtherStats.ulWildcardMatchHits;
+                pxStats->ulUnmatchedPublishes += xOtherStats.ulUnmatchedPublishes;
+                pxStats->ulAggregateOvermatches += xOtherStats.ulAggregateOvermatches;
+            }
+        #else /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+            prvGetTableStats( &( pxSubscriptionList->xTables[ 0 ] ), pxStats );
+        #endif /* if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 ) */
+    }
 }
@@ -34,12 +34,240 @@
 /* core MQTT include. */
 #include "core_mqtt.h"
 
+/* Subscription manager configurations include. */
+#include "subscription_manager_config.h"
+
+/**
+ * @brief Number of subscriptions in each block of the subscription pool. A
+ * subscription list grows and shrinks one block at a time. At most 32.
+ */
+#ifndef SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS
+    #define SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS    4U
+#endif
+
+/**
+ * @brief Number of blocks in the subscription pool shared by all subscription
+ * lists. At most 32.
+ */
+#ifndef SUBSCRIPTION_MANAGER_POOL_BLOCKS
+    #define SUBSCRIPTION_MANAGER_POOL_BLOCKS    3U
+#endif
+
 /**
  * @brief Maximum number of subscriptions maintained by the subscription manager
- * simultaneously in a list.
+ * simultaneously in a list, which is the capacity of the whole pool.
+ */
+#define SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS    ( SUBSCRIPTION_MANAGER_POOL_BLOCKS * SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS )
+
+/**
+ * @brief Set to 1 to allocate the blocks of the subscription pool with
+ * SUBSCRIPTION_MANAGER_MALLOC() when a list grows, and free them with
+ * SUBSCRIPTION_MANAGER_FREE() when it shrinks, instead of reserving the whole
+ * pool statically. SUBSCRIPTION_MANAGER_POOL_BLOCKS still bounds the number of
+ * blocks in use.
+ */
+#ifndef SUBSCRIPTION_MANAGER_POOL_FROM_HEAP
+    #define SUBSCRIPTION_MANAGER_POOL_FROM_HEAP    0
+#endif
+
+#if ( SUBSCRIPTION_MANAGER_POOL_FROM_HEAP == 1 ) && ( !defined( SUBSCRIPTION_MANAGER_MALLOC ) || !defined( SUBSCRIPTION_MANAGER_FREE ) )
+    #error "SUBSCRIPTION_MANAGER_MALLOC and SUBSCRIPTION_MANAGER_FREE must be defined when SUBSCRIPTION_MANAGER_POOL_FROM_HEAP is 1."
+#endif
+
+/**
+ * @brief Set to 1 to index topic filters in a level trie so that an incoming
+ * publish is matched against all subscriptions in a single traversal.
+ */
+#ifndef SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE
+    #define SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE    0
+#endif
+
+/**
+ * @brief Maximum number of nodes in the topic trie. Every distinct topic level
+ * of a topic filter prefix takes one node, plus one for the root.
+ */
+#ifndef SUBSCRIPTION_MANAGER_TRIE_MAX_NODES
+    #define SUBSCRIPTION_MANAGER_TRIE_MAX_NODES    ( 4U * SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+#endif
+
+/**
+ * @brief Set to 1 to keep topic filters without wildcards in a hash table, so
+ * that they are matched with one hash and one compare instead of
+ * MQTT_MatchTopic. Only the wildcard filters are then matched against every
+ * incoming publish.
+ */
+#ifndef SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH
+    #define SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH    0
+#endif
+
+/**
+ * @brief Number of buckets of the exact match hash table. Must be a power of 2.
+ */
+#ifndef SUBSCRIPTION_MANAGER_HASH_BUCKETS
+    #define SUBSCRIPTION_MANAGER_HASH_BUCKETS    8U
+#endif
+
+/**
+ * @brief Set to 1 to precompile every topic filter when it is added, recording
+ * the offsets of its levels, the position of its wildcards, the length of its
+ * literal prefix and a hash of its first level. Incoming publishes are then
+ * matched level by level instead of through MQTT_MatchTopic, and most topics
+ * not matching a filter are rejected by comparing the hash of their first
+ * level. Not supported with SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE.
+ */
+#ifndef SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS
+    #define SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS    0
+#endif
+
+/**
+ * @brief Maximum number of levels of a precompiled topic filter. Filters with
+ * more levels, or longer than 255 bytes, are matched with MQTT_MatchTopic. At
+ * most 32.
+ */
+#ifndef SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS
+    #define SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS    8U
+#endif
+
+/**
+ * @brief Size in bytes of the arena in which a subscription list stores its
+ * topic filter strings. Identical topic filters share their storage.
  */
-#ifndef SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS
-    #define SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS    10U
+#ifndef SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE
+    #define SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE    ( 64U * SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS )
+#endif
+
+/**
+ * @brief Set to 1 to let handleIncomingPublishes() read the subscription list
+ * without locks while another task adds or removes subscriptions.
+ *
+ * The list then keeps two copies of its subscription table. Readers use the
+ * copy published as active, while a writer updates the other copy, publishes
+ * it, waits for the readers of the previous copy to finish and replays the
+ * update on it. This doubles the memory used by the list and the pool, and the
+ * number of pool blocks must then be at most 16. Writers must be serialized.
+ * A writer waits for the readers of the copy it updates, so writes from the
+ * task running handleIncomingPublishes() while it dispatches, which would wait
+ * for themselves, are refused. handleIncomingPublishes() must then be called
+ * from a single task per list.
+ */
+#ifndef SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS
+    #define SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS    0
+#endif
+
+/**
+ * @brief Get an identifier of the calling task, used to refuse writes from the
+ * task dispatching incoming publishes. NULL disables the check.
+ */
+#ifndef SUBSCRIPTION_MANAGER_GET_TASK
+    #define SUBSCRIPTION_MANAGER_GET_TASK()    ( NULL )
+#endif
+
+/**
+ * @brief Create the event a writer blocks on while readers still use the copy
+ * of the subscription table it needs to update. NULL if there is none.
+ */
+#ifndef SUBSCRIPTION_MANAGER_CREATE_READERS_DONE
+    #define SUBSCRIPTION_MANAGER_CREATE_READERS_DONE()    ( NULL )
+#endif
+
+/**
+ * @brief Called by a writer while readers still use the copy of the
+ * subscription table it needs to update. Should block until
+ * SUBSCRIPTION_MANAGER_SIGNAL_WRITER() is called with the same event, or for a
+ * short time if the event is NULL, to let the readers run. The writer checks
+ * the readers again on return, so spurious returns are harmless.
+ */
+#ifndef SUBSCRIPTION_MANAGER_WAIT_FOR_READERS
+    #define SUBSCRIPTION_MANAGER_WAIT_FOR_READERS( pvReadersDone )
+#endif
+
+/**
+ * @brief Called by the last reader of the copy of the subscription table a
+ * writer waits for, to wake the writer.
+ */
+#ifndef SUBSCRIPTION_MANAGER_SIGNAL_WRITER
+    #define SUBSCRIPTION_MANAGER_SIGNAL_WRITER( pvReadersDone )
+#endif
+
+/**
+ * @brief Set to 1 to record, for every subscription, how many incoming
+ * publishes it matched, the payload bytes delivered to its callback, and the
+ * time spent in the callback.
+ */
+#ifndef SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS
+    #define SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS    0
+#endif
+
+/**
+ * @brief Current time in microseconds, used to time subscription callbacks when
+ * SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS is 1.
+ */
+#ifndef SUBSCRIPTION_MANAGER_GET_TIME_US
+    #define SUBSCRIPTION_MANAGER_GET_TIME_US()    ( 0U )
+#endif
+
+/**
+ * @brief A warning is logged with the topic filter of any subscription callback
+ * running for longer than this many microseconds. 0 disables the warning.
+ */
+#ifndef SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US
+    #define SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US    0U
+#endif
+
+/**
+ * @brief Set to 1 to let sibling topic filters without wildcards, such as
+ * device/thing/cmd/led and device/thing/cmd/fan, share one broker
+ * subscription to a covering filter, device/thing/cmd/+, whose publishes are
+ * demultiplexed locally. See getAggregateFilter().
+ */
+#ifndef SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION
+    #define SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION    0
+#endif
+
+/**
+ * @brief Maximum number of covering filters of a list, including the ones
+ * refused for exceeding the overmatch budget.
+ */
+#ifndef SUBSCRIPTION_MANAGER_MAX_AGGREGATES
+    #define SUBSCRIPTION_MANAGER_MAX_AGGREGATES    2U
+#endif
+
+/**
+ * @brief Maximum length of a covering filter.
+ */
+#ifndef SUBSCRIPTION_MANAGER_AGGREGATE_FILTER_LENGTH
+    #define SUBSCRIPTION_MANAGER_AGGREGATE_FILTER_LENGTH    64U
+#endif
+
+/**
+ * @brief Number of sibling topic filters, including the one being subscribed,
+ * from which they are aggregated under a covering filter.
+ */
+#ifndef SUBSCRIPTION_MANAGER_AGGREGATION_MIN_FILTERS
+    #define SUBSCRIPTION_MANAGER_AGGREGATION_MIN_FILTERS    3U
+#endif
+
+/**
+ * @brief Overmatch budget of a covering filter: the percentage of the publishes
+ * it receives which may match no subscription. A covering filter found over
+ * budget, once it received SUBSCRIPTION_MANAGER_AGGREGATION_MIN_SAMPLES
+ * publishes, is not chosen again after its last subscriber leaves.
+ */
+#ifndef SUBSCRIPTION_MANAGER_AGGREGATION_OVERMATCH_PERCENT
+    #define SUBSCRIPTION_MANAGER_AGGREGATION_OVERMATCH_PERCENT    25U
+#endif
+
+#ifndef SUBSCRIPTION_MANAGER_AGGREGATION_MIN_SAMPLES
+    #define SUBSCRIPTION_MANAGER_AGGREGATION_MIN_SAMPLES    20U
+#endif
+
+/**
+ * @brief Number of copies of the subscription table kept by a list.
+ */
+#if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+    #define SUBSCRIPTION_MANAGER_TABLE_COPIES    2U
+#else
+    #define SUBSCRIPTION_MANAGER_TABLE_COPIES    1U
 #endif
 
 /* *INDENT-OFF* */
@@ -58,16 +286,45 @@ typedef void (* IncomingPubCallback_t )( void * pvIncomingPublishCallbackContext
                                          MQTTPublishInfo_t * pxPublishInfo );
 
 /**
- * @brief An element in the list of subscriptions.
+ * @brief Dispatch statistics of a subscription, recorded when
+ * SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS is 1.
+ */
+typedef struct subscriptionDispatchStats
+{
+    uint32_t ulMatches;           /**< Incoming publishes delivered to the callback. */
+    uint32_t ulBytesDelivered;    /**< Payload bytes delivered to the callback. */
+    uint32_t ulCallbackTimeUs;    /**< Time spent in the callback. */
+    uint32_t ulMaxCallbackTimeUs; /**< Longest single run of the callback. */
+    uint32_t ulSlowCallbacks;     /**< Runs longer than SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US. */
+} SubscriptionDispatchStats_t;
+
+/**
+ * @brief Topic filter precompiled when it is added to the list, when
+ * SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS is 1.
  *
- * This subscription manager implementation expects that the array of the
- * subscription elements used for storing subscriptions to be initialized to 0.
+ * The literal prefix is made of the levels before the first wildcard, without
+ * the '/' following them.
+ */
+typedef struct subscriptionCompiledFilter
+{
+    uint32_t ulFirstLevelHash;                                       /**< Hash of the first level, if it is not a wildcard. */
+    uint32_t ulSingleLevelWildcards;                                 /**< Bit n is set if level n is '+'. */
+    uint16_t usLiteralPrefixLength;                                  /**< Length of the literal prefix. */
+    uint8_t ucLevelOffsets[ SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS ]; /**< Offset of every level in the filter. */
+    uint8_t ucLevelCount;                                            /**< Number of levels, 0 if the filter is not compiled. */
+    uint8_t ucLiteralLevels;                                         /**< Number of levels in the literal prefix. */
+    bool xEndsWithMultiLevelWildcard;                                /**< The last level is '#'. */
+} SubscriptionCompiledFilter_t;
+
+/**
+ * @brief An element in the list of subscriptions.
  *
  * @note This implementation allows multiple tasks to subscribe to the same topic.
  * In this case, another element is added to the subscription list, differing
- * in the intended publish callback. Also note that the topic filters are not
- * copied in the subscription manager and hence the topic filter strings need to
- * stay in scope until unsubscribed.
+ * in the intended publish callback. The topic filter string is copied into the
+ * filter arena of the subscription list, and shared with the other
+ * subscriptions to the same topic filter, so the caller's copy does not need to
+ * stay in scope. It is not NULL terminated.
  */
 typedef struct subscriptionElement
 {
@@ -75,8 +332,195 @@ typedef struct subscriptionElement
     void * pvIncomingPublishCallbackContext;
     uint16_t usFilterStringLength;
     const char * pcSubscriptionFilterString;
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+        uint32_t ulFilterHash;     /**< Hash of the topic filter, if it has no wildcards. */
+        uint16_t usNextInBucket;   /**< Index + 1 of the next subscription in the hash bucket. */
+        bool xIsExactMatch;        /**< The topic filter has no wildcards. */
+    #endif
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+        SubscriptionCompiledFilter_t xCompiledFilter;
+    #endif
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 )
+        SubscriptionDispatchStats_t xDispatchStats;
+    #endif
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+        bool xAggregated; /**< Publishes arrive through a covering filter, not a broker subscription of its own. */
+    #endif
+    bool xUnsubscribing;  /**< The last subscriber left, and the broker UNSUBSCRIBE awaits its UNSUBACK. Publishes are not delivered. */
 } SubscriptionElement_t;
 
+/**
+ * @brief Result of addSharedSubscription().
+ */
+typedef enum SharedSubscriptionStatus
+{
+    SharedSubscriptionAdded = 0,    /**< Added, the broker subscription is shared. */
+    SharedSubscriptionNotFound,     /**< Not added, the caller sends a SUBSCRIBE. */
+    SharedSubscriptionUnsubscribing /**< Not added, the caller waits for the UNSUBACK of the topic filter and tries again. */
+} SharedSubscriptionStatus_t;
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+
+/**
+ * @brief A covering filter subscribed at the broker on behalf of sibling topic
+ * filters, or refused for exceeding the overmatch budget.
+ */
+    typedef struct subscriptionAggregate
+    {
+        char cFilter[ SUBSCRIPTION_MANAGER_AGGREGATE_FILTER_LENGTH ];
+        uint16_t usFilterLength; /**< 0 if the entry is free. */
+        bool xActive;            /**< Subscribed at the broker. */
+        uint32_t ulPublishes;    /**< Incoming publishes matching the covering filter. */
+        uint32_t ulOvermatches;  /**< Of those, publishes matching no subscription. */
+    } SubscriptionAggregate_t;
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+
+/**
+ * @brief A node of the topic trie, representing one topic level.
+ *
+ * Links to other nodes and to subscriptions are stored as index + 1 so that a
+ * zero initialized node has no children, siblings or subscriptions. The level
+ * string points into the topic filter of one of the subscriptions below it.
+ */
+    typedef struct subscriptionTrieNode
+    {
+        const char * pcLevel;
+        uint16_t usLevelLength;
+        uint16_t usFirstChild;
+        uint16_t usNextSibling;
+        uint16_t usFirstSubscription;
+    } SubscriptionTrieNode_t;
+
+/**
+ * @brief Topic filter index. Node 0 is the root, which has no level of its own.
+ */
+    typedef struct subscriptionTrie
+    {
+        SubscriptionTrieNode_t xNodes[ SUBSCRIPTION_MANAGER_TRIE_MAX_NODES ];
+        uint16_t usNextSubscription[ SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS ];
+        uint16_t usNodeCount;
+    } SubscriptionTrie_t;
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 */
+
+/**
+ * @brief A table of subscriptions, and any index kept over it.
+ *
+ * Subscriptions are stored in blocks taken from the subscription pool as the
+ * list grows, and blocks are returned to the pool as soon as they are empty,
+ * leaving a hole which the next block taken fills. The index of a subscription
+ * is stable while it is in the list.
+ *
+ * Topic filter strings are stored once in the filter arena. The space of a
+ * removed filter is reclaimed at once if it is at the end of the arena, and
+ * otherwise when the arena is compacted on a later addition.
+ */
+typedef struct subscriptionTable
+{
+    SubscriptionElement_t * pxBlocks[ SUBSCRIPTION_MANAGER_POOL_BLOCKS ];
+    uint32_t ulUsedSlots[ SUBSCRIPTION_MANAGER_POOL_BLOCKS ];
+    uint8_t ucPoolBlocks[ SUBSCRIPTION_MANAGER_POOL_BLOCKS ]; /**< Pool block held at each position. */
+    uint16_t usBlockCount;
+    uint16_t usSubscriptionCount;
+    uint16_t usHighWatermark;
+    uint32_t ulFailedAdds;
+    uint32_t ulExactMatchLookups;
+    uint32_t ulExactMatchHits;
+    uint32_t ulWildcardMatchLookups;
+    uint32_t ulWildcardMatchHits;
+    uint32_t ulBrokerSubscribesAvoided;
+    uint32_t ulBrokerUnsubscribesAvoided;
+    uint32_t ulUnmatchedPublishes;
+    uint16_t usFilterArenaUsed;
+    char cFilterArena[ SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE ];
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE == 1 )
+        SubscriptionTrie_t xTrie;
+    #endif
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH == 1 )
+        uint16_t usHashBuckets[ SUBSCRIPTION_MANAGER_HASH_BUCKETS ];
+    #endif
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+        SubscriptionAggregate_t xAggregates[ SUBSCRIPTION_MANAGER_MAX_AGGREGATES ];
+        uint32_t ulAggregatedSubscribes;
+        uint32_t ulAggregateOvermatches;
+    #endif
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        SubscriptionElement_t * pxReservedBlock; /**< Pool block reserved for the write in progress. */
+        uint8_t ucReservedPoolBlock;
+    #endif
+} SubscriptionTable_t;
+
+/**
+ * @brief The list of subscriptions.
+ *
+ * When SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS is 1, ulActiveTable is the copy
+ * of the table readers use, and ulReaders counts the readers of each copy. A
+ * writer waiting for the readers of a copy sets ulWriterWaiting to its index
+ * + 1, and the last of these readers signals pvReadersDone. pvDispatchTask is
+ * the task running handleIncomingPublishes(), if any.
+ *
+ * This subscription manager implementation expects that the list is
+ * initialized to 0.
+ */
+typedef struct subscriptionList
+{
+    SubscriptionTable_t xTables[ SUBSCRIPTION_MANAGER_TABLE_COPIES ];
+    #if ( SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS == 1 )
+        uint32_t ulActiveTable;
+        uint32_t ulReaders[ SUBSCRIPTION_MANAGER_TABLE_COPIES ];
+        uint32_t ulWriterWaiting;
+        void * pvReadersDone;
+        void * pvDispatchTask;
+    #endif
+} SubscriptionList_t;
+
+/**
+ * @brief Capacity and usage statistics of a subscription list.
+ */
+typedef struct subscriptionManagerStats
+{
+    size_t xSubscriptionCount; /**< Subscriptions currently in the list. */
+    size_t xCapacity;          /**< Subscriptions the blocks held by the list can hold. */
+    size_t xHighWatermark;     /**< Largest number of subscriptions held at once. */
+    size_t xFreePoolBlocks;    /**< Blocks left in the pool shared by all lists. */
+    size_t xTotalPoolBlocks;   /**< Blocks in the pool. */
+    uint32_t ulFailedAdds;     /**< Subscriptions refused for lack of memory. */
+    size_t xFilterArenaUsed;   /**< Bytes of the filter arena in use, including released filters not yet compacted. */
+    size_t xFilterArenaSize;   /**< Size of the filter arena. */
+
+    /* Incoming publishes looked up in the exact match hash table, and how many
+     * of them matched a subscription there. */
+    uint32_t ulExactMatchLookups;
+    uint32_t ulExactMatchHits;
+
+    /* Incoming publishes matched against the wildcard topic filters, or against
+     * all topic filters when the hash table is disabled, and how many of them
+     * matched a subscription there. */
+    uint32_t ulWildcardMatchLookups;
+    uint32_t ulWildcardMatchHits;
+
+    /* Incoming publishes which matched no subscription. */
+    uint32_t ulUnmatchedPublishes;
+
+    /* Broker round trips avoided by addSharedSubscription() and
+     * removeSharedSubscription(). */
+    uint32_t ulBrokerSubscribesAvoided;
+    uint32_t ulBrokerUnsubscribesAvoided;
+
+    /* Covering filters subscribed at the broker, and how many broker
+     * subscriptions they currently save: the sibling topic filters they
+     * receive publishes for, minus themselves. */
+    size_t xActiveAggregates;
+    size_t xBrokerSubscriptionsSaved;
+
+    /* SUBSCRIBE round trips avoided by addAggregatedSubscription(), and the
+     * publishes received through covering filters which matched no
+     * subscription. */
+    uint32_t ulAggregatedSubscribes;
+    uint32_t ulAggregateOvermatches;
+} SubscriptionManagerStats_t;
+
 /**
  * @brief Add a subscription to the subscription list.
  *
@@ -84,47 +528,349 @@ typedef struct subscriptionElement
  * context-callback pairs. However, a single context-callback pair may only be
  * associated to the same topic filter once.
  *
- * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
  * @param[in] pcTopicFilterString Topic filter string of subscription.
  * @param[in] usTopicFilterLength Length of topic filter string.
  * @param[in] pxIncomingPublishCallback Callback function for the subscription.
  * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
  *
  * @return `true` if subscription added or exists, `false` if insufficient memory.
+ * The failure is logged and counted in SubscriptionManagerStats_t::ulFailedAdds.
  */
-bool addSubscription( SubscriptionElement_t * pxSubscriptionList,
+bool addSubscription( SubscriptionList_t * pxSubscriptionList,
                       const char * pcTopicFilterString,
                       uint16_t usTopicFilterLength,
                       IncomingPubCallback_t pxIncomingPublishCallback,
                       void * pvIncomingPublishCallbackContext );
 
+/**
+ * @brief Add a subscription to the subscription list, and get its index, with
+ * which removeSubscriptionAtIndex() removes it without searching the list.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter string of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] pxIncomingPublishCallback Callback function for the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
+ * @param[out] pxIndex Index of the subscription, which stays valid until it is
+ * removed. May be NULL.
+ *
+ * @return `true` if subscription added or exists, `false` if insufficient memory.
+ */
+bool addSubscriptionWithIndex( SubscriptionList_t * pxSubscriptionList,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext,
+                               size_t * pxIndex );
+
 /**
  * @brief Remove a subscription from the subscription list.
  *
  * @note If the topic filter exists multiple times in the subscription list,
  * then every instance of the subscription will be removed.
  *
- * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
  * @param[in] pcTopicFilterString Topic filter of subscription.
  * @param[in] usTopicFilterLength Length of topic filter.
  */
-void removeSubscription( SubscriptionElement_t * pxSubscriptionList,
+void removeSubscription( SubscriptionList_t * pxSubscriptionList,
                          const char * pcTopicFilterString,
                          uint16_t usTopicFilterLength );
 
+/**
+ * @brief Remove the subscription at an index returned by
+ * addSubscriptionWithIndex() or getSubscription().
+ *
+ * Unlike removeSubscription(), this does not search the list for the
+ * subscription. With the topic trie enabled, the trie is still rebuilt.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] xIndex Index of the subscription.
+ */
+void removeSubscriptionAtIndex( SubscriptionList_t * pxSubscriptionList,
+                                size_t xIndex );
+
+/**
+ * @brief Add a subscription to a topic filter only if the list already has a
+ * subscription to it, and hence the broker too.
+ *
+ * Together with removeSharedSubscription(), this lets several local
+ * subscribers share one broker subscription: only the first one needs to send
+ * a SUBSCRIBE, and only the last one an UNSUBSCRIBE. While that UNSUBSCRIBE
+ * awaits its UNSUBACK, a SUBSCRIBE could reach the broker before it and be
+ * undone, so the subscription is not added and the caller tries again after
+ * completeSharedUnsubscribe().
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter string of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] pxIncomingPublishCallback Callback function for the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
+ *
+ * @return #SharedSubscriptionAdded if the subscription was added, so no
+ * SUBSCRIBE needs to be sent to the broker, #SharedSubscriptionUnsubscribing
+ * if the broker is unsubscribing from the topic filter, and
+ * #SharedSubscriptionNotFound if the topic filter has no subscription yet or
+ * the subscription could not be added.
+ */
+SharedSubscriptionStatus_t addSharedSubscription( SubscriptionList_t * pxSubscriptionList,
+                                                  const char * pcTopicFilterString,
+                                                  uint16_t usTopicFilterLength,
+                                                  IncomingPubCallback_t pxIncomingPublishCallback,
+                                                  void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Remove the subscription of a single context-callback pair to a topic
+ * filter.
+ *
+ * The subscription of the last subscriber is kept, without delivering
+ * publishes, until the caller gets the UNSUBACK of the topic filter and calls
+ * completeSharedUnsubscribe().
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter.
+ * @param[in] pxIncomingPublishCallback Callback function of the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context of the subscription callback.
+ *
+ * @return `true` if other subscriptions to the topic filter remain, so no
+ * UNSUBSCRIBE needs to be sent to the broker, `false` otherwise.
+ */
+bool removeSharedSubscription( SubscriptionList_t * pxSubscriptionList,
+                               const char * pcTopicFilterString,
+                               uint16_t usTopicFilterLength,
+                               IncomingPubCallback_t pxIncomingPublishCallback,
+                               void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Remove the subscriptions to a topic filter kept by
+ * removeSharedSubscription() until the broker acknowledged the UNSUBSCRIBE.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter of the UNSUBSCRIBE.
+ * @param[in] usTopicFilterLength Length of topic filter.
+ */
+void completeSharedUnsubscribe( SubscriptionList_t * pxSubscriptionList,
+                                const char * pcTopicFilterString,
+                                uint16_t usTopicFilterLength );
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 )
+
+/**
+ * @brief Choose a covering filter to subscribe to at the broker instead of a
+ * topic filter.
+ *
+ * A topic filter without wildcards is aggregated by replacing its last level
+ * with '+', once the list has subscriptions to at least
+ * SUBSCRIPTION_MANAGER_AGGREGATION_MIN_FILTERS - 1 other filters under the
+ * same parent. Covering filters found over the overmatch budget are not chosen
+ * again.
+ *
+ * After the broker acknowledges the SUBSCRIBE to the covering filter, the
+ * caller registers it with addAggregate(), adds its own subscription with
+ * addAggregatedSubscription(), and unsubscribes at the broker from the filters
+ * returned by absorbAggregatedFilter().
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter to subscribe to.
+ * @param[in] usTopicFilterLength Length of the topic filter.
+ * @param[out] pcAggregateFilter Buffer receiving the covering filter.
+ * @param[in] usBufferLength Length of the buffer.
+ *
+ * @return Length of the covering filter, or 0 if the topic filter should be
+ * subscribed to as is.
+ */
+    uint16_t getAggregateFilter( SubscriptionList_t * pxSubscriptionList,
+                                 const char * pcTopicFilterString,
+                                 uint16_t usTopicFilterLength,
+                                 char * pcAggregateFilter,
+                                 uint16_t usBufferLength );
+
+/**
+ * @brief Register a covering filter the broker acknowledged a SUBSCRIBE to.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcAggregateFilter Covering filter from getAggregateFilter().
+ * @param[in] usAggregateFilterLength Length of the covering filter.
+ *
+ * @return `true` if the covering filter was registered or already was,
+ * `false` if there is no room for it.
+ */
+    bool addAggregate( SubscriptionList_t * pxSubscriptionList,
+                       const char * pcAggregateFilter,
+                       uint16_t usAggregateFilterLength );
+
+/**
+ * @brief Add a subscription to a topic filter only if a registered covering
+ * filter already receives its publishes.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter string of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter string.
+ * @param[in] pxIncomingPublishCallback Callback function for the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context for the subscription callback.
+ *
+ * @return `true` if the subscription was added, so no SUBSCRIBE needs to be
+ * sent to the broker, `false` otherwise.
+ */
+    bool addAggregatedSubscription( SubscriptionList_t * pxSubscriptionList,
+                                    const char * pcTopicFilterString,
+                                    uint16_t usTopicFilterLength,
+                                    IncomingPubCallback_t pxIncomingPublishCallback,
+                                    void * pvIncomingPublishCallbackContext );
+
+/**
+ * @brief Move the subscriptions to one topic filter under a registered
+ * covering filter, when they still have a broker subscription of their own.
+ *
+ * Call until it returns 0 after registering a covering filter, unsubscribing
+ * at the broker from every returned topic filter.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcAggregateFilter The covering filter.
+ * @param[in] usAggregateFilterLength Length of the covering filter.
+ * @param[out] pcTopicFilter Buffer receiving the topic filter.
+ * @param[in] usBufferLength Length of the buffer.
+ *
+ * @return Length of the topic filter to unsubscribe from, or 0 if there is
+ * none left.
+ */
+    uint16_t absorbAggregatedFilter( SubscriptionList_t * pxSubscriptionList,
+                                     const char * pcAggregateFilter,
+                                     uint16_t usAggregateFilterLength,
+                                     char * pcTopicFilter,
+                                     uint16_t usBufferLength );
+
+/**
+ * @brief Remove the subscription of a single context-callback pair to a topic
+ * filter, and find the broker subscription it leaves unused.
+ *
+ * This is removeSharedSubscription() for lists with covering filters. A
+ * covering filter left without subscriptions is released, and remembered if
+ * it exceeded the overmatch budget. The last subscription to a topic filter
+ * without a covering filter is kept until completeSharedUnsubscribe().
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] pcTopicFilterString Topic filter of subscription.
+ * @param[in] usTopicFilterLength Length of topic filter.
+ * @param[in] pxIncomingPublishCallback Callback function of the subscription.
+ * @param[in] pvIncomingPublishCallbackContext Context of the subscription callback.
+ * @param[out] pcUnsubscribeFilter Buffer receiving the topic filter or
+ * covering filter to unsubscribe from at the broker.
+ * @param[in] usBufferLength Length of the buffer.
+ *
+ * @return Length of the filter to unsubscribe from, or 0 if other
+ * subscriptions still need the broker subscription.
+ */
+    uint16_t removeAggregatedSubscription( SubscriptionList_t * pxSubscriptionList,
+                                           const char * pcTopicFilterString,
+                                           uint16_t usTopicFilterLength,
+                                           IncomingPubCallback_t pxIncomingPublishCallback,
+                                           void * pvIncomingPublishCallbackContext,
+                                           char * pcUnsubscribeFilter,
+                                           uint16_t usBufferLength );
+
+/**
+ * @brief Get a covering filter subscribed at the broker.
+ *
+ * Used with getSubscription() to list the broker subscriptions of the list,
+ * skipping the subscriptions with xAggregated set.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] xIndex Index of the covering filter, below
+ * SUBSCRIPTION_MANAGER_MAX_AGGREGATES.
+ * @param[out] pusLength Length of the covering filter.
+ *
+ * @return The covering filter, or NULL if there is none at this index.
+ */
+    const char * getAggregate( SubscriptionList_t * pxSubscriptionList,
+                               size_t xIndex,
+                               uint16_t * pusLength );
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION == 1 */
+
 /**
  * @brief Handle incoming publishes by invoking the callbacks registered
  * for the incoming publish's topic filter.
  *
- * @param[in] pxSubscriptionList  The pointer to the subscription list array.
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
  * @param[in] pxPublishInfo Info of incoming publish.
  *
+ * @note When SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE is 1, the matching
+ * subscriptions are collected in one traversal of the topic trie before any
+ * callback is invoked. When SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH is 1,
+ * the callbacks of topic filters without wildcards are invoked first. When
+ * SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS is 1, this function takes no lock and
+ * may run concurrently with addSubscription() and removeSubscription(). The
+ * callbacks then get the subscriptions the dispatch started with, and changes
+ * to the list from them are refused.
+ *
  * @return `true` if an application callback could be invoked;
  *  `false` otherwise.
  */
-bool handleIncomingPublishes( SubscriptionElement_t * pxSubscriptionList,
+bool handleIncomingPublishes( SubscriptionList_t * pxSubscriptionList,
                               MQTTPublishInfo_t * pxPublishInfo );
 
+/**
+ * @brief Get the subscription stored at an index of the list.
+ *
+ * Used to iterate over the list, from index 0 up to
+ * SUBSCRIPTION_MANAGER_MAX_SUBSCRIPTIONS. The list must not be modified while
+ * the subscription is in use.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] xIndex Index of the subscription.
+ *
+ * @return The subscription, or NULL if there is none at this index.
+ */
+SubscriptionElement_t * getSubscription( SubscriptionList_t * pxSubscriptionList,
+                                         size_t xIndex );
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 )
+
+/**
+ * @brief Match a topic name against the topic filter of a subscription, with
+ * its precompiled form if it has one and with MQTT_MatchTopic() otherwise.
+ *
+ * This is the matcher handleIncomingPublishes() uses for each subscription.
+ *
+ * @param[in] pxSubscription The subscription, from getSubscription().
+ * @param[in] pcTopicName Topic name of the incoming publish.
+ * @param[in] usTopicNameLength Length of the topic name.
+ *
+ * @return `true` if the topic name matches the topic filter.
+ */
+    bool matchSubscriptionFilter( const SubscriptionElement_t * pxSubscription,
+                                  const char * pcTopicName,
+                                  uint16_t usTopicNameLength );
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS == 1 */
+
+#if ( SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 )
+
+/**
+ * @brief Get the dispatch statistics of the subscription stored at an index of
+ * the list.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[in] xIndex Index of the subscription, as for getSubscription().
+ * @param[out] pxStats Receives the statistics.
+ *
+ * @return `true` if there is a subscription at this index, `false` otherwise.
+ */
+    bool getSubscriptionDispatchStats( SubscriptionList_t * pxSubscriptionList,
+                                       size_t xIndex,
+                                       SubscriptionDispatchStats_t * pxStats );
+#endif /* SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS == 1 */
+
+/**
+ * @brief Get the capacity and usage statistics of a subscription list.
+ *
+ * @param[in] pxSubscriptionList  The pointer to the subscription list.
+ * @param[out] pxStats Statistics of the list.
+ */
+void getSubscriptionManagerStats( const SubscriptionList_t * pxSubscriptionList,
+                                  SubscriptionManagerStats_t * pxStats );
+
 /* *INDENT-OFF* */
     #ifdef __cplusplus
         } /* extern "C" */
@@ -0,0 +1,158 @@
+/*
+ * ESP32-C3 Featured FreeRTOS IoT Integration V202204.00
+ * Copyright (C) 2022 Amazon.com, Inc. or its affiliates.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * https://www.FreeRTOS.org
+ * https://github.com/FreeRTOS
+ *
+ */
+
+#ifndef SUBSCRIPTION_MANAGER_CONFIG_H
+#define SUBSCRIPTION_MANAGER_CONFIG_H
+
+/* ESP-IDF sdkconfig include. */
+#include <sdkconfig.h>
+
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS || CONFIG_GRI_SUBSCRIPTION_MANAGER_POOL_FROM_HEAP
+    /* FreeRTOS includes. */
+    #include "freertos/FreeRTOS.h"
+    #include "freertos/task.h"
+    #include "freertos/semphr.h"
+#endif
+
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS
+    /* ESP-IDF timer include. */
+    #include "esp_timer.h"
+#endif
+
+/* *INDENT-OFF* */
+    #ifdef __cplusplus
+        extern "C" {
+    #endif
+/* *INDENT-ON* */
+
+/**
+ * @brief Number of blocks in the subscription pool, and number of
+ * subscriptions held by each block.
+ */
+#define SUBSCRIPTION_MANAGER_POOL_BLOCKS            ( CONFIG_GRI_SUBSCRIPTION_MANAGER_POOL_BLOCKS )
+#define SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS    ( CONFIG_GRI_SUBSCRIPTION_MANAGER_BLOCK_SUBSCRIPTIONS )
+
+/**
+ * @brief Set to 1 to allocate the blocks of the subscription pool from the
+ * FreeRTOS heap as lists grow, instead of reserving the whole pool statically.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_POOL_FROM_HEAP
+    #define SUBSCRIPTION_MANAGER_POOL_FROM_HEAP     ( 1 )
+    #define SUBSCRIPTION_MANAGER_MALLOC( xSize )    pvPortMalloc( xSize )
+    #define SUBSCRIPTION_MANAGER_FREE( pvBlock )    vPortFree( pvBlock )
+#else
+    #define SUBSCRIPTION_MANAGER_POOL_FROM_HEAP    ( 0 )
+#endif
+
+/**
+ * @brief Size in bytes of the arena holding the topic filter strings of a
+ * subscription list.
+ */
+#define SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE      ( CONFIG_GRI_SUBSCRIPTION_MANAGER_FILTER_ARENA_SIZE )
+
+/**
+ * @brief Set to 1 to dispatch incoming publishes through a topic level trie
+ * instead of matching every subscription with MQTT_MatchTopic.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE
+    #define SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE    ( 1 )
+    #define SUBSCRIPTION_MANAGER_TRIE_MAX_NODES       ( CONFIG_GRI_SUBSCRIPTION_MANAGER_TRIE_MAX_NODES )
+#else
+    #define SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE    ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_TOPIC_TRIE */
+
+/**
+ * @brief Set to 1 to match topic filters without wildcards through a hash
+ * table, with one hash and one compare per incoming publish.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH
+    #define SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH    ( 1 )
+    #define SUBSCRIPTION_MANAGER_HASH_BUCKETS               ( CONFIG_GRI_SUBSCRIPTION_MANAGER_HASH_BUCKETS )
+#else
+    #define SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH    ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_EXACT_MATCH_HASH */
+
+/**
+ * @brief Set to 1 to precompile the levels of every topic filter when it is
+ * added, and match incoming publishes against them instead of calling
+ * MQTT_MatchTopic.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS
+    #define SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS    ( 1 )
+    #define SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS             ( CONFIG_GRI_SUBSCRIPTION_MANAGER_FILTER_MAX_LEVELS )
+#else
+    #define SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS    ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_PRECOMPILED_FILTERS */
+
+/**
+ * @brief Set to 1 to dispatch incoming publishes without locks while
+ * subscriptions are added or removed from other tasks. Writers block on a
+ * binary semaphore until the last reader of the previous copy of the
+ * subscription table gives it, or poll every tick if it could not be created.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS
+    #define SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS                 ( 1 )
+    #define SUBSCRIPTION_MANAGER_GET_TASK()                       ( ( void * ) xTaskGetCurrentTaskHandle() )
+    #define SUBSCRIPTION_MANAGER_CREATE_READERS_DONE()            ( ( void * ) xSemaphoreCreateBinary() )
+    #define SUBSCRIPTION_MANAGER_WAIT_FOR_READERS( pvReadersDone ) \
+    ( ( ( pvReadersDone ) != NULL ) ?                              \
+      ( void ) xSemaphoreTake( ( SemaphoreHandle_t ) ( pvReadersDone ), portMAX_DELAY ) : vTaskDelay( 1 ) )
+    #define SUBSCRIPTION_MANAGER_SIGNAL_WRITER( pvReadersDone )    ( void ) xSemaphoreGive( ( SemaphoreHandle_t ) ( pvReadersDone ) )
+#else
+    #define SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS    ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_SNAPSHOTS */
+
+/**
+ * @brief Set to 1 to record the dispatch statistics of every subscription,
+ * timing callbacks with esp_timer.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS
+    #define SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS    ( 1 )
+    #define SUBSCRIPTION_MANAGER_GET_TIME_US()            esp_timer_get_time()
+    #define SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US         ( CONFIG_GRI_SUBSCRIPTION_MANAGER_SLOW_CALLBACK_US )
+#else
+    #define SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS    ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_DISPATCH_STATS */
+
+/**
+ * @brief Set to 1 to let sibling topic filters share a broker subscription to
+ * a covering filter, within an overmatch budget.
+ */
+#if CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION
+    #define SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION               ( 1 )
+    #define SUBSCRIPTION_MANAGER_AGGREGATION_MIN_FILTERS          ( CONFIG_GRI_SUBSCRIPTION_MANAGER_AGGREGATION_MIN_FILTERS )
+    #define SUBSCRIPTION_MANAGER_AGGREGATION_OVERMATCH_PERCENT    ( CONFIG_GRI_SUBSCRIPTION_MANAGER_AGGREGATION_OVERMATCH_PERCENT )
+#else
+    #define SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION               ( 0 )
+#endif /* CONFIG_GRI_SUBSCRIPTION_MANAGER_ENABLE_AGGREGATION */
+
+/* *INDENT-OFF* */
+    #ifdef __cplusplus
+        } /* extern "C" */
+    #endif
+/* *INDENT-ON* */
+
+#endif /* SUBSCRIPTION_MANAGER_CONFIG_H */